@@ -68,3 +68,7 @@ string DropboxAccountInfo::getDisplayName() const {
 string DropboxAccountInfo::getEmail() const {
   return email_;
 }
+
+string DropboxAccountInfo::getAccountId() const {
+  return accountId_;
+}
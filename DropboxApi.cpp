@@ -16,6 +16,7 @@
 #include "DropboxApi.h"
 
 #include "util/HttpRequest.h"
+#include "util/PercentEncoding.h"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -85,10 +86,8 @@ void DropboxApi::setRoot(const string root) {
 DropboxErrorCode DropboxApi::execute(shared_ptr<HttpRequest> r) {
   int ret;
 
-  {
-    lock_guard<mutex> g(stateLock_);
-    oauth_->addOAuthAccessHeader(r.get());
-  }
+  // Lock free; the header is an atomically published snapshot
+  oauth_->addOAuthAccessHeader(r.get());
 
   if ((ret = r->execute())) {
     stringstream ss;
@@ -117,7 +116,8 @@ DropboxErrorCode DropboxApi::getAccountInfo(DropboxAccountInfo& info) {
 DropboxErrorCode DropboxApi::getFileMetadata(DropboxMetadataRequest& req,
     DropboxMetadataResponse& res) {
   stringstream ss;
-  ss << "https://api.dropbox.com/1/metadata/" << root_ << "/" << req.path();
+  ss << "https://api.dropbox.com/1/metadata/" << root_ << "/"
+    << percentEncode(req.path(), UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
 
@@ -160,7 +160,8 @@ DropboxErrorCode DropboxApi::getRevisions(string path,
     size_t numRevisions, DropboxRevisions& revs) {
   stringstream ss;
 
-  ss << "https://api.dropbox.com/1/revisions/" << root_ << "/" << path;
+  ss << "https://api.dropbox.com/1/revisions/" << root_ << "/"
+    << percentEncode(path, UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
 
@@ -185,7 +186,8 @@ DropboxErrorCode DropboxApi::restoreFile(string path,
     string rev, DropboxMetadata& m) {
   stringstream ss;
 
-  ss << "https://api.dropbox.com/1/restore/" << root_ << "/" << path;
+  ss << "https://api.dropbox.com/1/restore/" << root_ << "/"
+    << percentEncode(path, UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
 
@@ -308,7 +310,7 @@ DropboxErrorCode DropboxApi::getFile(DropboxGetFileRequest& req,
     DropboxGetFileResponse& res) {
   stringstream ss;
   ss << "https://api-content.dropbox.com/1/files/" << root_ << "/"
-    << req.getPath();
+    << percentEncode(req.getPath(), UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
   if (req.getRev().compare("")) {
@@ -319,12 +321,18 @@ DropboxErrorCode DropboxApi::getFile(DropboxGetFileRequest& req,
     r->addRange(req.getOffset(), req.getOffset() + req.getLength() - 1);
   }
 
+  if (req.getDataSink()) {
+    r->setResponseSink(req.getDataSink());
+  }
+
   DropboxErrorCode code = execute(r);
   if (code != SUCCESS && code != PARTIAL_CONTENT) {
     return code;
   }
 
-  res.setData(r->getResponse(), r->getResponseSize());
+  if (!req.getDataSink()) {
+    res.setData(r->getResponse(), r->getResponseSize());
+  }
 
   map<string, string> respHeaders = r->getResponseHeaders();
   res.setMetadata(respHeaders["x-dropbox-metadata"]);
@@ -336,7 +344,7 @@ DropboxErrorCode DropboxApi::uploadFile(const DropboxUploadFileRequest& req,
     DropboxMetadata& m) {
   stringstream ss;
   ss << "https://api-content.dropbox.com/1/files_put/" << root_ << "/"
-    << req.getPath();
+    << percentEncode(req.getPath(), UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
   r->setMethod(HttpPutRequest);
@@ -423,7 +431,8 @@ DropboxErrorCode DropboxApi::uploadLargeFile(
 
   stringstream ss;
   ss << "https://api-content.dropbox.com/1/commit_chunked_upload/" << root_
-    << "/" << req.getPath();
+    << "/"
+    << percentEncode(req.getPath(), UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
   r->setMethod(HttpPostRequest);
@@ -462,7 +471,7 @@ DropboxErrorCode DropboxApi::search(const DropboxSearchRequest& req,
     DropboxSearchResult& res) {
   stringstream ss;
   ss << "https://api.dropbox.com/1/search/" << root_ << "/"
-    << req.getSearchPath();
+    << percentEncode(req.getSearchPath(), UrlPath);
 
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
 
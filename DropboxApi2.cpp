@@ -14,39 +14,260 @@
 */
 
 #include "DropboxApi2.h"
+#include "DropboxJson.h"
 
 #include "util/HttpRequest.h"
+#include "util/PercentEncoding.h"
+#include "util/HedgedRequest.h"
+#include "util/Metrics.h"
+#include "util/Tracer.h"
+#include "util/TransferProgress.h"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 #include <sstream>
 #include <cassert>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <strings.h>
 
 using namespace dropbox;
 using namespace oauth;
 using namespace http;
+using namespace util;
 using namespace std;
 
 using namespace boost::property_tree;
+
+namespace {
+
+// Process wide; looked up once so that recording never takes a lock
+struct ApiMetrics {
+  ApiMetrics() :
+    requests_(counter("dropbox_requests_total",
+      "Requests sent, including retries")),
+    bytesSent_(counter("dropbox_sent_bytes_total",
+      "Request body bytes sent")),
+    bytesReceived_(counter("dropbox_received_bytes_total",
+      "Response body bytes received")),
+    metadataLatency_(histogram("dropbox_request_microseconds",
+      "Time from sending a request to its response", "class=\"metadata\"")),
+    contentLatency_(histogram("dropbox_request_microseconds",
+      "Time from sending a request to its response", "class=\"content\"")),
+    jsonParse_(histogram("dropbox_json_parse_microseconds",
+      "Time spent parsing JSON responses")),
+    uploadChunk_(histogram("dropbox_upload_chunk_microseconds",
+      "Time taken by each chunk of a chunked upload or upload session")),
+    download_(histogram("dropbox_download_microseconds",
+      "Time taken by each file download")),
+    retryTransient_(retries("transient")),
+    retryThrottled_(retries("throttled")),
+    retryServer_(retries("server")),
+    retryUnauthorized_(retries("unauthorized")),
+    coalesced_(cacheHits("coalesced")),
+    notModified_(cacheHits("not_modified")) {
+  }
+
+  static Counter& counter(const char* name, const char* help) {
+    return Metrics::getInstance()->counter(name, help);
+  }
+
+  static Histogram& histogram(const char* name,
+      const char* help,
+      const char* labels = "") {
+    return Metrics::getInstance()->histogram(name, help, labels);
+  }
+
+  static Counter& retries(const string& reason) {
+    return Metrics::getInstance()->counter("dropbox_retries_total",
+      "Requests sent again, by reason", "reason=\"" + reason + "\"");
+  }
+
+  static Counter& cacheHits(const string& kind) {
+    return Metrics::getInstance()->counter("dropbox_cache_hits_total",
+      "Calls answered without transferring a result, by kind",
+      "kind=\"" + kind + "\"");
+  }
+
+  Counter&      requests_;
+  Counter&      bytesSent_;
+  Counter&      bytesReceived_;
+  Histogram&    metadataLatency_;
+  Histogram&    contentLatency_;
+  Histogram&    jsonParse_;
+  Histogram&    uploadChunk_;
+  Histogram&    download_;
+  Counter&      retryTransient_;
+  Counter&      retryThrottled_;
+  Counter&      retryServer_;
+  Counter&      retryUnauthorized_;
+  Counter&      coalesced_;
+  Counter&      notModified_;
+};
+
+ApiMetrics& metrics() {
+  static ApiMetrics m;
+  return m;
+}
+
+// A JSON parse, timed for both the metrics and the trace
+struct ParseTimer {
+  ParseTimer() : timer_(metrics().jsonParse_), span_("parse_json") {
+  }
+
+  ScopedTimer   timer_;
+  Span          span_;
+};
+
+// Errors are rare enough to afford the registry lookup
+void countError(DropboxErrorCode code) {
+  stringstream labels;
+  labels << "code=\"" << code << "\"";
+
+  Metrics::getInstance()->counter("dropbox_errors_total",
+    "Failed requests, by DropboxErrorCode", labels.str()).add();
+}
+
+// The url of a v1 call on a file, built in one allocation. The root is
+// one of a few fixed names; the path is percent-encoded.
+string fileUrl(const char* base, const string& root, const string& path) {
+  size_t size = strlen(base);
+
+  string url;
+  url.reserve(size + root.size() + 1 +
+    percentEncodedSize(path.data(), path.size(), UrlPath));
+  url.append(base, size);
+  url += root;
+  url += '/';
+  percentEncode(path.data(), path.size(), UrlPath, url);
+
+  return url;
+}
+
+// A meter for the progress callback of a transfer request, if it has one
+template <typename Request>
+shared_ptr<ProgressMeter> progressMeter(const Request& req) {
+  if (!req.getProgressCallback()) {
+    return nullptr;
+  }
+
+  return make_shared<ProgressMeter>(req.getProgressCallback(),
+    req.getProgressInterval());
+}
+
+// Reports the bytes a request uploads, on top of the 'base' bytes sent by
+// the earlier requests of the same transfer
+void followUpload(HttpRequest* r,
+    shared_ptr<ProgressMeter> meter,
+    uint64_t base,
+    uint64_t total) {
+  if (meter) {
+    r->setProgressHandler([=](uint64_t, uint64_t, uint64_t, uint64_t ulnow) {
+      return meter->update(base + ulnow, total);
+    });
+  }
+}
+
+void followDownload(HttpRequest* r, shared_ptr<ProgressMeter> meter) {
+  if (meter) {
+    r->setProgressHandler([=](uint64_t dltotal, uint64_t dlnow, uint64_t,
+        uint64_t) {
+      return meter->update(dlnow, dltotal);
+    });
+  }
+}
+
+// Lays the phases curl timed end to end, ending now, under a span for the
+// whole request
+void traceRequest(HttpRequest* r, int ret, const RequestTiming& t) {
+  typedef Tracer::Clock Clock;
+
+  Tracer* tracer = Tracer::getInstance();
+  Clock::time_point end = Clock::now();
+  Clock::time_point at = end - t.total_;
+
+  stringstream args;
+  args << "\"endpoint\": \""
+    << DropboxRequestStats::getEndpoint(r->getUrl()) << "\", "
+    << "\"status\": " << (ret ? 0 : r->getResponseCode()) << ", "
+    << "\"curl_code\": " << ret << ", "
+    << "\"sent\": " << t.bytesSent_ << ", "
+    << "\"received\": " << t.bytesReceived_ << ", "
+    << "\"reused\": " << (t.connectionReused_ ? "true" : "false");
+  tracer->record("http", at, end, args.str());
+
+  const pair<const char*, chrono::microseconds> phases[] = {
+    make_pair("dns", t.nameLookup_),
+    make_pair("connect", t.connect_),
+    make_pair("tls", t.tlsHandshake_),
+    make_pair("wait", t.firstByte_),
+    make_pair("transfer", t.transfer_)
+  };
+
+  for (auto& p : phases) {
+    if (p.second.count() > 0) {
+      tracer->record(p.first, at, at + p.second);
+      at += p.second;
+    }
+  }
+}
+
+}
 using namespace boost::property_tree::json_parser;
 
-DropboxApi2::DropboxApi2(string appKey, string appSecret) {
+DropboxApi2::DropboxApi2(string appKey, string appSecret) :
+    rateAccountSet_(false),
+    coalesce_(false),
+    throttleRetries_(3),
+    uploadBandwidth_(new BandwidthLimiter()),
+    downloadBandwidth_(new BandwidthLimiter()),
+    retryPolicy_(new RetryPolicy()),
+    hedge_(false),
+    hedges_(0),
+    hedgeWins_(0) {
   httpFactory_ = HttpRequestFactory::createFactory();
 
   lock_guard<mutex> g(stateLock_);
   oauth_.reset(new OAuth2(appKey, appSecret));
+  oauth_->setTokenListener([this]() { tokenChanged(); });
   root_ = DROPBOX_ROOT;
+  appKey_ = appKey;
+
+  lock_guard<mutex> r(rateLock_);
+  publishRateAccount("", false);
 }
 
 DropboxApi2::DropboxApi2(string appKey,
     string appSecret,
-    string accessToken) {
+    string accessToken) :
+    rateAccountSet_(false),
+    coalesce_(false),
+    throttleRetries_(3),
+    uploadBandwidth_(new BandwidthLimiter()),
+    downloadBandwidth_(new BandwidthLimiter()),
+    retryPolicy_(new RetryPolicy()),
+    hedge_(false),
+    hedges_(0),
+    hedgeWins_(0) {
   httpFactory_ = HttpRequestFactory::createFactory();
 
   lock_guard<mutex> g(stateLock_);
   oauth_.reset(new OAuth2(appKey, appSecret));
   oauth_->setAccessToken(accessToken);
+  oauth_->setTokenListener([this]() { tokenChanged(); });
+  appKey_ = appKey;
+
+  lock_guard<mutex> r(rateLock_);
+  publishRateAccount(defaultRateAccount(), false);
+}
+
+DropboxApi2::~DropboxApi2() {
+  // The refresh thread reports new tokens to this instance
+  oauth_->stopAutoRefresh();
 }
 void DropboxApi2::authenticate() {
   lock_guard<mutex> g(stateLock_);
@@ -59,6 +280,160 @@ void DropboxApi2::authenticate() {
 void DropboxApi2::setAccessToken(string token) {
   lock_guard<mutex> g(stateLock_);
   oauth_->setAccessToken(token);
+
+  // The token may be for another account
+  lock_guard<mutex> r(rateLock_);
+  accountId_.clear();
+  if (!rateAccountSet_) {
+    publishRateAccount(defaultRateAccount(), false);
+  }
+}
+
+void DropboxApi2::setRefreshToken(const string refreshToken,
+    chrono::seconds expiresIn) {
+  lock_guard<mutex> g(stateLock_);
+
+  oauth_->setRefreshToken(refreshToken);
+  if (expiresIn.count() > 0) {
+    oauth_->setTokenExpiry(expiresIn);
+  }
+}
+
+void DropboxApi2::startAutoRefresh(chrono::seconds margin) {
+  lock_guard<mutex> g(stateLock_);
+  oauth_->startAutoRefresh(margin);
+}
+
+void DropboxApi2::setRateLimitAccount(const string account) {
+  lock_guard<mutex> g(rateLock_);
+  rateAccountSet_ = true;
+  publishRateAccount(account, false);
+}
+
+string DropboxApi2::getRateLimitAccount() const {
+  return *atomic_load(&rateAccount_);
+}
+
+// Must be called with rateLock_ held. Credentials are hashed rather than
+// kept as keys of the process wide maps.
+string DropboxApi2::defaultRateAccount() const {
+  string token = oauth_->getAccessToken();
+  if (accountId_.empty() && token.empty()) {
+    return "";
+  }
+
+  std::hash<string> h;
+  stringstream ss;
+  if (!accountId_.empty()) {
+    ss << "account:" << hex << h(appKey_ + "\n" + accountId_);
+  } else {
+    ss << "token:" << hex << h(appKey_ + "\n" + token);
+  }
+  return ss.str();
+}
+
+void DropboxApi2::tokenChanged() {
+  lock_guard<mutex> g(rateLock_);
+
+  // Tokens from the authorization code come with the account id; a
+  // refreshed token is for the same account as before
+  string id = oauth_->getAccountId();
+  if (!id.empty()) {
+    accountId_ = id;
+  }
+
+  if (!rateAccountSet_) {
+    publishRateAccount(defaultRateAccount(), true);
+  }
+}
+
+void DropboxApi2::learnAccountId(const string id) {
+  lock_guard<mutex> g(rateLock_);
+
+  if (id.empty() || id == accountId_) {
+    return;
+  }
+
+  accountId_ = id;
+  if (!rateAccountSet_) {
+    publishRateAccount(defaultRateAccount(), true);
+  }
+}
+
+// Must be called with rateLock_ held. When the same account gets a new name,
+// its limits go with it.
+void DropboxApi2::publishRateAccount(const string account, bool rename) {
+  DropboxRateLimiter* process = DropboxRateLimiter::getInstance();
+
+  shared_ptr<const string> old = atomic_load(&rateAccount_);
+  if (rename && old && !old->empty()) {
+    process->renameAccount(*old, account);
+  }
+
+  atomic_store(&rateAccount_,
+    shared_ptr<const string>(new string(account)));
+  atomic_store(&metadataLimiter_,
+    process->getConcurrencyLimiter(account, METADATA_ENDPOINTS));
+  atomic_store(&contentLimiter_,
+    process->getConcurrencyLimiter(account, CONTENT_ENDPOINTS));
+}
+
+bool DropboxApi2::isContent(HttpRequest* r) {
+  return r->getRequestedUrl().find("content") != string::npos;
+}
+
+chrono::microseconds DropboxApi2::reserveRate(HttpRequest* r) {
+  double bytes = isContent(r) ? r->getRequestDataSize() : 0;
+
+  return DropboxRateLimiter::getInstance()->reserve(appKey_,
+    *atomic_load(&rateAccount_), 1, bytes);
+}
+
+bool DropboxApi2::tryReserveRate(HttpRequest* r) {
+  double bytes = isContent(r) ? r->getRequestDataSize() : 0;
+
+  return DropboxRateLimiter::getInstance()->tryReserve(appKey_,
+    *atomic_load(&rateAccount_), 1, bytes);
+}
+
+void DropboxApi2::chargeReceived(HttpRequest* r) {
+  if (!isContent(r)) {
+    return;
+  }
+
+  // Download sizes are only known afterwards; the debt delays later calls
+  DropboxRateLimiter::getInstance()->reserve(appKey_,
+    *atomic_load(&rateAccount_), 0, r->getBytesReceived());
+}
+
+void DropboxApi2::finished(HttpRequest* r, int ret) {
+  requestStats_.record(r, ret);
+
+  ApiMetrics& m = metrics();
+  RequestTiming t = r->getTiming();
+
+  m.requests_.add();
+  m.bytesSent_.add(t.bytesSent_);
+  m.bytesReceived_.add(t.bytesReceived_);
+  (isContent(r) ? m.contentLatency_ : m.metadataLatency_).record(t.total_);
+
+  if (ret) {
+    countError(CURL_ERROR);
+  } else if (r->getResponseCode() >= 400) {
+    countError((DropboxErrorCode)r->getResponseCode());
+  }
+
+  if (!ret) {
+    chargeReceived(r);
+  }
+
+  if (Tracer::isEnabled()) {
+    traceRequest(r, ret, t);
+  }
+}
+
+DropboxRequestStats& DropboxApi2::getRequestStats() {
+  return requestStats_;
 }
 
 string DropboxApi2::getAccessToken() {
@@ -71,15 +446,374 @@ void DropboxApi2::setRoot(const string root) {
   root_ = root;
 }
 
+// How long the server asked us to wait before trying again. Without a
+// Retry-After header, back off exponentially with the attempt.
+static chrono::milliseconds retryAfter(HttpRequest* r, size_t attempt) {
+  for (auto& h : r->getResponseHeaders()) {
+    if (strcasecmp(h.first.c_str(), "Retry-After")) {
+      continue;
+    }
+
+    stringstream ss(h.second);
+    long seconds;
+    if (ss >> seconds) {
+      return chrono::milliseconds(max(seconds, 0L) * 1000);
+    }
+
+    // Otherwise an HTTP date
+    time_t when = curl_getdate(h.second.c_str(), NULL);
+    if (when != -1) {
+      return chrono::milliseconds(max((long)(when - time(NULL)), 0L) * 1000);
+    }
+  }
+
+  return chrono::milliseconds(250L << min(attempt, (size_t)5));
+}
+
+// Failures that say nothing about the request itself, and may well not
+// happen again
+static bool isTransient(int curlCode) {
+  switch (curlCode) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_HTTP2:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    default:
+      return false;
+  }
+}
+
 DropboxErrorCode DropboxApi2::execute(shared_ptr<HttpRequest> r) {
+  return execute(r, nullptr);
+}
+
+int DropboxApi2::send(shared_ptr<HttpRequest>& r,
+    RequestBuilder hedge,
+    ConcurrencyLimiter& limiter,
+    LatencyTracker& latency) {
+  typedef chrono::steady_clock Clock;
+
+  Clock::time_point start = Clock::now();
+  chrono::microseconds p95;
   int ret;
 
-  {
-    lock_guard<mutex> g(stateLock_);
-    oauth_->addOAuthAccessHeader(r.get());
+  if (hedge && hedge_.load() && latency.quantile(0.95, p95)) {
+    shared_ptr<HttpRequest> h = hedge();
+    authorize(h.get());
+    bind(h.get());
+
+    chrono::milliseconds delay = max(
+      chrono::duration_cast<chrono::milliseconds>(p95),
+      chrono::milliseconds(5));
+
+    // The copy is a request like any other, but it is only worth sending
+    // if it delays no one: it needs a free slot and room in the rate limits
+    Priority priority = DropboxRequestContext::getCurrent().getPriority();
+    bool admitted = false;
+    auto admit = [&]() {
+      uint64_t ticket;
+      if (!limiter.tryAcquire(priority, ticket)) {
+        return false;
+      }
+      if (!tryReserveRate(h.get())) {
+        limiter.abandon();
+        return false;
+      }
+      admitted = true;
+      return true;
+    };
+
+    shared_ptr<HttpRequest> winner;
+    bool hedged;
+    ret = executeHedged(r, h, delay, admit, winner, hedged);
+
+    // The caller gives back one slot for the winner
+    if (admitted) {
+      limiter.abandon();
+    }
+
+    if (hedged) {
+      ++hedges_;
+    }
+    if (winner == h) {
+      ++hedgeWins_;
+    }
+    r = winner;
+  } else {
+    ret = r->execute();
+  }
+
+  if (!ret) {
+    latency.record(chrono::duration_cast<chrono::microseconds>(
+      Clock::now() - start));
+  }
+
+  return ret;
+}
+
+DropboxErrorCode DropboxApi2::execute(shared_ptr<HttpRequest>& r,
+    RequestBuilder hedge) {
+  CallState call = startCall(r.get());
+  LatencyTracker& latency = isContent(r.get()) ? contentLatency_ :
+    metadataLatency_;
+
+  const DropboxRequestContext& ctx = DropboxRequestContext::getCurrent();
+  bind(r.get());
+
+  while (true) {
+    // Wait out the rate limits before taking a concurrency slot, so that
+    // a slot is never held while sleeping
+    chrono::microseconds wait = reserveRate(r.get());
+    if (wait.count() > 0) {
+      Span span("rate_limit_wait");
+      backOff(wait);
+    }
+
+    {
+      Span span("concurrency_wait");
+      if (!call.limiter_->acquire(ctx.getPriority(), ctx.getDeadline(),
+          ctx.getCancellationToken().get(), call.ticket_)) {
+        checkContext();
+      }
+    }
+
+    {
+      Span span("authorize");
+      authorize(r.get());
+    }
+
+    int ret = send(r, hedge, *call.limiter_, latency);
+    finished(r.get(), ret);
+
+    DropboxErrorCode code;
+    chrono::microseconds delay;
+    switch (nextStep(call, r.get(), ret, ctx, code, delay)) {
+      case CALL_DONE:
+        return code;
+
+      case CALL_REFRESH:
+        if (!refreshToken(r.get())) {
+          return code;
+        }
+        break;
+
+      case CALL_RETRY:
+        if (delay.count() > 0) {
+          backOff(delay);
+        }
+        break;
+    }
+  }
+}
+
+DropboxApi2::CallState DropboxApi2::startCall(HttpRequest* r) {
+  CallState call;
+  call.limiter_ = getConcurrencyLimiter(isContent(r) ? CONTENT_ENDPOINTS :
+    METADATA_ENDPOINTS);
+  call.policy_ = atomic_load(&retryPolicy_);
+  call.delay_ = call.policy_->getBaseDelay();
+  call.failures_ = 0;
+  call.attempt_ = 0;
+  call.refreshed_ = false;
+  call.ticket_ = 0;
+  return call;
+}
+
+// Called once the request holding a slot of call.limiter_ has been sent;
+// gives the slot back
+DropboxApi2::CallStep DropboxApi2::nextStep(CallState& call,
+    HttpRequest* r,
+    int ret,
+    const DropboxRequestContext& ctx,
+    DropboxErrorCode& code,
+    chrono::microseconds& delay) {
+  size_t attempt = call.attempt_++;
+  delay = chrono::microseconds(0);
+
+  if (ret) {
+    call.limiter_->abandon();
+
+    // A timeout or abort may be the deadline or a cancellation, which
+    // are not retried
+    checkContext(ctx);
+
+    // Otherwise only a progress callback aborts a transfer
+    if (ret == CURLE_ABORTED_BY_CALLBACK) {
+      countError(CANCELLED);
+      throw DropboxException(CANCELLED,
+        "Transfer aborted by its progress callback");
+    }
+
+    if (isTransient(ret) && r->isIdempotent() &&
+        ++call.failures_ < call.policy_->getMaxAttempts()) {
+      call.delay_ = call.policy_->nextDelay(call.delay_);
+      delay = call.delay_;
+      metrics().retryTransient_.add();
+      return CALL_RETRY;
+    }
+
+    code = completed(r, ret);
+    return CALL_DONE;
+  }
+
+  code = (DropboxErrorCode)r->getResponseCode();
+  if (code == UNAUTHORIZED && !call.refreshed_ && oauth_->canRefresh()) {
+    call.limiter_->abandon();
+
+    // The token has likely expired
+    call.refreshed_ = true;
+    return CALL_REFRESH;
   }
 
-  if ((ret = r->execute())) {
+  if (code == TOO_MANY_REQUESTS || code == SERVICE_UNAVAILABLE) {
+    // The limiter holds everyone back for the Retry-After delay
+    call.limiter_->release(call.ticket_, true, retryAfter(r, attempt));
+
+    if (attempt >= throttleRetries_.load()) {
+      return CALL_DONE;
+    }
+    metrics().retryThrottled_.add();
+    return CALL_RETRY;
+  }
+
+  if (code < 500) {
+    call.limiter_->release(call.ticket_, false);
+    return CALL_DONE;
+  }
+
+  // Server errors say nothing about how hard we may push; don't grow
+  call.limiter_->abandon();
+
+  if (!r->isIdempotent() ||
+      ++call.failures_ >= call.policy_->getMaxAttempts()) {
+    return CALL_DONE;
+  }
+
+  call.delay_ = call.policy_->nextDelay(call.delay_);
+  delay = call.delay_;
+  metrics().retryServer_.add();
+  return CALL_RETRY;
+}
+
+// Only the first of the requests rejected with the same token refreshes
+// it; the rest wait for it and go again
+bool DropboxApi2::refreshToken(HttpRequest* r) {
+  if (!oauth_->refreshAccessToken(r->getHeader("Authorization"))) {
+    return false;
+  }
+
+  metrics().retryUnauthorized_.add();
+  return true;
+}
+
+void DropboxApi2::bind(HttpRequest* r) {
+  const DropboxRequestContext& ctx = DropboxRequestContext::getCurrent();
+
+  r->setDeadline(ctx.getDeadline());
+  r->setCancellationToken(ctx.getCancellationToken());
+}
+
+void DropboxApi2::checkContext() {
+  checkContext(DropboxRequestContext::getCurrent());
+}
+
+void DropboxApi2::checkContext(const DropboxRequestContext& ctx) {
+  DropboxErrorCode code = ctx.check();
+
+  if (code == CANCELLED) {
+    countError(CANCELLED);
+    throw DropboxException(CANCELLED, "Call cancelled");
+  }
+
+  if (code == DEADLINE_EXCEEDED) {
+    countError(DEADLINE_EXCEEDED);
+    throw DropboxException(DEADLINE_EXCEEDED, "Call deadline exceeded");
+  }
+}
+
+void DropboxApi2::backOff(chrono::microseconds delay) {
+  const DropboxRequestContext& ctx = DropboxRequestContext::getCurrent();
+
+  // Don't wait for a request that could not complete in time anyway
+  if (ctx.hasDeadline() &&
+      chrono::steady_clock::now() + delay >= ctx.getDeadline()) {
+    countError(DEADLINE_EXCEEDED);
+    throw DropboxException(DEADLINE_EXCEEDED, "Call deadline exceeded");
+  }
+
+  shared_ptr<CancellationToken> token = ctx.getCancellationToken();
+  if (!token) {
+    this_thread::sleep_for(delay);
+  } else if (!token->waitFor(delay)) {
+    countError(CANCELLED);
+    throw DropboxException(CANCELLED, "Call cancelled");
+  }
+}
+
+shared_ptr<ConcurrencyLimiter> DropboxApi2::getConcurrencyLimiter(
+    DropboxEndpointClass c) {
+  return c == CONTENT_ENDPOINTS ? atomic_load(&contentLimiter_) :
+    atomic_load(&metadataLimiter_);
+}
+
+shared_ptr<BandwidthLimiter> DropboxApi2::getBandwidthLimiter(
+    DropboxBandwidthDirection d) {
+  return d == UPLOAD_BANDWIDTH ? uploadBandwidth_ : downloadBandwidth_;
+}
+
+void DropboxApi2::setThrottleRetries(size_t retries) {
+  throttleRetries_.store(retries);
+}
+
+void DropboxApi2::setRetryPolicy(const RetryPolicy& policy) {
+  atomic_store(&retryPolicy_,
+    shared_ptr<const RetryPolicy>(new RetryPolicy(policy)));
+}
+
+RetryPolicy DropboxApi2::getRetryPolicy() const {
+  return *atomic_load(&retryPolicy_);
+}
+
+void DropboxApi2::setHedging(bool enable) {
+  hedge_.store(enable);
+}
+
+uint64_t DropboxApi2::getHedgeCount() const {
+  return hedges_.load();
+}
+
+uint64_t DropboxApi2::getHedgeWinCount() const {
+  return hedgeWins_.load();
+}
+
+void DropboxApi2::authorize(HttpRequest* r) {
+  // Lock free; the header is an atomically published snapshot
+  oauth_->addOAuthAccessHeader(r);
+  shape(r);
+}
+
+void DropboxApi2::shape(HttpRequest* r) {
+  if (!isContent(r)) {
+    return;
+  }
+
+  DropboxRateLimiter* process = DropboxRateLimiter::getInstance();
+
+  r->addSendLimiter(process->getBandwidthLimiter(UPLOAD_BANDWIDTH));
+  r->addSendLimiter(uploadBandwidth_);
+  r->addReceiveLimiter(process->getBandwidthLimiter(DOWNLOAD_BANDWIDTH));
+  r->addReceiveLimiter(downloadBandwidth_);
+}
+
+DropboxErrorCode DropboxApi2::completed(HttpRequest* r, int ret) {
+  if (ret) {
     stringstream ss;
     ss << "Curl error (code = " << ret << ")";
 
@@ -89,13 +823,163 @@ DropboxErrorCode DropboxApi2::execute(shared_ptr<HttpRequest> r) {
   return (DropboxErrorCode)r->getResponseCode();
 }
 
+void DropboxApi2::setRequestCoalescing(bool enable) {
+  coalesce_.store(enable);
+}
+
+uint64_t DropboxApi2::getCoalescedRequestCount() const {
+  return accountFlights_.sharedCount() + metadataFlights_.sharedCount() +
+    revisionFlights_.sharedCount() + fileFlights_.sharedCount() +
+    searchFlights_.sharedCount();
+}
+
+// Paths are case insensitive; fold case and redundant slashes so that
+// equivalent requests share a key
+static string normalizePath(const string& path) {
+  string out = "/";
+
+  for (char c : path) {
+    if (c == '/' && out[out.size() - 1] == '/') {
+      continue;
+    }
+    out += (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  }
+
+  if (out.size() > 1 && out[out.size() - 1] == '/') {
+    out.erase(out.size() - 1);
+  }
+
+  return out;
+}
+
+// A shared call runs with the context of the caller that started it. Calls
+// with a deadline or cancellation token run on their own, so that they
+// neither end other callers' calls nor fail with them; the priority is
+// part of the key, so no call waits behind one of a lower class.
+template <typename Result>
+static DropboxErrorCode coalesce(
+    SingleFlight<string, pair<DropboxErrorCode, Result> >& group,
+    const string& key,
+    function<DropboxErrorCode(Result&)> fn,
+    Result& out) {
+  const DropboxRequestContext& context = DropboxRequestContext::getCurrent();
+  if (context.hasDeadline() || context.getCancellationToken()) {
+    return fn(out);
+  }
+
+  bool shared;
+  string k = key + "\n" + to_string(context.getPriority());
+  auto result = group.run(k, [&]() {
+    pair<DropboxErrorCode, Result> v;
+    v.first = fn(v.second);
+    return v;
+  }, &shared);
+
+  if (shared) {
+    metrics().coalesced_.add();
+  }
+
+  out = result->second;
+  return result->first;
+}
+
 DropboxErrorCode DropboxApi2::getAccountInfo(DropboxAccountInfo& info) {
-  shared_ptr<HttpRequest> r(
-    httpFactory_->createHttpRequest("https://api.dropboxapi.com/2/users/get_account"));
+  Span span("getAccountInfo");
+  if (!coalesce_.load()) {
+    return fetchAccountInfo(info);
+  }
 
-  DropboxErrorCode code = execute(r);
+  return coalesce<DropboxAccountInfo>(accountFlights_, "account",
+    [this](DropboxAccountInfo& i) { return fetchAccountInfo(i); }, info);
+}
+
+DropboxErrorCode DropboxApi2::getFileMetadata(DropboxMetadataRequest& req,
+    DropboxMetadataResponse& res) {
+  Span span("getFileMetadata");
+  if (!coalesce_.load()) {
+    return fetchFileMetadata(req, res);
+  }
+
+  stringstream key;
+  key << root_ << "\n" << normalizePath(req.path()) << "\n"
+    << req.getLimit() << "\n" << req.getHash() << "\n" << req.getRev() << "\n"
+    << req.includeChildren() << req.includeDeleted();
+
+  return coalesce<DropboxMetadataResponse>(metadataFlights_, key.str(),
+    [&](DropboxMetadataResponse& r) { return fetchFileMetadata(req, r); },
+    res);
+}
+
+DropboxErrorCode DropboxApi2::getRevisions(string path,
+    size_t numRevisions, DropboxRevisions& revs) {
+  Span span("getRevisions");
+  if (!coalesce_.load()) {
+    return fetchRevisions(path, numRevisions, revs);
+  }
+
+  stringstream key;
+  key << root_ << "\n" << normalizePath(path) << "\n" << numRevisions;
+
+  return coalesce<DropboxRevisions>(revisionFlights_, key.str(),
+    [&](DropboxRevisions& r) { return fetchRevisions(path, numRevisions, r); },
+    revs);
+}
+
+DropboxErrorCode DropboxApi2::getFile(DropboxGetFileRequest& req,
+    DropboxGetFileResponse& res) {
+  Span span("getFile");
+  // Streamed downloads are not retained, so they cannot be shared, and a
+  // shared download would not report its progress to every caller
+  if (!coalesce_.load() || req.getDataSink() || req.getProgressCallback()) {
+    return fetchFile(req, res);
+  }
+
+  stringstream key;
+  key << root_ << "\n" << normalizePath(req.getPath()) << "\n" << req.getRev();
+  if (req.hasRange()) {
+    key << "\n" << req.getOffset() << "-" << req.getLength();
+  }
+
+  return coalesce<DropboxGetFileResponse>(fileFlights_, key.str(),
+    [&](DropboxGetFileResponse& r) { return fetchFile(req, r); }, res);
+}
+
+DropboxErrorCode DropboxApi2::search(const DropboxSearchRequest& req,
+    DropboxSearchResult& res) {
+  Span span("search");
+  if (!coalesce_.load()) {
+    return fetchSearch(req, res);
+  }
+
+  stringstream key;
+  key << root_ << "\n" << normalizePath(req.getSearchPath()) << "\n"
+    << req.getSearchQuery() << "\n" << req.getResultLimit() << "\n"
+    << req.shouldIncludeDeleted();
+
+  return coalesce<DropboxSearchResult>(searchFlights_, key.str(),
+    [&](DropboxSearchResult& r) { return fetchSearch(req, r); }, res);
+}
+
+DropboxErrorCode DropboxApi2::fetchAccountInfo(DropboxAccountInfo& info) {
+  shared_ptr<HttpRequest> r = accountInfoRequest();
+  DropboxErrorCode code = readAccountInfo(r.get(), execute(r), info);
 
   if (code == SUCCESS) {
+    learnAccountId(info.getAccountId());
+  }
+  return code;
+}
+
+shared_ptr<HttpRequest> DropboxApi2::accountInfoRequest() {
+  return shared_ptr<HttpRequest>(httpFactory_->createHttpRequest(
+    "https://api.dropboxapi.com/2/users/get_account"));
+}
+
+DropboxErrorCode DropboxApi2::readAccountInfo(HttpRequest* r,
+    DropboxErrorCode code,
+    DropboxAccountInfo& info) {
+  if (code == SUCCESS) {
+    ParseTimer t;
     string response((char *)r->getResponse(), r->getResponseSize());
     info.readJson(response);
   }
@@ -103,12 +987,20 @@ DropboxErrorCode DropboxApi2::getAccountInfo(DropboxAccountInfo& info) {
   return code;
 }
 
-DropboxErrorCode DropboxApi2::getFileMetadata(DropboxMetadataRequest& req,
+DropboxErrorCode DropboxApi2::fetchFileMetadata(DropboxMetadataRequest& req,
     DropboxMetadataResponse& res) {
-  stringstream ss;
-  ss << "https://api.dropbox.com/1/metadata/" << root_ << "/" << req.path();
+  shared_ptr<HttpRequest> r = fileMetadataRequest(req);
+  DropboxErrorCode code = execute(r, [&]() {
+    return fileMetadataRequest(req);
+  });
+
+  return readFileMetadata(r.get(), code, res);
+}
 
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+shared_ptr<HttpRequest> DropboxApi2::fileMetadataRequest(
+    const DropboxMetadataRequest& req) {
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api.dropbox.com/1/metadata/", root_, req.path())));
 
   r->setMethod(HttpGetRequest);
 
@@ -134,24 +1026,31 @@ DropboxErrorCode DropboxApi2::getFileMetadata(DropboxMetadataRequest& req,
     r->addParam("rev", req.getRev());
   }
 
-  DropboxErrorCode code = execute(r);
+  return r;
+}
+
+DropboxErrorCode DropboxApi2::readFileMetadata(HttpRequest* r,
+    DropboxErrorCode code,
+    DropboxMetadataResponse& res) {
+  if (code == NOT_MODIFIED) {
+    metrics().notModified_.add();
+  }
+
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
   res.readJson(response);
 
   return code;
 }
 
-DropboxErrorCode DropboxApi2::getRevisions(string path,
+DropboxErrorCode DropboxApi2::fetchRevisions(string path,
     size_t numRevisions, DropboxRevisions& revs) {
-  stringstream ss;
-
-  ss << "https://api.dropbox.com/1/revisions/" << root_ << "/" << path;
-
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api.dropbox.com/1/revisions/", root_, path)));
 
   r->setMethod(HttpGetRequest);
 
@@ -164,6 +1063,7 @@ DropboxErrorCode DropboxApi2::getRevisions(string path,
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
   revs.readFromJson(response);
 
@@ -172,11 +1072,9 @@ DropboxErrorCode DropboxApi2::getRevisions(string path,
 
 DropboxErrorCode DropboxApi2::restoreFile(string path,
     string rev, DropboxMetadata& m) {
-  stringstream ss;
-
-  ss << "https://api.dropbox.com/1/restore/" << root_ << "/" << path;
-
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+  Span span("restoreFile");
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api.dropbox.com/1/restore/", root_, path)));
 
   r->setMethod(HttpPostRequest);
   r->addParam("rev", rev);
@@ -186,6 +1084,7 @@ DropboxErrorCode DropboxApi2::restoreFile(string path,
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -200,17 +1099,22 @@ DropboxErrorCode DropboxApi2::restoreFile(string path,
 }
 
 DropboxErrorCode DropboxApi2::deleteFile(string path, DropboxMetadata& m) {
+  Span span("deleteFile");
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
     "https://api.dropbox.com/1/fileops/delete"));
 
   r->addParam("root", root_);
   r->addParam("path", path);
 
+  // The fileops calls go out as GET requests, yet change state
+  r->setIdempotent(false);
+
   DropboxErrorCode code = execute(r);
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -228,20 +1132,20 @@ DropboxErrorCode DropboxApi2::copyOrMove(const string from,
     const string to,
     const string op,
     DropboxMetadata& m) {
-  stringstream ss;
-  ss << "https://api.dropbox.com/1/fileops/" << op;
-
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    "https://api.dropbox.com/1/fileops/" + op));
 
   r->addParam("root", root_);
   r->addParam("from_path", from);
   r->addParam("to_path", to);
+  r->setIdempotent(false);
 
   DropboxErrorCode code = execute(r);
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -258,28 +1162,33 @@ DropboxErrorCode DropboxApi2::copyOrMove(const string from,
 DropboxErrorCode DropboxApi2::copyFile(string from,
     string to,
     DropboxMetadata& m) {
+  Span span("copyFile");
   return copyOrMove(from, to, "copy", m);
 }
 
 DropboxErrorCode DropboxApi2::moveFile(string from,
     string to,
     DropboxMetadata& m) {
+  Span span("moveFile");
   return copyOrMove(from, to, "move", m);
 }
 
 DropboxErrorCode DropboxApi2::createFolder(const string path,
     DropboxMetadata& m) {
+  Span span("createFolder");
   shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
     "https://api.dropbox.com/1/fileops/create_folder"));
 
   r->addParam("root", root_);
   r->addParam("path", path);
+  r->setIdempotent(false);
 
   DropboxErrorCode code = execute(r);
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -293,13 +1202,31 @@ DropboxErrorCode DropboxApi2::createFolder(const string path,
   return code;
 }
 
-DropboxErrorCode DropboxApi2::getFile(DropboxGetFileRequest& req,
+DropboxErrorCode DropboxApi2::fetchFile(DropboxGetFileRequest& req,
     DropboxGetFileResponse& res) {
-  stringstream ss;
-  ss << "https://api-content.dropbox.com/1/files/" << root_ << "/"
-    << req.getPath();
+  shared_ptr<HttpRequest> r = fileRequest(req);
+  shared_ptr<ProgressMeter> meter = progressMeter(req);
+  followDownload(r.get(), meter);
+
+  // Only ranged reads are hedged; whole files are too costly to fetch twice
+  RequestBuilder hedge;
+  if (req.hasRange() && !req.getDataSink() && !meter) {
+    hedge = [&]() { return fileRequest(req); };
+  }
+
+  ScopedTimer t(metrics().download_);
+  DropboxErrorCode code = execute(r, hedge);
+  if (meter && (code == SUCCESS || code == PARTIAL_CONTENT)) {
+    meter->finish();
+  }
+  return readFile(r.get(), code, req, res);
+}
 
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+shared_ptr<HttpRequest> DropboxApi2::fileRequest(
+    const DropboxGetFileRequest& req) {
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api-content.dropbox.com/1/files/", root_,
+      req.getPath())));
   if (req.getRev().compare("")) {
     r->addParam("rev", req.getRev());
   }
@@ -308,12 +1235,31 @@ DropboxErrorCode DropboxApi2::getFile(DropboxGetFileRequest& req,
     r->addRange(req.getOffset(), req.getOffset() + req.getLength() - 1);
   }
 
-  DropboxErrorCode code = execute(r);
+  if (req.getBandwidthLimiter()) {
+    r->addReceiveLimiter(req.getBandwidthLimiter());
+  }
+
+  if (req.getDataSink()) {
+    r->setResponseSink(req.getDataSink());
+
+    // Data already handed to the sink cannot be taken back
+    r->setIdempotent(false);
+  }
+
+  return r;
+}
+
+DropboxErrorCode DropboxApi2::readFile(HttpRequest* r,
+    DropboxErrorCode code,
+    const DropboxGetFileRequest& req,
+    DropboxGetFileResponse& res) {
   if (code != SUCCESS && code != PARTIAL_CONTENT) {
     return code;
   }
 
-  res.setData(r->getResponse(), r->getResponseSize());
+  if (!req.getDataSink()) {
+    res.setData(r->getResponse(), r->getResponseSize());
+  }
 
   map<string, string> respHeaders = r->getResponseHeaders();
   res.setMetadata(respHeaders["x-dropbox-metadata"]);
@@ -323,11 +1269,23 @@ DropboxErrorCode DropboxApi2::getFile(DropboxGetFileRequest& req,
 
 DropboxErrorCode DropboxApi2::uploadFile(const DropboxUploadFileRequest& req,
     DropboxMetadata& m) {
-  stringstream ss;
-  ss << "https://api-content.dropbox.com/1/files_put/" << root_ << "/"
-    << req.getPath();
+  Span span("uploadFile");
+  shared_ptr<HttpRequest> r = uploadFileRequest(req);
+  shared_ptr<ProgressMeter> meter = progressMeter(req);
+  followUpload(r.get(), meter, 0, req.getUploadDataSize());
 
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+  DropboxErrorCode code = execute(r);
+  if (meter && code == SUCCESS) {
+    meter->finish();
+  }
+  return readMetadata(r.get(), code, m);
+}
+
+shared_ptr<HttpRequest> DropboxApi2::uploadFileRequest(
+    const DropboxUploadFileRequest& req) {
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api-content.dropbox.com/1/files_put/", root_,
+      req.getPath())));
   r->setMethod(HttpPutRequest);
 
   if (req.shouldOverwrite()) {
@@ -343,13 +1301,21 @@ DropboxErrorCode DropboxApi2::uploadFile(const DropboxUploadFileRequest& req,
   assert(req.getUploadData());
 
   r->setRequestData(req.getUploadData(), req.getUploadDataSize());
+  if (req.getBandwidthLimiter()) {
+    r->addSendLimiter(req.getBandwidthLimiter());
+  }
 
-  DropboxErrorCode code = execute(r);
+  return r;
+}
 
+DropboxErrorCode DropboxApi2::readMetadata(HttpRequest* r,
+    DropboxErrorCode code,
+    DropboxMetadata& m) {
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -366,11 +1332,13 @@ DropboxErrorCode DropboxApi2::uploadFile(const DropboxUploadFileRequest& req,
 DropboxErrorCode DropboxApi2::uploadLargeFile(
     const DropboxUploadLargeFileRequest& req,
     DropboxMetadata& m) {
+  Span span("uploadLargeFile");
   string uploadId = "";
   size_t offset = req.getOffset();
   size_t size = 0;
   unique_ptr<uint8_t, void(*)(void*)> data(
     (uint8_t*)malloc(req.getChunkSize()), free);
+  shared_ptr<ProgressMeter> meter = progressMeter(req);
 
   if (!data.get()) {
     throw std::bad_alloc();
@@ -396,12 +1364,23 @@ DropboxErrorCode DropboxApi2::uploadLargeFile(
     }
 
     r->setRequestData(data.get(), size);
-
-    DropboxErrorCode code = execute(r);
+    if (req.getBandwidthLimiter()) {
+      r->addSendLimiter(req.getBandwidthLimiter());
+    }
+    followUpload(r.get(), meter, offset, req.getTotalSize());
+
+    DropboxErrorCode code;
+    {
+      ScopedTimer t(metrics().uploadChunk_);
+      Span span("upload_chunk");
+      span.addArg("offset", (int64_t)offset);
+      code = execute(r);
+    }
     if (code != SUCCESS) {
       return code;
     }
 
+    ParseTimer t;
     string response((char *)r->getResponse(), r->getResponseSize());
 
     DropboxUploadLargeFileResponse res =
@@ -410,11 +1389,13 @@ DropboxErrorCode DropboxApi2::uploadLargeFile(
     offset = res.getOffset();
   } while (size != 0);
 
-  stringstream ss;
-  ss << "https://api-content.dropbox.com/1/commit_chunked_upload/" << root_
-    << "/" << req.getPath();
+  if (meter) {
+    meter->finish();
+  }
 
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api-content.dropbox.com/1/commit_chunked_upload/",
+      root_, req.getPath())));
   r->setMethod(HttpPostRequest);
 
   if (req.shouldOverwrite()) {
@@ -434,6 +1415,7 @@ DropboxErrorCode DropboxApi2::uploadLargeFile(
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
 
   stringstream s;
@@ -447,13 +1429,17 @@ DropboxErrorCode DropboxApi2::uploadLargeFile(
   return code;
 }
 
-DropboxErrorCode DropboxApi2::search(const DropboxSearchRequest& req,
+DropboxErrorCode DropboxApi2::fetchSearch(const DropboxSearchRequest& req,
     DropboxSearchResult& res) {
-  stringstream ss;
-  ss << "https://api.dropbox.com/1/search/" << root_ << "/"
-    << req.getSearchPath();
+  shared_ptr<HttpRequest> r = searchRequest(req);
+  return readSearch(r.get(), execute(r), res);
+}
 
-  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(ss.str()));
+shared_ptr<HttpRequest> DropboxApi2::searchRequest(
+    const DropboxSearchRequest& req) {
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    fileUrl("https://api.dropbox.com/1/search/", root_,
+      req.getSearchPath())));
 
   r->addParam("query", req.getSearchQuery());
   r->addIntegerParam("file_limit", req.getResultLimit());
@@ -464,14 +1450,448 @@ DropboxErrorCode DropboxApi2::search(const DropboxSearchRequest& req,
     r->addParam("include_deleted", "false");
   }
 
-  DropboxErrorCode code = execute(r);
+  return r;
+}
 
+DropboxErrorCode DropboxApi2::readSearch(HttpRequest* r,
+    DropboxErrorCode code,
+    DropboxSearchResult& res) {
   if (code != SUCCESS) {
     return code;
   }
 
+  ParseTimer t;
   string response((char *)r->getResponse(), r->getResponseSize());
   res = DropboxSearchResult::readFromJson(response);
 
   return code;
 }
+
+shared_ptr<HttpRequest> DropboxApi2::createRpcRequest(const string url,
+    const string& body) {
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(url));
+
+  r->setMethod(HttpPostRequest);
+  r->addHeader("Content-Type", "application/json");
+  r->setRequestData((uint8_t*)body.data(), body.size());
+
+  return r;
+}
+
+DropboxErrorCode DropboxApi2::readBatchLaunch(HttpRequest* r,
+    const char* metadataKey,
+    string& asyncJobId,
+    bool& complete,
+    vector<DropboxBatchEntryResult>& results) {
+  ParseTimer t;
+  string response((char *)r->getResponse(), r->getResponseSize());
+
+  try {
+    stringstream s;
+    s << response;
+
+    ptree pt;
+    read_json(s, pt);
+
+    string tag = jsonTag(pt);
+    asyncJobId = "";
+    complete = false;
+
+    if (tag == "async_job_id") {
+      asyncJobId = pt.get<string>("async_job_id");
+      return SUCCESS;
+    }
+
+    if (tag == "in_progress") {
+      return SUCCESS;
+    }
+
+    complete = true;
+    results.clear();
+
+    if (tag == "failed") {
+      // The job as a whole failed; there are no per-entry results
+      return SUCCESS;
+    }
+
+    if (tag != "complete") {
+      throw DropboxException(MALFORMED_RESPONSE, "Unexpected batch status " +
+        tag);
+    }
+
+    for (auto& v : pt.get_child("entries")) {
+      DropboxBatchEntryResult res;
+
+      res.success_ = (jsonTag(v.second) == "success");
+      if (res.success_ && metadataKey) {
+        DropboxMetadata::readFromJsonV2(v.second.get_child(metadataKey),
+          res.metadata_);
+      } else if (res.success_) {
+        DropboxMetadata::readFromJsonV2(v.second, res.metadata_);
+      } else {
+        stringstream e;
+        write_json(e, v.second.get_child("failure", ptree()), false);
+        res.error_ = e.str();
+      }
+
+      results.push_back(res);
+    }
+  } catch (DropboxException&) {
+    throw;
+  } catch (exception& e) {
+    throw DropboxException(MALFORMED_RESPONSE, e.what());
+  }
+
+  return SUCCESS;
+}
+
+DropboxErrorCode DropboxApi2::uploadSession(
+    const DropboxUploadLargeFileRequest& req,
+    DropboxUploadSessionCursor& cursor) {
+  Span span("uploadSession");
+  size_t chunkSize = req.getChunkSize();
+  unique_ptr<uint8_t, void(*)(void*)> data(
+    (uint8_t*)malloc(chunkSize ? chunkSize : 1), free);
+  shared_ptr<ProgressMeter> meter = progressMeter(req);
+
+  if (!data.get()) {
+    throw std::bad_alloc();
+  }
+
+  cursor.sessionId_ = "";
+  cursor.offset_ = 0;
+
+  bool closed = false;
+  while (!closed) {
+    size_t size = req.getData(data.get(), cursor.offset_, chunkSize);
+    closed = (size < chunkSize);
+
+    shared_ptr<HttpRequest> r =
+      sessionChunkRequest(cursor, closed, data.get(), size);
+    if (req.getBandwidthLimiter()) {
+      r->addSendLimiter(req.getBandwidthLimiter());
+    }
+    followUpload(r.get(), meter, cursor.offset_, req.getTotalSize());
+
+    ScopedTimer t(metrics().uploadChunk_);
+    Span span("upload_chunk");
+    span.addArg("offset", (int64_t)cursor.offset_);
+    DropboxErrorCode code = readSessionChunk(r.get(), execute(r), size,
+      cursor);
+    if (code != SUCCESS) {
+      return code;
+    }
+  }
+
+  if (meter) {
+    meter->finish();
+  }
+
+  return SUCCESS;
+}
+
+shared_ptr<HttpRequest> DropboxApi2::sessionChunkRequest(
+    const DropboxUploadSessionCursor& cursor,
+    bool close,
+    uint8_t* data,
+    size_t size) {
+  stringstream arg;
+  shared_ptr<HttpRequest> r;
+
+  if (cursor.sessionId_.empty()) {
+    r.reset(httpFactory_->createHttpRequest(
+      "https://content.dropboxapi.com/2/files/upload_session/start"));
+    arg << "{\"close\": " << jsonBool(close) << "}";
+  } else {
+    r.reset(httpFactory_->createHttpRequest(
+      "https://content.dropboxapi.com/2/files/upload_session/append_v2"));
+    arg << "{\"cursor\": {\"session_id\": "
+      << jsonQuote(cursor.sessionId_, true)
+      << ", \"offset\": " << cursor.offset_ << "}, "
+      << "\"close\": " << jsonBool(close) << "}";
+  }
+
+  r->setMethod(HttpPostRequest);
+  r->addHeader("Dropbox-API-Arg", arg.str());
+  r->addHeader("Content-Type", "application/octet-stream");
+  r->setRequestData(data, size);
+
+  return r;
+}
+
+DropboxErrorCode DropboxApi2::readSessionChunk(HttpRequest* r,
+    DropboxErrorCode code,
+    size_t size,
+    DropboxUploadSessionCursor& cursor) {
+  if (code != SUCCESS) {
+    return code;
+  }
+
+  if (cursor.sessionId_.empty()) {
+    ParseTimer t;
+    string response((char *)r->getResponse(), r->getResponseSize());
+
+    try {
+      stringstream s;
+      s << response;
+
+      ptree pt;
+      read_json(s, pt);
+      cursor.sessionId_ = pt.get<string>("session_id");
+    } catch (exception& e) {
+      throw DropboxException(MALFORMED_RESPONSE, e.what());
+    }
+  }
+
+  cursor.offset_ += size;
+
+  return code;
+}
+
+shared_ptr<HttpRequest> DropboxApi2::sessionFinishRequest(
+    const DropboxUploadSessionCursor& cursor,
+    const string path,
+    bool overwrite,
+    const string parentRev) {
+  stringstream arg;
+  arg << "{\"cursor\": {\"session_id\": "
+    << jsonQuote(cursor.sessionId_, true)
+    << ", \"offset\": " << cursor.offset_ << "}, "
+    << "\"commit\": {\"path\": " << jsonQuote(path, true) << ", \"mode\": ";
+
+  if (!parentRev.empty()) {
+    arg << "{\".tag\": \"update\", \"update\": "
+      << jsonQuote(parentRev, true) << "}";
+  } else {
+    arg << (overwrite ? "\"overwrite\"" : "\"add\"");
+  }
+  arg << "}}";
+
+  shared_ptr<HttpRequest> r(httpFactory_->createHttpRequest(
+    "https://content.dropboxapi.com/2/files/upload_session/finish"));
+
+  r->setMethod(HttpPostRequest);
+  r->addHeader("Dropbox-API-Arg", arg.str());
+  r->addHeader("Content-Type", "application/octet-stream");
+
+  return r;
+}
+
+DropboxErrorCode DropboxApi2::readSessionFinish(HttpRequest* r,
+    DropboxErrorCode code,
+    DropboxMetadata& m) {
+  if (code != SUCCESS) {
+    return code;
+  }
+
+  try {
+    ParseTimer t;
+    stringstream s;
+    s.write((char *)r->getResponse(), r->getResponseSize());
+
+    ptree pt;
+    read_json(s, pt);
+    DropboxMetadata::readFromJsonV2(pt, m);
+  } catch (exception& e) {
+    throw DropboxException(MALFORMED_RESPONSE, e.what());
+  }
+
+  return code;
+}
+
+DropboxErrorCode DropboxApi2::finishUploadBatch(
+    const vector<DropboxUploadSessionCommit>& commits,
+    string& asyncJobId,
+    vector<DropboxBatchEntryResult>& results) {
+  Span span("finishUploadBatch");
+  assert(commits.size() <= MAX_BATCH_ENTRIES);
+
+  stringstream body;
+  body << "{\"entries\": [";
+
+  for (size_t i = 0; i < commits.size(); ++i) {
+    const DropboxUploadSessionCommit& c = commits[i];
+
+    if (i) {
+      body << ", ";
+    }
+
+    body << "{\"cursor\": {\"session_id\": "
+      << jsonQuote(c.cursor_.sessionId_)
+      << ", \"offset\": " << c.cursor_.offset_ << "}, "
+      << "\"commit\": {\"path\": " << jsonQuote(c.path_)
+      << ", \"mode\": " << (c.overwrite_ ? "\"overwrite\"" : "\"add\"")
+      << ", \"autorename\": " << jsonBool(c.autorename_) << "}}";
+  }
+
+  body << "]}";
+
+  string b = body.str();
+  shared_ptr<HttpRequest> r(createRpcRequest(
+    "https://api.dropboxapi.com/2/files/upload_session/finish_batch", b));
+
+  DropboxErrorCode code = execute(r);
+  if (code != SUCCESS) {
+    return code;
+  }
+
+  bool complete;
+  return readBatchLaunch(r.get(), NULL, asyncJobId, complete, results);
+}
+
+DropboxErrorCode DropboxApi2::checkUploadBatch(const string asyncJobId,
+    bool& complete,
+    vector<DropboxBatchEntryResult>& results) {
+  Span span("checkUploadBatch");
+  string b = "{\"async_job_id\": " + jsonQuote(asyncJobId) + "}";
+  shared_ptr<HttpRequest> r(createRpcRequest(
+    "https://api.dropboxapi.com/2/files/upload_session/finish_batch/check", b));
+  r->setIdempotent(true);
+
+  DropboxErrorCode code = execute(r);
+  if (code != SUCCESS) {
+    return code;
+  }
+
+  string jobId;
+  return readBatchLaunch(r.get(), NULL, jobId, complete, results);
+}
+
+DropboxErrorCode DropboxApi2::runBatch(const string submitUrl,
+    const string checkUrl,
+    const vector<string>& entries,
+    const string extraArgs,
+    const char* metadataKey,
+    vector<DropboxBatchEntryResult>& results) {
+  struct Chunk {
+    size_t                          begin_;
+    size_t                          end_;
+    string                          jobId_;
+    bool                            complete_;
+    vector<DropboxBatchEntryResult> results_;
+  };
+
+  DropboxErrorCode firstError = SUCCESS;
+  auto failChunk = [&](Chunk& c, DropboxErrorCode code) {
+    stringstream ss;
+    ss << "Batch request failed (code = " << code << ")";
+
+    DropboxBatchEntryResult res;
+    res.success_ = false;
+    res.error_ = ss.str();
+
+    c.complete_ = true;
+    c.results_.assign(c.end_ - c.begin_, res);
+
+    if (firstError == SUCCESS) {
+      firstError = code;
+    }
+  };
+
+  // Submit every chunk first so the server can run the jobs concurrently
+  vector<Chunk> chunks;
+  for (size_t i = 0; i < entries.size(); i += MAX_BATCH_ENTRIES) {
+    Chunk c;
+    c.begin_ = i;
+    c.end_ = min(entries.size(), i + MAX_BATCH_ENTRIES);
+    c.complete_ = false;
+
+    stringstream body;
+    body << "{\"entries\": [";
+    for (size_t j = c.begin_; j < c.end_; ++j) {
+      body << (j == c.begin_ ? "" : ", ") << entries[j];
+    }
+    body << "]" << extraArgs << "}";
+
+    string b = body.str();
+    shared_ptr<HttpRequest> r(createRpcRequest(submitUrl, b));
+
+    DropboxErrorCode code = execute(r);
+    if (code == SUCCESS) {
+      readBatchLaunch(r.get(), metadataKey, c.jobId_, c.complete_,
+        c.results_);
+    } else {
+      failChunk(c, code);
+    }
+
+    chunks.push_back(c);
+  }
+
+  // Then wait for the jobs, in order
+  for (auto& c : chunks) {
+    chrono::milliseconds delay(50);
+
+    while (!c.complete_) {
+      backOff(delay);
+      delay = min(delay * 2, chrono::milliseconds(1000));
+
+      string b = "{\"async_job_id\": " + jsonQuote(c.jobId_) + "}";
+      shared_ptr<HttpRequest> r(createRpcRequest(checkUrl, b));
+      r->setIdempotent(true);
+
+      DropboxErrorCode code = execute(r);
+      if (code != SUCCESS) {
+        failChunk(c, code);
+        break;
+      }
+
+      string jobId;
+      readBatchLaunch(r.get(), metadataKey, jobId, c.complete_, c.results_);
+    }
+
+    if (c.results_.size() != c.end_ - c.begin_) {
+      // The job failed as a whole
+      failChunk(c, IO_ERROR);
+    }
+
+    results.insert(results.end(), c.results_.begin(), c.results_.end());
+  }
+
+  return firstError;
+}
+
+DropboxErrorCode DropboxApi2::copyFiles(
+    const vector<DropboxRelocation>& entries,
+    vector<DropboxBatchEntryResult>& results) {
+  Span span("copyFiles");
+  vector<string> args;
+  for (auto& e : entries) {
+    args.push_back("{\"from_path\": " + jsonQuote(e.from_) +
+      ", \"to_path\": " + jsonQuote(e.to_) + "}");
+  }
+
+  results.clear();
+  return runBatch("https://api.dropboxapi.com/2/files/copy_batch_v2",
+    "https://api.dropboxapi.com/2/files/copy_batch/check_v2",
+    args, ", \"autorename\": false", "success", results);
+}
+
+DropboxErrorCode DropboxApi2::moveFiles(
+    const vector<DropboxRelocation>& entries,
+    vector<DropboxBatchEntryResult>& results) {
+  Span span("moveFiles");
+  vector<string> args;
+  for (auto& e : entries) {
+    args.push_back("{\"from_path\": " + jsonQuote(e.from_) +
+      ", \"to_path\": " + jsonQuote(e.to_) + "}");
+  }
+
+  results.clear();
+  return runBatch("https://api.dropboxapi.com/2/files/move_batch_v2",
+    "https://api.dropboxapi.com/2/files/move_batch/check_v2",
+    args, ", \"autorename\": false", "success", results);
+}
+
+DropboxErrorCode DropboxApi2::deleteFiles(const vector<string>& paths,
+    vector<DropboxBatchEntryResult>& results) {
+  Span span("deleteFiles");
+  vector<string> args;
+  for (auto& p : paths) {
+    args.push_back("{\"path\": " + jsonQuote(p) + "}");
+  }
+
+  results.clear();
+  return runBatch("https://api.dropboxapi.com/2/files/delete_batch",
+    "https://api.dropboxapi.com/2/files/delete_batch/check",
+    args, "", "metadata", results);
+}
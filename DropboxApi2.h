@@ -13,8 +13,8 @@
 * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
-#ifndef __DROPBOX_API_H__
-#define __DROPBOX_API_H__
+#ifndef __DROPBOX_API2_H__
+#define __DROPBOX_API2_H__
 
 #include "util/OAuth2.h"
 #include "util/HttpRequestFactory.h"
@@ -28,10 +28,21 @@
 #include "DropboxUploadFile.h"
 #include "DropboxUploadLargeFile.h"
 #include "DropboxSearch.h"
+#include "DropboxBatch.h"
+#include "DropboxRateLimiter.h"
+#include "DropboxRequestContext.h"
+#include "DropboxRequestStats.h"
+
+#include "util/SingleFlight.h"
+#include "util/ConcurrencyLimiter.h"
+#include "util/LatencyTracker.h"
+#include "util/RetryPolicy.h"
 
 #include <string>
 #include <memory>
 #include <mutex>
+#include <vector>
+#include <atomic>
 
 namespace dropbox {
 
@@ -59,6 +70,9 @@ public:
   DropboxApi2(const std::string appKey,
     const std::string appSecret,
     const std::string accessToken);
+
+  ~DropboxApi2();
+
   void authenticate();
   /**
    * Get an access token and an access token secret for the given user
@@ -82,6 +96,32 @@ public:
    */
   void setAccessToken(std::string token);
 
+  /**
+   * Set a refresh token so that expired access tokens are replaced without
+   * re-authenticating. A request rejected with UNAUTHORIZED triggers a
+   * refresh and is sent again once; concurrent refreshes are coalesced.
+   *
+   * @param refreshToken    The refresh token
+   * @param expiresIn       Remaining lifetime of the current access token;
+   *                        zero if unknown
+   *
+   * @return void
+   */
+  void setRefreshToken(const std::string refreshToken,
+    std::chrono::seconds expiresIn = std::chrono::seconds(0));
+
+  /**
+   * Refresh the access token in the background ahead of its expiry, so that
+   * requests do not fail at the expiry boundary. New tokens are published
+   * to requests without locking.
+   *
+   * @param margin          How long before expiry to refresh
+   *
+   * @return void
+   */
+  void startAutoRefresh(
+    std::chrono::seconds margin = std::chrono::seconds(300));
+
   /**
    * Get the access token for the user
    * @param none
@@ -100,6 +140,155 @@ public:
    */
   void setRoot(const std::string);
 
+  /**
+   * Enable or disable coalescing of identical concurrent requests. When
+   * enabled, a getAccountInfo, getFileMetadata, getFile, getRevisions or
+   * search call that is identical to one already in flight waits for that
+   * call and receives a copy of its result instead of going to the network.
+   * Requests are compared after normalizing paths, which are case
+   * insensitive. getFile calls that stream to a data sink are never
+   * coalesced, nor are calls whose DropboxRequestContext has a deadline or
+   * a cancellation token, and calls only share with calls of the same
+   * priority. Disabled by default.
+   *
+   * @param enable          true to enable coalescing
+   *
+   * @return void
+   */
+  void setRequestCoalescing(bool enable);
+
+  /**
+   * Get the number of calls that were served by sharing the result of an
+   * identical call in flight
+   *
+   * @return Number of coalesced calls
+   */
+  uint64_t getCoalescedRequestCount() const;
+
+  /**
+   * Get the limiter that bounds the requests in flight to a class of
+   * endpoints. Every request waits for a slot before it is sent. The limit
+   * grows while requests succeed and is cut when the server answers with
+   * TOO_MANY_REQUESTS or SERVICE_UNAVAILABLE, after which all requests of
+   * the class also wait for the Retry-After delay. The server throttles
+   * per account, so the limiters are shared by every instance using the
+   * same account (see DropboxRateLimiter); an instance that switches
+   * account switches limiters.
+   *
+   * Waiting requests are ordered by their DropboxPriorityScope; the
+   * scheduling policy and the slots reserved for interactive requests are
+   * set on the limiter.
+   *
+   * @param c               The endpoint class
+   *
+   * @return The limiter
+   */
+  std::shared_ptr<util::ConcurrencyLimiter> getConcurrencyLimiter(
+    DropboxEndpointClass c);
+
+  /**
+   * Get the limiter that caps the combined bandwidth of this instance's
+   * content transfers in one direction. Transfers are also held to the
+   * process wide limiter (see DropboxRateLimiter) and to any limit set on
+   * their request, going at the pace of the slowest. Unlimited until a
+   * rate is set on it.
+   *
+   * @param d               The direction
+   *
+   * @return The limiter
+   */
+  std::shared_ptr<util::BandwidthLimiter> getBandwidthLimiter(
+    DropboxBandwidthDirection d);
+
+  /**
+   * Get the timing of the requests sent by this instance, per endpoint.
+   * Every execution of a request is recorded, including retries and
+   * failures.
+   *
+   * @return The stats
+   */
+  DropboxRequestStats& getRequestStats();
+
+  /**
+   * Set how many times a throttled request is sent again, after waiting for
+   * the delay given by the server, before the throttling error code is
+   * returned to the caller. Defaults to 3.
+   *
+   * @param retries         Number of retries; 0 to return throttling errors
+   *                        right away
+   *
+   * @return void
+   */
+  void setThrottleRetries(size_t retries);
+
+  /**
+   * Set the policy for retrying transient failures: network errors and
+   * server errors (5xx). Only idempotent requests are retried, that is
+   * reads and the polling of batch jobs; calls that change state and
+   * downloads streamed to a data sink fail on the first error. Throttling
+   * is handled separately; see setThrottleRetries.
+   *
+   * @param policy          The policy
+   *
+   * @return void
+   */
+  void setRetryPolicy(const util::RetryPolicy& policy);
+
+  /**
+   * Get the retry policy in effect
+   *
+   * @return The policy
+   */
+  util::RetryPolicy getRetryPolicy() const;
+
+  /**
+   * Enable or disable hedging of getFileMetadata and ranged getFile calls.
+   * When enabled, a call that has not completed within the 95th percentile
+   * of recent latencies for its endpoint class is sent a second time, and
+   * the first successful response is used. The copy counts against the
+   * concurrency and rate limits like any request, and is not sent when
+   * they have no room for it. Hedging starts once enough latencies have
+   * been observed. Disabled by default.
+   *
+   * @param enable          true to enable hedging
+   *
+   * @return void
+   */
+  void setHedging(bool enable);
+
+  /**
+   * Number of hedge requests sent, and how many of them beat the original
+   *
+   * @return Count of requests
+   */
+  uint64_t getHedgeCount() const;
+  uint64_t getHedgeWinCount() const;
+
+  /**
+   * Set the name under which this instance's calls count against account
+   * rate limits and share concurrency limits; see DropboxRateLimiter.
+   * Calls also count against the limits of the app key.
+   *
+   * By default the name is a hash of the app key and the account id, which
+   * is known once the app is authorized with authenticate() or
+   * getAccountInfo() has returned. Until then it is a hash of the app key
+   * and the access token, and the account's limits move to the new name
+   * when the token is refreshed or the id becomes known.
+   *
+   * @param account         Name of the account
+   *
+   * @return void
+   */
+  void setRateLimitAccount(const std::string account);
+
+  /**
+   * Get the name under which this instance's calls count against account
+   * rate limits, e.g. to set limits for the account
+   *
+   * @return The name; empty until there is an access token
+   */
+  std::string getRateLimitAccount() const;
+
   /**
    * Get account info for the user. This method calls the /account/info method
    * of the core API.
@@ -260,17 +449,247 @@ public:
    */
   DropboxErrorCode search(const DropboxSearchRequest&, DropboxSearchResult&);
 
+  /**
+   * Upload file data into a new upload session. This uses the
+   * /upload_session/start and /upload_session/append_v2 methods of the v2
+   * API. Data is fetched through the request's data callback one chunk at a
+   * time; a chunk shorter than the request's chunk size is taken to be the
+   * last one. The session is closed after the last chunk so it can be
+   * committed with finishUploadBatch. Only the data callback and chunk size
+   * of the request are used.
+   *
+   * @param req             Object of type DropboxUploadLargeFileRequest that
+   *                        supplies the data
+   * @param cursor          Output param holding the session id and the
+   *                        number of bytes uploaded
+   *
+   * @return Error code for the operation. See DropboxErrorCode for values
+   */
+  DropboxErrorCode uploadSession(const DropboxUploadLargeFileRequest& req,
+    DropboxUploadSessionCursor& cursor);
+
+  /**
+   * Commit closed upload sessions as files in a single call to the
+   * /upload_session/finish_batch method of the v2 API. At most
+   * MAX_BATCH_ENTRIES commits may be passed. The server usually runs the
+   * commit as an asynchronous job, in which case asyncJobId is set and the
+   * results must be fetched with checkUploadBatch. Otherwise asyncJobId is
+   * empty and results holds one entry per commit. An empty list of results
+   * for a completed job means the job failed as a whole.
+   *
+   * @param commits         The sessions to commit and their destinations
+   * @param asyncJobId      Output param; id of the job to poll, if any
+   * @param results         Output param; per-commit results, if complete
+   *
+   * @return Error code for the operation. See DropboxErrorCode for values
+   */
+  DropboxErrorCode finishUploadBatch(
+    const std::vector<DropboxUploadSessionCommit>& commits,
+    std::string& asyncJobId,
+    std::vector<DropboxBatchEntryResult>& results);
+
+  /**
+   * Check the status of a job started by finishUploadBatch. This calls the
+   * /upload_session/finish_batch/check method of the v2 API.
+   *
+   * @param asyncJobId      Id of the job returned by finishUploadBatch
+   * @param complete        Output param; false while the job is running
+   * @param results         Output param; per-commit results once complete
+   *
+   * @return Error code for the operation. See DropboxErrorCode for values
+   */
+  DropboxErrorCode checkUploadBatch(const std::string asyncJobId,
+    bool& complete,
+    std::vector<DropboxBatchEntryResult>& results);
+
+  /**
+   * Copy files and folders. This uses the /copy_batch_v2 method of the v2
+   * API. Entries are submitted in chunks of MAX_BATCH_ENTRIES and the call
+   * returns once every chunk's job has completed.
+   *
+   * @param entries         Absolute source and destination paths
+   * @param results         Output param with one result per entry, in the
+   *                        order of entries
+   *
+   * @return SUCCESS, or the error code of the first chunk that failed as a
+   *         whole. Failures of single entries are reported in results
+   */
+  DropboxErrorCode copyFiles(const std::vector<DropboxRelocation>& entries,
+    std::vector<DropboxBatchEntryResult>& results);
+
+  /**
+   * Move files and folders. This uses the /move_batch_v2 method of the v2
+   * API. See copyFiles for the handling of large inputs and results.
+   *
+   * @param entries         Absolute source and destination paths
+   * @param results         Output param with one result per entry
+   *
+   * @return SUCCESS, or the error code of the first chunk that failed
+   */
+  DropboxErrorCode moveFiles(const std::vector<DropboxRelocation>& entries,
+    std::vector<DropboxBatchEntryResult>& results);
+
+  /**
+   * Delete files and folders. This uses the /delete_batch method of the v2
+   * API. See copyFiles for the handling of large inputs and results.
+   *
+   * @param paths           Absolute paths to delete
+   * @param results         Output param with one result per path; metadata_
+   *                        holds the metadata of the deleted entry
+   *
+   * @return SUCCESS, or the error code of the first chunk that failed
+   */
+  DropboxErrorCode deleteFiles(const std::vector<std::string>& paths,
+    std::vector<DropboxBatchEntryResult>& results);
+
 private:
+  DropboxErrorCode  fetchAccountInfo(DropboxAccountInfo&);
+  DropboxErrorCode  fetchFileMetadata(DropboxMetadataRequest&,
+    DropboxMetadataResponse&);
+  DropboxErrorCode  fetchRevisions(std::string, size_t, DropboxRevisions&);
+  DropboxErrorCode  fetchFile(DropboxGetFileRequest&, DropboxGetFileResponse&);
+  DropboxErrorCode  fetchSearch(const DropboxSearchRequest&,
+    DropboxSearchResult&);
+  DropboxErrorCode  runBatch(const std::string,
+    const std::string,
+    const std::vector<std::string>&,
+    const std::string,
+    const char*,
+    std::vector<DropboxBatchEntryResult>&);
+  std::shared_ptr<http::HttpRequest> createRpcRequest(const std::string url,
+    const std::string& body);
+  DropboxErrorCode  readBatchLaunch(http::HttpRequest*,
+    const char*,
+    std::string&,
+    bool&,
+    std::vector<DropboxBatchEntryResult>&);
   DropboxErrorCode  copyOrMove(const std::string,
     const std::string,
     const std::string,
     DropboxMetadata&);
+  typedef std::function<std::shared_ptr<http::HttpRequest>()> RequestBuilder;
+
+  // A call's way through the concurrency limiter, throttling, retries and
+  // the token refresh. execute waits by blocking, DropboxCoroApi on its
+  // loop; both leave the decisions to nextStep.
+  struct CallState {
+    std::shared_ptr<util::ConcurrencyLimiter>   limiter_;
+    std::shared_ptr<const util::RetryPolicy>    policy_;
+    std::chrono::milliseconds                   delay_;
+    size_t                                      failures_;
+    size_t                                      attempt_;
+    bool                                        refreshed_;
+    uint64_t                                    ticket_;
+  };
+
+  enum CallStep {
+    // The code is the result of the call
+    CALL_DONE,
+    // Wait for the delay, then send the request again
+    CALL_RETRY,
+    // Refresh the token with refreshToken, then send the request again
+    CALL_REFRESH
+  };
+
+  CallState         startCall(http::HttpRequest*);
+  CallStep          nextStep(CallState&, http::HttpRequest*, int,
+    const DropboxRequestContext&, DropboxErrorCode&,
+    std::chrono::microseconds&);
+  bool              refreshToken(http::HttpRequest*);
+
   DropboxErrorCode  execute(std::shared_ptr<http::HttpRequest>);
+  DropboxErrorCode  execute(std::shared_ptr<http::HttpRequest>&,
+    RequestBuilder);
+  int               send(std::shared_ptr<http::HttpRequest>&,
+    RequestBuilder, util::ConcurrencyLimiter&, util::LatencyTracker&);
+  void              authorize(http::HttpRequest*);
+  void              shape(http::HttpRequest*);
+  static void       bind(http::HttpRequest*);
+  static void       checkContext();
+  static void       checkContext(const DropboxRequestContext&);
+  static void       backOff(std::chrono::microseconds);
+  static bool       isContent(http::HttpRequest*);
+  std::chrono::microseconds reserveRate(http::HttpRequest*);
+  bool              tryReserveRate(http::HttpRequest*);
+  void              chargeReceived(http::HttpRequest*);
+  void              finished(http::HttpRequest*, int);
+  void              publishRateAccount(const std::string, bool);
+  std::string       defaultRateAccount() const;
+  void              tokenChanged();
+  void              learnAccountId(const std::string);
+  DropboxErrorCode  completed(http::HttpRequest*, int);
+
+  // Each call is split into building its request and reading the response
+  // so that the coroutine interface (DropboxCoroutines.h) can send the same
+  // requests through an HttpEventLoop
+  friend class DropboxCoroApi;
+
+  std::shared_ptr<http::HttpRequest> accountInfoRequest();
+  std::shared_ptr<http::HttpRequest> fileMetadataRequest(
+    const DropboxMetadataRequest&);
+  std::shared_ptr<http::HttpRequest> fileRequest(
+    const DropboxGetFileRequest&);
+  std::shared_ptr<http::HttpRequest> searchRequest(
+    const DropboxSearchRequest&);
+  std::shared_ptr<http::HttpRequest> uploadFileRequest(
+    const DropboxUploadFileRequest&);
+  std::shared_ptr<http::HttpRequest> sessionChunkRequest(
+    const DropboxUploadSessionCursor&, bool, uint8_t*, size_t);
+  std::shared_ptr<http::HttpRequest> sessionFinishRequest(
+    const DropboxUploadSessionCursor&, const std::string, bool,
+    const std::string);
+
+  static DropboxErrorCode readAccountInfo(http::HttpRequest*,
+    DropboxErrorCode, DropboxAccountInfo&);
+  static DropboxErrorCode readFileMetadata(http::HttpRequest*,
+    DropboxErrorCode, DropboxMetadataResponse&);
+  static DropboxErrorCode readFile(http::HttpRequest*,
+    DropboxErrorCode, const DropboxGetFileRequest&, DropboxGetFileResponse&);
+  static DropboxErrorCode readSearch(http::HttpRequest*,
+    DropboxErrorCode, DropboxSearchResult&);
+  static DropboxErrorCode readMetadata(http::HttpRequest*,
+    DropboxErrorCode, DropboxMetadata&);
+  static DropboxErrorCode readSessionChunk(http::HttpRequest*,
+    DropboxErrorCode, size_t, DropboxUploadSessionCursor&);
+  static DropboxErrorCode readSessionFinish(http::HttpRequest*,
+    DropboxErrorCode, DropboxMetadata&);
 
   std::string                     root_;
+  std::string                     appKey_;
+  std::shared_ptr<const std::string>  rateAccount_;
+  // Guards the account naming state; may be taken with stateLock_ held,
+  // as tokens obtained through authenticate() are reported under it
+  std::mutex                      rateLock_;
+  bool                            rateAccountSet_;
+  std::string                     accountId_;
   std::mutex                      stateLock_;
   std::unique_ptr<oauth::OAuth2>   oauth_;
   http::HttpRequestFactory*       httpFactory_;
+
+  std::atomic<bool>               coalesce_;
+  std::atomic<size_t>             throttleRetries_;
+  std::shared_ptr<util::ConcurrencyLimiter>  metadataLimiter_;
+  std::shared_ptr<util::ConcurrencyLimiter>  contentLimiter_;
+  std::shared_ptr<util::BandwidthLimiter>   uploadBandwidth_;
+  std::shared_ptr<util::BandwidthLimiter>   downloadBandwidth_;
+  std::shared_ptr<const util::RetryPolicy>  retryPolicy_;
+
+  std::atomic<bool>               hedge_;
+  std::atomic<uint64_t>           hedges_;
+  std::atomic<uint64_t>           hedgeWins_;
+  util::LatencyTracker            metadataLatency_;
+  util::LatencyTracker            contentLatency_;
+  DropboxRequestStats             requestStats_;
+  util::SingleFlight<std::string,
+    std::pair<DropboxErrorCode, DropboxAccountInfo> >       accountFlights_;
+  util::SingleFlight<std::string,
+    std::pair<DropboxErrorCode, DropboxMetadataResponse> >  metadataFlights_;
+  util::SingleFlight<std::string,
+    std::pair<DropboxErrorCode, DropboxRevisions> >         revisionFlights_;
+  util::SingleFlight<std::string,
+    std::pair<DropboxErrorCode, DropboxGetFileResponse> >   fileFlights_;
+  util::SingleFlight<std::string,
+    std::pair<DropboxErrorCode, DropboxSearchResult> >      searchFlights_;
 };
 }
 #endif
@@ -0,0 +1,325 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "DropboxAsyncApi.h"
+
+#include <memory>
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+DropboxAsyncApi::DropboxAsyncApi(DropboxApi2& api, Executor& executor) :
+    api_(api),
+    executor_(executor) {
+}
+
+// Calls are queued with trySubmit: a caller, or a completion callback on
+// an executor thread, must never wait for room in the queue that only the
+// executor's threads can make
+
+DropboxAsyncApi::Future DropboxAsyncApi::post(Call call) {
+  shared_ptr<packaged_task<DropboxErrorCode()> > task(
+    new packaged_task<DropboxErrorCode()>(call));
+  Future f = task->get_future();
+  DropboxRequestContext context = DropboxRequestContext::getCurrent();
+
+  if (!executor_.trySubmit([task, context]() {
+        DropboxContextScope scope(context);
+        (*task)();
+      })) {
+    if (executor_.isShutdown()) {
+      throw DropboxException(IO_ERROR, "Executor has been shut down");
+    }
+
+    promise<DropboxErrorCode> full;
+    full.set_value(QUEUE_FULL);
+    return full.get_future();
+  }
+
+  return f;
+}
+
+void DropboxAsyncApi::post(Call call, Callback cb) {
+  DropboxRequestContext context = DropboxRequestContext::getCurrent();
+
+  bool queued = executor_.trySubmit([call, cb, context]() {
+    DropboxContextScope scope(context);
+    DropboxErrorCode code;
+
+    try {
+      code = call();
+    } catch (DropboxException& e) {
+      cb(e.getErrorCode(), current_exception());
+      return;
+    } catch (...) {
+      // Anything else escaping a call is a response we could not parse
+      cb(MALFORMED_RESPONSE, current_exception());
+      return;
+    }
+
+    cb(code, nullptr);
+  });
+
+  if (!queued) {
+    if (executor_.isShutdown()) {
+      throw DropboxException(IO_ERROR, "Executor has been shut down");
+    }
+
+    cb(QUEUE_FULL, nullptr);
+  }
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::getAccountInfo(
+    DropboxAccountInfo& info) {
+  return post([this, &info]() { return api_.getAccountInfo(info); });
+}
+
+void DropboxAsyncApi::getAccountInfo(DropboxAccountInfo& info, Callback cb) {
+  post([this, &info]() { return api_.getAccountInfo(info); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::getFile(DropboxGetFileRequest req,
+    DropboxGetFileResponse& res) {
+  return post([this, req, &res]() mutable { return api_.getFile(req, res); });
+}
+
+void DropboxAsyncApi::getFile(DropboxGetFileRequest req,
+    DropboxGetFileResponse& res,
+    Callback cb) {
+  post([this, req, &res]() mutable { return api_.getFile(req, res); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::getFileMetadata(
+    DropboxMetadataRequest req,
+    DropboxMetadataResponse& res) {
+  return post([this, req, &res]() mutable {
+    return api_.getFileMetadata(req, res);
+  });
+}
+
+void DropboxAsyncApi::getFileMetadata(DropboxMetadataRequest req,
+    DropboxMetadataResponse& res,
+    Callback cb) {
+  post([this, req, &res]() mutable {
+    return api_.getFileMetadata(req, res);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::getRevisions(string path,
+    size_t numRevisions,
+    DropboxRevisions& revs) {
+  return post([this, path, numRevisions, &revs]() {
+    return api_.getRevisions(path, numRevisions, revs);
+  });
+}
+
+void DropboxAsyncApi::getRevisions(string path,
+    size_t numRevisions,
+    DropboxRevisions& revs,
+    Callback cb) {
+  post([this, path, numRevisions, &revs]() {
+    return api_.getRevisions(path, numRevisions, revs);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::restoreFile(string path,
+    string rev,
+    DropboxMetadata& m) {
+  return post([this, path, rev, &m]() {
+    return api_.restoreFile(path, rev, m);
+  });
+}
+
+void DropboxAsyncApi::restoreFile(string path,
+    string rev,
+    DropboxMetadata& m,
+    Callback cb) {
+  post([this, path, rev, &m]() { return api_.restoreFile(path, rev, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::deleteFile(string path,
+    DropboxMetadata& m) {
+  return post([this, path, &m]() { return api_.deleteFile(path, m); });
+}
+
+void DropboxAsyncApi::deleteFile(string path, DropboxMetadata& m,
+    Callback cb) {
+  post([this, path, &m]() { return api_.deleteFile(path, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::copyFile(string from,
+    string to,
+    DropboxMetadata& m) {
+  return post([this, from, to, &m]() { return api_.copyFile(from, to, m); });
+}
+
+void DropboxAsyncApi::copyFile(string from, string to, DropboxMetadata& m,
+    Callback cb) {
+  post([this, from, to, &m]() { return api_.copyFile(from, to, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::moveFile(string from,
+    string to,
+    DropboxMetadata& m) {
+  return post([this, from, to, &m]() { return api_.moveFile(from, to, m); });
+}
+
+void DropboxAsyncApi::moveFile(string from, string to, DropboxMetadata& m,
+    Callback cb) {
+  post([this, from, to, &m]() { return api_.moveFile(from, to, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::createFolder(string path,
+    DropboxMetadata& m) {
+  return post([this, path, &m]() { return api_.createFolder(path, m); });
+}
+
+void DropboxAsyncApi::createFolder(string path, DropboxMetadata& m,
+    Callback cb) {
+  post([this, path, &m]() { return api_.createFolder(path, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::uploadFile(
+    DropboxUploadFileRequest req,
+    DropboxMetadata& m) {
+  return post([this, req, &m]() { return api_.uploadFile(req, m); });
+}
+
+void DropboxAsyncApi::uploadFile(DropboxUploadFileRequest req,
+    DropboxMetadata& m,
+    Callback cb) {
+  post([this, req, &m]() { return api_.uploadFile(req, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::uploadLargeFile(
+    DropboxUploadLargeFileRequest req,
+    DropboxMetadata& m) {
+  return post([this, req, &m]() { return api_.uploadLargeFile(req, m); });
+}
+
+void DropboxAsyncApi::uploadLargeFile(DropboxUploadLargeFileRequest req,
+    DropboxMetadata& m,
+    Callback cb) {
+  post([this, req, &m]() { return api_.uploadLargeFile(req, m); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::search(DropboxSearchRequest req,
+    DropboxSearchResult& res) {
+  return post([this, req, &res]() { return api_.search(req, res); });
+}
+
+void DropboxAsyncApi::search(DropboxSearchRequest req,
+    DropboxSearchResult& res,
+    Callback cb) {
+  post([this, req, &res]() { return api_.search(req, res); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::uploadSession(
+    DropboxUploadLargeFileRequest req,
+    DropboxUploadSessionCursor& cursor) {
+  return post([this, req, &cursor]() {
+    return api_.uploadSession(req, cursor);
+  });
+}
+
+void DropboxAsyncApi::uploadSession(DropboxUploadLargeFileRequest req,
+    DropboxUploadSessionCursor& cursor,
+    Callback cb) {
+  post([this, req, &cursor]() { return api_.uploadSession(req, cursor); }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::finishUploadBatch(
+    vector<DropboxUploadSessionCommit> commits,
+    string& asyncJobId,
+    vector<DropboxBatchEntryResult>& results) {
+  return post([this, commits, &asyncJobId, &results]() {
+    return api_.finishUploadBatch(commits, asyncJobId, results);
+  });
+}
+
+void DropboxAsyncApi::finishUploadBatch(
+    vector<DropboxUploadSessionCommit> commits,
+    string& asyncJobId,
+    vector<DropboxBatchEntryResult>& results,
+    Callback cb) {
+  post([this, commits, &asyncJobId, &results]() {
+    return api_.finishUploadBatch(commits, asyncJobId, results);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::checkUploadBatch(string asyncJobId,
+    bool& complete,
+    vector<DropboxBatchEntryResult>& results) {
+  return post([this, asyncJobId, &complete, &results]() {
+    return api_.checkUploadBatch(asyncJobId, complete, results);
+  });
+}
+
+void DropboxAsyncApi::checkUploadBatch(string asyncJobId,
+    bool& complete,
+    vector<DropboxBatchEntryResult>& results,
+    Callback cb) {
+  post([this, asyncJobId, &complete, &results]() {
+    return api_.checkUploadBatch(asyncJobId, complete, results);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::copyFiles(
+    vector<DropboxRelocation> entries,
+    vector<DropboxBatchEntryResult>& results) {
+  return post([this, entries, &results]() {
+    return api_.copyFiles(entries, results);
+  });
+}
+
+void DropboxAsyncApi::copyFiles(vector<DropboxRelocation> entries,
+    vector<DropboxBatchEntryResult>& results,
+    Callback cb) {
+  post([this, entries, &results]() {
+    return api_.copyFiles(entries, results);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::moveFiles(
+    vector<DropboxRelocation> entries,
+    vector<DropboxBatchEntryResult>& results) {
+  return post([this, entries, &results]() {
+    return api_.moveFiles(entries, results);
+  });
+}
+
+void DropboxAsyncApi::moveFiles(vector<DropboxRelocation> entries,
+    vector<DropboxBatchEntryResult>& results,
+    Callback cb) {
+  post([this, entries, &results]() {
+    return api_.moveFiles(entries, results);
+  }, cb);
+}
+
+DropboxAsyncApi::Future DropboxAsyncApi::deleteFiles(vector<string> paths,
+    vector<DropboxBatchEntryResult>& results) {
+  return post([this, paths, &results]() {
+    return api_.deleteFiles(paths, results);
+  });
+}
+
+void DropboxAsyncApi::deleteFiles(vector<string> paths,
+    vector<DropboxBatchEntryResult>& results,
+    Callback cb) {
+  post([this, paths, &results]() {
+    return api_.deleteFiles(paths, results);
+  }, cb);
+}
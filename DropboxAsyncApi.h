@@ -0,0 +1,168 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_ASYNC_API_H__
+#define __DROPBOX_ASYNC_API_H__
+
+#include "DropboxApi2.h"
+
+#include "util/Executor.h"
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace dropbox {
+
+/**
+ * Asynchronous facade over DropboxApi2. Every method queues the matching
+ * DropboxApi2 call on a shared util::Executor and returns immediately,
+ * either with a future for the error code or by calling a completion
+ * callback from an executor thread.
+ *
+ * Request objects are copied, but output params are written by the executor
+ * thread: they must stay alive and untouched until the future is ready or
+ * the callback has run. Exceptions thrown by the call are stored in the
+ * future, or passed to the callback.
+ *
+ * Calls run with the DropboxRequestContext (priority, deadline and
+ * cancellation token) of the thread that queued them. Priority orders calls
+ * waiting for a connection slot, not calls waiting for the executor; give
+ * interactive calls their own executor if bulk calls can fill its queue.
+ *
+ * The executor bounds both the number of calls running at once and the
+ * number queued. Queueing never blocks: when the queue is full the call is
+ * not made, and it completes at once with QUEUE_FULL. The future is ready
+ * with QUEUE_FULL, or the callback is called with it, and no exception, on
+ * the calling thread before the method returns. A callback that retries
+ * should do so later rather than from inside that call. If the executor
+ * has been shut down, the methods throw a DropboxException with IO_ERROR.
+ */
+class DropboxAsyncApi {
+public:
+  typedef std::future<DropboxErrorCode>                       Future;
+  typedef std::function<void(DropboxErrorCode code,
+    std::exception_ptr error)>                                Callback;
+
+  /**
+   * Create an asynchronous facade
+   *
+   * @param api             The DropboxApi2 instance to call. It must outlive
+   *                        this object
+   * @param executor        The executor to run calls on. It may be shared
+   *                        by several facades and must outlive them
+   */
+  DropboxAsyncApi(DropboxApi2& api, util::Executor& executor);
+
+  Future getAccountInfo(DropboxAccountInfo& info);
+  void   getAccountInfo(DropboxAccountInfo& info, Callback cb);
+
+  Future getFile(DropboxGetFileRequest req, DropboxGetFileResponse& res);
+  void   getFile(DropboxGetFileRequest req, DropboxGetFileResponse& res,
+           Callback cb);
+
+  Future getFileMetadata(DropboxMetadataRequest req,
+           DropboxMetadataResponse& res);
+  void   getFileMetadata(DropboxMetadataRequest req,
+           DropboxMetadataResponse& res, Callback cb);
+
+  Future getRevisions(std::string path, size_t numRevisions,
+           DropboxRevisions& revs);
+  void   getRevisions(std::string path, size_t numRevisions,
+           DropboxRevisions& revs, Callback cb);
+
+  Future restoreFile(std::string path, std::string rev, DropboxMetadata& m);
+  void   restoreFile(std::string path, std::string rev, DropboxMetadata& m,
+           Callback cb);
+
+  Future deleteFile(std::string path, DropboxMetadata& m);
+  void   deleteFile(std::string path, DropboxMetadata& m, Callback cb);
+
+  Future copyFile(std::string from, std::string to, DropboxMetadata& m);
+  void   copyFile(std::string from, std::string to, DropboxMetadata& m,
+           Callback cb);
+
+  Future moveFile(std::string from, std::string to, DropboxMetadata& m);
+  void   moveFile(std::string from, std::string to, DropboxMetadata& m,
+           Callback cb);
+
+  Future createFolder(std::string path, DropboxMetadata& m);
+  void   createFolder(std::string path, DropboxMetadata& m, Callback cb);
+
+  /**
+   * The data passed to the request with setUploadData is not copied and must
+   * stay valid until the upload completes.
+   */
+  Future uploadFile(DropboxUploadFileRequest req, DropboxMetadata& m);
+  void   uploadFile(DropboxUploadFileRequest req, DropboxMetadata& m,
+           Callback cb);
+
+  /**
+   * The request's data callback is called from the executor thread.
+   */
+  Future uploadLargeFile(DropboxUploadLargeFileRequest req,
+           DropboxMetadata& m);
+  void   uploadLargeFile(DropboxUploadLargeFileRequest req,
+           DropboxMetadata& m, Callback cb);
+
+  Future search(DropboxSearchRequest req, DropboxSearchResult& res);
+  void   search(DropboxSearchRequest req, DropboxSearchResult& res,
+           Callback cb);
+
+  Future uploadSession(DropboxUploadLargeFileRequest req,
+           DropboxUploadSessionCursor& cursor);
+  void   uploadSession(DropboxUploadLargeFileRequest req,
+           DropboxUploadSessionCursor& cursor, Callback cb);
+
+  Future finishUploadBatch(std::vector<DropboxUploadSessionCommit> commits,
+           std::string& asyncJobId,
+           std::vector<DropboxBatchEntryResult>& results);
+  void   finishUploadBatch(std::vector<DropboxUploadSessionCommit> commits,
+           std::string& asyncJobId,
+           std::vector<DropboxBatchEntryResult>& results, Callback cb);
+
+  Future checkUploadBatch(std::string asyncJobId, bool& complete,
+           std::vector<DropboxBatchEntryResult>& results);
+  void   checkUploadBatch(std::string asyncJobId, bool& complete,
+           std::vector<DropboxBatchEntryResult>& results, Callback cb);
+
+  Future copyFiles(std::vector<DropboxRelocation> entries,
+           std::vector<DropboxBatchEntryResult>& results);
+  void   copyFiles(std::vector<DropboxRelocation> entries,
+           std::vector<DropboxBatchEntryResult>& results, Callback cb);
+
+  Future moveFiles(std::vector<DropboxRelocation> entries,
+           std::vector<DropboxBatchEntryResult>& results);
+  void   moveFiles(std::vector<DropboxRelocation> entries,
+           std::vector<DropboxBatchEntryResult>& results, Callback cb);
+
+  Future deleteFiles(std::vector<std::string> paths,
+           std::vector<DropboxBatchEntryResult>& results);
+  void   deleteFiles(std::vector<std::string> paths,
+           std::vector<DropboxBatchEntryResult>& results, Callback cb);
+
+private:
+  typedef std::function<DropboxErrorCode()>   Call;
+
+  Future    post(Call call);
+  void      post(Call call, Callback cb);
+
+  DropboxApi2&                    api_;
+  util::Executor&                 executor_;
+};
+}
+#endif
@@ -0,0 +1,68 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_BATCH_H__
+#define __DROPBOX_BATCH_H__
+
+#include "DropboxMetadataType.h"
+
+#include <string>
+#include <cstdint>
+
+namespace dropbox {
+
+// Largest number of entries the v2 API accepts in one batch call
+const size_t MAX_BATCH_ENTRIES = 1000;
+
+/**
+ * Position in an upload session. A closed session whose offset equals the
+ * size of the file is ready to be committed.
+ */
+struct DropboxUploadSessionCursor {
+  std::string         sessionId_;
+  uint64_t            offset_;
+};
+
+/**
+ * A file to commit from an upload session with
+ * /upload_session/finish_batch
+ */
+struct DropboxUploadSessionCommit {
+  DropboxUploadSessionCursor  cursor_;
+  std::string                 path_;
+  bool                        overwrite_;
+  bool                        autorename_;
+};
+
+/**
+ * Source and destination of a batch copy or move
+ */
+struct DropboxRelocation {
+  std::string         from_;
+  std::string         to_;
+};
+
+/**
+ * Outcome of one entry of a batch call. On success metadata_ holds the
+ * metadata of the resulting file; on failure error_ holds the JSON error
+ * returned by the server for that entry.
+ */
+struct DropboxBatchEntryResult {
+  bool                success_;
+  DropboxMetadata     metadata_;
+  std::string         error_;
+};
+}
+#endif
@@ -0,0 +1,860 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_COROUTINES_H__
+#define __DROPBOX_COROUTINES_H__
+
+/**
+ * co_await-able versions of the DropboxApi2 calls. Requests are sent
+ * through an http::HttpEventLoop, so a suspended call holds no thread; one
+ * thread running the loop can drive thousands of concurrent operations.
+ *
+ * The library itself builds as C++11, so this interface is header only and
+ * is available to translation units compiled as C++20 or later.
+ *
+ *   http::HttpEventLoop loop;
+ *   DropboxCoroApi coro(api, loop);
+ *
+ *   auto fetch = [&]() -> DropboxTask<void> {
+ *     DropboxGetFileResponse res;
+ *     DropboxErrorCode code = co_await coro.getFile(req, res);
+ *     ...
+ *   };
+ *   spawn(loop, fetch());
+ *   loop.run();
+ *
+ * Coroutines are resumed on the loop thread; code between two co_awaits must
+ * not block. A spawned coroutine starts once the loop runs, so a lambda it is
+ * made from must still be alive by then.
+ *
+ * The tester is built as C++20 and covers this interface.
+ */
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#define DROPBOX_HAS_COROUTINES 1
+
+#include "DropboxApi2.h"
+#include "util/HttpEventLoop.h"
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace dropbox {
+
+template <typename T>
+class DropboxTask;
+
+namespace detail {
+
+struct TaskPromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> h) noexcept {
+      // Hand control straight to whoever awaited the task
+      std::coroutine_handle<> c = h.promise().continuation_;
+      return c ? c : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error_ = std::current_exception(); }
+
+  std::coroutine_handle<>   continuation_;
+  std::exception_ptr        error_;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  DropboxTask<T> get_return_object();
+
+  template <typename U>
+  void return_value(U&& v) { value_.emplace(std::forward<U>(v)); }
+
+  T result() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    return std::move(*value_);
+  }
+
+  std::optional<T>          value_;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  DropboxTask<void> get_return_object();
+
+  void return_void() {}
+
+  void result() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+}
+
+/**
+ * A lazily started coroutine returning a T. The coroutine body runs when the
+ * task is first awaited; exceptions thrown by the body are rethrown from the
+ * co_await.
+ */
+template <typename T>
+class DropboxTask {
+public:
+  typedef detail::TaskPromise<T>              promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  explicit DropboxTask(Handle h) : handle_(h) {}
+
+  DropboxTask(DropboxTask&& o) noexcept : handle_(o.handle_) {
+    o.handle_ = nullptr;
+  }
+
+  DropboxTask& operator=(DropboxTask&& o) noexcept {
+    if (this != &o) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = o.handle_;
+      o.handle_ = nullptr;
+    }
+    return *this;
+  }
+
+  DropboxTask(const DropboxTask&) = delete;
+  DropboxTask& operator=(const DropboxTask&) = delete;
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    handle_.promise().continuation_ = c;
+    return handle_;
+  }
+
+  T await_resume() { return handle_.promise().result(); }
+
+  ~DropboxTask() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+private:
+  Handle                                      handle_;
+};
+
+namespace detail {
+
+template <typename T>
+DropboxTask<T> TaskPromise<T>::get_return_object() {
+  return DropboxTask<T>(
+    std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+}
+
+inline DropboxTask<void> TaskPromise<void>::get_return_object() {
+  return DropboxTask<void>(
+    std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+}
+
+// Eagerly started coroutine that frees itself on completion
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+};
+
+inline DetachedTask runDetached(DropboxTask<void> task) {
+  try {
+    co_await task;
+  } catch (...) {
+    // Like util::Executor, a detached task's errors are its own to handle
+  }
+}
+
+}
+
+/**
+ * Start a task on the loop thread without waiting for it. The task owns
+ * itself and is destroyed when it completes; exceptions escaping it are
+ * dropped.
+ *
+ * @param loop            Loop that runs the task
+ * @param task            The task
+ *
+ * @return void
+ */
+inline void spawn(http::HttpEventLoop& loop, DropboxTask<void> task) {
+  std::shared_ptr<DropboxTask<void> > t =
+    std::make_shared<DropboxTask<void> >(std::move(task));
+
+  loop.post([t]() { detail::runDetached(std::move(*t)); });
+}
+
+/**
+ * Awaitable that suspends the caller until an HttpRequest completes on an
+ * HttpEventLoop, and yields the curl error code
+ */
+class HttpAwaiter {
+public:
+  HttpAwaiter(http::HttpEventLoop& loop, std::shared_ptr<http::HttpRequest> r)
+      : loop_(loop), request_(r), ret_(0) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    loop_.start(request_, [this, h](int ret) {
+      ret_ = ret;
+      h.resume();
+    });
+  }
+
+  int await_resume() const noexcept { return ret_; }
+
+private:
+  http::HttpEventLoop&                  loop_;
+  std::shared_ptr<http::HttpRequest>    request_;
+  int                                   ret_;
+};
+
+/**
+ * Awaitable that suspends the caller for a while without holding the loop
+ */
+class SleepAwaiter {
+public:
+  SleepAwaiter(http::HttpEventLoop& loop, std::chrono::microseconds delay)
+      : loop_(loop), delay_(delay) {}
+
+  bool await_ready() const noexcept { return delay_.count() <= 0; }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    loop_.postAfter(delay_, [h]() { h.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  http::HttpEventLoop&                  loop_;
+  std::chrono::microseconds             delay_;
+};
+
+/**
+ * Awaitable that queues for a slot of a util::ConcurrencyLimiter without
+ * holding the loop, and yields whether one was taken. It gives up once the
+ * context's token is cancelled or its deadline has passed.
+ */
+class AdmissionAwaiter {
+public:
+  AdmissionAwaiter(http::HttpEventLoop& loop,
+      util::ConcurrencyLimiter& limiter,
+      const DropboxRequestContext& context,
+      uint64_t& ticket)
+      : state_(std::make_shared<State>(loop, limiter, context, ticket)) {
+    state_->self_ = state_;
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    std::shared_ptr<State> s = state_;
+    std::weak_ptr<State> w = s;
+    s->handle_ = h;
+
+    // Wakes come from the threads that free slots; polls run on the loop
+    s->waiter_ = s->limiter_.enqueue(s->context_.getPriority(), [w]() {
+      std::shared_ptr<State> s = w.lock();
+      if (s) {
+        s->loop_.post([s]() { s->poll(); });
+      }
+    });
+
+    if (s->admit()) {
+      return false;
+    }
+
+    if (s->context_.hasDeadline()) {
+      s->loop_.postAfter(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          s->context_.getDeadline() - std::chrono::steady_clock::now()),
+        [s]() { s->poll(); });
+    }
+
+    if (s->context_.getCancellationToken()) {
+      s->subscription_ = s->context_.getCancellationToken()->subscribe(
+        [s]() { s->loop_.post([s]() { s->poll(); }); });
+    }
+    return true;
+  }
+
+  bool await_resume() const noexcept { return state_->admitted_; }
+
+private:
+  struct State {
+    State(http::HttpEventLoop& loop,
+        util::ConcurrencyLimiter& limiter,
+        const DropboxRequestContext& context,
+        uint64_t& ticket)
+        : loop_(loop), limiter_(limiter), context_(context), ticket_(ticket),
+          waiter_(0), subscription_(0), done_(false), admitted_(false) {}
+
+    // Take the slot if it is our turn, arming a timer for the end of a
+    // Retry-After delay; done_ once this returns true
+    bool admit() {
+      util::ConcurrencyLimiter::Clock::time_point retryAt;
+      if (limiter_.tryAdmit(waiter_, ticket_, retryAt)) {
+        done_ = admitted_ = true;
+        return true;
+      }
+
+      if (retryAt != util::ConcurrencyLimiter::Clock::time_point() &&
+          retryAt != timerAt_) {
+        timerAt_ = retryAt;
+        std::shared_ptr<State> s = self_.lock();
+        loop_.postAfter(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            retryAt - util::ConcurrencyLimiter::Clock::now()),
+          [s]() { s->poll(); });
+      }
+      return false;
+    }
+
+    void poll() {
+      if (done_) {
+        return;
+      }
+
+      if (context_.check() != SUCCESS) {
+        limiter_.leave(waiter_);
+        done_ = true;
+      } else if (!admit()) {
+        return;
+      }
+
+      if (context_.getCancellationToken()) {
+        context_.getCancellationToken()->unsubscribe(subscription_);
+      }
+      handle_.resume();
+    }
+
+    http::HttpEventLoop&                        loop_;
+    util::ConcurrencyLimiter&                   limiter_;
+    const DropboxRequestContext&                context_;
+    uint64_t&                                   ticket_;
+    std::weak_ptr<State>                        self_;
+    std::coroutine_handle<>                     handle_;
+    uint64_t                                    waiter_;
+    uint64_t                                    subscription_;
+    util::ConcurrencyLimiter::Clock::time_point timerAt_;
+    bool                                        done_;
+    bool                                        admitted_;
+  };
+
+  std::shared_ptr<State>                state_;
+};
+
+/**
+ * Awaitable that runs a blocking function on a thread of its own, for the
+ * rare calls that have no event loop counterpart, and yields its result.
+ * The loop must outlive the function.
+ */
+class ThreadAwaiter {
+public:
+  ThreadAwaiter(http::HttpEventLoop& loop, std::function<bool()> fn)
+      : loop_(loop), fn_(fn), result_(false) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    std::thread([this, h]() {
+      result_ = fn_();
+      loop_.post([h]() { h.resume(); });
+    }).detach();
+  }
+
+  bool await_resume() const noexcept { return result_; }
+
+private:
+  http::HttpEventLoop&                  loop_;
+  std::function<bool()>                 fn_;
+  bool                                  result_;
+};
+
+/**
+ * Coroutine interface to a DropboxApi2. Calls take the same parameters as
+ * their blocking counterparts, except that requests are taken by value so
+ * that they live in the coroutine frame. Output params must stay valid
+ * until the call is resumed.
+ *
+ * Coroutines run on the loop thread, so calls cannot pick up the
+ * DropboxRequestContext of the thread that started them. Instead every call
+ * made through an instance runs with the context it was created with: a
+ * call is not sent once its token is cancelled or its deadline has passed,
+ * and one in flight is aborted. Either way it throws a DropboxException
+ * with CANCELLED or DEADLINE_EXCEEDED. Create one instance per context.
+ */
+class DropboxCoroApi {
+public:
+  /**
+   * Create the interface
+   *
+   * @param api             Supplies credentials, root and request building.
+   *                        Must outlive this object
+   * @param loop            Loop the requests are sent through
+   * @param context         Deadline and cancellation token of the calls;
+   *                        by default the calling thread's
+   */
+  DropboxCoroApi(DropboxApi2& api,
+      http::HttpEventLoop& loop,
+      const DropboxRequestContext& context =
+        DropboxRequestContext::getCurrent())
+      : api_(api), loop_(loop), context_(context) {}
+
+  /**
+   * See DropboxApi2::getAccountInfo
+   */
+  DropboxTask<DropboxErrorCode> getAccountInfo(DropboxAccountInfo& info) {
+    std::shared_ptr<http::HttpRequest> r = api_.accountInfoRequest();
+    co_return DropboxApi2::readAccountInfo(r.get(), co_await perform(r),
+      info);
+  }
+
+  /**
+   * See DropboxApi2::getFileMetadata
+   */
+  DropboxTask<DropboxErrorCode> getFileMetadata(DropboxMetadataRequest req,
+      DropboxMetadataResponse& res) {
+    std::shared_ptr<http::HttpRequest> r = api_.fileMetadataRequest(req);
+    co_return DropboxApi2::readFileMetadata(r.get(), co_await perform(r),
+      res);
+  }
+
+  /**
+   * See DropboxApi2::getFile. A data sink set on the request is called on
+   * the loop thread. To consume the body from a coroutine as it arrives,
+   * use openFile instead.
+   */
+  DropboxTask<DropboxErrorCode> getFile(DropboxGetFileRequest req,
+      DropboxGetFileResponse& res) {
+    std::shared_ptr<http::HttpRequest> r = api_.fileRequest(req);
+    co_return DropboxApi2::readFile(r.get(), co_await perform(r), req, res);
+  }
+
+  /**
+   * See DropboxApi2::search
+   */
+  DropboxTask<DropboxErrorCode> search(DropboxSearchRequest req,
+      DropboxSearchResult& res) {
+    std::shared_ptr<http::HttpRequest> r = api_.searchRequest(req);
+    co_return DropboxApi2::readSearch(r.get(), co_await perform(r), res);
+  }
+
+  /**
+   * See DropboxApi2::uploadFile
+   */
+  DropboxTask<DropboxErrorCode> uploadFile(DropboxUploadFileRequest req,
+      DropboxMetadata& m) {
+    std::shared_ptr<http::HttpRequest> r = api_.uploadFileRequest(req);
+    co_return DropboxApi2::readMetadata(r.get(), co_await perform(r), m);
+  }
+
+  /**
+   * Upload a large file through an upload session of the v2 API, one chunk
+   * in flight at a time. The request's data callback is called on the loop
+   * thread, so it should not block for long. The request's offset is
+   * ignored; data is read from offset 0.
+   */
+  DropboxTask<DropboxErrorCode> uploadLargeFile(
+      DropboxUploadLargeFileRequest req,
+      DropboxMetadata& m) {
+    size_t chunkSize = req.getChunkSize() ? req.getChunkSize() : 1;
+    std::vector<uint8_t> data(chunkSize);
+    DropboxUploadSessionCursor cursor;
+    cursor.offset_ = 0;
+
+    bool last = false;
+    while (!last) {
+      size_t size = req.getData(data.data(), cursor.offset_, chunkSize);
+      last = (size < chunkSize);
+
+      // The session is committed by /finish, so it is never closed here
+      std::shared_ptr<http::HttpRequest> r =
+        api_.sessionChunkRequest(cursor, false, data.data(), size);
+      if (req.getBandwidthLimiter()) {
+        r->addSendLimiter(req.getBandwidthLimiter());
+      }
+      DropboxErrorCode code = DropboxApi2::readSessionChunk(r.get(),
+        co_await perform(r), size, cursor);
+      if (code != SUCCESS) {
+        co_return code;
+      }
+    }
+
+    std::shared_ptr<http::HttpRequest> r = api_.sessionFinishRequest(cursor,
+      absolutePath(req.getPath()), req.shouldOverwrite(),
+      req.getParentRev());
+    co_return DropboxApi2::readSessionFinish(r.get(), co_await perform(r), m);
+  }
+
+  /**
+   * A file download whose body is read by a coroutine chunk by chunk.
+   * Received data is buffered up to a high water mark, past which the
+   * transfer is paused until the reader catches up. Must be used from
+   * coroutines running on the loop thread.
+   */
+  class FileStream {
+  public:
+    FileStream(FileStream&&) = default;
+    FileStream& operator=(FileStream&&) = default;
+
+    /**
+     * Get the next block of the body
+     *
+     * @param chunk         Output param receiving the data
+     *
+     * @return false once the body has been consumed or the request failed;
+     *         see getErrorCode. Curl errors are thrown as DropboxException
+     */
+    DropboxTask<bool> read(std::vector<uint8_t>& chunk) {
+      std::shared_ptr<State> s = state_;
+
+      while (s->chunks_.empty() && !s->done_) {
+        co_await Wait{s.get()};
+      }
+
+      if (!s->chunks_.empty()) {
+        chunk = std::move(s->chunks_.front());
+        s->chunks_.pop_front();
+        s->buffered_ -= chunk.size();
+
+        if (s->paused_ && s->buffered_ <= s->highWater_ / 2) {
+          s->paused_ = false;
+          s->api_.loop_.setReceivePaused(s->request_.get(), false);
+        }
+        co_return true;
+      }
+
+      if (s->code_ == SUCCESS) {
+        if (s->ret_) {
+          s->api_.checkContext();
+        }
+        s->code_ = s->api_.api_.completed(s->request_.get(), s->ret_);
+        DropboxApi2::readFile(s->request_.get(), s->code_, s->req_,
+          s->response_);
+      }
+      co_return false;
+    }
+
+    /**
+     * The response code once read has returned false
+     */
+    DropboxErrorCode getErrorCode() const { return state_->code_; }
+
+    /**
+     * The file's metadata once read has returned false
+     */
+    const DropboxGetFileResponse& getResponse() const {
+      return state_->response_;
+    }
+
+    ~FileStream() {
+      if (!state_) {
+        return;
+      }
+
+      std::shared_ptr<State> s = state_;
+      s->abandoned_ = true;
+
+      // Let a paused transfer run so that its sink can abort it
+      if (s->paused_ && !s->done_) {
+        s->api_.loop_.post([s]() {
+          s->api_.loop_.setReceivePaused(s->request_.get(), false);
+        });
+      }
+    }
+
+  private:
+    friend class DropboxCoroApi;
+
+    struct State {
+      State(DropboxCoroApi& api, const DropboxGetFileRequest& req,
+          size_t highWater)
+          : api_(api), req_(req), highWater_(highWater), buffered_(0),
+            paused_(false), done_(false), abandoned_(false), ret_(0),
+            code_(SUCCESS) {}
+
+      DropboxCoroApi&                     api_;
+      DropboxGetFileRequest               req_;
+      std::shared_ptr<http::HttpRequest>  request_;
+      DropboxGetFileResponse              response_;
+
+      std::deque<std::vector<uint8_t> >   chunks_;
+      const size_t                        highWater_;
+      size_t                              buffered_;
+      bool                                paused_;
+      bool                                done_;
+      bool                                abandoned_;
+      int                                 ret_;
+      DropboxErrorCode                    code_;
+      std::coroutine_handle<>             reader_;
+    };
+
+    struct Wait {
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { s_->reader_ = h; }
+      void await_resume() const noexcept {}
+
+      State*  s_;
+    };
+
+    explicit FileStream(std::shared_ptr<State> s) : state_(s) {}
+
+    std::shared_ptr<State>                state_;
+  };
+
+  /**
+   * Start a download whose body is read with FileStream::read. A data sink
+   * set on the request is ignored.
+   *
+   * @param req             The request
+   * @param highWater       Bytes buffered before the transfer is paused
+   *
+   * @return The stream
+   */
+  FileStream openFile(DropboxGetFileRequest req,
+      size_t highWater = 4 * 1024 * 1024) {
+    req.setDataSink(nullptr);
+
+    std::shared_ptr<FileStream::State> s =
+      std::make_shared<FileStream::State>(*this, req, highWater);
+    std::weak_ptr<FileStream::State> w = s;
+
+    checkContext();
+    s->request_ = api_.fileRequest(req);
+    bind(s->request_.get());
+    s->request_->setResponseSink([w](const uint8_t* data, size_t size) {
+      std::shared_ptr<FileStream::State> s = w.lock();
+      if (!s || s->abandoned_) {
+        return false;
+      }
+
+      s->chunks_.push_back(std::vector<uint8_t>(data, data + size));
+      s->buffered_ += size;
+
+      // Curl callbacks may not pause or resume coroutines directly; defer
+      // both to the loop
+      if (!s->paused_ && s->buffered_ >= s->highWater_) {
+        s->paused_ = true;
+        s->api_.loop_.post([s]() {
+          if (s->paused_ && !s->done_) {
+            s->api_.loop_.setReceivePaused(s->request_.get(), true);
+          }
+        });
+      }
+
+      wake(s.get());
+      return true;
+    });
+
+    api_.authorize(s->request_.get());
+
+    http::HttpEventLoop& loop = loop_;
+    DropboxApi2& api = api_;
+    loop_.postAfter(api_.reserveRate(s->request_.get()), [s, &loop, &api]() {
+      loop.start(s->request_, [s, &api](int ret) {
+        api.finished(s->request_.get(), ret);
+
+        s->done_ = true;
+        s->ret_ = ret;
+        wake(s.get());
+      });
+    });
+
+    return FileStream(s);
+  }
+
+  /**
+   * An upload written by a coroutine one block at a time through an upload
+   * session of the v2 API. Each write sends one block; there is never more
+   * than one request in flight.
+   */
+  class UploadStream {
+  public:
+    /**
+     * Send a block of data. The data must stay valid until the write is
+     * resumed.
+     *
+     * @return Error code for the operation. See DropboxErrorCode for values
+     */
+    DropboxTask<DropboxErrorCode> write(const uint8_t* data, size_t size) {
+      std::shared_ptr<http::HttpRequest> r = api_.api_.sessionChunkRequest(
+        cursor_, false, const_cast<uint8_t*>(data), size);
+      co_return DropboxApi2::readSessionChunk(r.get(),
+        co_await api_.perform(r), size, cursor_);
+    }
+
+    /**
+     * Commit the data written so far as the file
+     *
+     * @param m             Output param with the metadata of the new file
+     *
+     * @return Error code for the operation. See DropboxErrorCode for values
+     */
+    DropboxTask<DropboxErrorCode> finish(DropboxMetadata& m) {
+      if (cursor_.sessionId_.empty()) {
+        // Nothing written; an empty session still needs to be started
+        DropboxErrorCode code = co_await write(NULL, 0);
+        if (code != SUCCESS) {
+          co_return code;
+        }
+      }
+
+      std::shared_ptr<http::HttpRequest> r = api_.api_.sessionFinishRequest(
+        cursor_, path_, overwrite_, "");
+      co_return DropboxApi2::readSessionFinish(r.get(),
+        co_await api_.perform(r), m);
+    }
+
+    /**
+     * Number of bytes written so far
+     */
+    size_t getOffset() const { return cursor_.offset_; }
+
+  private:
+    friend class DropboxCoroApi;
+
+    UploadStream(DropboxCoroApi& api, std::string path, bool overwrite)
+        : api_(api), path_(path), overwrite_(overwrite) {
+      cursor_.offset_ = 0;
+    }
+
+    DropboxCoroApi&                       api_;
+    const std::string                     path_;
+    const bool                            overwrite_;
+    DropboxUploadSessionCursor            cursor_;
+  };
+
+  /**
+   * Create an upload written with UploadStream::write
+   *
+   * @param path            Destination path, relative to the root
+   * @param overwrite       Whether an existing file is replaced
+   *
+   * @return The stream
+   */
+  UploadStream createUpload(std::string path, bool overwrite = false) {
+    return UploadStream(*this, absolutePath(path), overwrite);
+  }
+
+private:
+  // Sends a request like DropboxApi2::execute does, through the same
+  // limits, retries and token refresh, but waits on the loop
+  DropboxTask<DropboxErrorCode> perform(
+      std::shared_ptr<http::HttpRequest> r) {
+    DropboxApi2::CallState call = api_.startCall(r.get());
+    bind(r.get());
+
+    while (true) {
+      checkContext();
+      co_await SleepAwaiter(loop_, api_.reserveRate(r.get()));
+      checkContext();
+
+      // Awaiters holding state are named: temporaries in a co_await
+      // condition are not destroyed reliably by every compiler
+      AdmissionAwaiter admission(loop_, *call.limiter_, context_,
+        call.ticket_);
+      if (!co_await admission) {
+        checkContext();
+      }
+
+      api_.authorize(r.get());
+      int ret = co_await HttpAwaiter(loop_, r);
+      api_.finished(r.get(), ret);
+
+      DropboxErrorCode code;
+      std::chrono::microseconds delay;
+      DropboxApi2::CallStep step = api_.nextStep(call, r.get(), ret,
+        context_, code, delay);
+
+      if (step == DropboxApi2::CALL_DONE) {
+        co_return code;
+      }
+
+      if (step == DropboxApi2::CALL_REFRESH) {
+        // The refresh is a blocking call; it must not hold the loop
+        DropboxApi2& api = api_;
+        ThreadAwaiter refresh(loop_, [&api, r]() {
+          return api.refreshToken(r.get());
+        });
+        if (!co_await refresh) {
+          co_return code;
+        }
+      }
+
+      co_await SleepAwaiter(loop_, delay);
+    }
+  }
+
+  // Lets curl abort the transfer at the deadline or on cancellation
+  void bind(http::HttpRequest* r) const {
+    r->setDeadline(context_.getDeadline());
+    r->setCancellationToken(context_.getCancellationToken());
+  }
+
+  void checkContext() const {
+    DropboxApi2::checkContext(context_);
+  }
+
+  static void wake(FileStream::State* s) {
+    std::coroutine_handle<> h = s->reader_;
+    if (h) {
+      s->reader_ = nullptr;
+      s->api_.loop_.post([h]() { h.resume(); });
+    }
+  }
+
+  // The v2 API wants paths with a leading slash
+  static std::string absolutePath(const std::string& path) {
+    return (!path.empty() && path[0] == '/') ? path : "/" + path;
+  }
+
+  DropboxApi2&                            api_;
+  http::HttpEventLoop&                    loop_;
+  const DropboxRequestContext             context_;
+};
+}
+
+#endif
+#endif
@@ -0,0 +1,346 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "DropboxDirectoryUploader.h"
+
+#include "util/BoundedQueue.h"
+#include "util/CancellationToken.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+namespace {
+
+struct LocalFile {
+  string              localPath_;
+  string              remotePath_;
+};
+
+void scanDirectory(const string& local,
+    const string& remote,
+    BoundedQueue<LocalFile>& out,
+    size_t& found) {
+  DIR* dir = opendir(local.c_str());
+  if (!dir) {
+    return;
+  }
+
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+      continue;
+    }
+
+    LocalFile f;
+    f.localPath_ = local + "/" + e->d_name;
+    f.remotePath_ = remote + "/" + e->d_name;
+
+    // Symlinks are not followed: one to an ancestor would never end the
+    // scan, and one to elsewhere would upload files from outside localDir
+    struct stat st;
+    if (lstat(f.localPath_.c_str(), &st) || S_ISLNK(st.st_mode)) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      scanDirectory(f.localPath_, f.remotePath_, out, found);
+    } else if (S_ISREG(st.st_mode)) {
+      ++found;
+      out.push(f);
+    }
+  }
+
+  closedir(dir);
+}
+
+string stripTrailingSlash(string path) {
+  while (!path.empty() && path[path.size() - 1] == '/') {
+    path.erase(path.size() - 1);
+  }
+
+  return path;
+}
+
+}
+
+DropboxDirectoryUploader::DropboxDirectoryUploader(DropboxApi2& api,
+    size_t concurrency,
+    size_t batchSize) :
+      api_(api),
+      overwrite_(true),
+      chunkSize_(1UL << 22) {
+  setConcurrency(concurrency);
+  setBatchSize(batchSize);
+}
+
+void DropboxDirectoryUploader::setConcurrency(size_t concurrency) {
+  concurrency_ = concurrency ? concurrency : 1;
+}
+
+void DropboxDirectoryUploader::setBatchSize(size_t batchSize) {
+  if (!batchSize) {
+    batchSize = 1;
+  } else if (batchSize > MAX_BATCH_ENTRIES) {
+    batchSize = MAX_BATCH_ENTRIES;
+  }
+
+  batchSize_ = batchSize;
+}
+
+void DropboxDirectoryUploader::setOverwrite(bool overwrite) {
+  overwrite_ = overwrite;
+}
+
+void DropboxDirectoryUploader::setChunkSize(size_t chunkSize) {
+  chunkSize_ = chunkSize ? chunkSize : 1;
+}
+
+DropboxErrorCode DropboxDirectoryUploader::upload(const string localDir,
+    const string remotePath,
+    DropboxDirectoryUploadStats& stats) {
+  memset(&stats, 0, sizeof(stats));
+
+  BoundedQueue<LocalFile> files(batchSize_);
+  BoundedQueue<DropboxUploadSessionCommit> commits(batchSize_);
+  BoundedQueue<pair<string, size_t> > jobs(16);
+
+  mutex statsLock;
+  DropboxErrorCode firstError = SUCCESS;
+
+  auto failed = [&](DropboxErrorCode code, size_t count) {
+    lock_guard<mutex> g(statsLock);
+    stats.filesFailed_ += count;
+    if (firstError == SUCCESS) {
+      firstError = code;
+    }
+  };
+
+  auto tally = [&](const vector<DropboxBatchEntryResult>& results,
+      size_t batchSize) {
+    lock_guard<mutex> g(statsLock);
+    ++stats.batchesCommitted_;
+
+    // A job that failed as a whole has no per-entry results
+    if (results.size() < batchSize) {
+      stats.filesFailed_ += batchSize - results.size();
+      if (firstError == SUCCESS) {
+        firstError = IO_ERROR;
+      }
+    }
+
+    for (auto& res : results) {
+      if (res.success_) {
+        ++stats.filesUploaded_;
+      } else {
+        ++stats.filesFailed_;
+        if (firstError == SUCCESS) {
+          firstError = IO_ERROR;
+        }
+      }
+    }
+  };
+
+  DropboxRequestContext context = DropboxRequestContext::getCurrent();
+
+  // Find the files to upload
+  thread scanner([&]() {
+    size_t found = 0;
+    scanDirectory(stripTrailingSlash(localDir), stripTrailingSlash(remotePath),
+      files, found);
+
+    {
+      lock_guard<mutex> g(statsLock);
+      stats.filesFound_ = found;
+    }
+
+    files.close();
+  });
+
+  // Stream the files into upload sessions
+  vector<thread> uploaders;
+  for (size_t i = 0; i < concurrency_; ++i) {
+    uploaders.push_back(thread([&]() {
+      DropboxContextScope scope(context);
+      LocalFile f;
+      while (files.pop(f)) {
+        int fd = open(f.localPath_.c_str(), O_RDONLY);
+        if (fd < 0) {
+          failed(IO_ERROR, 1);
+          continue;
+        }
+
+        auto cb = [fd](uint8_t* buf, size_t offset, size_t size) {
+          size_t done = 0;
+          while (done < size) {
+            ssize_t ret = pread(fd, buf + done, size - done, offset + done);
+            if (ret < 0) {
+              throw DropboxException(IO_ERROR, "Error reading file data");
+            }
+            if (ret == 0) {
+              break;
+            }
+            done += ret;
+          }
+          return done;
+        };
+
+        DropboxUploadLargeFileRequest req(f.remotePath_, cb, overwrite_, "",
+          chunkSize_);
+
+        DropboxUploadSessionCommit c;
+        DropboxErrorCode code;
+        try {
+          code = api_.uploadSession(req, c.cursor_);
+        } catch (DropboxException& e) {
+          code = e.getErrorCode();
+        }
+        close(fd);
+
+        if (code != SUCCESS) {
+          failed(code, 1);
+          continue;
+        }
+
+        {
+          lock_guard<mutex> g(statsLock);
+          stats.bytesUploaded_ += c.cursor_.offset_;
+        }
+
+        c.path_ = f.remotePath_;
+        c.overwrite_ = overwrite_;
+        c.autorename_ = !overwrite_;
+        commits.push(c);
+      }
+    }));
+  }
+
+  thread closer([&]() {
+    for (auto& t : uploaders) {
+      t.join();
+    }
+    commits.close();
+  });
+
+  // Wakes the poller as soon as the call is cancelled, rather than after
+  // its current poll interval
+  CancellationToken wake;
+  shared_ptr<CancellationToken> token = context.getCancellationToken();
+  uint64_t subscription = token ?
+    token->subscribe([&wake]() { wake.cancel(); }) : 0;
+
+  // Poll the commit jobs while later batches are uploaded
+  thread poller([&]() {
+    DropboxContextScope scope(context);
+    pair<string, size_t> job;
+    while (jobs.pop(job)) {
+      chrono::milliseconds delay(50);
+      bool complete = false;
+      vector<DropboxBatchEntryResult> results;
+
+      while (!complete) {
+        // Nor does it sleep past the deadline. Once woken, the check fails
+        // straight away with CANCELLED or DEADLINE_EXCEEDED.
+        auto wait = chrono::duration_cast<chrono::microseconds>(delay);
+        if (context.hasDeadline()) {
+          auto left = chrono::duration_cast<chrono::microseconds>(
+            context.getDeadline() - DropboxRequestContext::Clock::now());
+          wait = max(chrono::microseconds(0), min(wait, left));
+        }
+
+        wake.waitFor(wait);
+        delay = min(delay * 2, chrono::milliseconds(1000));
+
+        DropboxErrorCode code;
+        try {
+          code = api_.checkUploadBatch(job.first, complete, results);
+        } catch (DropboxException& e) {
+          code = e.getErrorCode();
+        }
+
+        if (code != SUCCESS) {
+          // The outcome of the batch is unknown; count it as failed
+          failed(code, job.second);
+          break;
+        }
+      }
+
+      if (complete) {
+        tally(results, job.second);
+      }
+    }
+  });
+
+  // Commit the sessions in batches, on the calling thread
+  vector<DropboxUploadSessionCommit> batch;
+  auto commitBatch = [&]() {
+    string jobId;
+    vector<DropboxBatchEntryResult> results;
+    DropboxErrorCode code;
+
+    try {
+      code = api_.finishUploadBatch(batch, jobId, results);
+    } catch (DropboxException& e) {
+      code = e.getErrorCode();
+    }
+
+    if (code != SUCCESS) {
+      failed(code, batch.size());
+    } else if (!jobId.empty()) {
+      jobs.push(make_pair(jobId, batch.size()));
+    } else {
+      tally(results, batch.size());
+    }
+
+    batch.clear();
+  };
+
+  DropboxUploadSessionCommit c;
+  while (commits.pop(c)) {
+    batch.push_back(c);
+    if (batch.size() >= batchSize_) {
+      commitBatch();
+    }
+  }
+
+  if (!batch.empty()) {
+    commitBatch();
+  }
+
+  jobs.close();
+
+  closer.join();
+  poller.join();
+  scanner.join();
+
+  if (token) {
+    token->unsubscribe(subscription);
+  }
+
+  return firstError;
+}
@@ -0,0 +1,96 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_DIRECTORY_UPLOADER_H__
+#define __DROPBOX_DIRECTORY_UPLOADER_H__
+
+#include "DropboxApi2.h"
+#include "DropboxBatch.h"
+
+#include <string>
+#include <cstdint>
+
+namespace dropbox {
+
+struct DropboxDirectoryUploadStats {
+  size_t              filesFound_;
+  size_t              filesUploaded_;
+  size_t              filesFailed_;
+  size_t              batchesCommitted_;
+  uint64_t            bytesUploaded_;
+};
+
+/**
+ * Uploads a local directory tree. Files are streamed into upload sessions by
+ * a pool of upload threads and the closed sessions are committed in batches
+ * of up to MAX_BATCH_ENTRIES with /upload_session/finish_batch. The batch
+ * jobs are polled on a separate thread while the next batch is uploaded, so
+ * committing never stalls the uploads.
+ */
+class DropboxDirectoryUploader {
+public:
+  /**
+   * Create a directory uploader
+   *
+   * @param api             The DropboxApi2 instance to use. It must outlive
+   *                        the uploader
+   * @param concurrency     Number of files uploaded in parallel
+   * @param batchSize       Number of files committed per finish_batch call
+   */
+  DropboxDirectoryUploader(DropboxApi2& api,
+    size_t concurrency = 8,
+    size_t batchSize = MAX_BATCH_ENTRIES);
+
+  void setConcurrency(size_t concurrency);
+  void setBatchSize(size_t batchSize);
+
+  /**
+   * Whether existing remote files are overwritten. When false, conflicting
+   * files are renamed by the server. Defaults to true.
+   */
+  void setOverwrite(bool overwrite);
+
+  /**
+   * Size of the chunks that files are read and uploaded in. Defaults to 4 MB.
+   */
+  void setChunkSize(size_t chunkSize);
+
+  /**
+   * Upload every regular file below a local directory. Files that fail to
+   * upload or commit are counted in the stats and do not stop the upload.
+   * Symbolic links are skipped, whether to files or to directories.
+   *
+   * Cancelling the calling thread's DropboxRequestContext, or reaching its
+   * deadline, also interrupts the polling of commit jobs at once.
+   *
+   * @param localDir        The local directory to upload
+   * @param remotePath      Absolute path of the destination folder
+   * @param stats           Output param with the counters for the run
+   *
+   * @return SUCCESS or the error code of the first failure
+   */
+  DropboxErrorCode upload(const std::string localDir,
+    const std::string remotePath,
+    DropboxDirectoryUploadStats& stats);
+
+private:
+  DropboxApi2&                    api_;
+  size_t                          concurrency_;
+  size_t                          batchSize_;
+  bool                            overwrite_;
+  size_t                          chunkSize_;
+};
+}
+#endif
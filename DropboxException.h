@@ -25,10 +25,16 @@ enum DropboxErrorCode {
   CURL_ERROR = -1,
   MALFORMED_RESPONSE = -2,
   IO_ERROR = -3,
+  DEADLINE_EXCEEDED = -4,
+  CANCELLED = -5,
+  QUEUE_FULL = -6,
   SUCCESS = 200,
   PARTIAL_CONTENT = 206,
   NOT_MODIFIED = 304,
+  UNAUTHORIZED = 401,
   TOO_MANY_FILES = 406,
+  TOO_MANY_REQUESTS = 429,
+  SERVICE_UNAVAILABLE = 503,
 };
 
 class DropboxException : public std::exception {
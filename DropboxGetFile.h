@@ -18,19 +18,25 @@
 
 #include <string>
 #include <memory>
+#include <chrono>
 #include <sstream>
+#include <functional>
+#include <cstring>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 #include "DropboxMetadata.h"
 
+#include "util/BandwidthLimiter.h"
+#include "util/TransferProgress.h"
+
 namespace dropbox {
 
 class DropboxGetFileRequest {
 public:
   DropboxGetFileRequest(std::string path, std::string rev="") :
-    path_(path), rev_(rev), hasRange_(false) {
+    path_(path), rev_(rev), hasRange_(false), progressInterval_(1000) {
   }
 
   void setRange(uint64_t offset, uint64_t length) {
@@ -59,21 +65,74 @@ public:
     return length_;
   }
 
+  /**
+   * Stream the file data to a sink instead of buffering it in the response.
+   * The sink is called with each block of data as it arrives and returns
+   * false to abort the download. When a sink is set, the response holds only
+   * the metadata of the file.
+   */
+  void setDataSink(std::function<bool(const uint8_t*, size_t)> sink) {
+    sink_ = sink;
+  }
+
+  std::function<bool(const uint8_t*, size_t)> getDataSink() const {
+    return sink_;
+  }
+
+  /**
+   * Cap the bandwidth of this transfer, on top of the per client and
+   * process wide caps. Copies of the request share the limiter, whose rate
+   * can be changed while the transfer is running.
+   */
+  void setBandwidthLimit(double bytesPerSecond) {
+    bandwidth_.reset(new util::BandwidthLimiter(bytesPerSecond));
+  }
+
+  std::shared_ptr<util::BandwidthLimiter> getBandwidthLimiter() const {
+    return bandwidth_;
+  }
+
+  /**
+   * Report the progress of this transfer to a callback, at most once per
+   * interval and once more when it completes. The transfer is aborted with
+   * CANCELLED if the callback returns false.
+   */
+  void setProgressCallback(util::ProgressCallback cb,
+      std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {
+    progress_ = cb;
+    progressInterval_ = interval;
+  }
+
+  util::ProgressCallback getProgressCallback() const {
+    return progress_;
+  }
+
+  std::chrono::milliseconds getProgressInterval() const {
+    return progressInterval_;
+  }
+
 private:
   std::string         path_;
   std::string         rev_;
   bool                hasRange_;
   uint64_t            offset_;
   uint64_t            length_;
+  std::function<bool(const uint8_t*, size_t)> sink_;
+  std::shared_ptr<util::BandwidthLimiter> bandwidth_;
+  util::ProgressCallback progress_;
+  std::chrono::milliseconds progressInterval_;
 };
 
 class DropboxGetFileResponse {
 public:
-  DropboxGetFileResponse() { }
-
-  void setData(uint8_t* data, uint64_t len) {
-    data_.reset(new uint8_t[len]);
-    memcpy(data_.get(), data, len);
+  DropboxGetFileResponse() : length_(0) { }
+
+  void setData(const uint8_t* data, uint64_t len) {
+    uint8_t* copy = new uint8_t[len];
+    if (len) {
+      memcpy(copy, data, len);
+    }
+    data_.reset(copy, std::default_delete<uint8_t[]>());
     length_ = len;
   }
 
@@ -102,7 +161,9 @@ public:
   }
 
 private:
-  std::unique_ptr<uint8_t>    data_;
+  // Never written after setData, so copies of a response, such as those
+  // handed to the callers of a coalesced download, share the bytes
+  std::shared_ptr<const uint8_t> data_;
   uint64_t                    length_;
   DropboxMetadata             metadata_;
 };
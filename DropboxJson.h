@@ -0,0 +1,117 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_JSON_H__
+#define __DROPBOX_JSON_H__
+
+/**
+ * Helpers for the JSON bodies and Dropbox-API-Arg headers of the v2 API.
+ * boost::property_tree writes every value as a string, which the v2 API
+ * rejects for booleans and integers, so request JSON is formatted by hand
+ * with these helpers. Responses are still parsed with property_tree.
+ */
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <cstdio>
+#include <string>
+
+namespace dropbox {
+
+/**
+ * Quote and escape a string as a JSON string literal. With asciiOnly set,
+ * non-ASCII characters are written as \u escapes, as required for values
+ * placed in HTTP headers such as Dropbox-API-Arg.
+ */
+inline std::string jsonQuote(const std::string& s, bool asciiOnly = false) {
+  std::string out;
+  out.reserve(s.size() + 2);
+  out += '"';
+
+  auto escape = [&](unsigned int cp) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "\\u%04x", cp);
+    out += buf;
+  };
+
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = s[i];
+
+    switch (c) {
+      case '"':   out += "\\\""; continue;
+      case '\\':  out += "\\\\"; continue;
+      case '\n':  out += "\\n"; continue;
+      case '\r':  out += "\\r"; continue;
+      case '\t':  out += "\\t"; continue;
+    }
+
+    if (c < 0x20) {
+      escape(c);
+    } else if (c < 0x80 || !asciiOnly) {
+      out += c;
+    } else {
+      // Decode one UTF-8 sequence; malformed bytes are passed through as
+      // U+FFFD
+      unsigned int cp = 0xfffd;
+      size_t len = 0;
+      if ((c & 0xe0) == 0xc0) {
+        cp = c & 0x1f;
+        len = 1;
+      } else if ((c & 0xf0) == 0xe0) {
+        cp = c & 0x0f;
+        len = 2;
+      } else if ((c & 0xf8) == 0xf0) {
+        cp = c & 0x07;
+        len = 3;
+      }
+
+      if (!len || i + len >= s.size()) {
+        escape(0xfffd);
+        continue;
+      }
+
+      for (size_t j = 1; j <= len; ++j) {
+        cp = (cp << 6) | (s[i + j] & 0x3f);
+      }
+      i += len;
+
+      if (cp >= 0x10000) {
+        cp -= 0x10000;
+        escape(0xd800 + (cp >> 10));
+        escape(0xdc00 + (cp & 0x3ff));
+      } else {
+        escape(cp);
+      }
+    }
+  }
+
+  out += '"';
+  return out;
+}
+
+inline const char* jsonBool(bool b) {
+  return b ? "true" : "false";
+}
+
+/**
+ * Get the ".tag" member of a v2 union. The tag cannot be fetched with a
+ * plain property_tree path since '.' is the path separator.
+ */
+inline std::string jsonTag(const boost::property_tree::ptree& pt) {
+  typedef boost::property_tree::ptree::path_type path;
+  return pt.get<std::string>(path(".tag", '/'), "");
+}
+}
+#endif
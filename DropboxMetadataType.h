@@ -86,6 +86,35 @@ typedef struct DropboxMetadata {
     }
   }
 
+  /**
+   * Read a FileMetadata/FolderMetadata/DeletedMetadata object returned by the
+   * v2 API into the v1 style metadata struct.
+   */
+  static void readFromJsonV2(boost::property_tree::ptree& pt,
+      DropboxMetadata& m) {
+    using namespace boost::property_tree;
+    using namespace std;
+
+    try {
+      string tag = pt.get<string>(ptree::path_type(".tag", '/'), "file");
+
+      m.path_ = pt.get<string>("path_display", pt.get<string>("name", ""));
+      m.sizeBytes_ = pt.get<size_t>("size", 0);
+      m.sizeStr_ = "";
+      m.isDir_ = (tag == "folder");
+      m.isDeleted_ = (tag == "deleted");
+      m.mimeType_ = "";
+      m.rev_ = pt.get<string>("rev", "");
+      m.hash_ = pt.get<string>("content_hash", "");
+      m.thumbExists_ = false;
+      m.icon_ = "";
+      m.clientMtime_ = pt.get<string>("client_modified", "");
+      m.root_ = "";
+    } catch (exception& e) {
+      throw DropboxException(MALFORMED_RESPONSE, e.what());
+    }
+  }
+
   static void readMetadataListFromJson(boost::property_tree::ptree& pt,
       std::vector<DropboxMetadata>& list) {
     using namespace boost::property_tree;
@@ -0,0 +1,360 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "DropboxMirror.h"
+
+#include "util/BoundedQueue.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+namespace {
+
+struct MirrorTransfer {
+  DropboxMetadata     metadata_;
+  string              localPath_;
+};
+
+// Parses the RFC 2822 dates used by the core API, e.g.
+// "Sat, 21 Aug 2010 22:31:20 +0000". The API always reports UTC.
+bool parseDropboxTime(const string& s, time_t& t) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+
+  if (!strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S", &tm)) {
+    return false;
+  }
+
+  t = timegm(&tm);
+  return true;
+}
+
+bool makeDirs(const string& path) {
+  if (path.empty()) {
+    return true;
+  }
+
+  size_t pos = 0;
+  do {
+    pos = path.find('/', pos + 1);
+    string dir = path.substr(0, pos);
+
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+      return false;
+    }
+  } while (pos != string::npos);
+
+  return true;
+}
+
+// Whether a path below the mirror root, as reported by the server, is safe
+// to join onto the local directory: it must be "/name[/name...]" with no
+// empty, "." or ".." segments, so it cannot climb out of the directory
+bool isSafeRelativePath(const string& path) {
+  if (path.size() < 2 || path[0] != '/') {
+    return false;
+  }
+
+  size_t start = 1;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos) {
+      end = path.size();
+    }
+
+    string segment = path.substr(start, end - start);
+    if (segment.empty() || segment == "." || segment == "..") {
+      return false;
+    }
+
+    start = end + 1;
+  }
+
+  return true;
+}
+
+// Whether the directory holding 'path' resolves, symlinks and all, to
+// 'root' or a directory below it. 'root' must already be resolved.
+bool isUnder(const string& path, const string& root) {
+  string dir = path.substr(0, path.rfind('/'));
+
+  char* resolved = realpath(dir.c_str(), NULL);
+  if (!resolved) {
+    return false;
+  }
+
+  string real(resolved);
+  free(resolved);
+
+  return real == root ||
+    (real.compare(0, root.size(), root) == 0 &&
+     (root == "/" || real[root.size()] == '/'));
+}
+
+string stripTrailingSlash(string path) {
+  while (path.size() > 1 && path[path.size() - 1] == '/') {
+    path.erase(path.size() - 1);
+  }
+
+  return path;
+}
+
+}
+
+DropboxMirror::DropboxMirror(DropboxApi2& api,
+    size_t concurrency,
+    size_t queueDepth) :
+      api_(api),
+      concurrency_(concurrency ? concurrency : 1),
+      queueDepth_(queueDepth ? queueDepth : 1),
+      walker_(api, concurrency_) {
+}
+
+void DropboxMirror::setConcurrency(size_t concurrency) {
+  concurrency_ = concurrency ? concurrency : 1;
+  walker_.setConcurrency(concurrency_);
+}
+
+void DropboxMirror::setQueueDepth(size_t queueDepth) {
+  queueDepth_ = queueDepth ? queueDepth : 1;
+}
+
+DropboxTreeWalker& DropboxMirror::getTreeWalker() {
+  return walker_;
+}
+
+DropboxErrorCode DropboxMirror::mirror(const string remotePath,
+    const string localDir,
+    DropboxMirrorStats& stats) {
+  memset(&stats, 0, sizeof(stats));
+
+  string root = stripTrailingSlash(remotePath);
+  size_t rootLen = (root == "/") ? 0 : root.size();
+  string local = stripTrailingSlash(localDir);
+
+  if (!makeDirs(local)) {
+    throw DropboxException(IO_ERROR, "Cannot create " + local);
+  }
+
+  char* resolved = realpath(local.c_str(), NULL);
+  if (!resolved) {
+    throw DropboxException(IO_ERROR, "Cannot resolve " + local);
+  }
+  string realLocal(resolved);
+  free(resolved);
+
+  BoundedQueue<DropboxMetadata> listed(queueDepth_);
+  BoundedQueue<MirrorTransfer> planned(queueDepth_);
+  BoundedQueue<MirrorTransfer> downloaded(queueDepth_);
+
+  mutex statsLock;
+  DropboxErrorCode listCode = SUCCESS;
+  DropboxErrorCode downloadCode = SUCCESS;
+  exception_ptr listException;
+  DropboxRequestContext context = DropboxRequestContext::getCurrent();
+
+  // Stage 1: list the tree
+  thread lister([&]() {
+    DropboxContextScope scope(context);
+    try {
+      listCode = walker_.walk(root, [&](const DropboxMetadata& m) {
+        listed.push(m);
+      });
+    } catch (...) {
+      listException = current_exception();
+    }
+
+    listed.close();
+  });
+
+  // Stage 2: create folders and decide which files need a transfer
+  thread planner([&]() {
+    DropboxMetadata m;
+    while (listed.pop(m)) {
+      if (m.isDeleted_) {
+        continue;
+      }
+
+      // Entries whose path would land outside the local directory are
+      // counted as failures and never written
+      string relative = m.path_.substr(min(rootLen, m.path_.size()));
+      if (!isSafeRelativePath(relative)) {
+        lock_guard<mutex> g(statsLock);
+        ++stats.filesFailed_;
+        if (downloadCode == SUCCESS) {
+          downloadCode = MALFORMED_RESPONSE;
+        }
+        continue;
+      }
+
+      string path = local + relative;
+
+      if (m.isDir_) {
+        lock_guard<mutex> g(statsLock);
+        ++stats.foldersListed_;
+
+        if (!makeDirs(path)) {
+          ++stats.filesFailed_;
+          if (downloadCode == SUCCESS) {
+            downloadCode = IO_ERROR;
+          }
+        }
+        continue;
+      }
+
+      {
+        lock_guard<mutex> g(statsLock);
+        ++stats.filesListed_;
+      }
+
+      struct stat st;
+      time_t mtime;
+      if (!stat(path.c_str(), &st) &&
+          (size_t)st.st_size == m.sizeBytes_ &&
+          parseDropboxTime(m.clientMtime_, mtime) &&
+          st.st_mtime == mtime) {
+        lock_guard<mutex> g(statsLock);
+        ++stats.filesSkipped_;
+        continue;
+      }
+
+      MirrorTransfer t;
+      t.metadata_ = m;
+      t.localPath_ = path;
+      planned.push(t);
+    }
+
+    planned.close();
+  });
+
+  // Stage 3: download in parallel, streaming to a temporary file
+  vector<thread> downloaders;
+  for (size_t i = 0; i < concurrency_; ++i) {
+    downloaders.push_back(thread([&]() {
+      DropboxContextScope scope(context);
+      MirrorTransfer t;
+      while (planned.pop(t)) {
+        string tmpPath = t.localPath_ + ".dbxpart";
+        DropboxErrorCode code = IO_ERROR;
+        uint64_t bytes = 0;
+
+        FILE* f = NULL;
+        if (isUnder(t.localPath_, realLocal)) {
+          f = fopen(tmpPath.c_str(), "wb");
+        }
+
+        if (f) {
+          DropboxGetFileRequest req(t.metadata_.path_, t.metadata_.rev_);
+          req.setDataSink([&](const uint8_t* data, size_t len) {
+            bytes += len;
+            return fwrite(data, 1, len, f) == len;
+          });
+
+          // Nothing may escape the thread, or the process terminates
+          DropboxGetFileResponse res;
+          try {
+            code = api_.getFile(req, res);
+          } catch (DropboxException& e) {
+            code = e.getErrorCode();
+          } catch (boost::property_tree::ptree_error&) {
+            code = MALFORMED_RESPONSE;
+          } catch (...) {
+            code = IO_ERROR;
+          }
+
+          if (fclose(f) && code == SUCCESS) {
+            code = IO_ERROR;
+          }
+
+          if (code == SUCCESS &&
+              rename(tmpPath.c_str(), t.localPath_.c_str())) {
+            code = IO_ERROR;
+          }
+
+          if (code != SUCCESS) {
+            unlink(tmpPath.c_str());
+          }
+        }
+
+        {
+          lock_guard<mutex> g(statsLock);
+          if (code == SUCCESS) {
+            ++stats.filesDownloaded_;
+            stats.bytesDownloaded_ += bytes;
+          } else {
+            ++stats.filesFailed_;
+            if (downloadCode == SUCCESS) {
+              downloadCode = code;
+            }
+          }
+        }
+
+        if (code == SUCCESS) {
+          downloaded.push(t);
+        }
+      }
+    }));
+  }
+
+  // Stage 4: fix up modification times, on the calling thread
+  thread closer([&]() {
+    for (auto& t : downloaders) {
+      t.join();
+    }
+    downloaded.close();
+  });
+
+  MirrorTransfer t;
+  while (downloaded.pop(t)) {
+    time_t mtime;
+    if (!parseDropboxTime(t.metadata_.clientMtime_, mtime)) {
+      continue;
+    }
+
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    utime(t.localPath_.c_str(), &times);
+  }
+
+  closer.join();
+  planner.join();
+  lister.join();
+
+  if (listException) {
+    rethrow_exception(listException);
+  }
+
+  return listCode != SUCCESS ? listCode : downloadCode;
+}
@@ -0,0 +1,98 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_MIRROR_H__
+#define __DROPBOX_MIRROR_H__
+
+#include "DropboxApi2.h"
+#include "DropboxTreeWalker.h"
+
+#include <string>
+#include <cstdint>
+
+namespace dropbox {
+
+struct DropboxMirrorStats {
+  size_t              foldersListed_;
+  size_t              filesListed_;
+  size_t              filesSkipped_;
+  size_t              filesDownloaded_;
+  size_t              filesFailed_;
+  uint64_t            bytesDownloaded_;
+};
+
+/**
+ * Mirrors a remote folder to a local directory. The work is a pipeline of
+ * stages connected by bounded queues:
+ *
+ *   list (DropboxTreeWalker) -> plan -> download (parallel) -> fix up mtimes
+ *
+ * The plan stage creates the local folders and skips files whose local size
+ * and modification time already match the remote metadata. Downloads stream
+ * straight to a temporary file next to their destination, which is renamed
+ * into place once complete.
+ */
+class DropboxMirror {
+public:
+  /**
+   * Create a mirror
+   *
+   * @param api             The DropboxApi2 instance to use. It must outlive
+   *                        the mirror
+   * @param concurrency     Number of parallel downloads (and listings)
+   * @param queueDepth      Capacity of the queue between each pair of stages
+   */
+  DropboxMirror(DropboxApi2& api,
+    size_t concurrency = 8,
+    size_t queueDepth = 1024);
+
+  void setConcurrency(size_t concurrency);
+  void setQueueDepth(size_t queueDepth);
+
+  /**
+   * The tree walker used by the list stage. Use it to add include/exclude
+   * filters; filtered entries are neither downloaded nor descended into.
+   *
+   * @return DropboxTreeWalker&
+   */
+  DropboxTreeWalker& getTreeWalker();
+
+  /**
+   * Mirror a remote folder. Files that fail to download are counted in the
+   * stats and do not stop the rest of the mirror. So are entries whose path
+   * has empty, "." or ".." segments, or would otherwise resolve outside
+   * 'localDir'; nothing is written for them.
+   *
+   * @param remotePath      Path of the folder relative to the root
+   * @param localDir        Local directory to mirror into. It is created if
+   *                        it does not exist
+   * @param stats           Output param with the counters for the run
+   *
+   * @return SUCCESS, the error code of a failed listing, MALFORMED_RESPONSE
+   *         for an unsafe path, or the error code of the first failed
+   *         download
+   */
+  DropboxErrorCode mirror(const std::string remotePath,
+    const std::string localDir,
+    DropboxMirrorStats& stats);
+
+private:
+  DropboxApi2&                    api_;
+  size_t                          concurrency_;
+  size_t                          queueDepth_;
+  DropboxTreeWalker               walker_;
+};
+}
+#endif
@@ -0,0 +1,279 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "DropboxRateLimiter.h"
+
+#include <algorithm>
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+DropboxRateLimiter::DropboxRateLimiter() :
+    upload_(new BandwidthLimiter()),
+    download_(new BandwidthLimiter()) {
+}
+
+shared_ptr<BandwidthLimiter> DropboxRateLimiter::getBandwidthLimiter(
+    DropboxBandwidthDirection d) {
+  return d == UPLOAD_BANDWIDTH ? upload_ : download_;
+}
+
+shared_ptr<ConcurrencyLimiter> DropboxRateLimiter::getConcurrencyLimiter(
+    const string& account,
+    DropboxEndpointClass c) {
+  if (account.empty()) {
+    return make_shared<ConcurrencyLimiter>();
+  }
+
+  lock_guard<mutex> g(lock_);
+
+  shared_ptr<ConcurrencyLimiter> limiter = concurrency_[make_pair(account,
+    c)].lock();
+  if (!limiter) {
+    limiter = make_shared<ConcurrencyLimiter>();
+    concurrency_[make_pair(account, c)] = limiter;
+  }
+
+  // Drop the entries of accounts no instance uses anymore
+  for (auto i = concurrency_.begin(); i != concurrency_.end(); ) {
+    if (i->second.expired()) {
+      i = concurrency_.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  return limiter;
+}
+
+DropboxRateLimiter* DropboxRateLimiter::getInstance() {
+  static DropboxRateLimiter limiter;
+  return &limiter;
+}
+
+void DropboxRateLimiter::setLimits(LimitMap& m,
+    const string& key,
+    const DropboxRateLimits& l) {
+  lock_guard<mutex> g(lock_);
+
+  if (l.callsPerSecond_ <= 0 && l.bytesPerSecond_ <= 0) {
+    m.erase(key);
+    return;
+  }
+
+  // Replace rather than update so reservations in progress keep a
+  // consistent view of the old limits
+  shared_ptr<Limits> limits(new Limits());
+  if (l.callsPerSecond_ > 0) {
+    limits->calls_.reset(new TokenBucket(l.callsPerSecond_,
+      max(l.callBurst_, 1.0)));
+  }
+  if (l.bytesPerSecond_ > 0) {
+    limits->bytes_.reset(new TokenBucket(l.bytesPerSecond_,
+      max(l.byteBurst_, 1.0)));
+  }
+
+  auto i = m.find(key);
+  if (i != m.end()) {
+    limits->stats_ = i->second->stats_;
+  }
+  m[key] = limits;
+}
+
+void DropboxRateLimiter::setAppLimits(const string& appKey,
+    const DropboxRateLimits& limits) {
+  setLimits(apps_, appKey, limits);
+}
+
+void DropboxRateLimiter::setAccountLimits(const string& account,
+    const DropboxRateLimits& limits) {
+  setLimits(accounts_, account, limits);
+}
+
+void DropboxRateLimiter::renameAccount(const string& from, const string& to) {
+  lock_guard<mutex> g(lock_);
+
+  if (from == to) {
+    return;
+  }
+
+  auto i = accounts_.find(from);
+  if (i != accounts_.end()) {
+    if (!accounts_.count(to)) {
+      accounts_[to] = i->second;
+    }
+    accounts_.erase(i);
+  }
+
+  // Instances still known by the old name keep their limiters until they
+  // move too
+  for (DropboxEndpointClass c : { METADATA_ENDPOINTS, CONTENT_ENDPOINTS }) {
+    shared_ptr<ConcurrencyLimiter> l = concurrency_[make_pair(from, c)].lock();
+    weak_ptr<ConcurrencyLimiter>& dest = concurrency_[make_pair(to, c)];
+    if (l && dest.expired()) {
+      dest = l;
+    }
+  }
+}
+
+shared_ptr<DropboxRateLimiter::Limits> DropboxRateLimiter::find(LimitMap& m,
+    const string& key) {
+  auto i = m.find(key);
+  return i == m.end() ? shared_ptr<Limits>() : i->second;
+}
+
+chrono::microseconds DropboxRateLimiter::take(Limits& l,
+    double calls,
+    double bytes) {
+  chrono::microseconds delay(0);
+
+  if (l.calls_ && calls > 0) {
+    delay = max(delay, l.calls_->reserve(calls));
+  }
+  if (l.bytes_ && bytes > 0) {
+    delay = max(delay, l.bytes_->reserve(bytes));
+  }
+
+  return delay;
+}
+
+bool DropboxRateLimiter::tryTake(Limits& l,
+    double calls,
+    double bytes) {
+  if (l.calls_ && calls > 0 && !l.calls_->tryTake(calls)) {
+    return false;
+  }
+  if (l.bytes_ && bytes > 0 && !l.bytes_->tryTake(bytes)) {
+    refund(l, calls, 0);
+    return false;
+  }
+
+  return true;
+}
+
+void DropboxRateLimiter::refund(Limits& l,
+    double calls,
+    double bytes) {
+  if (l.calls_ && calls > 0) {
+    l.calls_->refund(calls);
+  }
+  if (l.bytes_ && bytes > 0) {
+    l.bytes_->refund(bytes);
+  }
+}
+
+void DropboxRateLimiter::record(Limits& l,
+    chrono::microseconds delay,
+    double calls) {
+  DropboxRateLimitStats& s = l.stats_;
+
+  // Bytes charged after the fact are not calls being delayed
+  if (calls <= 0) {
+    return;
+  }
+
+  ++s.reservations_;
+  if (delay.count() > 0) {
+    ++s.delayed_;
+    s.totalDelay_ += delay;
+    s.maxDelay_ = max(s.maxDelay_, delay);
+  }
+}
+
+chrono::microseconds DropboxRateLimiter::reserve(const string& appKey,
+    const string& account,
+    double calls,
+    double bytes) {
+  shared_ptr<Limits> app;
+  shared_ptr<Limits> acct;
+
+  {
+    lock_guard<mutex> g(lock_);
+    app = find(apps_, appKey);
+    acct = find(accounts_, account);
+  }
+
+  chrono::microseconds appDelay(0);
+  chrono::microseconds acctDelay(0);
+
+  if (app) {
+    appDelay = take(*app, calls, bytes);
+  }
+  if (acct) {
+    acctDelay = take(*acct, calls, bytes);
+  }
+
+  lock_guard<mutex> g(lock_);
+  if (app) {
+    record(*app, appDelay, calls);
+  }
+  if (acct) {
+    record(*acct, acctDelay, calls);
+  }
+
+  return max(appDelay, acctDelay);
+}
+
+bool DropboxRateLimiter::tryReserve(const string& appKey,
+    const string& account,
+    double calls,
+    double bytes) {
+  shared_ptr<Limits> app;
+  shared_ptr<Limits> acct;
+
+  {
+    lock_guard<mutex> g(lock_);
+    app = find(apps_, appKey);
+    acct = find(accounts_, account);
+  }
+
+  if (app && !tryTake(*app, calls, bytes)) {
+    return false;
+  }
+  if (acct && !tryTake(*acct, calls, bytes)) {
+    if (app) {
+      refund(*app, calls, bytes);
+    }
+    return false;
+  }
+
+  lock_guard<mutex> g(lock_);
+  if (app) {
+    record(*app, chrono::microseconds(0), calls);
+  }
+  if (acct) {
+    record(*acct, chrono::microseconds(0), calls);
+  }
+
+  return true;
+}
+
+DropboxRateLimitStats DropboxRateLimiter::stats(LimitMap& m,
+    const string& key) {
+  lock_guard<mutex> g(lock_);
+
+  shared_ptr<Limits> l = find(m, key);
+  return l ? l->stats_ : DropboxRateLimitStats();
+}
+
+DropboxRateLimitStats DropboxRateLimiter::getAppStats(const string& appKey) {
+  return stats(apps_, appKey);
+}
+
+DropboxRateLimitStats DropboxRateLimiter::getAccountStats(
+    const string& account) {
+  return stats(accounts_, account);
+}
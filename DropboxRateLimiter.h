@@ -0,0 +1,216 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_RATE_LIMITER_H__
+#define __DROPBOX_RATE_LIMITER_H__
+
+#include "util/BandwidthLimiter.h"
+#include "util/ConcurrencyLimiter.h"
+#include "util/TokenBucket.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace dropbox {
+
+// Endpoints are throttled separately by the server depending on whether they
+// transfer file content or only metadata
+enum DropboxEndpointClass {
+  METADATA_ENDPOINTS,
+  CONTENT_ENDPOINTS,
+};
+
+// Bandwidth is shaped separately in each direction
+enum DropboxBandwidthDirection {
+  UPLOAD_BANDWIDTH,
+  DOWNLOAD_BANDWIDTH,
+};
+
+// Limits for one app key or one account. A rate of 0 means unlimited.
+struct DropboxRateLimits {
+  DropboxRateLimits() : callsPerSecond_(0), callBurst_(0),
+    bytesPerSecond_(0), byteBurst_(0) {
+  }
+
+  double                callsPerSecond_;
+  double                callBurst_;
+  double                bytesPerSecond_;
+  double                byteBurst_;
+};
+
+// How much the limits of an app key or account have delayed calls
+struct DropboxRateLimitStats {
+  DropboxRateLimitStats() : reservations_(0), delayed_(0), totalDelay_(0),
+    maxDelay_(0) {
+  }
+
+  uint64_t                    reservations_;
+  uint64_t                    delayed_;
+  std::chrono::microseconds   totalDelay_;
+  std::chrono::microseconds   maxDelay_;
+};
+
+/**
+ * Process wide rate limits, shared by every DropboxApi2 instance. Limits are
+ * set per app key, to stay under the app's quota, and per account. Each has
+ * a bucket of API calls and a bucket of content bytes. The adaptive
+ * concurrency limits are also kept here, per account. This class is a
+ * singleton; the memory is internally managed.
+ */
+class DropboxRateLimiter {
+public:
+  static DropboxRateLimiter* getInstance();
+
+  /**
+   * Set the limits shared by all instances using an app key
+   *
+   * @param appKey          The app key
+   * @param limits          The limits; all zero to remove them
+   *
+   * @return void
+   */
+  void setAppLimits(const std::string& appKey,
+    const DropboxRateLimits& limits);
+
+  /**
+   * Set the limits shared by all instances using an account
+   *
+   * @param account         The account; see
+   *                        DropboxApi2::getRateLimitAccount for the name an
+   *                        instance uses
+   * @param limits          The limits; all zero to remove them
+   *
+   * @return void
+   */
+  void setAccountLimits(const std::string& account,
+    const DropboxRateLimits& limits);
+
+  /**
+   * Move the limits, stats and concurrency limiters of an account to a new
+   * name, as when the access token it was known by is refreshed. The old
+   * name is forgotten. Nothing moves onto a name that has limits or
+   * limiters of its own.
+   *
+   * @param from            The old name
+   * @param to              The new name
+   *
+   * @return void
+   */
+  void renameAccount(const std::string& from, const std::string& to);
+
+  /**
+   * Reserve calls and bytes against the limits of an app key and an
+   * account. The caller should wait for the returned delay before sending
+   * its request. Bytes that only become known later, like the size of a
+   * download, can be reserved afterwards; they then delay later calls.
+   *
+   * @param appKey          The app key
+   * @param account         The account
+   * @param calls           Number of calls
+   * @param bytes           Number of content bytes
+   *
+   * @return How long to wait
+   */
+  std::chrono::microseconds reserve(const std::string& appKey,
+    const std::string& account,
+    double calls,
+    double bytes);
+
+  /**
+   * Reserve calls and bytes only if both the app key and the account can
+   * afford them now, e.g. for a speculative request that should not delay
+   * anyone
+   *
+   * @param appKey          The app key
+   * @param account         The account
+   * @param calls           Number of calls
+   * @param bytes           Number of content bytes
+   *
+   * @return false if nothing was reserved
+   */
+  bool tryReserve(const std::string& appKey,
+    const std::string& account,
+    double calls,
+    double bytes);
+
+  DropboxRateLimitStats getAppStats(const std::string& appKey);
+  DropboxRateLimitStats getAccountStats(const std::string& account);
+
+  /**
+   * Get the limiter that caps the combined bandwidth of all content
+   * transfers in the process in one direction. Unlike the byte limits
+   * above, which delay whole calls, it paces the transfers as the data
+   * moves. Unlimited until a rate is set on it.
+   *
+   * @param d               The direction
+   *
+   * @return The limiter
+   */
+  std::shared_ptr<util::BandwidthLimiter> getBandwidthLimiter(
+    DropboxBandwidthDirection d);
+
+  /**
+   * Get the limiter that bounds the requests in flight to a class of
+   * endpoints for an account. The server throttles per account, so every
+   * DropboxApi2 instance using the account shares it, along with what it
+   * has learned about the account's limit. The limiter lives as long as an
+   * instance holds it.
+   *
+   * @param account         The account; the empty string gets a limiter of
+   *                        its own that is not shared
+   * @param c               The endpoint class
+   *
+   * @return The limiter
+   */
+  std::shared_ptr<util::ConcurrencyLimiter> getConcurrencyLimiter(
+    const std::string& account,
+    DropboxEndpointClass c);
+
+private:
+  DropboxRateLimiter();
+
+  struct Limits {
+    std::unique_ptr<util::TokenBucket>  calls_;
+    std::unique_ptr<util::TokenBucket>  bytes_;
+    DropboxRateLimitStats               stats_;
+  };
+
+  typedef std::map<std::string, std::shared_ptr<Limits> > LimitMap;
+  typedef std::map<std::pair<std::string, DropboxEndpointClass>,
+    std::weak_ptr<util::ConcurrencyLimiter> > ConcurrencyMap;
+
+  void                  setLimits(LimitMap&, const std::string&,
+                          const DropboxRateLimits&);
+  std::shared_ptr<Limits> find(LimitMap&, const std::string&);
+  std::chrono::microseconds take(Limits&, double, double);
+  bool                  tryTake(Limits&, double, double);
+  void                  refund(Limits&, double, double);
+  void                  record(Limits&, std::chrono::microseconds, double);
+  DropboxRateLimitStats stats(LimitMap&, const std::string&);
+
+  std::mutex            lock_;
+  LimitMap              apps_;
+  LimitMap              accounts_;
+  ConcurrencyMap        concurrency_;
+
+  std::shared_ptr<util::BandwidthLimiter> upload_;
+  std::shared_ptr<util::BandwidthLimiter> download_;
+};
+}
+#endif
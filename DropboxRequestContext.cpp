@@ -0,0 +1,102 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "DropboxRequestContext.h"
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+namespace {
+thread_local DropboxRequestContext currentContext;
+}
+
+DropboxRequestContext::DropboxRequestContext() :
+    deadline_(Clock::time_point::max()),
+    priority_(PRIORITY_NORMAL) {
+}
+
+void DropboxRequestContext::setDeadline(Clock::time_point deadline) {
+  deadline_ = deadline;
+}
+
+void DropboxRequestContext::setTimeout(Clock::duration timeout) {
+  deadline_ = Clock::now() + timeout;
+}
+
+bool DropboxRequestContext::hasDeadline() const {
+  return deadline_ != Clock::time_point::max();
+}
+
+DropboxRequestContext::Clock::time_point
+DropboxRequestContext::getDeadline() const {
+  return deadline_;
+}
+
+void DropboxRequestContext::setCancellationToken(
+    shared_ptr<CancellationToken> token) {
+  token_ = token;
+}
+
+shared_ptr<CancellationToken>
+DropboxRequestContext::getCancellationToken() const {
+  return token_;
+}
+
+void DropboxRequestContext::setPriority(Priority priority) {
+  priority_ = priority;
+}
+
+Priority DropboxRequestContext::getPriority() const {
+  return priority_;
+}
+
+DropboxErrorCode DropboxRequestContext::check() const {
+  if (token_ && token_->isCancelled()) {
+    return CANCELLED;
+  }
+
+  if (hasDeadline() && Clock::now() >= deadline_) {
+    return DEADLINE_EXCEEDED;
+  }
+
+  return SUCCESS;
+}
+
+const DropboxRequestContext& DropboxRequestContext::getCurrent() {
+  return currentContext;
+}
+
+DropboxContextScope::DropboxContextScope(
+    const DropboxRequestContext& context) :
+    previous_(currentContext) {
+  currentContext = context;
+}
+
+DropboxContextScope::~DropboxContextScope() {
+  currentContext = previous_;
+}
+
+DropboxPriorityScope::DropboxPriorityScope(Priority priority) :
+    previous_(currentContext.priority_) {
+  currentContext.priority_ = priority;
+}
+
+DropboxPriorityScope::~DropboxPriorityScope() {
+  currentContext.priority_ = previous_;
+}
+
+Priority DropboxPriorityScope::getCurrent() {
+  return currentContext.priority_;
+}
@@ -0,0 +1,170 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __DROPBOX_REQUEST_CONTEXT_H__
+#define __DROPBOX_REQUEST_CONTEXT_H__
+
+#include "DropboxException.h"
+
+#include "util/CancellationToken.h"
+#include "util/ConcurrencyLimiter.h"
+
+#include <chrono>
+#include <memory>
+
+namespace dropbox {
+
+/**
+ * How a call should be carried out: its priority class, the time by which
+ * it must have completed, and a token through which it can be cancelled.
+ * A context applies to every call made by a thread while a
+ * DropboxContextScope holding it is alive, including each request of a
+ * call that sends several, like uploadLargeFile; the deadline is absolute,
+ * so every request gets what is left of it.
+ *
+ * A call that runs out of time fails with a DropboxException carrying
+ * DEADLINE_EXCEEDED, and one that is cancelled with CANCELLED, whether it
+ * was waiting for a slot, backing off or transferring data.
+ *
+ * DropboxAsyncApi, DropboxTreeWalker, DropboxMirror and
+ * DropboxDirectoryUploader carry the context of the calling thread over to
+ * the threads they run calls on.
+ *
+ *   DropboxRequestContext ctx;
+ *   ctx.setTimeout(std::chrono::seconds(30));
+ *   ctx.setCancellationToken(token);
+ *
+ *   DropboxContextScope scope(ctx);
+ *   api.uploadLargeFile(req, m);
+ */
+class DropboxRequestContext {
+public:
+  typedef std::chrono::steady_clock     Clock;
+
+  // No deadline, no token, PRIORITY_NORMAL
+  DropboxRequestContext();
+
+  /**
+   * Set the time by which calls must complete
+   *
+   * @param deadline        The deadline
+   *
+   * @return void
+   */
+  void setDeadline(Clock::time_point deadline);
+
+  /**
+   * Set the deadline to a time from now
+   *
+   * @param timeout         How long calls may take from now on
+   *
+   * @return void
+   */
+  void setTimeout(Clock::duration timeout);
+
+  bool hasDeadline() const;
+  Clock::time_point getDeadline() const;
+
+  /**
+   * Set the token through which calls are cancelled
+   *
+   * @param token           The token; NULL for none
+   *
+   * @return void
+   */
+  void setCancellationToken(std::shared_ptr<util::CancellationToken> token);
+  std::shared_ptr<util::CancellationToken> getCancellationToken() const;
+
+  /**
+   * Set the priority class of calls; see DropboxPriorityScope
+   *
+   * @param priority        The priority
+   *
+   * @return void
+   */
+  void setPriority(util::Priority priority);
+  util::Priority getPriority() const;
+
+  /**
+   * Whether calls should stop: the token has been cancelled or the deadline
+   * has passed
+   *
+   * @return SUCCESS, CANCELLED or DEADLINE_EXCEEDED
+   */
+  DropboxErrorCode check() const;
+
+  /**
+   * Get the context of calls made by the current thread
+   *
+   * @return The context
+   */
+  static const DropboxRequestContext& getCurrent();
+
+private:
+  friend class DropboxContextScope;
+  friend class DropboxPriorityScope;
+
+  Clock::time_point                         deadline_;
+  std::shared_ptr<util::CancellationToken>  token_;
+  util::Priority                            priority_;
+};
+
+/**
+ * Makes a context current for the calls made by this thread while in scope
+ */
+class DropboxContextScope {
+public:
+  DropboxContextScope(const DropboxRequestContext& context);
+  ~DropboxContextScope();
+
+private:
+  DropboxContextScope(const DropboxContextScope&);
+  DropboxContextScope& operator=(const DropboxContextScope&);
+
+  DropboxRequestContext   previous_;
+};
+
+/**
+ * Sets the priority class of the calls made by the current thread while it
+ * is in scope, leaving the rest of the current context as it is. Calls wait
+ * for a concurrency slot in the order picked by the limiter's scheduling
+ * policy (see util::ConcurrencyLimiter), so a UI lookup made under
+ * PRIORITY_INTERACTIVE is sent ahead of queued bulk transfers. Calls
+ * default to PRIORITY_NORMAL.
+ *
+ *   {
+ *     DropboxPriorityScope p(util::PRIORITY_BULK);
+ *     api.uploadLargeFile(req, m);
+ *   }
+ */
+class DropboxPriorityScope {
+public:
+  DropboxPriorityScope(util::Priority priority);
+  ~DropboxPriorityScope();
+
+  /**
+   * Get the priority class of calls made by the current thread
+   *
+   * @return The priority
+   */
+  static util::Priority getCurrent();
+
+private:
+  DropboxPriorityScope(const DropboxPriorityScope&);
+  DropboxPriorityScope& operator=(const DropboxPriorityScope&);
+
+  util::Priority          previous_;
+};
+}
+#endif
@@ -0,0 +1,141 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "DropboxRequestStats.h"
+
+#include <algorithm>
+
+using namespace dropbox;
+using namespace http;
+using namespace util;
+using namespace std;
+
+DropboxRequestStats::DropboxRequestStats() {
+}
+
+string DropboxRequestStats::getEndpoint(const string& url) {
+  // Skip the scheme and host
+  size_t start = url.find("://");
+  start = url.find('/', start == string::npos ? 0 : start + 3);
+  if (start == string::npos) {
+    return "";
+  }
+
+  // Then the api version
+  size_t next = url.find('/', start + 1);
+  if (next == string::npos) {
+    return url.substr(start + 1);
+  }
+
+  string endpoint;
+  for (start = next + 1; start < url.size(); start = next + 1) {
+    next = url.find('/', start);
+    string part = url.substr(start,
+      next == string::npos ? string::npos : next - start);
+
+    // In v1 urls the root is followed by the path of a file
+    if (part == "dropbox" || part == "sandbox" || part == "auto" ||
+        part.empty()) {
+      break;
+    }
+
+    if (!endpoint.empty()) {
+      endpoint += "/";
+    }
+    endpoint += part;
+
+    if (next == string::npos) {
+      break;
+    }
+  }
+
+  return endpoint;
+}
+
+void DropboxRequestStats::record(HttpRequest* r, int curlCode) {
+  RequestTiming t = r->getTiming();
+  string name = getEndpoint(r->getUrl());
+  shared_ptr<Endpoint> e;
+
+  {
+    lock_guard<mutex> g(lock_);
+
+    shared_ptr<Endpoint>& slot = endpoints_[name];
+    if (!slot) {
+      slot.reset(new Endpoint());
+    }
+    e = slot;
+
+    DropboxEndpointStats& s = e->stats_;
+    ++s.requests_;
+    if (curlCode) {
+      ++s.transportErrors_;
+    } else if (r->getResponseCode() >= 400) {
+      ++s.httpErrors_;
+    }
+    if (t.connectionReused_) {
+      ++s.reusedConnections_;
+    }
+
+    s.bytesSent_ += t.bytesSent_;
+    s.bytesReceived_ += t.bytesReceived_;
+    s.nameLookup_ += t.nameLookup_;
+    s.connect_ += t.connect_;
+    s.tlsHandshake_ += t.tlsHandshake_;
+    s.firstByte_ += t.firstByte_;
+    s.transfer_ += t.transfer_;
+    s.total_ += t.total_;
+    s.maxTotal_ = max(s.maxTotal_, t.total_);
+  }
+
+  e->latency_.record(t.total_);
+}
+
+vector<string> DropboxRequestStats::getEndpoints() {
+  lock_guard<mutex> g(lock_);
+
+  vector<string> names;
+  for (auto& e : endpoints_) {
+    names.push_back(e.first);
+  }
+
+  return names;
+}
+
+DropboxEndpointStats DropboxRequestStats::getStats(const string& endpoint) {
+  shared_ptr<Endpoint> e;
+  DropboxEndpointStats s;
+
+  {
+    lock_guard<mutex> g(lock_);
+
+    auto i = endpoints_.find(endpoint);
+    if (i == endpoints_.end()) {
+      return s;
+    }
+
+    e = i->second;
+    s = e->stats_;
+  }
+
+  e->latency_.quantile(0.5, s.p50Total_);
+  e->latency_.quantile(0.95, s.p95Total_);
+
+  return s;
+}
+
+void DropboxRequestStats::reset() {
+  lock_guard<mutex> g(lock_);
+  endpoints_.clear();
+}
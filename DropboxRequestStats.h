@@ -0,0 +1,127 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __DROPBOX_REQUEST_STATS_H__
+#define __DROPBOX_REQUEST_STATS_H__
+
+#include "util/HttpRequest.h"
+#include "util/LatencyTracker.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace dropbox {
+
+// Aggregated timing of the requests sent to one endpoint. The phase times
+// are sums over all requests; divide by requests_ for the mean.
+struct DropboxEndpointStats {
+  DropboxEndpointStats() : requests_(0), transportErrors_(0), httpErrors_(0),
+    reusedConnections_(0), bytesSent_(0), bytesReceived_(0), nameLookup_(0),
+    connect_(0), tlsHandshake_(0), firstByte_(0), transfer_(0), total_(0),
+    maxTotal_(0), p50Total_(0), p95Total_(0) {
+  }
+
+  uint64_t                    requests_;
+  // Requests that got no response, and responses with a 4xx or 5xx status
+  uint64_t                    transportErrors_;
+  uint64_t                    httpErrors_;
+  uint64_t                    reusedConnections_;
+  uint64_t                    bytesSent_;
+  uint64_t                    bytesReceived_;
+
+  std::chrono::microseconds   nameLookup_;
+  std::chrono::microseconds   connect_;
+  std::chrono::microseconds   tlsHandshake_;
+  std::chrono::microseconds   firstByte_;
+  std::chrono::microseconds   transfer_;
+  std::chrono::microseconds   total_;
+  std::chrono::microseconds   maxTotal_;
+
+  // Over the recent requests; zero until there are enough of them
+  std::chrono::microseconds   p50Total_;
+  std::chrono::microseconds   p95Total_;
+};
+
+/**
+ * Collects the timing of every request sent by a DropboxApi2 instance, per
+ * logical endpoint ("metadata", "files_put", "chunked_upload",
+ * "files/upload_session/append_v2", ...), so that slow calls can be pinned
+ * on DNS, connection setup, TLS, the server or the transfer. Thread safe.
+ */
+class DropboxRequestStats {
+public:
+  DropboxRequestStats();
+
+  /**
+   * Record one execution of a request
+   *
+   * @param r               The request
+   * @param curlCode        The error code returned by curl; 0 on success
+   *
+   * @return void
+   */
+  void record(http::HttpRequest* r, int curlCode);
+
+  /**
+   * Get the endpoints that requests have been recorded for
+   *
+   * @return The endpoint names
+   */
+  std::vector<std::string> getEndpoints();
+
+  /**
+   * Get the stats of an endpoint
+   *
+   * @param endpoint        The endpoint name
+   *
+   * @return The stats; all zero if nothing was recorded for it
+   */
+  DropboxEndpointStats getStats(const std::string& endpoint);
+
+  /**
+   * Forget everything recorded so far
+   *
+   * @return void
+   */
+  void reset();
+
+  /**
+   * Get the name of the endpoint a url belongs to: its path after the api
+   * version, without the root and file path of v1 urls
+   *
+   * @param url             The url, without params
+   *
+   * @return The endpoint name
+   */
+  static std::string getEndpoint(const std::string& url);
+
+private:
+  DropboxRequestStats(const DropboxRequestStats&);
+  DropboxRequestStats& operator=(const DropboxRequestStats&);
+
+  struct Endpoint {
+    DropboxEndpointStats                  stats_;
+    util::LatencyTracker                  latency_;
+  };
+
+  std::mutex                                          lock_;
+  std::map<std::string, std::shared_ptr<Endpoint> >   endpoints_;
+};
+}
+#endif
@@ -0,0 +1,179 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "DropboxTreeWalker.h"
+
+#include <thread>
+#include <cassert>
+
+using namespace dropbox;
+using namespace util;
+using namespace std;
+
+DropboxTreeWalker::DropboxTreeWalker(DropboxApi2& api, size_t concurrency) :
+    api_(api),
+    concurrency_(concurrency ? concurrency : 1),
+    includeDeleted_(false),
+    inFlight_(0),
+    error_(SUCCESS) {
+}
+
+void DropboxTreeWalker::setConcurrency(size_t concurrency) {
+  concurrency_ = concurrency ? concurrency : 1;
+}
+
+void DropboxTreeWalker::setIncludeDeleted(bool includeDeleted) {
+  includeDeleted_ = includeDeleted;
+}
+
+void DropboxTreeWalker::addIncludeFilter(Filter f) {
+  includes_.push_back(f);
+}
+
+void DropboxTreeWalker::addExcludeFilter(Filter f) {
+  excludes_.push_back(f);
+}
+
+bool DropboxTreeWalker::accept(const DropboxMetadata& m) const {
+  for (auto& f : excludes_) {
+    if (f(m)) {
+      return false;
+    }
+  }
+
+  if (includes_.empty()) {
+    return true;
+  }
+
+  for (auto& f : includes_) {
+    if (f(m)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void DropboxTreeWalker::fail(DropboxErrorCode code, exception_ptr e) {
+  lock_guard<mutex> g(lock_);
+
+  // Only the first failure is reported
+  if (error_ == SUCCESS && !exception_) {
+    error_ = code;
+    exception_ = e;
+  }
+
+  frontier_.clear();
+  cond_.notify_all();
+}
+
+void DropboxTreeWalker::listFolder(const string& path) {
+  DropboxMetadataRequest req(path, true, includeDeleted_);
+  req.setLimit(MAX_LISTING_FILE_LIMIT);
+
+  DropboxMetadataResponse res;
+  DropboxErrorCode code = api_.getFileMetadata(req, res);
+  if (code != SUCCESS) {
+    fail(code, nullptr);
+    return;
+  }
+
+  vector<string> folders;
+  for (auto& m : res.getChildren()) {
+    if (!accept(m)) {
+      continue;
+    }
+
+    {
+      lock_guard<mutex> g(visitLock_);
+      visitor_(m);
+    }
+
+    if (m.isDir_) {
+      folders.push_back(m.path_);
+    }
+  }
+
+  lock_guard<mutex> g(lock_);
+  if (error_ != SUCCESS || exception_) {
+    return;
+  }
+
+  for (auto& f : folders) {
+    frontier_.push_back(f);
+  }
+}
+
+void DropboxTreeWalker::worker(DropboxRequestContext context) {
+  DropboxContextScope scope(context);
+  unique_lock<mutex> g(lock_);
+
+  while (true) {
+    cond_.wait(g, [this]() {
+      return !frontier_.empty() || inFlight_ == 0;
+    });
+
+    if (frontier_.empty()) {
+      // Nothing queued and nothing in flight that could queue more
+      return;
+    }
+
+    string path = frontier_.front();
+    frontier_.pop_front();
+    ++inFlight_;
+    g.unlock();
+
+    try {
+      listFolder(path);
+    } catch (DropboxException& e) {
+      fail(e.getErrorCode(), current_exception());
+    } catch (...) {
+      fail(CURL_ERROR, current_exception());
+    }
+
+    g.lock();
+    --inFlight_;
+    cond_.notify_all();
+  }
+}
+
+DropboxErrorCode DropboxTreeWalker::walk(const string path, Visitor visitor) {
+  {
+    lock_guard<mutex> g(lock_);
+    assert(inFlight_ == 0);
+
+    frontier_.clear();
+    frontier_.push_back(path);
+    error_ = SUCCESS;
+    exception_ = nullptr;
+    visitor_ = visitor;
+  }
+
+  DropboxRequestContext context = DropboxRequestContext::getCurrent();
+  vector<thread> workers;
+  for (size_t i = 0; i < concurrency_; ++i) {
+    workers.push_back(thread(&DropboxTreeWalker::worker, this, context));
+  }
+
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  if (exception_) {
+    rethrow_exception(exception_);
+  }
+
+  return error_;
+}
@@ -0,0 +1,136 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __DROPBOX_TREE_WALKER_H__
+#define __DROPBOX_TREE_WALKER_H__
+
+#include "DropboxApi2.h"
+#include "DropboxMetadataType.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace dropbox {
+
+// Largest file_limit accepted by the /metadata method of the core API
+const size_t MAX_LISTING_FILE_LIMIT = 25000;
+
+/**
+ * Crawls a folder hierarchy breadth first using the /metadata method. Up to
+ * 'concurrency' folder listings are in flight at any time, so the crawl time
+ * of a deep tree is bounded by its depth and the concurrency rather than the
+ * number of folders in it.
+ */
+class DropboxTreeWalker {
+public:
+  typedef std::function<bool(const DropboxMetadata&)>   Filter;
+  typedef std::function<void(const DropboxMetadata&)>   Visitor;
+
+  /**
+   * Create a tree walker
+   *
+   * @param api             The DropboxApi2 instance used to list folders. It
+   *                        must outlive the walker
+   * @param concurrency     Maximum number of listings in flight
+   */
+  DropboxTreeWalker(DropboxApi2& api, size_t concurrency = 8);
+
+  /**
+   * Set the maximum number of listings in flight
+   *
+   * @param concurrency     Number of worker threads; must be at least 1
+   *
+   * @return void
+   */
+  void setConcurrency(size_t concurrency);
+
+  /**
+   * Whether deleted entries are listed (and deleted folders descended into)
+   *
+   * @param includeDeleted  true to include deleted entries
+   *
+   * @return void
+   */
+  void setIncludeDeleted(bool includeDeleted);
+
+  /**
+   * Add an include filter. When include filters are present, an entry is
+   * only visited if at least one of them returns true for it. Filters also
+   * see folders: a folder that is filtered out is neither visited nor listed,
+   * so an include filter must accept the folders it wants descended into.
+   *
+   * @param f               The filter
+   *
+   * @return void
+   */
+  void addIncludeFilter(Filter f);
+
+  /**
+   * Add an exclude filter. An entry for which any exclude filter returns true
+   * is skipped; excluded folders are not listed.
+   *
+   * @param f               The filter
+   *
+   * @return void
+   */
+  void addExcludeFilter(Filter f);
+
+  /**
+   * Walk the tree rooted at 'path'. Every entry below 'path' that passes the
+   * filters is passed to the visitor. The visitor is called from the worker
+   * threads but never concurrently, so it need not be thread safe.
+   *
+   * The walk stops at the first listing that fails. Exceptions thrown by the
+   * api or the visitor are rethrown from this method. /metadata can't page,
+   * so a folder with more than MAX_LISTING_FILE_LIMIT children fails to
+   * list with TOO_MANY_FILES, which fails the whole walk.
+   *
+   * @param path            Path of the folder to walk, relative to the root
+   * @param visitor         Called once for every entry found
+   *
+   * @return SUCCESS or the error code of the first failed listing
+   */
+  DropboxErrorCode walk(const std::string path, Visitor visitor);
+
+private:
+  bool              accept(const DropboxMetadata&) const;
+  void              worker(DropboxRequestContext);
+  void              listFolder(const std::string&);
+  void              fail(DropboxErrorCode, std::exception_ptr);
+
+  DropboxApi2&                    api_;
+  size_t                          concurrency_;
+  bool                            includeDeleted_;
+  std::vector<Filter>             includes_;
+  std::vector<Filter>             excludes_;
+
+  // State of the walk in progress
+  std::mutex                      lock_;
+  std::condition_variable         cond_;
+  std::deque<std::string>         frontier_;
+  size_t                          inFlight_;
+  DropboxErrorCode                error_;
+  std::exception_ptr              exception_;
+
+  std::mutex                      visitLock_;
+  Visitor                         visitor_;
+};
+}
+#endif
@@ -17,6 +17,11 @@
 #define __DROPBOX_UPLOAD_FILE_H__
 
 #include <string>
+#include <memory>
+#include <chrono>
+
+#include "util/BandwidthLimiter.h"
+#include "util/TransferProgress.h"
 
 namespace dropbox {
 
@@ -29,7 +34,8 @@ public:
       overwrite_(overwrite),
       parentRev_(parent_rev),
       data_(NULL),
-      dataSize_(0) {
+      dataSize_(0),
+      progressInterval_(1000) {
   }
 
   void setOverwrite(bool overwrite) {
@@ -65,12 +71,47 @@ public:
     return dataSize_;
   }
 
+  /**
+   * Cap the bandwidth of this transfer, on top of the per client and
+   * process wide caps. Copies of the request share the limiter, whose rate
+   * can be changed while the transfer is running.
+   */
+  void setBandwidthLimit(double bytesPerSecond) {
+    bandwidth_.reset(new util::BandwidthLimiter(bytesPerSecond));
+  }
+
+  std::shared_ptr<util::BandwidthLimiter> getBandwidthLimiter() const {
+    return bandwidth_;
+  }
+
+  /**
+   * Report the progress of this transfer to a callback, at most once per
+   * interval and once more when it completes. The transfer is aborted with
+   * CANCELLED if the callback returns false.
+   */
+  void setProgressCallback(util::ProgressCallback cb,
+      std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {
+    progress_ = cb;
+    progressInterval_ = interval;
+  }
+
+  util::ProgressCallback getProgressCallback() const {
+    return progress_;
+  }
+
+  std::chrono::milliseconds getProgressInterval() const {
+    return progressInterval_;
+  }
+
 private:
   const std::string   path_;
   bool                overwrite_;
   std::string         parentRev_;
   uint8_t*            data_;
   size_t              dataSize_;
+  std::shared_ptr<util::BandwidthLimiter> bandwidth_;
+  util::ProgressCallback progress_;
+  std::chrono::milliseconds progressInterval_;
 };
 }
 #endif
@@ -17,6 +17,12 @@
 #define __DROPBOX_UPLOAD_LARGE_FILE_H__
 
 #include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+#include "util/BandwidthLimiter.h"
+#include "util/TransferProgress.h"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -36,7 +42,9 @@ public:
       overwrite_(overwrite),
       parentRev_(parent_rev),
       chunkSize_(chunkSize),
-      offset_(offset) {
+      offset_(offset),
+      totalSize_(0),
+      progressInterval_(1000) {
   }
 
   void setOverwrite(bool overwrite) {
@@ -71,10 +79,54 @@ public:
     return offset_;
   }
 
+  /**
+   * Size of the data, from offset 0, when known in advance. Only used to
+   * report the progress of the upload.
+   */
+  void setTotalSize(uint64_t size) {
+    totalSize_ = size;
+  }
+
+  uint64_t getTotalSize() const {
+    return totalSize_;
+  }
+
   size_t getData(uint8_t* data, size_t offset, size_t size) const {
     return dataCb_(data, offset, size);
   }
 
+  /**
+   * Cap the bandwidth of this transfer, on top of the per client and
+   * process wide caps. Copies of the request share the limiter, whose rate
+   * can be changed while the transfer is running.
+   */
+  void setBandwidthLimit(double bytesPerSecond) {
+    bandwidth_.reset(new util::BandwidthLimiter(bytesPerSecond));
+  }
+
+  std::shared_ptr<util::BandwidthLimiter> getBandwidthLimiter() const {
+    return bandwidth_;
+  }
+
+  /**
+   * Report the progress of this transfer to a callback, at most once per
+   * interval and once more when it completes. The transfer is aborted with
+   * CANCELLED if the callback returns false.
+   */
+  void setProgressCallback(util::ProgressCallback cb,
+      std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {
+    progress_ = cb;
+    progressInterval_ = interval;
+  }
+
+  util::ProgressCallback getProgressCallback() const {
+    return progress_;
+  }
+
+  std::chrono::milliseconds getProgressInterval() const {
+    return progressInterval_;
+  }
+
 private:
   const std::string   path_;
   std::function<size_t(uint8_t*, size_t, size_t)> dataCb_;
@@ -83,6 +135,10 @@ private:
   std::string         parentRev_;
   size_t              chunkSize_;
   size_t              offset_;
+  uint64_t            totalSize_;
+  std::shared_ptr<util::BandwidthLimiter> bandwidth_;
+  util::ProgressCallback progress_;
+  std::chrono::milliseconds progressInterval_;
 };
 
 class DropboxUploadLargeFileResponse {
@@ -0,0 +1,128 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/**
+ * Thread scaling benchmark for adding the Authorization header to requests
+ * of a shared client.
+ *
+ *   locked    The header is formatted under a client wide mutex on every
+ *             request (how DropboxApi2::execute used to do it)
+ *   snapshot  OAuth2::addOAuthAccessHeader, which loads a preformatted
+ *             header published with an atomic shared_ptr
+ *
+ * A writer thread swaps the token every millisecond in both modes.
+ *
+ * Usage: AuthHeaderBench [seconds per run]
+ */
+
+#include "util/OAuth2.h"
+#include "util/HttpRequest.h"
+#include "util/HttpRequestFactory.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace http;
+using namespace oauth;
+
+static double run(bool snapshot, size_t numThreads, double seconds) {
+  HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+  OAuth2 oauth("key", "secret");
+  oauth.setAccessToken("token-0");
+
+  mutex stateLock;
+  string legacyToken = "token-0";
+
+  atomic<bool> stop(false);
+  atomic<uint64_t> total(0);
+
+  vector<thread> threads;
+  for (size_t i = 0; i < numThreads; ++i) {
+    threads.push_back(thread([&]() {
+      unique_ptr<HttpRequest> r(factory->createHttpRequest("http://localhost/"));
+      uint64_t n = 0;
+
+      while (!stop.load(memory_order_relaxed)) {
+        if (snapshot) {
+          oauth.addOAuthAccessHeader(r.get());
+        } else {
+          lock_guard<mutex> g(stateLock);
+          stringstream ss;
+          ss << "Bearer " << legacyToken;
+          r->addHeader("Authorization", ss.str());
+        }
+        ++n;
+      }
+
+      total += n;
+    }));
+  }
+
+  thread writer([&]() {
+    uint64_t gen = 0;
+    while (!stop.load()) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+
+      stringstream ss;
+      ss << "token-" << ++gen;
+      if (snapshot) {
+        oauth.setAccessToken(ss.str());
+      } else {
+        lock_guard<mutex> g(stateLock);
+        legacyToken = ss.str();
+      }
+    }
+  });
+
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop.store(true);
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  writer.join();
+
+  return total.load() / seconds;
+}
+
+int main(int argc, char** argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+  size_t maxThreads = thread::hardware_concurrency();
+  if (maxThreads < 2) {
+    maxThreads = 2;
+  }
+
+  printf("%8s %16s %16s %8s\n", "threads", "locked ops/s", "snapshot ops/s",
+    "speedup");
+
+  for (size_t n = 1; n <= maxThreads; n *= 2) {
+    double locked = run(false, n, seconds);
+    double snapshot = run(true, n, seconds);
+
+    printf("%8zu %16.0f %16.0f %7.2fx\n", n, locked, snapshot,
+      snapshot / locked);
+  }
+
+  return 0;
+}
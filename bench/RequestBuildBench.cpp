@@ -0,0 +1,121 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+/**
+ * Per request CPU cost of assembling a request: the url with its query
+ * string, the headers and the curl handle setup done by
+ * HttpRequest::prepare().
+ *
+ *   create    A new request with the params and headers of a chunked
+ *             upload, prepared once, as for every call of the api
+ *   reprepare The same request prepared again, as for a retry
+ *   encode    Percent-encoding a typical file path for its url
+ *
+ * Reports the time and the operator new calls per request. Allocations
+ * made by curl with malloc are not counted.
+ *
+ * Usage: RequestBuildBench [iterations]
+ */
+
+#include "util/HttpRequest.h"
+#include "util/HttpRequestFactory.h"
+#include "util/PercentEncoding.h"
+#include "test/AllocationCounter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+using namespace std;
+using namespace http;
+using namespace dropbox;
+
+typedef chrono::steady_clock Clock;
+
+static const char* URL = "https://api-content.dropbox.com/1/chunked_upload";
+
+static const string PATH =
+  "/Photos/2013/Summer holiday/IMG_20130714_183512_HDR (1).jpg";
+
+static void fill(HttpRequest* r) {
+  r->setMethod(HttpPutRequest);
+  r->addIntegerParam("offset", 4194304);
+  r->addParam("upload_id", "v0k84B0AT9fYkfMUp0sBTA");
+  r->addParam("overwrite", "true");
+  r->addParam("parent_rev", "35e97029684fe");
+  r->addHeader("Authorization",
+    "Bearer sl.Bq0cZ1V3dGhpc2lzbm90YXJlYWx0b2tlbmJ1dGl0c2xvbmc");
+  r->addHeader("Content-Type", "application/octet-stream");
+  r->addHeader("User-Agent", "dropbox-cpp");
+}
+
+static void report(const char* name, size_t n, Clock::duration elapsed,
+    uint64_t allocations) {
+  printf("%-10s %10.0f ns/op %8.1f allocs/op\n", name,
+    chrono::duration<double, nano>(elapsed).count() / n,
+    (double)allocations / n);
+}
+
+int main(int argc, char** argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+
+  {
+    AllocationCounter c;
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < n; ++i) {
+      unique_ptr<HttpRequest> r(factory->createHttpRequest(URL));
+      fill(r.get());
+      r->prepare();
+    }
+
+    report("create", n, Clock::now() - start, c.getAllocations());
+  }
+
+  {
+    unique_ptr<HttpRequest> r(factory->createHttpRequest(URL));
+    fill(r.get());
+    r->prepare();
+
+    AllocationCounter c;
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < n; ++i) {
+      fill(r.get());
+      r->prepare();
+    }
+
+    report("reprepare", n, Clock::now() - start, c.getAllocations());
+  }
+
+  {
+    string url;
+    url.reserve(256);
+
+    AllocationCounter c;
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < n; ++i) {
+      url.clear();
+      percentEncode(PATH.data(), PATH.size(), UrlPath, url);
+    }
+
+    report("encode", n, Clock::now() - start, c.getAllocations());
+  }
+
+  return 0;
+}
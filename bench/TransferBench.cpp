@@ -0,0 +1,404 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/**
+ * End-to-end transfer benchmark for DropboxApi2 against the loopback
+ * MockDropboxServer. Each case runs for a fixed time at every concurrency
+ * level, with one shared client, and reports requests/s, MB/s and latency
+ * percentiles.
+ *
+ *   upload          uploadFile of --size-mb bytes
+ *   upload_large    uploadLargeFile of max(--large-mb, chunk) bytes, for
+ *                   each chunk size in --chunks-mb
+ *   download        getFile of a --size-mb file
+ *   download_range  getFile of --range-kb at random offsets of that file
+ *   list            getFileMetadata listing of a folder of --list-size files
+ *
+ * uploadLargeFile runs are limited to 256 MB of file data in flight, so
+ * the larger chunk sizes skip the higher concurrency levels.
+ *
+ * Usage: TransferBench [--seconds=2] [--concurrency=1,2,4,8,16]
+ *                      [--latency-ms=0] [--size-mb=4] [--large-mb=16]
+ *                      [--chunks-mb=1,4,16,64] [--range-kb=256]
+ *                      [--list-size=1000] [--json=FILE] [--csv=FILE]
+ */
+
+#include "DropboxApi2.h"
+#include "test/MockDropboxServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace dropbox;
+
+typedef chrono::steady_clock Clock;
+
+static const size_t MB = 1024 * 1024;
+static const size_t MAX_LARGE_IN_FLIGHT = 256 * MB;
+
+struct Result {
+  string    case_;
+  size_t    chunkSize_;
+  size_t    concurrency_;
+  double    seconds_;
+  uint64_t  ops_;
+  uint64_t  bytes_;
+  uint64_t  errors_;
+  double    p50_;
+  double    p99_;
+};
+
+// One operation; returns the bytes transferred, or -1 on failure
+typedef function<int64_t(size_t thread, uint64_t n)> Operation;
+
+static Result run(const string& name,
+    size_t chunkSize,
+    size_t concurrency,
+    double seconds,
+    Operation op) {
+  atomic<bool> stop(false);
+  vector<uint64_t> ops(concurrency, 0), bytes(concurrency, 0);
+  vector<uint64_t> errors(concurrency, 0);
+  vector<vector<double> > latencies(concurrency);
+
+  Clock::time_point start = Clock::now();
+
+  vector<thread> threads;
+  for (size_t t = 0; t < concurrency; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (uint64_t n = 0; !stop.load(memory_order_relaxed); ++n) {
+        Clock::time_point begin = Clock::now();
+
+        int64_t size;
+        try {
+          size = op(t, n);
+        } catch (exception& e) {
+          size = -1;
+        }
+
+        if (size < 0) {
+          ++errors[t];
+          continue;
+        }
+
+        latencies[t].push_back(chrono::duration<double, milli>(
+          Clock::now() - begin).count());
+        ++ops[t];
+        bytes[t] += size;
+      }
+    }));
+  }
+
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop.store(true);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  Result r;
+  r.case_ = name;
+  r.chunkSize_ = chunkSize;
+  r.concurrency_ = concurrency;
+  r.seconds_ = chrono::duration<double>(Clock::now() - start).count();
+  r.ops_ = r.bytes_ = r.errors_ = 0;
+
+  vector<double> all;
+  for (size_t t = 0; t < concurrency; ++t) {
+    r.ops_ += ops[t];
+    r.bytes_ += bytes[t];
+    r.errors_ += errors[t];
+    all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+  }
+
+  sort(all.begin(), all.end());
+  r.p50_ = all.empty() ? 0 : all[(all.size() - 1) / 2];
+  r.p99_ = all.empty() ? 0 : all[(all.size() - 1) * 99 / 100];
+
+  printf("%-15s %6zu %6zu %10.1f %10.1f %9.2f %9.2f %7llu\n",
+    r.case_.c_str(), r.chunkSize_ / MB, r.concurrency_,
+    r.ops_ / r.seconds_, r.bytes_ / r.seconds_ / MB, r.p50_, r.p99_,
+    (unsigned long long)r.errors_);
+  fflush(stdout);
+
+  return r;
+}
+
+static vector<size_t> parseList(const string& s) {
+  vector<size_t> out;
+  stringstream ss(s);
+  string item;
+
+  while (getline(ss, item, ',')) {
+    out.push_back(strtoul(item.c_str(), NULL, 10));
+  }
+
+  return out;
+}
+
+static void writeJson(const string& path,
+    const map<string, string>& options,
+    const vector<Result>& results) {
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f) {
+    perror(path.c_str());
+    return;
+  }
+
+  fprintf(f, "{\n  \"benchmark\": \"TransferBench\",\n");
+  fprintf(f, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+  fprintf(f, "  \"options\": {");
+  for (auto i = options.begin(); i != options.end(); ++i) {
+    fprintf(f, "%s\"%s\": \"%s\"", i == options.begin() ? "" : ", ",
+      i->first.c_str(), i->second.c_str());
+  }
+  fprintf(f, "},\n  \"results\": [\n");
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(f, "    {\"case\": \"%s\", \"chunk_bytes\": %zu, "
+      "\"concurrency\": %zu, \"seconds\": %.3f, \"requests\": %llu, "
+      "\"bytes\": %llu, \"errors\": %llu, \"requests_per_sec\": %.2f, "
+      "\"mb_per_sec\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+      r.case_.c_str(), r.chunkSize_, r.concurrency_, r.seconds_,
+      (unsigned long long)r.ops_, (unsigned long long)r.bytes_,
+      (unsigned long long)r.errors_, r.ops_ / r.seconds_,
+      r.bytes_ / r.seconds_ / MB, r.p50_, r.p99_,
+      i + 1 < results.size() ? "," : "");
+  }
+
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static void writeCsv(const string& path, const vector<Result>& results) {
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f) {
+    perror(path.c_str());
+    return;
+  }
+
+  fprintf(f, "case,chunk_bytes,concurrency,seconds,requests,bytes,errors,"
+    "requests_per_sec,mb_per_sec,p50_ms,p99_ms\n");
+
+  for (auto& r : results) {
+    fprintf(f, "%s,%zu,%zu,%.3f,%llu,%llu,%llu,%.2f,%.3f,%.3f,%.3f\n",
+      r.case_.c_str(), r.chunkSize_, r.concurrency_, r.seconds_,
+      (unsigned long long)r.ops_, (unsigned long long)r.bytes_,
+      (unsigned long long)r.errors_, r.ops_ / r.seconds_,
+      r.bytes_ / r.seconds_ / MB, r.p50_, r.p99_);
+  }
+
+  fclose(f);
+}
+
+int main(int argc, char** argv) {
+  map<string, string> options;
+  options["seconds"] = "2";
+  options["concurrency"] = "1,2,4,8,16";
+  options["latency-ms"] = "0";
+  options["size-mb"] = "4";
+  options["large-mb"] = "16";
+  options["chunks-mb"] = "1,4,16,64";
+  options["range-kb"] = "256";
+  options["list-size"] = "1000";
+
+  string json, csv;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+
+    if (arg.compare(0, 2, "--") || eq == string::npos) {
+      fprintf(stderr, "Bad argument %s\n", argv[i]);
+      return 1;
+    }
+
+    string key = arg.substr(2, eq - 2);
+    string value = arg.substr(eq + 1);
+
+    if (key == "json") {
+      json = value;
+    } else if (key == "csv") {
+      csv = value;
+    } else if (options.count(key)) {
+      options[key] = value;
+    } else {
+      fprintf(stderr, "Unknown option --%s\n", key.c_str());
+      return 1;
+    }
+  }
+
+  double seconds = atof(options["seconds"].c_str());
+  vector<size_t> levels = parseList(options["concurrency"]);
+  vector<size_t> chunks = parseList(options["chunks-mb"]);
+  size_t size = strtoul(options["size-mb"].c_str(), NULL, 10) * MB;
+  size_t largeSize = strtoul(options["large-mb"].c_str(), NULL, 10) * MB;
+  size_t rangeSize = strtoul(options["range-kb"].c_str(), NULL, 10) * 1024;
+  size_t listSize = strtoul(options["list-size"].c_str(), NULL, 10);
+
+  MockDropboxServer server;
+  server.install();
+  server.setRevisionLimit(1);
+
+  DropboxApi2 api("bench-key", "bench-secret");
+  api.setAccessToken("bench-token");
+
+  // Enough data for the largest upload; its content does not matter
+  size_t maxSize = size;
+  for (size_t c : chunks) {
+    maxSize = max(maxSize, max(largeSize, c * MB));
+  }
+  vector<uint8_t> data(maxSize);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (uint8_t)(i * 2654435761U >> 24);
+  }
+
+  // Fixtures for the download and listing cases
+  DropboxMetadata m;
+  DropboxUploadFileRequest fixture("/bench/download");
+  fixture.setUploadData(data.data(), size);
+  if (api.uploadFile(fixture, m) != SUCCESS) {
+    fprintf(stderr, "Could not upload the download fixture\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < listSize; ++i) {
+    stringstream path;
+    path << "/bench/list/file-" << i;
+
+    DropboxUploadFileRequest req(path.str());
+    req.setUploadData(data.data(), 1024);
+    api.uploadFile(req, m);
+  }
+
+  server.setLatency(chrono::milliseconds(
+    atoi(options["latency-ms"].c_str())));
+
+  printf("%-15s %6s %6s %10s %10s %9s %9s %7s\n", "case", "chunk", "conc",
+    "req/s", "MB/s", "p50 ms", "p99 ms", "errors");
+
+  vector<Result> results;
+
+  for (size_t c : levels) {
+    results.push_back(run("upload", 0, c, seconds,
+      [&](size_t t, uint64_t) -> int64_t {
+        stringstream path;
+        path << "/bench/upload/" << t;
+
+        DropboxUploadFileRequest req(path.str());
+        req.setUploadData(data.data(), size);
+
+        DropboxMetadata m;
+        return api.uploadFile(req, m) == SUCCESS ? size : -1;
+      }));
+  }
+
+  for (size_t chunk : chunks) {
+    size_t chunkSize = chunk * MB;
+    size_t fileSize = max(largeSize, chunkSize);
+
+    for (size_t c : levels) {
+      if (c > 1 && c * fileSize > MAX_LARGE_IN_FLIGHT) {
+        continue;
+      }
+
+      results.push_back(run("upload_large", chunkSize, c, seconds,
+        [&](size_t t, uint64_t) -> int64_t {
+          stringstream path;
+          path << "/bench/upload_large/" << t;
+
+          auto cb = [&](uint8_t* buf, size_t offset, size_t len) {
+            size_t n = offset < fileSize ? min(len, fileSize - offset) : 0;
+            memcpy(buf, data.data() + offset, n);
+            return n;
+          };
+
+          DropboxUploadLargeFileRequest req(path.str(), cb, true, "",
+            chunkSize, 0);
+
+          DropboxMetadata m;
+          return api.uploadLargeFile(req, m) == SUCCESS ? fileSize : -1;
+        }));
+    }
+  }
+
+  for (size_t c : levels) {
+    results.push_back(run("download", 0, c, seconds,
+      [&](size_t, uint64_t) -> int64_t {
+        DropboxGetFileRequest req("/bench/download");
+        DropboxGetFileResponse res;
+
+        if (api.getFile(req, res) != SUCCESS) {
+          return -1;
+        }
+        return res.getDataLength();
+      }));
+  }
+
+  for (size_t c : levels) {
+    results.push_back(run("download_range", 0, c, seconds,
+      [&](size_t t, uint64_t n) -> int64_t {
+        // Spread the reads over the file, differently on each thread
+        uint64_t x = (n + 1) * 6364136223846793005ULL + t;
+        uint64_t offset = (x >> 33) % (size - min(size, rangeSize) + 1);
+
+        DropboxGetFileRequest req("/bench/download");
+        req.setRange(offset, min(size, rangeSize));
+        DropboxGetFileResponse res;
+
+        if (api.getFile(req, res) != PARTIAL_CONTENT) {
+          return -1;
+        }
+        return res.getDataLength();
+      }));
+  }
+
+  for (size_t c : levels) {
+    results.push_back(run("list", 0, c, seconds,
+      [&](size_t, uint64_t) -> int64_t {
+        DropboxMetadataRequest req("/bench/list", true);
+        req.setLimit(listSize);
+        DropboxMetadataResponse res;
+
+        if (api.getFileMetadata(req, res) != SUCCESS ||
+            res.getChildren().size() != listSize) {
+          return -1;
+        }
+        return 0;
+      }));
+  }
+
+  if (!json.empty()) {
+    writeJson(json, options, results);
+  }
+
+  if (!csv.empty()) {
+    writeCsv(csv, results);
+  }
+
+  return 0;
+}
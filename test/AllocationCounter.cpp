@@ -0,0 +1,100 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "AllocationCounter.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace dropbox;
+using namespace std;
+
+// Plain integers, so that reading them never allocates
+static thread_local uint64_t threadAllocations = 0;
+static thread_local uint64_t threadBytes = 0;
+
+static void* allocate(size_t size) {
+  ++threadAllocations;
+  threadBytes += size;
+
+  while (true) {
+    void* p = malloc(size ? size : 1);
+    if (p) {
+      return p;
+    }
+
+    new_handler handler = get_new_handler();
+    if (!handler) {
+      throw bad_alloc();
+    }
+    handler();
+  }
+}
+
+void* operator new(size_t size) {
+  return allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return allocate(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+AllocationCounter::AllocationCounter() {
+  reset();
+}
+
+uint64_t AllocationCounter::getAllocations() const {
+  return threadAllocations - allocations_;
+}
+
+uint64_t AllocationCounter::getBytes() const {
+  return threadBytes - bytes_;
+}
+
+void AllocationCounter::reset() {
+  allocations_ = threadAllocations;
+  bytes_ = threadBytes;
+}
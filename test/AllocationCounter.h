@@ -0,0 +1,62 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __ALLOCATION_COUNTER_H__
+#define __ALLOCATION_COUNTER_H__
+
+/**
+ * Counts the allocations made through operator new by the calling thread.
+ * Linking AllocationCounter.o replaces the global operator new and delete,
+ * so it belongs in test and benchmark builds only. Allocations made with
+ * malloc directly, e.g. by curl, are not counted.
+ *
+ *   AllocationCounter c;
+ *   res.readJson(json);
+ *   EXPECT_GE(budget, c.getAllocations());
+ */
+
+#include <cstdint>
+
+namespace dropbox {
+
+class AllocationCounter {
+public:
+  /**
+   * Start counting the allocations of the calling thread
+   */
+  AllocationCounter();
+
+  /**
+   * @return  Allocations made by this thread since construction or reset
+   */
+  uint64_t getAllocations() const;
+
+  /**
+   * @return  Bytes requested by this thread since construction or reset
+   */
+  uint64_t getBytes() const;
+
+  /**
+   * Start counting again from zero
+   *
+   * @return  void
+   */
+  void reset();
+
+private:
+  uint64_t          allocations_;
+  uint64_t          bytes_;
+};
+}
+#endif
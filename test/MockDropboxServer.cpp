@@ -0,0 +1,1446 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "MockDropboxServer.h"
+
+#include "DropboxJson.h"
+#include "util/HttpRequestFactory.h"
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace dropbox;
+using namespace http;
+using namespace std;
+
+using namespace boost::property_tree;
+
+const char* const MockDropboxServer::ACCOUNT_EMAIL = "mock@example.com";
+
+// Hosts the clients talk to
+static const char* const DROPBOX_HOSTS[] = {
+  "https://api.dropbox.com",
+  "https://api-content.dropbox.com",
+  "https://api.dropboxapi.com",
+  "https://content.dropboxapi.com",
+};
+
+static const size_t DEFAULT_FILE_LIMIT = 10000;
+static const size_t DEFAULT_SEARCH_LIMIT = 1000;
+static const size_t DEFAULT_REV_LIMIT = 10;
+static const size_t MAX_BATCH_ENTRIES = 1000;
+
+static string lower(const string& s) {
+  string out = s;
+  transform(out.begin(), out.end(), out.begin(), ::tolower);
+  return out;
+}
+
+// Collapse redundant slashes; the root is "/"
+static string normalize(const string& path) {
+  string out = "/";
+  for (char c : path) {
+    if (c != '/' || out[out.size() - 1] != '/') {
+      out += c;
+    }
+  }
+
+  if (out.size() > 1 && out[out.size() - 1] == '/') {
+    out.erase(out.size() - 1);
+  }
+
+  return out;
+}
+
+static string parentOf(const string& path) {
+  size_t slash = path.rfind('/');
+  return slash ? path.substr(0, slash) : "/";
+}
+
+static string nameOf(const string& path) {
+  return path.substr(path.rfind('/') + 1);
+}
+
+static string decode(const string& s) {
+  string out;
+  out.reserve(s.size());
+
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) &&
+        isxdigit(s[i + 2])) {
+      out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+
+  return out;
+}
+
+static void parseForm(const string& s, map<string, string>& params) {
+  stringstream ss(s);
+  string pair;
+
+  while (getline(ss, pair, '&')) {
+    size_t eq = pair.find('=');
+    if (eq == string::npos) {
+      params[decode(pair)] = "";
+    } else {
+      params[decode(pair.substr(0, eq))] = decode(pair.substr(eq + 1));
+    }
+  }
+}
+
+static string httpDate(time_t t) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+
+  char buf[64];
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+  return buf;
+}
+
+static string isoDate(time_t t) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+
+  char buf[64];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  return buf;
+}
+
+static const char* reason(int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 406: return "Not Acceptable";
+    case 409: return "Conflict";
+    case 416: return "Requested Range Not Satisfiable";
+    default:  return "Internal Server Error";
+  }
+}
+
+static bool sendAll(int fd, const char* data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+
+    data += n;
+    size -= n;
+  }
+
+  return true;
+}
+
+static bool fill(int fd, string& buf) {
+  char chunk[64 * 1024];
+
+  while (true) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+
+    buf.append(chunk, n);
+    return true;
+  }
+}
+
+static string error(const string& message) {
+  return "{\"error\": " + jsonQuote(message) + "}";
+}
+
+string MockDropboxServer::Request::param(const string& name,
+    const string& def) const {
+  auto i = params_.find(name);
+  return i == params_.end() ? def : i->second;
+}
+
+string MockDropboxServer::Request::header(const string& name) const {
+  auto i = headers_.find(name);
+  return i == headers_.end() ? "" : i->second;
+}
+
+MockDropboxServer::MockDropboxServer() :
+    listenFd_(-1),
+    port_(0),
+    installed_(false),
+    stopped_(false),
+    latency_(0),
+    requests_(0),
+    batchJobPolls_(0),
+    failBatchJobs_(false),
+    failures_(0),
+    failureStatus_(0),
+    drops_(0),
+    delays_(0),
+    delay_(0),
+    corruptFileMetadata_(false),
+    tokens_(0),
+    tokenLifetime_(14400),
+    revisionLimit_(0),
+    revCounter_(0x1000),
+    idCounter_(0) {
+  listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenFd_ < 0) {
+    throw runtime_error("socket() failed");
+  }
+
+  int one = 1;
+  setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  socklen_t len = sizeof(addr);
+  if (bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listenFd_, 128) ||
+      getsockname(listenFd_, (struct sockaddr*)&addr, &len)) {
+    close(listenFd_);
+    throw runtime_error("Could not listen on the loopback interface");
+  }
+  port_ = ntohs(addr.sin_port);
+
+  Entry& root = entries_["/"];
+  root.path_ = "/";
+  root.isDir_ = true;
+  root.deleted_ = false;
+  root.revisions_.push_back(Revision());
+  root.revisions_.back().rev_ = nextRev();
+  root.revisions_.back().deleted_ = false;
+  root.revisions_.back().modified_ = time(NULL);
+
+  acceptor_ = thread(&MockDropboxServer::acceptLoop, this);
+}
+
+MockDropboxServer::~MockDropboxServer() {
+  stopped_ = true;
+
+  // Wakes up accept()
+  shutdown(listenFd_, SHUT_RDWR);
+  acceptor_.join();
+  close(listenFd_);
+
+  {
+    lock_guard<mutex> g(connLock_);
+    for (int fd : connections_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+
+  for (auto& t : workers_) {
+    t.join();
+  }
+
+  if (installed_) {
+    HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+    for (const char* host : DROPBOX_HOSTS) {
+      factory->setBaseUrl(host, "");
+    }
+  }
+}
+
+string MockDropboxServer::getBaseUrl() const {
+  stringstream ss;
+  ss << "http://127.0.0.1:" << port_;
+  return ss.str();
+}
+
+void MockDropboxServer::install() {
+  HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+  for (const char* host : DROPBOX_HOSTS) {
+    factory->setBaseUrl(host, getBaseUrl());
+  }
+
+  installed_ = true;
+}
+
+void MockDropboxServer::setLatency(chrono::microseconds latency) {
+  latency_.store(latency.count());
+}
+
+void MockDropboxServer::setRevisionLimit(size_t limit) {
+  lock_guard<mutex> g(lock_);
+  revisionLimit_ = limit;
+}
+
+void MockDropboxServer::setBatchJobPolls(size_t polls) {
+  lock_guard<mutex> g(lock_);
+  batchJobPolls_ = polls;
+}
+
+void MockDropboxServer::failBatchJobs(bool fail) {
+  lock_guard<mutex> g(lock_);
+  failBatchJobs_ = fail;
+}
+
+void MockDropboxServer::failRequests(size_t count, int status) {
+  lock_guard<mutex> g(lock_);
+  failures_ = count;
+  failureStatus_ = status;
+}
+
+void MockDropboxServer::dropRequests(size_t count) {
+  lock_guard<mutex> g(lock_);
+  drops_ = count;
+}
+
+void MockDropboxServer::delayRequests(size_t count,
+    chrono::microseconds delay) {
+  lock_guard<mutex> g(lock_);
+  delays_ = count;
+  delay_ = delay;
+}
+
+void MockDropboxServer::setRejectedToken(const string& token) {
+  lock_guard<mutex> g(lock_);
+  rejectedHeader_ = token.empty() ? "" : "Bearer " + token;
+}
+
+void MockDropboxServer::setTokenLifetime(long seconds) {
+  lock_guard<mutex> g(lock_);
+  tokenLifetime_ = seconds;
+}
+
+void MockDropboxServer::setCorruptFileMetadata(bool corrupt) {
+  lock_guard<mutex> g(lock_);
+  corruptFileMetadata_ = corrupt;
+}
+
+uint64_t MockDropboxServer::getRequestCount() const {
+  return requests_.load();
+}
+
+uint64_t MockDropboxServer::getTokenCount() {
+  lock_guard<mutex> g(lock_);
+  return tokens_;
+}
+
+void MockDropboxServer::acceptLoop() {
+  while (!stopped_) {
+    int fd = accept(listenFd_, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    lock_guard<mutex> g(connLock_);
+    if (stopped_) {
+      close(fd);
+      return;
+    }
+
+    connections_.insert(fd);
+    workers_.push_back(thread(&MockDropboxServer::serve, this, fd));
+  }
+}
+
+void MockDropboxServer::serve(int fd) {
+  string buf;
+
+  while (!stopped_) {
+    Request req;
+    if (!readRequest(fd, buf, req)) {
+      break;
+    }
+
+    Response res = handle(req);
+
+    if (res.drop_) {
+      // Promise a body that never comes
+      string s = "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n";
+      sendAll(fd, s.data(), s.size());
+      break;
+    }
+
+    stringstream head;
+    head << "HTTP/1.1 " << res.status_ << " " << reason(res.status_)
+      << "\r\nContent-Length: " << res.body_.size() << "\r\n";
+    for (auto& h : res.headers_) {
+      head << h.first << ": " << h.second << "\r\n";
+    }
+    head << "\r\n";
+
+    string s = head.str();
+    if (!sendAll(fd, s.data(), s.size()) ||
+        !sendAll(fd, res.body_.data(), res.body_.size())) {
+      break;
+    }
+
+    if (lower(req.header("connection")) == "close") {
+      break;
+    }
+  }
+
+  // Under the lock, so that the destructor never shuts down a reused fd
+  lock_guard<mutex> g(connLock_);
+  connections_.erase(fd);
+  close(fd);
+}
+
+bool MockDropboxServer::readRequest(int fd, string& buf, Request& req) {
+  size_t end;
+  while ((end = buf.find("\r\n\r\n")) == string::npos) {
+    if (!fill(fd, buf)) {
+      return false;
+    }
+  }
+
+  stringstream head(buf.substr(0, end));
+  buf.erase(0, end + 4);
+
+  string line;
+  getline(head, line);
+
+  string target, version;
+  stringstream first(line);
+  first >> req.method_ >> target >> version;
+
+  while (getline(head, line)) {
+    size_t colon = line.find(':');
+    if (colon == string::npos) {
+      continue;
+    }
+
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    size_t stop = line.find_last_not_of(" \t\r");
+    req.headers_[lower(line.substr(0, colon))] = start == string::npos ?
+      "" : line.substr(start, stop - start + 1);
+  }
+
+  size_t query = target.find('?');
+  req.path_ = decode(target.substr(0, query));
+  if (query != string::npos) {
+    parseForm(target.substr(query + 1), req.params_);
+  }
+
+  if (lower(req.header("expect")) == "100-continue") {
+    static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!sendAll(fd, cont, sizeof(cont) - 1)) {
+      return false;
+    }
+  }
+
+  if (lower(req.header("transfer-encoding")) == "chunked") {
+    while (true) {
+      while ((end = buf.find("\r\n")) == string::npos) {
+        if (!fill(fd, buf)) {
+          return false;
+        }
+      }
+
+      size_t size = strtoul(buf.substr(0, end).c_str(), NULL, 16);
+      buf.erase(0, end + 2);
+
+      while (buf.size() < size + 2) {
+        if (!fill(fd, buf)) {
+          return false;
+        }
+      }
+
+      req.body_.append(buf, 0, size);
+      buf.erase(0, size + 2);
+
+      if (!size) {
+        break;
+      }
+    }
+  } else {
+    size_t size = strtoul(req.header("content-length").c_str(), NULL, 10);
+    while (buf.size() < size) {
+      if (!fill(fd, buf)) {
+        return false;
+      }
+    }
+
+    req.body_ = buf.substr(0, size);
+    buf.erase(0, size);
+  }
+
+  string type = lower(req.header("content-type"));
+  if (req.method_ == "POST" &&
+      type.find("application/x-www-form-urlencoded") == 0) {
+    parseForm(req.body_, req.params_);
+  }
+
+  return true;
+}
+
+MockDropboxServer::Response MockDropboxServer::handle(const Request& req) {
+  ++requests_;
+
+  Response res;
+  const string& p = req.path_;
+
+  // Requests fail in the order they arrive, not the order they finish
+  int failure = 0;
+  chrono::microseconds delay(latency_.load());
+  if (p != "/oauth2/token" && p != "/1/oauth2/token") {
+    lock_guard<mutex> g(lock_);
+    if (failures_) {
+      --failures_;
+      failure = failureStatus_;
+    }
+    if (drops_) {
+      --drops_;
+      res.drop_ = true;
+    }
+    if (delays_) {
+      --delays_;
+      delay += delay_;
+    }
+  }
+
+  if (delay.count() > 0) {
+    this_thread::sleep_for(delay);
+  }
+
+  if (res.drop_) {
+    return res;
+  }
+
+  if (failure) {
+    res.status_ = failure;
+    res.headers_["Retry-After"] = "0";
+    res.body_ = error("Injected failure");
+    return res;
+  }
+
+  if (p == "/oauth2/token" || p == "/1/oauth2/token") {
+    lock_guard<mutex> g(lock_);
+    ++tokens_;
+
+    stringstream ss;
+    ss << "{\"access_token\": \"mock-token-" << ++idCounter_
+      << "\", \"token_type\": \"bearer\", \"expires_in\": "
+      << tokenLifetime_;
+    if (req.param("grant_type") == "authorization_code") {
+      ss << ", \"refresh_token\": \"mock-refresh\"";
+    }
+    ss << "}";
+
+    res.body_ = ss.str();
+    return res;
+  }
+
+  if (req.header("authorization").empty()) {
+    res.status_ = 401;
+    res.body_ = error("No auth method found");
+    return res;
+  }
+
+  {
+    lock_guard<mutex> g(lock_);
+    if (!rejectedHeader_.empty() &&
+        req.header("authorization") == rejectedHeader_) {
+      res.status_ = 401;
+      res.body_ = error("expired_access_token");
+      return res;
+    }
+  }
+
+  if (p == "/1/account/info" || p == "/2/users/get_account") {
+    res.body_ = string("{\"account_id\": \"dbid:mock\", \"name\": {") +
+      "\"given_name\": \"Mock\", \"surname\": \"User\", " +
+      "\"familiar_name\": \"Mock\", \"display_name\": \"Mock User\", " +
+      "\"abbreviated_name\": \"MU\"}, \"email\": " +
+      jsonQuote(ACCOUNT_EMAIL) + ", \"email_verified\": true, " +
+      "\"disabled\": false, \"is_teammate\": false, \"locale\": \"en\", " +
+      "\"country\": \"US\"}";
+    return res;
+  }
+
+  lock_guard<mutex> g(lock_);
+
+  if (p == "/1/chunked_upload") {
+    return chunkedUpload(req);
+  }
+
+  static const string fileops = "/1/fileops/";
+  if (!p.compare(0, fileops.size(), fileops)) {
+    return fileOp(req, p.substr(fileops.size()));
+  }
+
+  static const string session = "/2/files/upload_session/";
+  if (!p.compare(0, session.size(), session)) {
+    return uploadSession(req, p.substr(session.size()));
+  }
+
+  static const string files = "/2/files/";
+  if (!p.compare(0, files.size(), files)) {
+    return fileBatch(req, p.substr(files.size()));
+  }
+
+  // The remaining endpoints take /<root>/<path> after their name
+  typedef Response (MockDropboxServer::*Endpoint)(const Request&,
+    const string&);
+  static const pair<string, Endpoint> rooted[] = {
+    make_pair("/1/metadata/", &MockDropboxServer::metadata),
+    make_pair("/1/files/", &MockDropboxServer::getFile),
+    make_pair("/1/files_put/", &MockDropboxServer::putFile),
+    make_pair("/1/commit_chunked_upload/",
+      &MockDropboxServer::commitChunkedUpload),
+    make_pair("/1/search/", &MockDropboxServer::search),
+    make_pair("/1/revisions/", &MockDropboxServer::revisions),
+    make_pair("/1/restore/", &MockDropboxServer::restore),
+  };
+
+  for (auto& e : rooted) {
+    if (p.compare(0, e.first.size(), e.first)) {
+      continue;
+    }
+
+    string rest = p.substr(e.first.size());
+    size_t slash = rest.find('/');
+    string path = normalize(slash == string::npos ? "" : rest.substr(slash));
+
+    return (this->*e.second)(req, path);
+  }
+
+  res.status_ = 404;
+  res.body_ = error("Unknown endpoint " + p);
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::metadata(const Request& req,
+    const string& path) {
+  Response res;
+  bool includeDeleted = req.param("include_deleted") == "true";
+
+  Entry* e = find(path, includeDeleted);
+  if (!e) {
+    res.status_ = 404;
+    res.body_ = error("Path '" + path + "' not found");
+    return res;
+  }
+
+  const Revision* r = NULL;
+  string rev = req.param("rev");
+  for (auto& v : e->revisions_) {
+    if (v.rev_ == rev) {
+      r = &v;
+    }
+  }
+
+  if (!rev.empty() && !r) {
+    res.status_ = 404;
+    res.body_ = error("Revision '" + rev + "' not found");
+    return res;
+  }
+
+  if (!e->isDir_ || req.param("list", "true") != "true") {
+    res.body_ = metadataJson(*e, r);
+    return res;
+  }
+
+  string hash = folderHash(path);
+  if (req.param("hash") == hash) {
+    res.status_ = 304;
+    return res;
+  }
+
+  vector<Entry*> kids = children(path, false);
+  size_t limit = strtoul(req.param("file_limit", "0").c_str(), NULL, 10);
+
+  stringstream contents;
+  size_t count = 0;
+  for (Entry* c : kids) {
+    if (c->deleted_ && !includeDeleted) {
+      continue;
+    }
+
+    contents << (count++ ? ", " : "") << metadataJson(*c);
+  }
+
+  if (count > (limit ? limit : DEFAULT_FILE_LIMIT)) {
+    res.status_ = 406;
+    res.body_ = error("Too many entries to list");
+    return res;
+  }
+
+  string m = metadataJson(*e);
+  m.erase(m.size() - 1);
+
+  res.body_ = m + ", \"hash\": " + jsonQuote(hash) + ", \"contents\": [" +
+    contents.str() + "]}";
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::getFile(const Request& req,
+    const string& path) {
+  Response res;
+
+  Entry* e = find(path);
+  if (!e || e->isDir_) {
+    res.status_ = 404;
+    res.body_ = error("File '" + path + "' not found");
+    return res;
+  }
+
+  const Revision* r = &e->revisions_.back();
+  string rev = req.param("rev");
+  if (!rev.empty()) {
+    r = NULL;
+    for (auto& v : e->revisions_) {
+      if (v.rev_ == rev && !v.deleted_) {
+        r = &v;
+      }
+    }
+
+    if (!r) {
+      res.status_ = 404;
+      res.body_ = error("Revision '" + rev + "' not found");
+      return res;
+    }
+  }
+
+  const string& data = *r->data_;
+  res.headers_["x-dropbox-metadata"] = corruptFileMetadata_ ?
+    "{\"size\": " : metadataJson(*e, r);
+
+  string range = req.header("range");
+  if (range.compare(0, 6, "bytes=")) {
+    res.body_ = data;
+    return res;
+  }
+
+  size_t dash = range.find('-');
+  size_t first = strtoull(range.substr(6, dash - 6).c_str(), NULL, 10);
+  size_t last = data.size() - 1;
+  if (dash != string::npos && dash + 1 < range.size()) {
+    last = min(last,
+      (size_t)strtoull(range.substr(dash + 1).c_str(), NULL, 10));
+  }
+
+  if (first >= data.size() || first > last) {
+    res.status_ = 416;
+    return res;
+  }
+
+  stringstream ss;
+  ss << "bytes " << first << "-" << last << "/" << data.size();
+
+  res.status_ = 206;
+  res.headers_["Content-Range"] = ss.str();
+  res.body_ = data.substr(first, last - first + 1);
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::putFile(const Request& req,
+    const string& path) {
+  Response res;
+
+  shared_ptr<const string> data(new string(req.body_));
+  Entry& e = write(path, data, req.param("overwrite", "true") == "true",
+    req.param("parent_rev"));
+
+  res.body_ = metadataJson(e);
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::chunkedUpload(
+    const Request& req) {
+  Response res;
+
+  string id = req.param("upload_id");
+  if (id.empty()) {
+    stringstream ss;
+    ss << "mock-upload-" << ++idCounter_;
+    id = ss.str();
+    uploads_[id] = "";
+  }
+
+  auto i = uploads_.find(id);
+  if (i == uploads_.end()) {
+    res.status_ = 404;
+    res.body_ = error("Unknown upload_id");
+    return res;
+  }
+
+  size_t offset = strtoull(req.param("offset", "0").c_str(), NULL, 10);
+  if (offset == i->second.size()) {
+    i->second += req.body_;
+  } else {
+    res.status_ = 400;
+  }
+
+  stringstream ss;
+  ss << "{\"upload_id\": " << jsonQuote(id) << ", \"offset\": "
+    << i->second.size() << ", \"expires\": "
+    << jsonQuote(httpDate(time(NULL) + 24 * 3600)) << "}";
+
+  res.body_ = ss.str();
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::commitChunkedUpload(
+    const Request& req,
+    const string& path) {
+  Response res;
+
+  auto i = uploads_.find(req.param("upload_id"));
+  if (i == uploads_.end()) {
+    res.status_ = 400;
+    res.body_ = error("Unknown upload_id");
+    return res;
+  }
+
+  shared_ptr<string> data(new string());
+  data->swap(i->second);
+  uploads_.erase(i);
+
+  Entry& e = write(path, data, req.param("overwrite", "true") == "true",
+    req.param("parent_rev"));
+
+  res.body_ = metadataJson(e);
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::fileOp(const Request& req,
+    const string& op) {
+  Response res;
+
+  if (op == "create_folder") {
+    string path = normalize(req.param("path"));
+    if (find(path)) {
+      res.status_ = 403;
+      res.body_ = error("A file or folder already exists at " + path);
+      return res;
+    }
+
+    res.body_ = metadataJson(makeFolder(path));
+    return res;
+  }
+
+  if (op == "delete") {
+    string path = normalize(req.param("path"));
+    Entry* e = find(path);
+    if (!e) {
+      res.status_ = 404;
+      res.body_ = error("Path '" + path + "' not found");
+      return res;
+    }
+
+    remove(*e);
+    res.body_ = metadataJson(*e);
+    return res;
+  }
+
+  if (op == "copy" || op == "move") {
+    string from = normalize(req.param("from_path"));
+    string to = normalize(req.param("to_path"));
+
+    Entry* src = find(from);
+    if (!src) {
+      res.status_ = 404;
+      res.body_ = error("Path '" + from + "' not found");
+      return res;
+    }
+
+    if (find(to)) {
+      res.status_ = 403;
+      res.body_ = error("A file or folder already exists at " + to);
+      return res;
+    }
+
+    copy(*src, to);
+    if (op == "move") {
+      remove(*src);
+    }
+
+    res.body_ = metadataJson(*find(to));
+    return res;
+  }
+
+  res.status_ = 404;
+  res.body_ = error("Unknown file operation " + op);
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::search(const Request& req,
+    const string& path) {
+  Response res;
+  bool includeDeleted = req.param("include_deleted") == "true";
+  size_t limit = strtoul(req.param("file_limit", "0").c_str(), NULL, 10);
+
+  vector<string> words;
+  stringstream query(lower(req.param("query")));
+  string word;
+  while (query >> word) {
+    words.push_back(word);
+  }
+
+  stringstream ss;
+  size_t count = 0;
+
+  for (Entry* e : children(path, true)) {
+    if (count >= (limit ? limit : DEFAULT_SEARCH_LIMIT)) {
+      break;
+    }
+
+    if (e->deleted_ && !includeDeleted) {
+      continue;
+    }
+
+    string name = lower(nameOf(e->path_));
+    bool match = !words.empty();
+    for (auto& w : words) {
+      match = match && name.find(w) != string::npos;
+    }
+
+    if (match) {
+      ss << (count++ ? ", " : "") << metadataJson(*e);
+    }
+  }
+
+  res.body_ = "[" + ss.str() + "]";
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::revisions(const Request& req,
+    const string& path) {
+  Response res;
+
+  Entry* e = find(path, true);
+  if (!e || e->isDir_) {
+    res.status_ = 404;
+    res.body_ = error("File '" + path + "' not found");
+    return res;
+  }
+
+  size_t limit = strtoul(req.param("rev_limit", "0").c_str(), NULL, 10);
+  if (!limit) {
+    limit = DEFAULT_REV_LIMIT;
+  }
+
+  stringstream ss;
+  size_t count = 0;
+  for (auto i = e->revisions_.rbegin();
+      i != e->revisions_.rend() && count < limit; ++i) {
+    ss << (count++ ? ", " : "") << metadataJson(*e, &*i);
+  }
+
+  res.body_ = "[" + ss.str() + "]";
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::restore(const Request& req,
+    const string& path) {
+  Response res;
+
+  Entry* e = find(path, true);
+  string rev = req.param("rev");
+
+  shared_ptr<const string> data;
+  if (e && !e->isDir_) {
+    for (auto& v : e->revisions_) {
+      if (v.rev_ == rev && !v.deleted_) {
+        data = v.data_;
+      }
+    }
+  }
+
+  if (!data) {
+    res.status_ = 404;
+    res.body_ = error("Revision '" + rev + "' of '" + path + "' not found");
+    return res;
+  }
+
+  res.body_ = metadataJson(write(path, data, true, ""));
+  return res;
+}
+
+MockDropboxServer::Response MockDropboxServer::uploadSession(
+    const Request& req,
+    const string& op) {
+  Response res;
+  ptree arg;
+
+  try {
+    // Batches take their argument in the body
+    stringstream ss(!op.compare(0, 12, "finish_batch") ?
+      req.body_ : req.header("dropbox-api-arg"));
+    read_json(ss, arg);
+  } catch (exception& e) {
+    res.status_ = 400;
+    res.body_ = error(string("Bad argument: ") + e.what());
+    return res;
+  }
+
+  if (op == "start") {
+    stringstream id;
+    id << "mock-session-" << ++idCounter_;
+    uploads_[id.str()] = req.body_;
+
+    res.body_ = "{\"session_id\": " + jsonQuote(id.str()) + "}";
+    return res;
+  }
+
+  if (op == "append_v2" || op == "finish") {
+    string failure = appendSession(arg, req.body_);
+    if (!failure.empty()) {
+      res.status_ = 409;
+      res.body_ = "{\"error_summary\": \"lookup_failed/" + failure +
+        "/\"}";
+      return res;
+    }
+
+    res.body_ = op == "finish" ? finishSession(arg) : "null";
+    return res;
+  }
+
+  if (op == "finish_batch/check") {
+    return checkJob(arg);
+  }
+
+  // Committed right away; with batchJobPolls_ set, the result is only
+  // handed out by a job after that many checks
+  if (op == "finish_batch") {
+    stringstream ss;
+    size_t count = 0;
+
+    for (auto& v : arg.get_child("entries", ptree())) {
+      string failure = appendSession(v.second, "");
+
+      ss << (count++ ? ", " : "");
+      if (failure.empty()) {
+        string m = finishSession(v.second);
+        ss << "{\".tag\": \"success\", " << m.substr(m.find(',') + 2);
+      } else {
+        ss << "{\".tag\": \"failure\", \"failure\": {\".tag\": "
+          << "\"lookup_failed\", \"lookup_failed\": {\".tag\": "
+          << jsonQuote(failure) << "}}}";
+      }
+    }
+
+    res.body_ = "{\".tag\": \"complete\", \"entries\": [" + ss.str() + "]}";
+
+    if (batchJobPolls_) {
+      res.body_ = startJob(res.body_);
+    }
+    return res;
+  }
+
+  res.status_ = 404;
+  res.body_ = error("Unknown upload session operation " + op);
+  return res;
+}
+
+string MockDropboxServer::appendSession(const ptree& arg,
+    const string& data) {
+  ptree::path_type id("cursor/session_id", '/');
+  ptree::path_type offset("cursor/offset", '/');
+
+  auto i = uploads_.find(arg.get<string>(id, ""));
+  if (i == uploads_.end()) {
+    return "not_found";
+  }
+
+  if (arg.get<size_t>(offset, 0) != i->second.size()) {
+    return "incorrect_offset";
+  }
+
+  i->second += data;
+  return "";
+}
+
+string MockDropboxServer::finishSession(const ptree& arg) {
+  string path = normalize(arg.get<string>(
+    ptree::path_type("commit/path", '/'), ""));
+  string mode = arg.get<string>(ptree::path_type("commit/mode/.tag", '/'),
+    arg.get<string>(ptree::path_type("commit/mode", '/'), "add"));
+  string parentRev = arg.get<string>(
+    ptree::path_type("commit/mode/update", '/'), "");
+
+  auto i = uploads_.find(arg.get<string>(
+    ptree::path_type("cursor/session_id", '/'), ""));
+  shared_ptr<string> data(new string());
+  data->swap(i->second);
+  uploads_.erase(i);
+
+  return metadataJsonV2(write(path, data, mode != "add", parentRev));
+}
+
+MockDropboxServer::Response MockDropboxServer::fileBatch(const Request& req,
+    const string& op) {
+  Response res;
+  ptree arg;
+
+  try {
+    stringstream ss(req.body_);
+    read_json(ss, arg);
+  } catch (exception& e) {
+    res.status_ = 400;
+    res.body_ = error(string("Bad argument: ") + e.what());
+    return res;
+  }
+
+  if (op == "copy_batch/check_v2" || op == "move_batch/check_v2" ||
+      op == "delete_batch/check") {
+    return checkJob(arg);
+  }
+
+  bool isDelete = op == "delete_batch";
+  if (op != "copy_batch_v2" && op != "move_batch_v2" && !isDelete) {
+    res.status_ = 404;
+    res.body_ = error("Unknown file operation " + op);
+    return res;
+  }
+
+  const ptree& entries = arg.get_child("entries", ptree());
+  if (entries.size() > MAX_BATCH_ENTRIES) {
+    res.status_ = 400;
+    res.body_ = error("Too many entries in the batch");
+    return res;
+  }
+
+  if (failBatchJobs_) {
+    res.body_ = startJob("{\".tag\": \"failed\", \"failed\": {\".tag\": "
+      "\"too_many_write_operations\"}}");
+    return res;
+  }
+
+  // Applied right away, entry by entry; a failed entry doesn't stop the
+  // ones after it
+  stringstream ss;
+  size_t count = 0;
+
+  for (auto& v : entries) {
+    string failure;
+    string detail;
+    string m;
+
+    if (isDelete) {
+      Entry* e = find(normalize(v.second.get<string>("path", "")));
+      if (!e) {
+        failure = "path_lookup";
+        detail = "not_found";
+      } else {
+        m = metadataJsonV2(*e);
+        remove(*e);
+      }
+    } else {
+      Entry* src = find(normalize(v.second.get<string>("from_path", "")));
+      string to = normalize(v.second.get<string>("to_path", ""));
+      if (!src) {
+        failure = "from_lookup";
+        detail = "not_found";
+      } else if (find(to)) {
+        failure = "to";
+        detail = "conflict";
+      } else {
+        copy(*src, to);
+        if (op == "move_batch_v2") {
+          remove(*src);
+        }
+        m = metadataJsonV2(*find(to));
+      }
+    }
+
+    ss << (count++ ? ", " : "");
+    if (failure.empty()) {
+      ss << "{\".tag\": \"success\", "
+        << jsonQuote(isDelete ? "metadata" : "success") << ": " << m << "}";
+    } else {
+      ss << "{\".tag\": \"failure\", \"failure\": {\".tag\": "
+        << jsonQuote(failure) << ", " << jsonQuote(failure)
+        << ": {\".tag\": " << jsonQuote(detail) << "}}}";
+    }
+  }
+
+  res.body_ = "{\".tag\": \"complete\", \"entries\": [" + ss.str() + "]}";
+
+  if (batchJobPolls_) {
+    res.body_ = startJob(res.body_);
+  }
+  return res;
+}
+
+string MockDropboxServer::startJob(const string& result) {
+  stringstream id;
+  id << "mock-job-" << ++idCounter_;
+  jobs_[id.str()] = make_pair(batchJobPolls_, result);
+
+  return "{\".tag\": \"async_job_id\", \"async_job_id\": " +
+    jsonQuote(id.str()) + "}";
+}
+
+MockDropboxServer::Response MockDropboxServer::checkJob(const ptree& arg) {
+  Response res;
+
+  auto job = jobs_.find(arg.get<string>("async_job_id", ""));
+  if (job == jobs_.end()) {
+    res.status_ = 409;
+    res.body_ = "{\"error_summary\": \"invalid_async_job_id/\"}";
+  } else if (job->second.first) {
+    --job->second.first;
+    res.body_ = "{\".tag\": \"in_progress\"}";
+  } else {
+    res.body_ = job->second.second;
+    jobs_.erase(job);
+  }
+  return res;
+}
+
+MockDropboxServer::Entry* MockDropboxServer::find(const string& path,
+    bool includeDeleted) {
+  auto i = entries_.find(lower(path));
+  if (i == entries_.end() || (i->second.deleted_ && !includeDeleted)) {
+    return NULL;
+  }
+
+  return &i->second;
+}
+
+MockDropboxServer::Entry& MockDropboxServer::makeFolder(const string& path) {
+  Entry* e = find(path);
+  if (e) {
+    return *e;
+  }
+
+  makeFolder(parentOf(path));
+
+  Entry& f = entries_[lower(path)];
+  f.path_ = path;
+  f.isDir_ = true;
+  f.deleted_ = false;
+
+  Revision r;
+  r.rev_ = nextRev();
+  r.deleted_ = false;
+  r.modified_ = time(NULL);
+  addRevision(f, r);
+
+  return f;
+}
+
+MockDropboxServer::Entry& MockDropboxServer::write(const string& path,
+    shared_ptr<const string> data,
+    bool overwrite,
+    const string& parentRev) {
+  string target = path;
+
+  // Conflicting writes go to "name (1).ext" and so on, as on the server
+  Entry* e = find(path);
+  if (e && (e->isDir_ || (!parentRev.empty() ?
+      parentRev != e->revisions_.back().rev_ : !overwrite))) {
+    string name = nameOf(path);
+    size_t dot = name.rfind('.');
+    if (!dot || dot == string::npos) {
+      dot = name.size();
+    }
+
+    for (size_t n = 1; find(target); ++n) {
+      stringstream ss;
+      ss << parentOf(path) << (parentOf(path) == "/" ? "" : "/")
+        << name.substr(0, dot) << " (" << n << ")" << name.substr(dot);
+      target = ss.str();
+    }
+  }
+
+  makeFolder(parentOf(target));
+
+  Entry& f = entries_[lower(target)];
+  f.path_ = target;
+  f.isDir_ = false;
+  f.deleted_ = false;
+
+  Revision r;
+  r.rev_ = nextRev();
+  r.data_ = data;
+  r.deleted_ = false;
+  r.modified_ = time(NULL);
+  addRevision(f, r);
+
+  return f;
+}
+
+void MockDropboxServer::remove(Entry& e) {
+  if (e.isDir_) {
+    for (Entry* c : children(e.path_, true)) {
+      if (!c->deleted_) {
+        remove(*c);
+      }
+    }
+  }
+
+  e.deleted_ = true;
+
+  Revision r;
+  r.rev_ = nextRev();
+  r.data_.reset(new string());
+  r.deleted_ = true;
+  r.modified_ = time(NULL);
+  addRevision(e, r);
+}
+
+void MockDropboxServer::addRevision(Entry& e, const Revision& r) {
+  e.revisions_.push_back(r);
+
+  if (revisionLimit_ && e.revisions_.size() > revisionLimit_) {
+    e.revisions_.erase(e.revisions_.begin(),
+      e.revisions_.end() - revisionLimit_);
+  }
+}
+
+void MockDropboxServer::copy(const Entry& from, const string& to) {
+  if (!from.isDir_) {
+    write(to, from.revisions_.back().data_, true, "");
+    return;
+  }
+
+  makeFolder(to);
+
+  for (Entry* c : children(from.path_, false)) {
+    if (!c->deleted_) {
+      copy(*c, to + "/" + nameOf(c->path_));
+    }
+  }
+}
+
+vector<MockDropboxServer::Entry*> MockDropboxServer::children(
+    const string& path,
+    bool recursive) {
+  string key = lower(path);
+  string prefix = key == "/" ? key : key + "/";
+
+  vector<Entry*> out;
+  for (auto i = entries_.lower_bound(prefix); i != entries_.end(); ++i) {
+    if (i->first.compare(0, prefix.size(), prefix)) {
+      break;
+    }
+
+    if (i->first == key ||
+        (!recursive && i->first.find('/', prefix.size()) != string::npos)) {
+      continue;
+    }
+
+    out.push_back(&i->second);
+  }
+
+  return out;
+}
+
+string MockDropboxServer::nextRev() {
+  stringstream ss;
+  ss << hex << ++revCounter_ << "0ab1ed";
+  return ss.str();
+}
+
+string MockDropboxServer::folderHash(const string& path) {
+  string state;
+  for (Entry* c : children(path, false)) {
+    state += c->path_ + "\n" + c->revisions_.back().rev_ + "\n";
+  }
+
+  stringstream ss;
+  ss << hex << std::hash<string>()(state);
+  return ss.str();
+}
+
+string MockDropboxServer::metadataJson(const Entry& e, const Revision* r) {
+  if (!r) {
+    r = &e.revisions_.back();
+  }
+
+  size_t bytes = (!e.isDir_ && r->data_) ? r->data_->size() : 0;
+
+  stringstream size;
+  if (bytes < 1024) {
+    size << bytes << " bytes";
+  } else if (bytes < 1024 * 1024) {
+    size << bytes / 1024 << " KB";
+  } else {
+    size << bytes / (1024 * 1024) << " MB";
+  }
+
+  stringstream ss;
+  ss << "{\"size\": " << jsonQuote(size.str())
+    << ", \"bytes\": " << bytes
+    << ", \"path\": " << jsonQuote(e.path_)
+    << ", \"is_dir\": " << jsonBool(e.isDir_)
+    << ", \"is_deleted\": " << jsonBool(r->deleted_)
+    << ", \"rev\": " << jsonQuote(r->rev_)
+    << ", \"thumb_exists\": false"
+    << ", \"icon\": " << (e.isDir_ ? "\"folder\"" : "\"page_white\"")
+    << ", \"root\": \"dropbox\""
+    << ", \"modified\": " << jsonQuote(httpDate(r->modified_));
+
+  if (!e.isDir_) {
+    ss << ", \"client_mtime\": " << jsonQuote(httpDate(r->modified_))
+      << ", \"mime_type\": \"application/octet-stream\"";
+  }
+
+  ss << "}";
+  return ss.str();
+}
+
+string MockDropboxServer::metadataJsonV2(const Entry& e) {
+  const Revision& r = e.revisions_.back();
+
+  stringstream ss;
+  ss << "{\".tag\": " << (e.isDir_ ? "\"folder\"" : "\"file\"")
+    << ", \"name\": " << jsonQuote(nameOf(e.path_))
+    << ", \"path_lower\": " << jsonQuote(lower(e.path_))
+    << ", \"path_display\": " << jsonQuote(e.path_)
+    << ", \"id\": \"id:" << r.rev_ << "\"";
+
+  if (!e.isDir_) {
+    ss << ", \"client_modified\": " << jsonQuote(isoDate(r.modified_))
+      << ", \"server_modified\": " << jsonQuote(isoDate(r.modified_))
+      << ", \"rev\": " << jsonQuote(r.rev_)
+      << ", \"size\": " << r.data_->size();
+  }
+
+  ss << "}";
+  return ss.str();
+}
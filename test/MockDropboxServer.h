@@ -0,0 +1,300 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __MOCK_DROPBOX_SERVER_H__
+#define __MOCK_DROPBOX_SERVER_H__
+
+/**
+ * A loopback HTTP server that implements the Dropbox endpoints used by
+ * DropboxApi and DropboxApi2 on top of an in-memory filesystem, so that
+ * functional tests and benchmarks can run without an account or network.
+ *
+ * Implemented: account/info, metadata, files, files_put, chunked_upload,
+ * commit_chunked_upload, fileops/{copy,move,delete,create_folder}, search,
+ * revisions and restore of the core API; users/get_account,
+ * upload_session/{start,append_v2,finish,finish_batch} and oauth2/token of
+ * the v2 API.
+ * Other endpoints answer 404. Any Authorization header is accepted, except
+ * for a token set with setRejectedToken.
+ *
+ * Each connection is served by its own thread, with keep-alive.
+ */
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dropbox {
+
+class MockDropboxServer {
+public:
+  static const char* const    ACCOUNT_EMAIL;
+
+  /**
+   * Start a server on a free port of 127.0.0.1
+   *
+   * @throws  std::runtime_error if the socket can't be set up
+   */
+  MockDropboxServer();
+
+  /**
+   * Stops the server and, if it was installed, removes the mappings
+   */
+  ~MockDropboxServer();
+
+  /**
+   * @return  The base url of the server, e.g. "http://127.0.0.1:40123"
+   */
+  std::string getBaseUrl() const;
+
+  /**
+   * Point every Dropbox host at this server, through
+   * HttpRequestFactory::setBaseUrl
+   *
+   * @return  void
+   */
+  void install();
+
+  /**
+   * Delay every response, to model a network round trip
+   *
+   * @param latency       Delay added to each request
+   *
+   * @return  void
+   */
+  void setLatency(std::chrono::microseconds latency);
+
+  /**
+   * Keep at most this many revisions of each entry, to bound the memory
+   * used by long benchmarks. Unlimited by default.
+   *
+   * @param limit         Revisions to keep; 0 for no limit
+   *
+   * @return  void
+   */
+  void setRevisionLimit(size_t limit);
+
+  /**
+   * Make upload_session/finish_batch and the copy, move and delete batches
+   * start an async job, which answers "in_progress" to this many checks
+   * before completing. 0, the default, commits batches right away.
+   *
+   * @param polls         Checks answered "in_progress" per job
+   *
+   * @return  void
+   */
+  void setBatchJobPolls(size_t polls);
+
+  /**
+   * Make copy, move and delete batches start an async job that fails as a
+   * whole, leaving every entry untouched
+   *
+   * @param fail          true to fail the jobs
+   *
+   * @return  void
+   */
+  void failBatchJobs(bool fail);
+
+  /**
+   * Answer the next requests that arrive, other than oauth2/token, with an
+   * error status and "Retry-After: 0" instead of serving them. The latency
+   * still applies.
+   *
+   * @param count         Number of requests to fail
+   * @param status        HTTP status to answer with, e.g. 503
+   *
+   * @return  void
+   */
+  void failRequests(size_t count, int status);
+
+  /**
+   * Hang up on the next requests that arrive, other than oauth2/token,
+   * right after sending the status line and headers of a response, so that
+   * the client sees the connection drop in the middle of the reply
+   *
+   * @param count         Number of requests to drop
+   *
+   * @return  void
+   */
+  void dropRequests(size_t count);
+
+  /**
+   * Hold back the responses to the next requests that arrive, other than
+   * oauth2/token, on top of the latency
+   *
+   * @param count         Number of requests to delay
+   * @param delay         Delay added to each of them
+   *
+   * @return  void
+   */
+  void delayRequests(size_t count, std::chrono::microseconds delay);
+
+  /**
+   * Answer 401 to requests made with an access token, as if it had expired
+   *
+   * @param token         The token; empty to accept all tokens again
+   *
+   * @return  void
+   */
+  void setRejectedToken(const std::string& token);
+
+  /**
+   * Set the expires_in handed out with new access tokens
+   *
+   * @param seconds       Lifetime of the tokens, 14400 by default
+   *
+   * @return  void
+   */
+  void setTokenLifetime(long seconds);
+
+  /**
+   * Send a malformed x-dropbox-metadata header with file downloads
+   *
+   * @param corrupt       true to corrupt the header
+   *
+   * @return  void
+   */
+  void setCorruptFileMetadata(bool corrupt);
+
+  /**
+   * @return  Number of requests served so far
+   */
+  uint64_t getRequestCount() const;
+
+  /**
+   * @return  Number of access tokens handed out by oauth2/token so far
+   */
+  uint64_t getTokenCount();
+
+private:
+  MockDropboxServer(const MockDropboxServer&);
+  MockDropboxServer& operator=(const MockDropboxServer&);
+
+  struct Request {
+    std::string                         method_;
+    std::string                         path_;
+    std::map<std::string, std::string>  params_;
+    std::map<std::string, std::string>  headers_;
+    std::string                         body_;
+
+    std::string param(const std::string& name,
+      const std::string& def = "") const;
+    std::string header(const std::string& name) const;
+  };
+
+  struct Response {
+    Response() : status_(200), drop_(false) {
+    }
+
+    int                                 status_;
+    bool                                drop_;
+    std::string                         body_;
+    std::map<std::string, std::string>  headers_;
+  };
+
+  struct Revision {
+    std::string                         rev_;
+    std::shared_ptr<const std::string>  data_;
+    bool                                deleted_;
+    time_t                              modified_;
+  };
+
+  struct Entry {
+    std::string                         path_;
+    bool                                isDir_;
+    bool                                deleted_;
+    std::vector<Revision>               revisions_;
+  };
+
+  void          acceptLoop();
+  void          serve(int fd);
+  bool          readRequest(int fd, std::string& buf, Request& req);
+  Response      handle(const Request& req);
+
+  // Endpoints; called with lock_ held
+  Response      metadata(const Request&, const std::string& path);
+  Response      getFile(const Request&, const std::string& path);
+  Response      putFile(const Request&, const std::string& path);
+  Response      chunkedUpload(const Request&);
+  Response      commitChunkedUpload(const Request&, const std::string& path);
+  Response      fileOp(const Request&, const std::string& op);
+  Response      search(const Request&, const std::string& path);
+  Response      revisions(const Request&, const std::string& path);
+  Response      restore(const Request&, const std::string& path);
+  Response      uploadSession(const Request&, const std::string& op);
+  std::string   appendSession(const boost::property_tree::ptree& arg,
+                  const std::string& data);
+  std::string   finishSession(const boost::property_tree::ptree& arg);
+  Response      fileBatch(const Request&, const std::string& op);
+  std::string   startJob(const std::string& result);
+  Response      checkJob(const boost::property_tree::ptree& arg);
+
+  // The in-memory filesystem; called with lock_ held
+  Entry*        find(const std::string& path, bool includeDeleted = false);
+  Entry&        makeFolder(const std::string& path);
+  Entry&        write(const std::string& path,
+                  std::shared_ptr<const std::string> data,
+                  bool overwrite,
+                  const std::string& parentRev);
+  void          remove(Entry& e);
+  void          addRevision(Entry& e, const Revision& r);
+  void          copy(const Entry& from, const std::string& to);
+  std::vector<Entry*> children(const std::string& path, bool recursive);
+  std::string   nextRev();
+  std::string   folderHash(const std::string& path);
+  std::string   metadataJson(const Entry& e, const Revision* r = NULL);
+  std::string   metadataJsonV2(const Entry& e);
+
+  int                                   listenFd_;
+  unsigned short                        port_;
+  bool                                  installed_;
+  std::atomic<bool>                     stopped_;
+  std::atomic<int64_t>                  latency_;
+  std::atomic<uint64_t>                 requests_;
+  std::thread                           acceptor_;
+
+  std::mutex                            connLock_;
+  std::set<int>                         connections_;
+  std::vector<std::thread>              workers_;
+
+  std::mutex                            lock_;
+  std::map<std::string, Entry>          entries_;
+  std::map<std::string, std::string>    uploads_;
+  // Async batch jobs: polls left before completing, and the result
+  std::map<std::string, std::pair<size_t, std::string> > jobs_;
+  size_t                                batchJobPolls_;
+  bool                                  failBatchJobs_;
+  size_t                                failures_;
+  int                                   failureStatus_;
+  size_t                                drops_;
+  size_t                                delays_;
+  std::chrono::microseconds             delay_;
+  std::string                           rejectedHeader_;
+  bool                                  corruptFileMetadata_;
+  uint64_t                              tokens_;
+  long                                  tokenLifetime_;
+  size_t                                revisionLimit_;
+  uint64_t                              revCounter_;
+  uint64_t                              idCounter_;
+};
+}
+#endif
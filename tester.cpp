@@ -15,23 +15,52 @@
 
 #include <gtest/gtest.h>
 
+#include <boost/property_tree/json_parser.hpp>
+
 #include <cstdlib>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <future>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "DropboxAccountInfo.h"
 #include "DropboxMetadata.h"
 #include "DropboxApi.h"
+#include "DropboxApi2.h"
+#include "DropboxAsyncApi.h"
+#include "DropboxCoroutines.h"
+#include "DropboxDirectoryUploader.h"
+#include "DropboxMirror.h"
+#include "DropboxTreeWalker.h"
+#include "test/AllocationCounter.h"
+#include "test/MockDropboxServer.h"
+#include "util/Metrics.h"
+#include "util/OAuth.h"
+#include "util/OAuth2.h"
+#include "util/PercentEncoding.h"
+#include "util/Tracer.h"
 
 using namespace std;
 using namespace std::placeholders;
 using namespace dropbox;
+using namespace http;
 
 // Globals
 const string TEST_DIR = "/testdir";
 const size_t SIZE = (1 << 20);
 const size_t LARGE_SIZE = 2 * (1 << 20) + 2;
 DropboxApi* d;
+MockDropboxServer* server;
 
 class AuthorizationHelper {
 public:
@@ -238,6 +267,29 @@ TEST_F(DropboxFileTestCase, DeleteFileTest) {
   EXPECT_EQ(true, m.isDeleted_);
 }
 
+TEST_F(DropboxFileTestCase, ReservedCharactersTest) {
+  string name = TEST_DIR + "/a b+c&d=e%f;g?h#i \xc3\xa9.txt";
+  DropboxUploadFileRequest up_req(name);
+  up_req.setUploadData(data_, SIZE);
+
+  DropboxMetadata m;
+  EXPECT_EQ(SUCCESS, d->uploadFile(up_req, m));
+  EXPECT_EQ(name, m.path_);
+
+  DropboxMetadataRequest req(name);
+  DropboxMetadataResponse res;
+  EXPECT_EQ(SUCCESS, d->getFileMetadata(req, res));
+  EXPECT_EQ(name, res.getMetadata().path_);
+
+  DropboxSearchRequest search(TEST_DIR, "b+c&d=e%f", false);
+  DropboxSearchResult results;
+  EXPECT_EQ(SUCCESS, d->search(search, results));
+  ASSERT_EQ(1UL, results.getResults().size());
+  EXPECT_EQ(name, results.getResults()[0].path_);
+
+  EXPECT_EQ(SUCCESS, d->deleteFile(name, m));
+}
+
 class DropboxLargeFileTestCase : public BaseDropboxTestCase {
 public:
   void SetUp() {
@@ -438,9 +490,2620 @@ TEST_F(DropboxMetadataOpsTestCase, SearchIncludeDeletedTest) {
   EXPECT_LT(2UL, v.size());
 }
 
-class DropboxTestEnvironment : public ::testing::Environment {
+// Progress reporting is a DropboxApi2 feature, tested against the mock
+class TransferProgressTestCase : public BaseDropboxTestCase {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+    data_ = DropboxFileTestCase::getRandomData(LARGE_SIZE);
+  }
+
+  void TearDown() {
+    free(data_);
+  }
+
+  DropboxErrorCode upload(util::ProgressCallback cb) {
+    auto read = [&](uint8_t* buf, size_t offset, size_t size) {
+      size = min(size, LARGE_SIZE - offset);
+      memcpy(buf, data_ + offset, size);
+      return size;
+    };
+
+    DropboxUploadLargeFileRequest req(TEST_DIR + "/progressfile", read,
+      true, "", SIZE, 0);
+    req.setTotalSize(LARGE_SIZE);
+    req.setProgressCallback(cb, chrono::milliseconds(0));
+
+    DropboxMetadata m;
+    return api_->uploadLargeFile(req, m);
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  uint8_t*                  data_;
+};
+
+TEST_F(TransferProgressTestCase, UploadProgressTest) {
+  vector<util::TransferProgress> reports;
+  DropboxErrorCode code = upload([&](const util::TransferProgress& p) {
+    reports.push_back(p);
+    return true;
+  });
+
+  EXPECT_EQ(SUCCESS, code);
+  ASSERT_FALSE(reports.empty());
+  for (size_t i = 1; i < reports.size(); ++i) {
+    EXPECT_LE(reports[i - 1].done_, reports[i].done_);
+    EXPECT_EQ(LARGE_SIZE, reports[i].total_);
+  }
+
+  EXPECT_EQ(LARGE_SIZE, reports.back().done_);
+  EXPECT_EQ(0, reports.back().eta_.count());
+  EXPECT_LT(0, reports.back().smoothedRate_);
+}
+
+TEST_F(TransferProgressTestCase, DownloadAbortTest) {
+  ASSERT_EQ(SUCCESS, upload(util::ProgressCallback()));
+
+  DropboxGetFileRequest req(TEST_DIR + "/progressfile");
+  req.setProgressCallback([](const util::TransferProgress&) {
+    return false;
+  }, chrono::milliseconds(0));
+
+  DropboxGetFileResponse res;
+  try {
+    api_->getFile(req, res);
+    FAIL() << "The download was not aborted";
+  } catch (DropboxException& e) {
+    EXPECT_EQ(CANCELLED, e.getErrorCode());
+  }
+}
+
+TEST_F(TransferProgressTestCase, DownloadBandwidthTest) {
+  typedef chrono::steady_clock Clock;
+  ASSERT_EQ(SUCCESS, upload(util::ProgressCallback()));
+
+  // 2MB at 2MB/s, less the 512KB burst
+  shared_ptr<util::BandwidthLimiter> limiter =
+    api_->getBandwidthLimiter(DOWNLOAD_BANDWIDTH);
+  limiter->setRate(2 * (1 << 20));
+
+  DropboxGetFileRequest req(TEST_DIR + "/progressfile");
+  DropboxGetFileResponse res;
+  Clock::time_point start = Clock::now();
+  EXPECT_EQ(SUCCESS, api_->getFile(req, res));
+  Clock::duration elapsed = Clock::now() - start;
+
+  EXPECT_EQ(LARGE_SIZE, res.getDataLength());
+  EXPECT_LE(LARGE_SIZE, limiter->getBytes());
+  EXPECT_LT(chrono::milliseconds(700), elapsed);
+  EXPECT_GT(chrono::milliseconds(1500), elapsed);
+}
+
+// A mirror must never write outside its local directory, whatever paths the
+// server reports
+// A tree of folders and files on the mock server, walked by the tests
+class DropboxTreeWalkerTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+
+    // /walk/fN/sM/file.txt, plus a file in every fN; creating a folder
+    // that exists already fails, which doesn't matter here
+    mkdir("/walk");
+    for (int i = 0; i < 3; ++i) {
+      string f = "/walk/f" + to_string(i);
+      mkdir(f);
+      put(f + "/top.txt");
+      for (int j = 0; j < 3; ++j) {
+        string sub = f + "/s" + to_string(j);
+        mkdir(sub);
+        put(sub + "/file.txt");
+      }
+    }
+  }
+
+  void mkdir(const string& path) {
+    DropboxMetadata m;
+    api_->createFolder(path, m);
+    expected_.insert(path);
+  }
+
+  void put(const string& path) {
+    DropboxUploadFileRequest up(path);
+    up.setUploadData((uint8_t*)"data", 4);
+    DropboxMetadata m;
+    ASSERT_EQ(SUCCESS, api_->uploadFile(up, m));
+    expected_.insert(path);
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  set<string>               expected_;
+};
+
+TEST_F(DropboxTreeWalkerTestCase, NestedTreeTest) {
+  DropboxTreeWalker w(*api_, 4);
+  multiset<string> seen;
+
+  EXPECT_EQ(SUCCESS, w.walk("/walk", [&](const DropboxMetadata& m) {
+    seen.insert(m.path_);
+  }));
+
+  // Every entry below the root, each exactly once
+  expected_.erase("/walk");
+  EXPECT_EQ(expected_.size(), seen.size());
+  for (auto& p : expected_) {
+    EXPECT_EQ(1UL, seen.count(p)) << p;
+  }
+}
+
+TEST_F(DropboxTreeWalkerTestCase, ListingErrorTest) {
+  DropboxTreeWalker w(*api_, 1);
+  size_t visited = 0;
+
+  // Once the root is listed, the next listing fails as a folder with too
+  // many children would
+  DropboxErrorCode code = w.walk("/walk", [&](const DropboxMetadata&) {
+    if (!visited++) {
+      server->failRequests(1, TOO_MANY_FILES);
+    }
+  });
+  server->failRequests(0, 0);
+
+  EXPECT_EQ(TOO_MANY_FILES, code);
+  EXPECT_GT(expected_.size() - 1, visited);
+
+  EXPECT_EQ(404, w.walk("/walk/missing", [](const DropboxMetadata&) {}));
+}
+
+TEST_F(DropboxTreeWalkerTestCase, CancelTest) {
+  DropboxTreeWalker w(*api_, 2);
+  auto token = make_shared<util::CancellationToken>();
+  size_t visited = 0;
+
+  DropboxRequestContext ctx;
+  ctx.setCancellationToken(token);
+  DropboxContextScope scope(ctx);
+
+  // Cancel while the listings below the root are still to come
+  try {
+    w.walk("/walk", [&](const DropboxMetadata&) {
+      ++visited;
+      token->cancel();
+    });
+    ADD_FAILURE() << "The walk was not cancelled";
+  } catch (DropboxException& e) {
+    EXPECT_EQ(CANCELLED, e.getErrorCode());
+  }
+
+  EXPECT_GT(expected_.size() - 1, visited);
+}
+
+TEST(DropboxMirrorTestCase, UnsafePathTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+
+  DropboxUploadFileRequest up_req("/mirrorsrc.txt");
+  uint8_t data[] = { 'd', 'a', 't', 'a' };
+  up_req.setUploadData(data, sizeof(data));
+  DropboxMetadata m;
+  ASSERT_EQ(SUCCESS, api.uploadFile(up_req, m));
+
+  // Folder operations take their paths as params, which reach the server
+  // unnormalized, unlike paths in urls
+  ASSERT_EQ(SUCCESS, api.createFolder("/mirrortest/..", m));
+  ASSERT_EQ(SUCCESS, api.createFolder("/mirrortest/../escaped", m));
+  ASSERT_EQ(SUCCESS, api.copyFile("/mirrorsrc.txt", "/mirrortest/ok.txt", m));
+  ASSERT_EQ(SUCCESS,
+    api.copyFile("/mirrorsrc.txt", "/mirrortest/../escape.txt", m));
+
+  char tmp[] = "/tmp/mirrortestXXXXXX";
+  ASSERT_TRUE(mkdtemp(tmp));
+  string local = string(tmp) + "/root";
+
+  DropboxMirror mirror(api, 2);
+  DropboxMirrorStats stats;
+  EXPECT_EQ(MALFORMED_RESPONSE, mirror.mirror("/mirrortest", local, stats));
+
+  struct stat st;
+  EXPECT_EQ(0, stat((local + "/ok.txt").c_str(), &st));
+  EXPECT_EQ(4, st.st_size);
+  EXPECT_NE(0, stat((string(tmp) + "/escaped").c_str(), &st));
+  EXPECT_NE(0, stat((string(tmp) + "/escape.txt").c_str(), &st));
+  EXPECT_EQ(1UL, stats.filesDownloaded_);
+  EXPECT_EQ(3UL, stats.filesFailed_);
+
+  unlink((local + "/ok.txt").c_str());
+  rmdir(local.c_str());
+  rmdir(tmp);
+}
+
+// Download a tree, then mirror it again: unchanged files are skipped
+TEST(DropboxMirrorTestCase, DownloadAndSkipTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+
+  const string files[] = { "/mirrorskip/a.txt", "/mirrorskip/sub/b.txt" };
+  string contents[2];
+  for (int i = 0; i < 2; ++i) {
+    contents[i] = string(1000 * (i + 1), (char)('a' + i));
+    DropboxUploadFileRequest up(files[i]);
+    up.setUploadData((uint8_t*)&contents[i][0], contents[i].size());
+    DropboxMetadata m;
+    ASSERT_EQ(SUCCESS, api.uploadFile(up, m));
+  }
+
+  char tmp[] = "/tmp/mirrortestXXXXXX";
+  ASSERT_TRUE(mkdtemp(tmp));
+  string local = tmp;
+
+  DropboxMirror mirror(api, 2);
+  DropboxMirrorStats stats;
+  EXPECT_EQ(SUCCESS, mirror.mirror("/mirrorskip", local, stats));
+  EXPECT_EQ(1UL, stats.foldersListed_);
+  EXPECT_EQ(2UL, stats.filesListed_);
+  EXPECT_EQ(2UL, stats.filesDownloaded_);
+  EXPECT_EQ(0UL, stats.filesSkipped_);
+  EXPECT_EQ(0UL, stats.filesFailed_);
+  EXPECT_EQ(3000UL, stats.bytesDownloaded_);
+
+  for (int i = 0; i < 2; ++i) {
+    string path = local + files[i].substr(strlen("/mirrorskip"));
+    ifstream in(path.c_str());
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    EXPECT_EQ(contents[i], data) << path;
+  }
+
+  uint64_t requests = server->getRequestCount();
+  DropboxMirrorStats again;
+  EXPECT_EQ(SUCCESS, mirror.mirror("/mirrorskip", local, again));
+  EXPECT_EQ(2UL, again.filesListed_);
+  EXPECT_EQ(2UL, again.filesSkipped_);
+  EXPECT_EQ(0UL, again.filesDownloaded_);
+  // Only the two folders were listed
+  EXPECT_EQ(requests + 2, server->getRequestCount());
+
+  // A file whose size changed is downloaded again
+  {
+    ofstream out((local + "/a.txt").c_str());
+    out << "short";
+  }
+  DropboxMirrorStats changed;
+  EXPECT_EQ(SUCCESS, mirror.mirror("/mirrorskip", local, changed));
+  EXPECT_EQ(1UL, changed.filesSkipped_);
+  EXPECT_EQ(1UL, changed.filesDownloaded_);
+
+  string cmd = string("rm -rf ") + tmp;
+  EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+// A download whose metadata header can't be parsed fails that file only
+TEST(DropboxMirrorTestCase, MalformedMetadataTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+
+  DropboxUploadFileRequest up("/mirrorbad/a.txt");
+  uint8_t data[] = { 'd', 'a', 't', 'a' };
+  up.setUploadData(data, sizeof(data));
+  DropboxMetadata m;
+  ASSERT_EQ(SUCCESS, api.uploadFile(up, m));
+
+  char tmp[] = "/tmp/mirrortestXXXXXX";
+  ASSERT_TRUE(mkdtemp(tmp));
+
+  server->setCorruptFileMetadata(true);
+  DropboxMirror mirror(api, 2);
+  DropboxMirrorStats stats;
+  EXPECT_EQ(MALFORMED_RESPONSE, mirror.mirror("/mirrorbad", tmp, stats));
+  server->setCorruptFileMetadata(false);
+
+  EXPECT_EQ(1UL, stats.filesFailed_);
+  EXPECT_EQ(0UL, stats.filesDownloaded_);
+
+  struct stat st;
+  EXPECT_NE(0, stat((string(tmp) + "/a.txt").c_str(), &st));
+  EXPECT_NE(0, stat((string(tmp) + "/a.txt.dbxpart").c_str(), &st));
+  rmdir(tmp);
+}
+
+class DropboxBatchTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+
+    // Every test works in a folder of its own
+    root_ = string("/batch/") +
+      ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    src_ = root_ + "/src.txt";
+
+    DropboxUploadFileRequest up(src_);
+    up.setUploadData((uint8_t*)"data", 4);
+    DropboxMetadata m;
+    ASSERT_EQ(SUCCESS, api_->uploadFile(up, m));
+  }
+
+  void TearDown() {
+    if (server) {
+      server->setBatchJobPolls(0);
+      server->failBatchJobs(false);
+    }
+  }
+
+  bool exists(const string& path) {
+    DropboxMetadataRequest req(path);
+    DropboxMetadataResponse res;
+    return api_->getFileMetadata(req, res) == SUCCESS &&
+      !res.getMetadata().isDeleted_;
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  string                    root_;
+  string                    src_;
+};
+
+TEST_F(DropboxBatchTestCase, ChunkedTest) {
+  // More entries than one call takes; the mock rejects larger batches
+  vector<DropboxRelocation> copies;
+  vector<string> paths;
+  for (int i = 0; i < 2001; ++i) {
+    DropboxRelocation r;
+    r.from_ = src_;
+    r.to_ = root_ + "/copy" + to_string(i) + ".txt";
+    copies.push_back(r);
+    paths.push_back(r.to_);
+  }
+
+  vector<DropboxBatchEntryResult> results;
+  uint64_t before = server->getRequestCount();
+  EXPECT_EQ(SUCCESS, api_->copyFiles(copies, results));
+  EXPECT_EQ(3UL, server->getRequestCount() - before);
+
+  ASSERT_EQ(copies.size(), results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_TRUE(results[i].success_) << results[i].error_;
+    EXPECT_EQ(copies[i].to_, results[i].metadata_.path_);
+    EXPECT_EQ(4UL, results[i].metadata_.sizeBytes_);
+  }
+  EXPECT_TRUE(exists(paths.back()));
+
+  EXPECT_EQ(SUCCESS, api_->deleteFiles(paths, results));
+  ASSERT_EQ(paths.size(), results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_TRUE(results[i].success_) << results[i].error_;
+    EXPECT_EQ(paths[i], results[i].metadata_.path_);
+  }
+  EXPECT_FALSE(exists(paths.front()));
+  EXPECT_FALSE(exists(paths.back()));
+  EXPECT_TRUE(exists(src_));
+}
+
+TEST_F(DropboxBatchTestCase, PollingTest) {
+  server->setBatchJobPolls(3);
+
+  DropboxRelocation r;
+  r.from_ = src_;
+  r.to_ = root_ + "/moved.txt";
+
+  // The submit, three checks answered in_progress and the final one
+  vector<DropboxBatchEntryResult> results;
+  uint64_t before = server->getRequestCount();
+  EXPECT_EQ(SUCCESS, api_->moveFiles(vector<DropboxRelocation>(1, r),
+    results));
+  EXPECT_EQ(5UL, server->getRequestCount() - before);
+
+  ASSERT_EQ(1UL, results.size());
+  EXPECT_TRUE(results[0].success_) << results[0].error_;
+  EXPECT_EQ(r.to_, results[0].metadata_.path_);
+  EXPECT_TRUE(exists(r.to_));
+  EXPECT_FALSE(exists(src_));
+}
+
+TEST_F(DropboxBatchTestCase, FailedJobTest) {
+  server->failBatchJobs(true);
+
+  vector<string> paths;
+  paths.push_back(src_);
+  paths.push_back(root_ + "/missing.txt");
+
+  vector<DropboxBatchEntryResult> results;
+  EXPECT_EQ(IO_ERROR, api_->deleteFiles(paths, results));
+
+  ASSERT_EQ(2UL, results.size());
+  EXPECT_FALSE(results[0].success_);
+  EXPECT_FALSE(results[1].success_);
+  EXPECT_FALSE(results[0].error_.empty());
+  EXPECT_TRUE(exists(src_));
+}
+
+TEST_F(DropboxBatchTestCase, EntryFailureTest) {
+  // A missing source, then the same destination twice
+  vector<DropboxRelocation> copies(3);
+  copies[0].from_ = root_ + "/missing.txt";
+  copies[0].to_ = root_ + "/a.txt";
+  copies[1].from_ = src_;
+  copies[1].to_ = root_ + "/b.txt";
+  copies[2].from_ = src_;
+  copies[2].to_ = root_ + "/b.txt";
+
+  vector<DropboxBatchEntryResult> results;
+  EXPECT_EQ(SUCCESS, api_->copyFiles(copies, results));
+
+  ASSERT_EQ(3UL, results.size());
+  EXPECT_FALSE(results[0].success_);
+  EXPECT_NE(string::npos, results[0].error_.find("from_lookup"));
+  EXPECT_TRUE(results[1].success_) << results[1].error_;
+  EXPECT_FALSE(results[2].success_);
+  EXPECT_NE(string::npos, results[2].error_.find("conflict"));
+  EXPECT_FALSE(exists(root_ + "/a.txt"));
+
+  vector<string> paths;
+  paths.push_back(root_ + "/missing.txt");
+  paths.push_back(root_ + "/b.txt");
+  EXPECT_EQ(SUCCESS, api_->deleteFiles(paths, results));
+
+  ASSERT_EQ(2UL, results.size());
+  EXPECT_FALSE(results[0].success_);
+  EXPECT_NE(string::npos, results[0].error_.find("path_lookup"));
+  EXPECT_TRUE(results[1].success_) << results[1].error_;
+  EXPECT_FALSE(exists(root_ + "/b.txt"));
+}
+
+class DropboxDirectoryUploaderTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+
+    char tmp[] = "/tmp/uploadtestXXXXXX";
+    ASSERT_TRUE(mkdtemp(tmp));
+    tmp_ = tmp;
+  }
+
+  void TearDown() {
+    if (!tmp_.empty()) {
+      string cmd = "rm -rf " + tmp_;
+      EXPECT_EQ(0, system(cmd.c_str()));
+    }
+  }
+
+  void writeFile(const string& path, const string& data) {
+    ofstream(path.c_str()) << data;
+  }
+
+  bool exists(const string& path) {
+    DropboxMetadataRequest req(path);
+    DropboxMetadataResponse res;
+    try {
+      return api_->getFileMetadata(req, res) == SUCCESS &&
+        !res.getMetadata().isDeleted_;
+    } catch (DropboxException&) {
+      return false;
+    }
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  string                    tmp_;
+};
+
+TEST_F(DropboxDirectoryUploaderTestCase, SymlinkTest) {
+  string local = tmp_ + "/local";
+  string outside = tmp_ + "/outside";
+  ASSERT_EQ(0, mkdir(local.c_str(), 0755));
+  ASSERT_EQ(0, mkdir((local + "/sub").c_str(), 0755));
+  ASSERT_EQ(0, mkdir(outside.c_str(), 0755));
+
+  writeFile(local + "/a.txt", "a");
+  writeFile(local + "/sub/b.txt", "bb");
+  writeFile(outside + "/c.txt", "ccc");
+
+  // A cycle back to an ancestor, a directory elsewhere and a file
+  ASSERT_EQ(0, symlink("..", (local + "/sub/loop").c_str()));
+  ASSERT_EQ(0, symlink(outside.c_str(), (local + "/outside").c_str()));
+  ASSERT_EQ(0, symlink("a.txt", (local + "/link.txt").c_str()));
+
+  DropboxDirectoryUploader uploader(*api_, 2);
+  DropboxDirectoryUploadStats stats;
+  EXPECT_EQ(SUCCESS, uploader.upload(local, "/uploadtest", stats));
+
+  EXPECT_EQ(2UL, stats.filesFound_);
+  EXPECT_EQ(2UL, stats.filesUploaded_);
+  EXPECT_EQ(0UL, stats.filesFailed_);
+  EXPECT_EQ(3UL, stats.bytesUploaded_);
+
+  EXPECT_TRUE(exists("/uploadtest/a.txt"));
+  EXPECT_TRUE(exists("/uploadtest/sub/b.txt"));
+  EXPECT_FALSE(exists("/uploadtest/link.txt"));
+  EXPECT_FALSE(exists("/uploadtest/outside/c.txt"));
+  EXPECT_FALSE(exists("/uploadtest/sub/loop/a.txt"));
+}
+
+TEST_F(DropboxDirectoryUploaderTestCase, CancelPollingTest) {
+  writeFile(tmp_ + "/a.txt", "a");
+
+  // The commit job never completes within the test; polls back off to 1s
+  server->setBatchJobPolls(1000);
+
+  auto token = make_shared<util::CancellationToken>();
+  DropboxRequestContext ctx;
+  ctx.setCancellationToken(token);
+  DropboxContextScope scope(ctx);
+
+  typedef chrono::steady_clock Clock;
+  Clock::time_point cancelled;
+  thread canceller([&]() {
+    this_thread::sleep_for(chrono::milliseconds(800));
+    cancelled = Clock::now();
+    token->cancel();
+  });
+
+  DropboxDirectoryUploader uploader(*api_, 1);
+  DropboxDirectoryUploadStats stats;
+  DropboxErrorCode code = uploader.upload(tmp_, "/canceltest", stats);
+  Clock::time_point returned = Clock::now();
+  canceller.join();
+  server->setBatchJobPolls(0);
+
+  EXPECT_EQ(CANCELLED, code);
+  EXPECT_EQ(1UL, stats.filesFailed_);
+  EXPECT_GT(chrono::milliseconds(200), returned - cancelled);
+}
+
+class CoalescingTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+    api_->setRequestCoalescing(true);
+    server->setLatency(chrono::milliseconds(200));
+  }
+
+  void TearDown() {
+    if (server) {
+      server->setLatency(chrono::microseconds(0));
+    }
+  }
+
+  DropboxErrorCode getMetadata() {
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    try {
+      return api_->getFileMetadata(req, res);
+    } catch (DropboxException& e) {
+      return e.getErrorCode();
+    }
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+};
+
+TEST_F(CoalescingTestCase, SharedCallTest) {
+  DropboxErrorCode first;
+  thread t([&]() { first = getMetadata(); });
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  EXPECT_EQ(SUCCESS, getMetadata());
+  t.join();
+
+  EXPECT_EQ(SUCCESS, first);
+  EXPECT_EQ(1UL, api_->getCoalescedRequestCount());
+}
+
+// The callers of a shared download get the same bytes, not copies of them
+TEST_F(CoalescingTestCase, SharedDownloadTest) {
+  DropboxUploadFileRequest up("/coalesce/shared.txt");
+  up.setUploadData((uint8_t*)"shared", 6);
+  DropboxMetadata m;
+  ASSERT_EQ(SUCCESS, api_->uploadFile(up, m));
+
+  DropboxGetFileResponse first;
+  thread t([&]() {
+    DropboxGetFileRequest req("/coalesce/shared.txt");
+    EXPECT_EQ(SUCCESS, api_->getFile(req, first));
+  });
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  DropboxGetFileRequest req("/coalesce/shared.txt");
+  DropboxGetFileResponse second;
+  EXPECT_EQ(SUCCESS, api_->getFile(req, second));
+  t.join();
+
+  EXPECT_EQ(1UL, api_->getCoalescedRequestCount());
+  ASSERT_EQ(6UL, second.getDataLength());
+  EXPECT_EQ(0, memcmp("shared", second.getData(), 6));
+  EXPECT_EQ(first.getData(), second.getData());
+}
+
+// Cancelling one caller must not fail an identical call made by another
+TEST_F(CoalescingTestCase, CancelledCallerTest) {
+  auto token = make_shared<util::CancellationToken>();
+  DropboxErrorCode cancelled;
+
+  thread t([&]() {
+    DropboxRequestContext ctx;
+    ctx.setCancellationToken(token);
+    DropboxContextScope scope(ctx);
+    cancelled = getMetadata();
+  });
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  thread canceller([&]() {
+    this_thread::sleep_for(chrono::milliseconds(50));
+    token->cancel();
+  });
+
+  EXPECT_EQ(SUCCESS, getMetadata());
+  t.join();
+  canceller.join();
+
+  EXPECT_EQ(CANCELLED, cancelled);
+  EXPECT_EQ(0UL, api_->getCoalescedRequestCount());
+}
+
+// A full executor queue fails calls instead of blocking, even when the
+// call is made from a completion callback on the executor's only thread
+TEST(DropboxAsyncApiTestCase, QueueFullTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+  util::Executor executor(1, 1);
+  DropboxAsyncApi async(api, executor);
+  server->setLatency(chrono::milliseconds(100));
+
+  DropboxAccountInfo info;
+  DropboxMetadataResponse res;
+  promise<DropboxErrorCode> first;
+  promise<DropboxErrorCode> nested;
+
+  async.getAccountInfo(info, [&](DropboxErrorCode code, exception_ptr) {
+    first.set_value(code);
+
+    // The queue still holds the task queued below
+    async.getFileMetadata(DropboxMetadataRequest("/"), res,
+      [&](DropboxErrorCode code, exception_ptr e) {
+        EXPECT_FALSE(e);
+        nested.set_value(code);
+      });
+  });
+
+  // Occupies the only queue slot while the call above runs
+  promise<void> release;
+  shared_future<void> released = release.get_future().share();
+  while (executor.getQueuedCount()) {
+    this_thread::yield();
+  }
+  ASSERT_TRUE(executor.trySubmit([released]() { released.wait(); }));
+
+  DropboxAsyncApi::Future f = async.getAccountInfo(info);
+  ASSERT_EQ(future_status::ready, f.wait_for(chrono::seconds(0)));
+  EXPECT_EQ(QUEUE_FULL, f.get());
+
+  auto done = nested.get_future();
+  EXPECT_EQ(future_status::ready, done.wait_for(chrono::seconds(5)));
+  EXPECT_EQ(SUCCESS, first.get_future().get());
+  EXPECT_EQ(QUEUE_FULL, done.get());
+
+  release.set_value();
+  server->setLatency(chrono::microseconds(0));
+}
+
+#ifdef DROPBOX_HAS_COROUTINES
+class DropboxCoroutineTestCase : public ::testing::Test {
 public:
   void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+  }
+
+  void TearDown() {
+    if (server) {
+      server->setLatency(chrono::microseconds(0));
+    }
+  }
+
+  // Run a task on the loop until it completes. Exceptions escaping it fail
+  // the test.
+  void run(DropboxTask<void> task) {
+    spawn(loop_, [](http::HttpEventLoop& loop,
+        DropboxTask<void> task) -> DropboxTask<void> {
+      try {
+        co_await task;
+      } catch (exception& e) {
+        ADD_FAILURE() << "Task threw " << e.what();
+      }
+      loop.stop();
+    }(loop_, std::move(task)));
+
+    loop_.run();
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  http::HttpEventLoop       loop_;
+};
+
+TEST_F(DropboxCoroutineTestCase, UploadDownloadTest) {
+  DropboxCoroApi coro(*api_, loop_);
+  vector<uint8_t> data(3 * 100000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (uint8_t)(i * 7);
+  }
+
+  run([&]() -> DropboxTask<void> {
+    DropboxCoroApi::UploadStream up = coro.createUpload("/corofile", true);
+    for (size_t offset = 0; offset < data.size(); offset += 100000) {
+      EXPECT_EQ(SUCCESS, co_await up.write(&data[offset], 100000));
+    }
+    EXPECT_EQ(data.size(), up.getOffset());
+
+    DropboxMetadata m;
+    EXPECT_EQ(SUCCESS, co_await up.finish(m));
+    EXPECT_EQ("/corofile", m.path_);
+    EXPECT_EQ(data.size(), m.sizeBytes_);
+
+    // A small high water mark pauses and resumes the transfer
+    DropboxCoroApi::FileStream stream =
+      coro.openFile(DropboxGetFileRequest("/corofile"), 32 * 1024);
+    vector<uint8_t> received;
+    vector<uint8_t> chunk;
+    while (co_await stream.read(chunk)) {
+      received.insert(received.end(), chunk.begin(), chunk.end());
+    }
+    EXPECT_EQ(SUCCESS, stream.getErrorCode());
+    EXPECT_TRUE(received == data);
+
+    DropboxGetFileResponse res;
+    EXPECT_EQ(SUCCESS,
+      co_await coro.getFile(DropboxGetFileRequest("/corofile"), res));
+    EXPECT_EQ(data.size(), res.getDataLength());
+    EXPECT_EQ(0, memcmp(&data[0], res.getData(), data.size()));
+  }());
+}
+
+TEST_F(DropboxCoroutineTestCase, SleepTest) {
+  typedef chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  Clock::time_point first;
+  Clock::time_point second;
+
+  // Two sleeps on one loop overlap rather than run back to back
+  auto sleeper = [&](Clock::time_point& woke) -> DropboxTask<void> {
+    co_await SleepAwaiter(loop_, chrono::milliseconds(100));
+    woke = Clock::now();
+  };
+
+  run([&]() -> DropboxTask<void> {
+    spawn(loop_, sleeper(first));
+    co_await sleeper(second);
+    co_await SleepAwaiter(loop_, chrono::milliseconds(10));
+  }());
+
+  EXPECT_LE(chrono::milliseconds(100), first - start);
+  EXPECT_LE(chrono::milliseconds(100), second - start);
+  EXPECT_GT(chrono::milliseconds(190), second - start);
+}
+
+TEST_F(DropboxCoroutineTestCase, CancelTest) {
+  server->setLatency(chrono::seconds(3));
+
+  auto token = make_shared<util::CancellationToken>();
+  DropboxRequestContext ctx;
+  ctx.setCancellationToken(token);
+  DropboxCoroApi coro(*api_, loop_, ctx);
+
+  typedef chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  DropboxErrorCode code = SUCCESS;
+
+  // Named so that the closure outlives the coroutine it starts
+  auto canceller = [&]() -> DropboxTask<void> {
+    co_await SleepAwaiter(loop_, chrono::milliseconds(100));
+    token->cancel();
+  };
+
+  run([&]() -> DropboxTask<void> {
+    spawn(loop_, canceller());
+
+    DropboxMetadataResponse res;
+    try {
+      co_await coro.getFileMetadata(DropboxMetadataRequest("/"), res);
+    } catch (DropboxException& e) {
+      code = e.getErrorCode();
+    }
+  }());
+
+  EXPECT_EQ(CANCELLED, code);
+  EXPECT_GT(chrono::seconds(2), Clock::now() - start);
+}
+
+// Throttled calls are sent again once the Retry-After delay has passed
+TEST_F(DropboxCoroutineTestCase, ThrottleTest) {
+  DropboxCoroApi coro(*api_, loop_);
+  shared_ptr<util::ConcurrencyLimiter> l =
+    api_->getConcurrencyLimiter(METADATA_ENDPOINTS);
+  uint64_t throttles = l->getThrottleCount();
+  uint64_t requests = server->getRequestCount();
+
+  server->failRequests(2, TOO_MANY_REQUESTS);
+  run([&]() -> DropboxTask<void> {
+    DropboxMetadataResponse res;
+    EXPECT_EQ(SUCCESS,
+      co_await coro.getFileMetadata(DropboxMetadataRequest("/"), res));
+  }());
+  server->failRequests(0, 0);
+
+  EXPECT_EQ(3UL, server->getRequestCount() - requests);
+  EXPECT_EQ(throttles + 2, l->getThrottleCount());
+}
+
+// An expired token is refreshed once and the call goes again
+TEST_F(DropboxCoroutineTestCase, RefreshTest) {
+  api_->setAccessToken("expired-token");
+  api_->setRefreshToken("mock-refresh");
+  server->setRejectedToken("expired-token");
+  uint64_t tokens = server->getTokenCount();
+
+  DropboxCoroApi coro(*api_, loop_);
+  run([&]() -> DropboxTask<void> {
+    DropboxMetadataResponse res;
+    EXPECT_EQ(SUCCESS,
+      co_await coro.getFileMetadata(DropboxMetadataRequest("/"), res));
+
+    // Later calls use the new token
+    EXPECT_EQ(SUCCESS,
+      co_await coro.getFileMetadata(DropboxMetadataRequest("/"), res));
+  }());
+  server->setRejectedToken("");
+
+  EXPECT_EQ(tokens + 1, server->getTokenCount());
+}
+
+// Calls wait for a slot of the concurrency limiter without holding the
+// loop, and are admitted in priority order
+TEST_F(DropboxCoroutineTestCase, AdmissionTest) {
+  shared_ptr<util::ConcurrencyLimiter> l =
+    api_->getConcurrencyLimiter(METADATA_ENDPOINTS);
+  l->setScheduling(util::STRICT_SCHEDULING);
+  l->setReservedSlots(0);
+
+  size_t held = 0;
+  uint64_t ticket;
+  while (l->tryAcquire(util::PRIORITY_INTERACTIVE, ticket)) {
+    ++held;
+  }
+  ASSERT_LT(0UL, held);
+
+  DropboxRequestContext bulkContext;
+  bulkContext.setPriority(util::PRIORITY_BULK);
+  DropboxCoroApi bulk(*api_, loop_, bulkContext);
+
+  DropboxRequestContext interactiveContext;
+  interactiveContext.setPriority(util::PRIORITY_INTERACTIVE);
+  DropboxCoroApi interactive(*api_, loop_, interactiveContext);
+
+  vector<string> order;
+  auto call = [&](DropboxCoroApi& coro, string name) -> DropboxTask<void> {
+    DropboxMetadataResponse res;
+    EXPECT_EQ(SUCCESS,
+      co_await coro.getFileMetadata(DropboxMetadataRequest("/"), res));
+    order.push_back(name);
+  };
+
+  run([&]() -> DropboxTask<void> {
+    spawn(loop_, call(bulk, "bulk"));
+    co_await SleepAwaiter(loop_, chrono::milliseconds(20));
+    spawn(loop_, call(interactive, "interactive"));
+    co_await SleepAwaiter(loop_, chrono::milliseconds(20));
+
+    // Both are queued while the loop goes on
+    EXPECT_EQ(1UL, l->getWaiting(util::PRIORITY_BULK));
+    EXPECT_EQ(1UL, l->getWaiting(util::PRIORITY_INTERACTIVE));
+    EXPECT_TRUE(order.empty());
+
+    // One slot; the bulk call gets the one the other gives back
+    l->abandon();
+    --held;
+    for (int i = 0; i < 200 && order.size() < 2; ++i) {
+      co_await SleepAwaiter(loop_, chrono::milliseconds(5));
+    }
+  }());
+
+  while (held--) {
+    l->abandon();
+  }
+  l->setScheduling(util::WEIGHTED_SCHEDULING);
+  l->setReservedSlots(1);
+
+  ASSERT_EQ(2UL, order.size());
+  EXPECT_EQ("interactive", order[0]);
+  EXPECT_EQ("bulk", order[1]);
+}
+#endif
+
+TEST(ConcurrencyLimiterTestCase, DecreaseOncePerEpochTest) {
+  util::ConcurrencyLimiter l(8, 1, 64, 0.5);
+
+  // Throttles for requests admitted before the cut only cut once
+  uint64_t t[4];
+  for (int i = 0; i < 4; ++i) {
+    t[i] = l.acquire();
+  }
+  EXPECT_EQ(4, l.getInFlight());
+
+  l.release(t[0], true);
+  EXPECT_EQ(4, l.getLimit());
+  l.release(t[1], true);
+  l.release(t[2], true);
+  EXPECT_EQ(4, l.getLimit());
+  EXPECT_EQ(3, l.getThrottleCount());
+
+  // A request admitted after the cut starts a new epoch
+  uint64_t later = l.acquire();
+  l.release(later, true);
+  EXPECT_EQ(2, l.getLimit());
+
+  l.release(t[3], true);
+  EXPECT_EQ(2, l.getLimit());
+  EXPECT_EQ(0, l.getInFlight());
+
+  // Never below the minimum
+  for (int i = 0; i < 4; ++i) {
+    l.release(l.acquire(), true);
+  }
+  EXPECT_EQ(1, l.getLimit());
+}
+
+TEST(ConcurrencyLimiterTestCase, RetryAfterTest) {
+  typedef util::ConcurrencyLimiter::Clock Clock;
+  util::ConcurrencyLimiter l;
+
+  Clock::time_point start = Clock::now();
+  l.release(l.acquire(), true, chrono::milliseconds(200));
+
+  // Everyone holds off until the delay is over
+  uint64_t ticket;
+  EXPECT_FALSE(l.acquire(util::PRIORITY_INTERACTIVE,
+    Clock::now() + chrono::milliseconds(50), NULL, ticket));
+
+  ticket = l.acquire();
+  EXPECT_LE(chrono::milliseconds(200), Clock::now() - start);
+  EXPECT_GT(chrono::milliseconds(400), Clock::now() - start);
+  l.release(ticket, false);
+
+  // A shorter delay does not bring the resume time forward
+  start = Clock::now();
+  l.release(l.acquire(), true, chrono::milliseconds(200));
+  l.release(l.acquire(), true, chrono::milliseconds(10));
+  l.release(l.acquire(), false);
+  EXPECT_LE(chrono::milliseconds(200), Clock::now() - start);
+}
+
+// Waiters queued without blocking take their turn with the blocking ones
+TEST(ConcurrencyLimiterTestCase, AsyncWaiterTest) {
+  typedef util::ConcurrencyLimiter::Clock Clock;
+  util::ConcurrencyLimiter l(1, 1, 1);
+  l.setReservedSlots(0);
+
+  uint64_t held = l.acquire();
+  size_t wakes = 0;
+  uint64_t waiter = l.enqueue(util::PRIORITY_NORMAL, [&]() { ++wakes; });
+
+  uint64_t ticket;
+  Clock::time_point retryAt;
+  EXPECT_FALSE(l.tryAdmit(waiter, ticket, retryAt));
+  EXPECT_EQ(Clock::time_point(), retryAt);
+
+  // A blocking waiter behind it waits for its turn
+  atomic<bool> admitted(false);
+  thread blocked([&]() {
+    l.release(l.acquire(), false);
+    admitted = true;
+  });
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  // A throttle holds it back until the delay is over
+  l.release(held, true, chrono::milliseconds(100));
+  EXPECT_EQ(1UL, wakes);
+  EXPECT_FALSE(l.tryAdmit(waiter, ticket, retryAt));
+  EXPECT_LT(Clock::now(), retryAt);
+
+  this_thread::sleep_for(retryAt - Clock::now());
+  EXPECT_TRUE(l.tryAdmit(waiter, ticket, retryAt));
+  EXPECT_FALSE(admitted.load());
+
+  l.release(ticket, false);
+  blocked.join();
+  EXPECT_TRUE(admitted.load());
+
+  // Leaving the queue lets the next waiter go
+  held = l.acquire();
+  waiter = l.enqueue(util::PRIORITY_NORMAL, []() {});
+  admitted = false;
+  blocked = thread([&]() {
+    l.release(l.acquire(), false);
+    admitted = true;
+  });
+  this_thread::sleep_for(chrono::milliseconds(50));
+  l.release(held, false);
+  this_thread::sleep_for(chrono::milliseconds(50));
+  EXPECT_FALSE(admitted.load());
+
+  l.leave(waiter);
+  blocked.join();
+  EXPECT_TRUE(admitted.load());
+  EXPECT_EQ(0UL, l.getInFlight());
+}
+
+TEST(ConcurrencyLimiterTestCase, RecoveryTest) {
+  util::ConcurrencyLimiter l(2, 1, 5, 0.5);
+
+  l.release(l.acquire(), true);
+  EXPECT_EQ(1, l.getLimit());
+
+  // About one more slot per window of successes
+  l.release(l.acquire(), false);
+  EXPECT_EQ(2, l.getLimit());
+  for (int i = 0; i < 10; ++i) {
+    l.release(l.acquire(), false);
+  }
+  EXPECT_EQ(4, l.getLimit());
+
+  // Up to the maximum
+  for (int i = 0; i < 100; ++i) {
+    l.release(l.acquire(), false);
+  }
+  EXPECT_EQ(5, l.getLimit());
+}
+
+TEST(ConcurrencyLimiterTestCase, SharedPerAccountTest) {
+  DropboxApi2 a("mock-key", "mock-secret");
+  DropboxApi2 b("mock-key", "mock-secret");
+  a.setAccessToken("shared-token");
+  b.setAccessToken("shared-token");
+
+  // The server throttles per account, so what one instance learns about
+  // the limit applies to the other
+  shared_ptr<util::ConcurrencyLimiter> l =
+    a.getConcurrencyLimiter(CONTENT_ENDPOINTS);
+  EXPECT_EQ(l, b.getConcurrencyLimiter(CONTENT_ENDPOINTS));
+  EXPECT_NE(l, a.getConcurrencyLimiter(METADATA_ENDPOINTS));
+  l->release(l->acquire(), true);
+  EXPECT_EQ(l->getLimit(),
+    b.getConcurrencyLimiter(CONTENT_ENDPOINTS)->getLimit());
+
+  b.setAccessToken("other-token");
+  EXPECT_NE(l, b.getConcurrencyLimiter(CONTENT_ENDPOINTS));
+
+  // Instances without an account do not share
+  DropboxApi2 c1("mock-key", "mock-secret");
+  DropboxApi2 c2("mock-key", "mock-secret");
+  EXPECT_NE(c1.getConcurrencyLimiter(CONTENT_ENDPOINTS),
+    c2.getConcurrencyLimiter(CONTENT_ENDPOINTS));
+}
+
+TEST(RetryPolicyTestCase, JitterTest) {
+  util::RetryPolicy p(3, chrono::milliseconds(10), chrono::milliseconds(100));
+
+  // Each delay lies between the base delay and three times the previous
+  // one, within the cap, and they are spread out
+  chrono::milliseconds previous = p.getBaseDelay();
+  set<long> seen;
+  for (int i = 0; i < 1000; ++i) {
+    chrono::milliseconds delay = p.nextDelay(previous);
+    EXPECT_LE(10, delay.count());
+    EXPECT_GE(min(previous.count() * 3, 100L), delay.count());
+    seen.insert(delay.count());
+    previous = delay;
+  }
+  EXPECT_LT(10UL, seen.size());
+
+  // Settings out of range are corrected
+  EXPECT_EQ(1UL, util::RetryPolicy(0).getMaxAttempts());
+  EXPECT_EQ(chrono::milliseconds(100), util::RetryPolicy(3,
+    chrono::milliseconds(100), chrono::milliseconds(10)).getMaxDelay());
+}
+
+class RetryTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+    api_->setRetryPolicy(util::RetryPolicy(3, chrono::milliseconds(1),
+      chrono::milliseconds(10)));
+  }
+
+  void TearDown() {
+    if (server) {
+      server->failRequests(0, 0);
+      server->dropRequests(0);
+    }
+  }
+
+  DropboxErrorCode getMetadata() {
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    try {
+      return api_->getFileMetadata(req, res);
+    } catch (DropboxException& e) {
+      return e.getErrorCode();
+    }
+  }
+
+  DropboxErrorCode createFolder() {
+    const ::testing::TestInfo* test =
+      ::testing::UnitTest::GetInstance()->current_test_info();
+    DropboxMetadata m;
+    try {
+      return api_->createFolder(string("/retry/") + test->name(), m);
+    } catch (DropboxException& e) {
+      return e.getErrorCode();
+    }
+  }
+
+  // Requests the server got for a call
+  uint64_t sent(function<void()> call) {
+    uint64_t requests = server->getRequestCount();
+    call();
+    return server->getRequestCount() - requests;
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+};
+
+// Reads go again after a server error or a dropped connection, up to the
+// policy's number of attempts
+TEST_F(RetryTestCase, TransientTest) {
+  server->failRequests(2, 500);
+  EXPECT_EQ(3UL, sent([&]() { EXPECT_EQ(SUCCESS, getMetadata()); }));
+
+  server->dropRequests(2);
+  EXPECT_EQ(3UL, sent([&]() { EXPECT_EQ(SUCCESS, getMetadata()); }));
+
+  server->failRequests(3, 500);
+  EXPECT_EQ(3UL, sent([&]() { EXPECT_EQ(500, getMetadata()); }));
+
+  server->dropRequests(3);
+  EXPECT_EQ(3UL, sent([&]() { EXPECT_EQ(CURL_ERROR, getMetadata()); }));
+}
+
+// Calls that change state may have taken effect before the failure, so
+// they are never sent twice
+TEST_F(RetryTestCase, NonIdempotentTest) {
+  server->failRequests(1, 500);
+  EXPECT_EQ(1UL, sent([&]() { EXPECT_EQ(500, createFolder()); }));
+
+  server->dropRequests(1);
+  EXPECT_EQ(1UL, sent([&]() { EXPECT_EQ(CURL_ERROR, createFolder()); }));
+
+  // Neither failed call reached the filesystem
+  EXPECT_EQ(1UL, sent([&]() { EXPECT_EQ(SUCCESS, createFolder()); }));
+}
+
+class HedgingTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    if (!server) {
+      GTEST_SKIP() << "Only run against the mock server";
+    }
+
+    api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+    api_->setAccessToken("mock-token");
+    api_->setRateLimitAccount("hedging-account");
+    api_->setHedging(true);
+
+    // Hedging starts once the latency of fast calls is known, so a call
+    // slower than a few ms gets a copy
+    for (int i = 0; i < 30; ++i) {
+      ASSERT_EQ(SUCCESS, getMetadata());
+    }
+
+    hedges_ = api_->getHedgeCount();
+    wins_ = api_->getHedgeWinCount();
+    requests_ = server->getRequestCount();
+    server->setLatency(chrono::milliseconds(100));
+  }
+
+  void TearDown() {
+    if (server) {
+      server->setLatency(chrono::microseconds(0));
+      server->failRequests(0, 0);
+      DropboxRateLimiter::getInstance()->setAccountLimits("hedging-account",
+        DropboxRateLimits());
+    }
+  }
+
+  DropboxErrorCode getMetadata() {
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    return api_->getFileMetadata(req, res);
+  }
+
+  unique_ptr<DropboxApi2>   api_;
+  uint64_t                  hedges_;
+  uint64_t                  wins_;
+  uint64_t                  requests_;
+};
+
+TEST_F(HedgingTestCase, SuccessWinsTest) {
+  // Both copies succeed; the primary was sent first and answers first
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(hedges_ + 1, api_->getHedgeCount());
+  EXPECT_EQ(wins_, api_->getHedgeWinCount());
+
+  // The primary fails first; the copy's answer is used and nothing is
+  // retried
+  server->failRequests(1, 503);
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(hedges_ + 2, api_->getHedgeCount());
+  EXPECT_EQ(wins_ + 1, api_->getHedgeWinCount());
+  EXPECT_EQ(requests_ + 4, server->getRequestCount());
+}
+
+TEST_F(HedgingTestCase, BothFailTest) {
+  api_->setThrottleRetries(0);
+  server->failRequests(2, 503);
+
+  EXPECT_EQ(SERVICE_UNAVAILABLE, getMetadata());
+  EXPECT_EQ(hedges_ + 1, api_->getHedgeCount());
+  EXPECT_EQ(requests_ + 2, server->getRequestCount());
+}
+
+TEST_F(HedgingTestCase, LimitsTest) {
+  // With every other slot taken, there is none left for a copy
+  shared_ptr<util::ConcurrencyLimiter> limiter =
+    api_->getConcurrencyLimiter(METADATA_ENDPOINTS);
+  size_t held = limiter->getLimit() - 2;
+  for (size_t i = 0; i < held; ++i) {
+    limiter->acquire();
+  }
+
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(hedges_, api_->getHedgeCount());
+
+  for (size_t i = 0; i < held; ++i) {
+    limiter->abandon();
+  }
+
+  // Nor is there when the account's call rate is used up by the primary
+  DropboxRateLimits limits;
+  limits.callsPerSecond_ = 0.1;
+  limits.callBurst_ = 1;
+  DropboxRateLimiter::getInstance()->setAccountLimits("hedging-account",
+    limits);
+
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(hedges_, api_->getHedgeCount());
+  EXPECT_EQ(requests_ + 2, server->getRequestCount());
+}
+
+// Slow calls get no copy until there are enough latencies to tell slow
+// from usual
+TEST_F(HedgingTestCase, WarmupTest) {
+  api_.reset(new DropboxApi2("mock-key", "mock-secret"));
+  api_->setAccessToken("mock-token");
+  api_->setRateLimitAccount("hedging-account");
+  api_->setHedging(true);
+  server->setLatency(chrono::microseconds(0));
+
+  for (int i = 0; i < 19; ++i) {
+    ASSERT_EQ(SUCCESS, getMetadata());
+  }
+  server->delayRequests(1, chrono::milliseconds(200));
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(0UL, api_->getHedgeCount());
+
+  // That call made 20, enough for the 95th percentile
+  server->delayRequests(1, chrono::milliseconds(200));
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_EQ(1UL, api_->getHedgeCount());
+  EXPECT_EQ(1UL, api_->getHedgeWinCount());
+}
+
+// Once the copy has won, the primary is aborted rather than waited for,
+// and the slot taken for the copy goes back to the limiter
+TEST_F(HedgingTestCase, LoserTest) {
+  typedef chrono::steady_clock Clock;
+  shared_ptr<util::ConcurrencyLimiter> limiter =
+    api_->getConcurrencyLimiter(METADATA_ENDPOINTS);
+  server->setLatency(chrono::microseconds(0));
+  server->delayRequests(1, chrono::seconds(2));
+
+  Clock::time_point start = Clock::now();
+  EXPECT_EQ(SUCCESS, getMetadata());
+  EXPECT_GT(chrono::seconds(1), Clock::now() - start);
+
+  EXPECT_EQ(hedges_ + 1, api_->getHedgeCount());
+  EXPECT_EQ(wins_ + 1, api_->getHedgeWinCount());
+  EXPECT_EQ(0UL, limiter->getInFlight());
+  EXPECT_EQ(requests_ + 2, server->getRequestCount());
+}
+
+TEST(TokenBucketTestCase, BurstTest) {
+  util::TokenBucket b(10, 5);
+
+  // A full bucket allows a burst of its capacity, and no more
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(b.tryTake(1));
+  }
+  EXPECT_FALSE(b.tryTake(1));
+
+  // Reservations overdraw it and are told to wait for the refill
+  chrono::microseconds wait = b.reserve(1);
+  EXPECT_LT(chrono::milliseconds(90), wait);
+  EXPECT_GE(chrono::milliseconds(100), wait);
+  wait = b.reserve(2);
+  EXPECT_LT(chrono::milliseconds(290), wait);
+  EXPECT_GE(chrono::milliseconds(300), wait);
+
+  // Refunds and shrinking the bucket keep it within its capacity
+  util::TokenBucket c(10, 5);
+  c.refund(10);
+  c.setRate(10, 2);
+  EXPECT_TRUE(c.tryTake(2));
+  EXPECT_FALSE(c.tryTake(1));
+}
+
+TEST(TokenBucketTestCase, RefillTest) {
+  util::TokenBucket b(100, 10);
+
+  EXPECT_EQ(0, b.reserve(10).count());
+  chrono::microseconds wait = b.reserve(5);
+  EXPECT_LT(chrono::milliseconds(45), wait);
+  EXPECT_GE(chrono::milliseconds(50), wait);
+
+  // Tokens accrue at the rate, up to the capacity
+  this_thread::sleep_for(chrono::milliseconds(300));
+  EXPECT_TRUE(b.tryTake(10));
+  EXPECT_FALSE(b.tryTake(1));
+
+  this_thread::sleep_for(chrono::milliseconds(50));
+  EXPECT_TRUE(b.tryTake(4));
+  EXPECT_FALSE(b.tryTake(4));
+}
+
+TEST(DropboxRateLimiterTestCase, AccountNameTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxRateLimiter* limiter = DropboxRateLimiter::getInstance();
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("secret-token");
+
+  // Accounts are named by a hash, not by the token itself
+  string name = api.getRateLimitAccount();
+  EXPECT_EQ(0, name.find("token:"));
+  EXPECT_EQ(string::npos, name.find("secret-token"));
+  EXPECT_EQ(name, DropboxApi2("mock-key", "mock-secret",
+    "secret-token").getRateLimitAccount());
+  EXPECT_NE(name, DropboxApi2("other-key", "mock-secret",
+    "secret-token").getRateLimitAccount());
+
+  DropboxRateLimits limits;
+  limits.callsPerSecond_ = 1000;
+  limits.callBurst_ = 100;
+  limiter->setAccountLimits(name, limits);
+
+  DropboxAccountInfo info;
+  EXPECT_EQ(SUCCESS, api.getAccountInfo(info));
+
+  // Once the account id is known the limits follow the account to its new
+  // name, along with its concurrency limiter
+  string account = api.getRateLimitAccount();
+  EXPECT_EQ(0, account.find("account:"));
+  EXPECT_EQ(0, limiter->getAccountStats(name).reservations_);
+  EXPECT_EQ(1, limiter->getAccountStats(account).reservations_);
+
+  // A token refreshed in the background keeps the account's name
+  shared_ptr<util::ConcurrencyLimiter> l =
+    api.getConcurrencyLimiter(CONTENT_ENDPOINTS);
+  api.setRefreshToken("mock-refresh", chrono::seconds(1));
+  api.startAutoRefresh(chrono::seconds(1));
+
+  DropboxApi2 other("mock-key", "mock-secret", "secret-token");
+  other.setRefreshToken("mock-refresh", chrono::seconds(1));
+  string otherName = other.getRateLimitAccount();
+  limiter->setAccountLimits(otherName, limits);
+  shared_ptr<util::ConcurrencyLimiter> otherLimiter =
+    other.getConcurrencyLimiter(CONTENT_ENDPOINTS);
+  other.startAutoRefresh(chrono::seconds(1));
+
+  // Without the account id, the limits move to the new token's name
+  for (int i = 0; i < 100 && other.getRateLimitAccount() == otherName; ++i) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  string refreshed = other.getRateLimitAccount();
+  EXPECT_NE(otherName, refreshed);
+  EXPECT_EQ(0, refreshed.find("token:"));
+  EXPECT_EQ(otherLimiter, other.getConcurrencyLimiter(CONTENT_ENDPOINTS));
+  EXPECT_EQ(0, limiter->getAccountStats(otherName).reservations_);
+
+  EXPECT_EQ(account, api.getRateLimitAccount());
+  EXPECT_EQ(l, api.getConcurrencyLimiter(CONTENT_ENDPOINTS));
+
+  limiter->setAccountLimits(account, DropboxRateLimits());
+  limiter->setAccountLimits(refreshed, DropboxRateLimits());
+}
+
+TEST(TokenRefreshTestCase, SingleFlightTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("expired-token");
+  api.setRefreshToken("mock-refresh");
+  server->setRejectedToken("expired-token");
+
+  // Latency makes every thread see the 401 before the refresh is done
+  server->setLatency(chrono::milliseconds(50));
+  uint64_t tokens = server->getTokenCount();
+
+  const int THREADS = 8;
+  vector<thread> threads;
+  atomic<int> succeeded(0);
+  for (int i = 0; i < THREADS; ++i) {
+    threads.push_back(thread([&]() {
+      DropboxMetadataRequest req("/");
+      DropboxMetadataResponse res;
+      if (api.getFileMetadata(req, res) == SUCCESS) {
+        ++succeeded;
+      }
+    }));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+
+  server->setLatency(chrono::microseconds(0));
+
+  // One refresh served them all, and each request went through
+  EXPECT_EQ(THREADS, succeeded.load());
+  EXPECT_EQ(tokens + 1, server->getTokenCount());
+
+  // Later calls use the new token
+  server->setRejectedToken("expired-token");
+  DropboxAccountInfo info;
+  EXPECT_EQ(SUCCESS, api.getAccountInfo(info));
+  EXPECT_EQ(tokens + 1, server->getTokenCount());
+  server->setRejectedToken("");
+}
+
+// A margin longer than the token's lifetime must not refresh in a loop
+TEST(TokenRefreshTestCase, LargeMarginTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  server->setTokenLifetime(2);
+  uint64_t tokens = server->getTokenCount();
+
+  // Each token is refreshed once half of its lifetime is used up
+  {
+    DropboxApi2 api("mock-key", "mock-secret");
+    api.setRefreshToken("mock-refresh", chrono::seconds(2));
+    api.startAutoRefresh(chrono::seconds(300));
+    this_thread::sleep_for(chrono::milliseconds(2500));
+  }
+  server->setTokenLifetime(14400);
+
+  uint64_t refreshes = server->getTokenCount() - tokens;
+  EXPECT_LE(1UL, refreshes);
+  EXPECT_GE(3UL, refreshes);
+}
+
+// Readers add the authorization header to new requests while change()
+// replaces the token "...token-<n>" with a newer one and returns its n. A
+// header must hold a whole token, of the form header(n), and never one
+// older than the last change made before the header was added.
+static void checkTokenSwaps(function<uint64_t()> change,
+    function<void(HttpRequest*)> authorize,
+    function<string(uint64_t)> header,
+    int changes) {
+  HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+  atomic<uint64_t> published(0);
+  atomic<uint64_t> headers(0);
+  atomic<bool> stop(false);
+
+  vector<thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.push_back(thread([&]() {
+      uint64_t last = 0;
+
+      while (!stop.load()) {
+        uint64_t floor = published.load();
+        unique_ptr<HttpRequest> r(
+          factory->createHttpRequest("http://localhost/"));
+        authorize(r.get());
+
+        string h = r->getHeader("Authorization");
+        size_t at = h.find("token-");
+        uint64_t n = at == string::npos ? 0 :
+          strtoull(h.c_str() + at + 6, NULL, 10);
+        ++headers;
+
+        if (h != header(n) || n < floor || n < last) {
+          ADD_FAILURE() << "Got '" << h << "' after token " << floor;
+          return;
+        }
+        last = n;
+      }
+    }));
+  }
+
+  for (int i = 0; i < changes; ++i) {
+    published.store(change());
+    this_thread::sleep_for(chrono::microseconds(200));
+  }
+  stop.store(true);
+
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  EXPECT_LT(0UL, headers.load());
+
+  unique_ptr<HttpRequest> r(factory->createHttpRequest("http://localhost/"));
+  authorize(r.get());
+  EXPECT_EQ(header(published.load()), r->getHeader("Authorization"));
+}
+
+TEST(TokenSwapTestCase, OAuthTest) {
+  oauth::OAuth o("key", "secret");
+  o.setAccessTokenSecret("access-secret");
+  o.setAccessToken("token-0");
+
+  HttpRequestFactory* factory = HttpRequestFactory::createFactory();
+  unique_ptr<HttpRequest> r(factory->createHttpRequest("http://localhost/"));
+  o.addOAuthAccessHeader(r.get());
+  string first = r->getHeader("Authorization");
+  size_t at = first.find("token-0");
+  ASSERT_NE(string::npos, at);
+
+  uint64_t n = 0;
+  checkTokenSwaps([&]() {
+    o.setAccessToken("token-" + to_string(++n));
+    return n;
+  }, [&](HttpRequest* r) {
+    o.addOAuthAccessHeader(r);
+  }, [&](uint64_t n) {
+    return string(first).replace(at, 7, "token-" + to_string(n));
+  }, 500);
+}
+
+TEST(TokenSwapTestCase, OAuth2Test) {
+  oauth::OAuth2 o("key", "secret");
+  o.setAccessToken("token-0");
+
+  uint64_t n = 0;
+  checkTokenSwaps([&]() {
+    o.setAccessToken("token-" + to_string(++n));
+    return n;
+  }, [&](HttpRequest* r) {
+    o.addOAuthAccessHeader(r);
+  }, [](uint64_t n) {
+    return "Bearer token-" + to_string(n);
+  }, 500);
+}
+
+// Refreshes replace the token through setToken
+TEST(TokenSwapTestCase, RefreshTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  oauth::OAuth2 o("mock-key", "mock-secret");
+  o.setAccessToken("mock-token-0");
+  o.setRefreshToken("mock-refresh");
+
+  checkTokenSwaps([&]() {
+    EXPECT_TRUE(o.refreshAccessToken());
+    string token = o.getAccessToken();
+    return strtoull(token.c_str() + token.rfind('-') + 1, NULL, 10);
+  }, [&](HttpRequest* r) {
+    o.addOAuthAccessHeader(r);
+  }, [](uint64_t n) {
+    return "Bearer mock-token-" + to_string(n);
+  }, 100);
+}
+
+TEST(ConcurrencyLimiterTestCase, ReservedSlotsTest) {
+  typedef util::ConcurrencyLimiter::Clock Clock;
+  util::ConcurrencyLimiter l(4, 1, 64, 0.5);
+  l.setReservedSlots(1);
+
+  // Bulk requests can only fill the slots above the reservation
+  vector<uint64_t> tickets;
+  for (int i = 0; i < 3; ++i) {
+    tickets.push_back(l.acquire(util::PRIORITY_BULK));
+  }
+  uint64_t ticket;
+  EXPECT_FALSE(l.acquire(util::PRIORITY_BULK,
+    Clock::now() + chrono::milliseconds(20), NULL, ticket));
+  EXPECT_FALSE(l.acquire(util::PRIORITY_NORMAL,
+    Clock::now() + chrono::milliseconds(20), NULL, ticket));
+
+  // which leaves one for an interactive request
+  EXPECT_TRUE(l.acquire(util::PRIORITY_INTERACTIVE,
+    Clock::now() + chrono::milliseconds(20), NULL, ticket));
+  EXPECT_EQ(4, l.getInFlight());
+  l.abandon();
+
+  for (size_t i = 0; i < tickets.size(); ++i) {
+    l.abandon();
+  }
+}
+
+TEST(ConcurrencyLimiterTestCase, InteractiveUnderLoadTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  typedef chrono::steady_clock Clock;
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+  api.setRateLimitAccount("priority-account");
+  shared_ptr<util::ConcurrencyLimiter> limiter =
+    api.getConcurrencyLimiter(METADATA_ENDPOINTS);
+  size_t limit = limiter->getLimit();
+
+  server->setLatency(chrono::milliseconds(200));
+
+  // Twice as many bulk calls as there are slots keep the queue full
+  vector<thread> threads;
+  for (size_t i = 0; i < 2 * limit; ++i) {
+    threads.push_back(thread([&]() {
+      DropboxPriorityScope p(util::PRIORITY_BULK);
+      DropboxMetadataRequest req("/");
+      DropboxMetadataResponse res;
+      EXPECT_EQ(SUCCESS, api.getFileMetadata(req, res));
+    }));
+  }
+
+  for (int i = 0; i < 100 && limiter->getWaiting(util::PRIORITY_BULK) <
+      limit; ++i) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  EXPECT_EQ(limit - 1, limiter->getInFlight());
+  EXPECT_LE(limit, limiter->getWaiting(util::PRIORITY_BULK));
+
+  // An interactive call goes straight to the reserved slot, taking one
+  // round trip instead of waiting for the bulk calls ahead of it
+  Clock::time_point start = Clock::now();
+  {
+    DropboxPriorityScope p(util::PRIORITY_INTERACTIVE);
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    EXPECT_EQ(SUCCESS, api.getFileMetadata(req, res));
+  }
+  EXPECT_GT(chrono::milliseconds(350), Clock::now() - start);
+  EXPECT_LT(0, limiter->getWaiting(util::PRIORITY_BULK));
+
+  for (thread& t : threads) {
+    t.join();
+  }
+  server->setLatency(chrono::microseconds(0));
+}
+
+// Moves bytes through a limiter in chunks, as a transfer's callbacks do,
+// for a while
+static uint64_t transferThrough(util::BandwidthLimiter& l,
+    chrono::milliseconds duration,
+    int threads) {
+  typedef chrono::steady_clock Clock;
+  Clock::time_point end = Clock::now() + duration;
+  atomic<uint64_t> moved(0);
+
+  vector<thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(thread([&]() {
+      while (Clock::now() < end) {
+        this_thread::sleep_for(l.reserve(16 * 1024));
+        moved += 16 * 1024;
+      }
+    }));
+  }
+  for (thread& t : workers) {
+    t.join();
+  }
+
+  return moved.load();
+}
+
+TEST(BandwidthLimiterTestCase, RateTest) {
+  const double RATE = 1 << 20;
+  const double BURST = 128 * 1024;
+  util::BandwidthLimiter l(RATE, BURST);
+
+  // Concurrent transfers share the rate; over a second they move it plus
+  // the burst, and a chunk each that was granted before the end
+  for (int threads : { 1, 4 }) {
+    uint64_t moved = transferThrough(l, chrono::milliseconds(1000), threads);
+    EXPECT_GE(RATE + BURST + threads * 16 * 1024, moved) << threads;
+    EXPECT_LE(0.85 * RATE, moved) << threads;
+  }
+
+  // Unlimited
+  l.setRate(0);
+  EXPECT_EQ(0, l.reserve(100 * (1 << 20)).count());
+}
+
+TEST(BandwidthLimiterTestCase, ScheduleTest) {
+  const double RATE = 2 * (1 << 20);
+  const double WINDOW_RATE = 512 * 1024;
+  util::BandwidthLimiter l(RATE, 64 * 1024);
+
+  // Today at 9:59, local time
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  local.tm_hour = 9;
+  local.tm_min = 59;
+  local.tm_sec = 0;
+  atomic<time_t> wall(mktime(&local));
+  l.setWallClock([&]() { return wall.load(); });
+  l.addSchedule(chrono::hours(10), chrono::hours(11), WINDOW_RATE);
+
+  EXPECT_EQ(RATE, l.getRate());
+  uint64_t moved = transferThrough(l, chrono::milliseconds(500), 2);
+  EXPECT_GE(RATE / 2 + 64 * 1024 + 2 * 16 * 1024, moved);
+  EXPECT_LE(0.85 * RATE / 2, moved);
+
+  // The window opens while transfers are going on. The rate in effect is
+  // looked up once a second, so it changes within a second.
+  wall += 60;
+  transferThrough(l, chrono::milliseconds(1000), 2);
+  EXPECT_EQ(WINDOW_RATE, l.getRate());
+  moved = transferThrough(l, chrono::milliseconds(1000), 2);
+  EXPECT_GE(WINDOW_RATE + 64 * 1024 + 2 * 16 * 1024, moved);
+  EXPECT_LE(0.85 * WINDOW_RATE, moved);
+
+  // And closes again
+  wall += 60 * 60;
+  transferThrough(l, chrono::milliseconds(1000), 2);
+  EXPECT_EQ(RATE, l.getRate());
+  moved = transferThrough(l, chrono::milliseconds(500), 2);
+  EXPECT_LE(0.85 * RATE / 2, moved);
+
+  l.setWallClock(nullptr);
+}
+
+// Listen on a loopback port without ever accepting. Requests sent to it
+// connect but get no response.
+static int listenLoopback(int backlog, int& port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+
+  if (fd < 0 || ::bind(fd, (sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, backlog) || getsockname(fd, (sockaddr *)&addr, &len)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  port = ntohs(addr.sin_port);
+  return fd;
+}
+
+class RequestTimeoutTestCase : public ::testing::Test {
+public:
+  void SetUp() {
+    factory_ = HttpRequestFactory::createFactory();
+    connectTimeout_ = factory_->getConnectTimeout();
+    stallTimeout_ = factory_->getStallTimeout();
+    factory_->setConnectTimeout(chrono::milliseconds(300));
+    factory_->setStallTimeout(chrono::seconds(1));
+  }
+
+  void TearDown() {
+    factory_->setConnectTimeout(connectTimeout_);
+    factory_->setStallTimeout(stallTimeout_);
+    if (server) {
+      server->setLatency(chrono::microseconds(0));
+    }
+  }
+
+  // Run a request to a loopback port, returning how long it took
+  chrono::milliseconds execute(int port, int& ret) {
+    stringstream url;
+    url << "http://127.0.0.1:" << port << "/";
+    unique_ptr<HttpRequest> r(factory_->createHttpRequest(url.str()));
+
+    auto start = chrono::steady_clock::now();
+    ret = r->execute();
+    return chrono::duration_cast<chrono::milliseconds>(
+      chrono::steady_clock::now() - start);
+  }
+
+  DropboxErrorCode getMetadata(DropboxApi2& api) {
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    try {
+      return api.getFileMetadata(req, res);
+    } catch (DropboxException& e) {
+      return e.getErrorCode();
+    }
+  }
+
+  HttpRequestFactory*       factory_;
+  chrono::milliseconds      connectTimeout_;
+  chrono::seconds           stallTimeout_;
+};
+
+// A server whose accept queue is full drops connection attempts, so the
+// connect timeout is all that ends them
+TEST_F(RequestTimeoutTestCase, ConnectTimeoutTest) {
+  int port;
+  int fd = listenLoopback(0, port);
+  ASSERT_LE(0, fd);
+
+  // Fill the accept queue
+  vector<int> clients;
+  for (int i = 0; i < 4; ++i) {
+    int c = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(c, F_SETFL, O_NONBLOCK);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    connect(c, (sockaddr *)&addr, sizeof(addr));
+    clients.push_back(c);
+  }
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  int ret;
+  chrono::milliseconds elapsed = execute(port, ret);
+  EXPECT_EQ(CURLE_OPERATION_TIMEDOUT, ret);
+  EXPECT_LE(chrono::milliseconds(250), elapsed);
+  EXPECT_GT(chrono::milliseconds(1000), elapsed);
+
+  for (int c : clients) {
+    close(c);
+  }
+  close(fd);
+}
+
+// A connection that never sends a response stalls the transfer
+TEST_F(RequestTimeoutTestCase, StallTest) {
+  int port;
+  int fd = listenLoopback(16, port);
+  ASSERT_LE(0, fd);
+
+  int ret;
+  chrono::milliseconds elapsed = execute(port, ret);
+  EXPECT_EQ(CURLE_OPERATION_TIMEDOUT, ret);
+  EXPECT_LE(chrono::milliseconds(900), elapsed);
+  EXPECT_GT(chrono::milliseconds(3000), elapsed);
+
+  close(fd);
+}
+
+// The deadline ends a call while its response is outstanding
+TEST_F(RequestTimeoutTestCase, DeadlineTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+  ASSERT_EQ(SUCCESS, getMetadata(api));
+  server->setLatency(chrono::milliseconds(2000));
+
+  DropboxRequestContext ctx;
+  ctx.setTimeout(chrono::milliseconds(300));
+  DropboxContextScope scope(ctx);
+
+  auto start = chrono::steady_clock::now();
+  EXPECT_EQ(DEADLINE_EXCEEDED, getMetadata(api));
+  auto elapsed = chrono::steady_clock::now() - start;
+  EXPECT_LE(chrono::milliseconds(250), elapsed);
+  EXPECT_GT(chrono::milliseconds(800), elapsed);
+}
+
+// Cancelling the token ends a call while its response is outstanding
+TEST_F(RequestTimeoutTestCase, CancelTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+  ASSERT_EQ(SUCCESS, getMetadata(api));
+  server->setLatency(chrono::milliseconds(3000));
+
+  // Only cancellation may end the call early
+  factory_->setStallTimeout(chrono::seconds(10));
+
+  auto token = make_shared<util::CancellationToken>();
+  DropboxRequestContext ctx;
+  ctx.setCancellationToken(token);
+  DropboxContextScope scope(ctx);
+
+  thread canceller([&]() {
+    this_thread::sleep_for(chrono::milliseconds(200));
+    token->cancel();
+  });
+
+  auto start = chrono::steady_clock::now();
+  EXPECT_EQ(CANCELLED, getMetadata(api));
+  auto elapsed = chrono::steady_clock::now() - start;
+  canceller.join();
+
+  // Cancellation is noticed from curl's progress callback, which runs at
+  // least once a second
+  EXPECT_LE(chrono::milliseconds(150), elapsed);
+  EXPECT_GT(chrono::milliseconds(1500), elapsed);
+}
+
+TEST(DropboxRequestStatsTestCase, EndpointNameTest) {
+  EXPECT_EQ("metadata", DropboxRequestStats::getEndpoint(
+    "https://api.dropbox.com/1/metadata/dropbox/a/b"));
+  EXPECT_EQ("files_put", DropboxRequestStats::getEndpoint(
+    "https://api-content.dropbox.com/1/files_put/auto/a"));
+  EXPECT_EQ("chunked_upload", DropboxRequestStats::getEndpoint(
+    "https://api-content.dropbox.com/1/chunked_upload"));
+  EXPECT_EQ("files/upload_session/append_v2", DropboxRequestStats::getEndpoint(
+    "https://content.dropboxapi.com/2/files/upload_session/append_v2"));
+  EXPECT_EQ("users/get_account", DropboxRequestStats::getEndpoint(
+    "http://127.0.0.1:8080/2/users/get_account"));
+}
+
+// The stats of each endpoint add up to the requests made to it
+TEST(DropboxRequestStatsTestCase, MockCountsTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  const size_t CALLS = 25;
+  const size_t UPLOADS = 3;
+  const size_t UPLOAD_SIZE = 10000;
+  const chrono::milliseconds LATENCY(10);
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+  DropboxRequestStats& stats = api.getRequestStats();
+
+  DropboxMetadataRequest req("/");
+  DropboxMetadataResponse res;
+  ASSERT_EQ(SUCCESS, api.getFileMetadata(req, res));
+  stats.reset();
+  server->setLatency(LATENCY);
+
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < CALLS; ++i) {
+    ASSERT_EQ(SUCCESS, api.getFileMetadata(req, res));
+  }
+
+  DropboxMetadataRequest missing("/no/such/file");
+  EXPECT_NE(SUCCESS, api.getFileMetadata(missing, res));
+  auto elapsed = chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now() - start);
+
+  vector<uint8_t> data(UPLOAD_SIZE, 'x');
+  for (size_t i = 0; i < UPLOADS; ++i) {
+    DropboxUploadFileRequest up("/statsfile");
+    up.setUploadData(&data[0], data.size());
+    DropboxMetadata m;
+    ASSERT_EQ(SUCCESS, api.uploadFile(up, m));
+  }
+  server->setLatency(chrono::microseconds(0));
+
+  vector<string> endpoints = stats.getEndpoints();
+  EXPECT_EQ(2UL, endpoints.size());
+
+  DropboxEndpointStats s = stats.getStats("metadata");
+  EXPECT_EQ(CALLS + 1, s.requests_);
+  EXPECT_EQ(1UL, s.httpErrors_);
+  EXPECT_EQ(0UL, s.transportErrors_);
+  EXPECT_EQ(0UL, s.bytesSent_);
+  EXPECT_LT(0UL, s.bytesReceived_);
+
+  // The phases split each request's time, and the server's latency is
+  // spent waiting for the first byte
+  EXPECT_EQ(s.total_, s.nameLookup_ + s.connect_ + s.tlsHandshake_ +
+    s.firstByte_ + s.transfer_);
+  EXPECT_LE(chrono::microseconds(LATENCY) * (CALLS + 1), s.firstByte_);
+  EXPECT_GE(elapsed, s.total_);
+  EXPECT_LE(chrono::microseconds(LATENCY), s.maxTotal_);
+  EXPECT_LE(chrono::microseconds(LATENCY), s.p50Total_);
+  EXPECT_LE(s.p50Total_, s.p95Total_);
+  EXPECT_LE(s.p95Total_, s.maxTotal_);
+
+  DropboxEndpointStats up = stats.getStats("files_put");
+  EXPECT_EQ(UPLOADS, up.requests_);
+  EXPECT_EQ(0UL, up.httpErrors_ + up.transportErrors_);
+  EXPECT_EQ(UPLOADS * UPLOAD_SIZE, up.bytesSent_);
+  // With a body, the server's time is counted as transfer
+  EXPECT_LE(chrono::microseconds(LATENCY) * UPLOADS, up.transfer_);
+  // Too few requests for quantiles
+  EXPECT_EQ(chrono::microseconds(0), up.p50Total_);
+
+  stats.reset();
+  EXPECT_TRUE(stats.getEndpoints().empty());
+  EXPECT_EQ(0UL, stats.getStats("metadata").requests_);
+}
+
+// Values recorded and added by threads that have exited still count, and
+// their shards are freed
+TEST(MetricsTestCase, CounterTest) {
+  const int THREADS = 8;
+  const uint64_t ADDS = 10000;
+
+  util::Counter& c = util::Metrics::getInstance()->counter(
+    "tester_counter_total", "Counter test");
+  uint64_t base = c.get();
+  size_t shards = c.getShardCount();
+
+  promise<void> done;
+  shared_future<void> exit = done.get_future().share();
+  atomic<int> added(0);
+
+  vector<thread> threads;
+  for (int i = 0; i < THREADS; ++i) {
+    threads.push_back(thread([&]() {
+      for (uint64_t j = 0; j < ADDS; ++j) {
+        c.add();
+      }
+      c.add(5);
+      ++added;
+      exit.wait();
+    }));
+  }
+
+  while (added.load() < THREADS) {
+    this_thread::yield();
+  }
+  EXPECT_EQ(base + THREADS * (ADDS + 5), c.get());
+  EXPECT_EQ(shards + THREADS, c.getShardCount());
+
+  done.set_value();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(base + THREADS * (ADDS + 5), c.get());
+  EXPECT_EQ(shards, c.getShardCount());
+}
+
+TEST(MetricsTestCase, HistogramTest) {
+  const int THREADS = 4;
+  const uint64_t VALUES = 1000;
+
+  util::Histogram& h = util::Metrics::getInstance()->histogram(
+    "tester_histogram", "Histogram test");
+
+  // Each thread records its share of 1..VALUES, then exits
+  for (int round = 0; round < 10; ++round) {
+    vector<thread> threads;
+    for (int i = 0; i < THREADS; ++i) {
+      threads.push_back(thread([&h, i]() {
+        for (uint64_t v = i + 1; v <= VALUES; v += THREADS) {
+          h.record(v);
+        }
+      }));
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+  EXPECT_EQ(0UL, h.getShardCount());
+
+  util::Histogram::Snapshot snap = h.snapshot();
+  EXPECT_EQ(10 * VALUES, snap.count_);
+  EXPECT_EQ(10 * VALUES * (VALUES + 1) / 2, snap.sum_);
+  EXPECT_EQ(VALUES, snap.max_);
+
+  // Within a sub-bucket, about 3%, of the exact quantile
+  for (double q : { 0.01, 0.25, 0.5, 0.9, 0.99, 0.999, 1.0 }) {
+    double exact = q * VALUES;
+    EXPECT_NEAR(exact, (double)snap.quantile(q), exact / 32 + 1) << q;
+  }
+  EXPECT_EQ(0UL, util::Histogram::Snapshot().quantile(0.5));
+}
+
+// Values on either side of every bucket edge land in the right bucket, and
+// quantiles of them stay inside it
+TEST(MetricsTestCase, BucketEdgeTest) {
+  typedef util::Histogram H;
+
+  for (size_t b = 0; b < H::NUM_BUCKETS; ++b) {
+    uint64_t lo = H::lowestOf(b);
+    uint64_t hi = H::highestOf(b);
+    ASSERT_LE(lo, hi) << b;
+    ASSERT_EQ(b, H::bucketOf(lo)) << b;
+    ASSERT_EQ(b, H::bucketOf(hi)) << b;
+    if (b + 1 < H::NUM_BUCKETS) {
+      ASSERT_EQ(b + 1, H::bucketOf(hi + 1)) << b;
+      // Buckets are no wider than a 32nd of their values
+      ASSERT_LE(hi - lo, lo / 32) << b;
+    }
+
+    for (uint64_t v : { lo, hi }) {
+      if (b + 1 == H::NUM_BUCKETS) {
+        v = lo;
+      }
+
+      H::Snapshot snap;
+      snap.counts_[b] = 100;
+      snap.count_ = 100;
+      snap.max_ = v;
+
+      for (double q : { 0.0, 0.5, 0.999, 1.0 }) {
+        uint64_t est = snap.quantile(q);
+        ASSERT_LE(lo, est) << b << " " << q;
+        ASSERT_GE(v, est) << b << " " << q;
+      }
+    }
+  }
+  EXPECT_EQ(H::NUM_BUCKETS - 1, H::bucketOf(UINT64_MAX));
+
+  // One outlier moves only the top quantile
+  H::Snapshot snap;
+  snap.counts_[H::bucketOf(100)] = 999;
+  snap.counts_[H::bucketOf(100000)] = 1;
+  snap.count_ = 1000;
+  snap.max_ = 100000;
+  EXPECT_EQ(H::bucketOf(100), H::bucketOf(snap.quantile(0.5)));
+  EXPECT_EQ(H::bucketOf(100), H::bucketOf(snap.quantile(0.999)));
+  EXPECT_EQ(H::bucketOf(100000), H::bucketOf(snap.quantile(1)));
+}
+
+// Read a trace file back as Chrome trace JSON
+static boost::property_tree::ptree readTrace(const string& path) {
+  boost::property_tree::ptree pt;
+  boost::property_tree::read_json(path, pt);
+  return pt.get_child("traceEvents");
+}
+
+TEST(TracerTestCase, MockCallsTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  char path[] = "/tmp/tracetestXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  close(fd);
+
+  DropboxApi2 api("mock-key", "mock-secret");
+  api.setAccessToken("mock-token");
+
+  util::Tracer* tracer = util::Tracer::getInstance();
+  ASSERT_TRUE(tracer->start(path));
+  EXPECT_TRUE(util::Tracer::isEnabled());
+
+  for (int i = 0; i < 3; ++i) {
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    EXPECT_EQ(SUCCESS, api.getFileMetadata(req, res));
+  }
+
+  vector<uint8_t> data(1000, 'x');
+  DropboxUploadFileRequest up("/tracefile");
+  up.setUploadData(&data[0], data.size());
+  DropboxMetadata m;
+  EXPECT_EQ(SUCCESS, api.uploadFile(up, m));
+
+  tracer->stop();
+  EXPECT_FALSE(util::Tracer::isEnabled());
+
+  boost::property_tree::ptree events;
+  ASSERT_NO_THROW(events = readTrace(path));
+  unlink(path);
+
+  map<string, int> counts;
+  vector<pair<int64_t, int64_t> > calls;
+  vector<pair<int64_t, int64_t> > requests;
+
+  for (auto& child : events) {
+    const boost::property_tree::ptree& e = child.second;
+    string name = e.get<string>("name");
+    int64_t ts = e.get<int64_t>("ts");
+    int64_t dur = e.get<int64_t>("dur");
+
+    ++counts[name];
+    EXPECT_EQ("X", e.get<string>("ph"));
+    EXPECT_EQ(getpid(), e.get<int>("pid"));
+    EXPECT_LE(0, ts) << name;
+    EXPECT_LE(0, dur) << name;
+
+    if (name == "getFileMetadata") {
+      calls.push_back(make_pair(ts, ts + dur));
+    } else if (name == "http") {
+      EXPECT_EQ(200, e.get<int>("args.status"));
+      if (e.get<string>("args.endpoint") == "metadata") {
+        requests.push_back(make_pair(ts, ts + dur));
+      }
+    }
+  }
+
+  EXPECT_EQ(3, counts["getFileMetadata"]);
+  EXPECT_EQ(1, counts["uploadFile"]);
+  EXPECT_EQ(4, counts["http"]);
+
+  // Each request falls within the span of the call that made it
+  ASSERT_EQ(calls.size(), requests.size());
+  sort(calls.begin(), calls.end());
+  sort(requests.begin(), requests.end());
+  for (size_t i = 0; i < calls.size(); ++i) {
+    EXPECT_LE(calls[i].first, requests[i].first + 1);
+    EXPECT_GE(calls[i].second + 1, requests[i].second);
+  }
+}
+
+// Starting and stopping from several threads while spans are recorded
+// leaves a well formed trace
+TEST(TracerTestCase, StartStopTest) {
+  char path[] = "/tmp/tracetestXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  close(fd);
+
+  util::Tracer* tracer = util::Tracer::getInstance();
+  atomic<bool> done(false);
+  vector<thread> threads;
+
+  for (int i = 0; i < 2; ++i) {
+    threads.push_back(thread([&]() {
+      while (!done.load()) {
+        util::Span span("spin");
+        span.addArg("n", 1);
+      }
+    }));
+  }
+
+  vector<thread> controllers;
+  for (int i = 0; i < 4; ++i) {
+    controllers.push_back(thread([&, i]() {
+      for (int j = 0; j < 20; ++j) {
+        if ((i + j) % 2) {
+          tracer->stop();
+        } else {
+          EXPECT_TRUE(tracer->start(path));
+        }
+      }
+    }));
+  }
+
+  for (auto& t : controllers) {
+    t.join();
+  }
+  ASSERT_TRUE(tracer->start(path));
+  this_thread::sleep_for(chrono::milliseconds(10));
+  tracer->stop();
+
+  done.store(true);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  boost::property_tree::ptree events;
+  ASSERT_NO_THROW(events = readTrace(path));
+  EXPECT_LT(0UL, events.size());
+  for (auto& child : events) {
+    EXPECT_EQ("spin", child.second.get<string>("name"));
+    EXPECT_LE(0, child.second.get<int64_t>("ts"));
+  }
+  unlink(path);
+}
+
+// Run a function on a thread of its own, which starts with no connections
+static void onNewThread(function<void()> f) {
+  thread t(f);
+  t.join();
+}
+
+TEST(ConnectionStatsTestCase, MockHostTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only run against the mock server";
+  }
+
+  http::HttpRequestFactory* f = http::HttpRequestFactory::createFactory();
+  string host = server->getBaseUrl().substr(strlen("http://"));
+  f->resetConnectionStats();
+
+  // Blocking requests made one after another keep the connection alive
+  onNewThread([]() {
+    for (int i = 0; i < 3; ++i) {
+      DropboxMetadataRequest req("/", false);
+      DropboxMetadataResponse res;
+      EXPECT_EQ(SUCCESS, d->getFileMetadata(req, res));
+    }
+  });
+
+  map<string, http::HostConnectionStats> stats = f->getConnectionStats();
+  ASSERT_EQ(1UL, stats.count(host));
+
+  http::HostConnectionStats s = stats[host];
+  EXPECT_EQ(3UL, s.requests_);
+  EXPECT_EQ(1UL, s.newConnections_);
+  EXPECT_EQ(2UL, s.reusedConnections_);
+  EXPECT_EQ(s.newConnections_, s.dnsLookups_);
+  EXPECT_EQ(0UL, s.tlsHandshakes_);
+  EXPECT_EQ(0UL, s.tlsResumptions_);
+
+  // Calls sent through the hedging multi handle reuse it as well, once
+  // enough latencies are known for hedging to start
+  onNewThread([f, host]() {
+    DropboxApi2 api("mock-key", "mock-secret");
+    api.setAccessToken("mock-token");
+    api.setHedging(true);
+
+    DropboxMetadataRequest req("/");
+    DropboxMetadataResponse res;
+    for (int i = 0; i < 30; ++i) {
+      EXPECT_EQ(SUCCESS, api.getFileMetadata(req, res));
+    }
+
+    f->resetConnectionStats();
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(SUCCESS, api.getFileMetadata(req, res));
+    }
+    EXPECT_EQ(0UL, api.getHedgeCount());
+
+    http::HostConnectionStats s = f->getConnectionStats()[host];
+    EXPECT_EQ(5UL, s.requests_);
+    EXPECT_EQ(0UL, s.newConnections_);
+    EXPECT_EQ(5UL, s.reusedConnections_);
+    EXPECT_EQ(0UL, s.dnsLookups_);
+  });
+
+  // So do requests run one after another on an event loop
+  f->resetConnectionStats();
+  onNewThread([f]() {
+    http::HttpEventLoop loop;
+    int left = 3;
+    function<void()> next = [&]() {
+      shared_ptr<HttpRequest> r(f->createHttpRequest(
+        "https://api.dropboxapi.com/2/users/get_current_account",
+        HttpPostRequest));
+      loop.start(r, [&](int ret) {
+        EXPECT_EQ(0, ret);
+        if (--left) {
+          next();
+        } else {
+          loop.stop();
+        }
+      });
+    };
+    next();
+    loop.run();
+  });
+
+  s = f->getConnectionStats()[host];
+  EXPECT_EQ(3UL, s.requests_);
+  EXPECT_EQ(1UL, s.newConnections_);
+  EXPECT_EQ(2UL, s.reusedConnections_);
+
+  // The name is looked up for each new connection, one per thread here,
+  // and not for reused ones
+  string local = "localhost:" + host.substr(host.find(':') + 1);
+  auto get = [f, local]() {
+    unique_ptr<HttpRequest> r(f->createHttpRequest("http://" + local +
+      "/2/users/get_current_account", HttpPostRequest));
+    EXPECT_EQ(0, r->execute());
+    EXPECT_NE(0L, r->getResponseCode());
+  };
+
+  f->resetConnectionStats();
+  onNewThread([&]() {
+    get();
+    get();
+  });
+  onNewThread(get);
+
+  s = f->getConnectionStats()[local];
+  EXPECT_EQ(3UL, s.requests_);
+  EXPECT_EQ(2UL, s.newConnections_);
+  EXPECT_EQ(1UL, s.reusedConnections_);
+  EXPECT_EQ(2UL, s.dnsLookups_);
+}
+
+// Allocation budgets: the number of operator new calls a code path may
+// make. They are the counts at the time of writing plus some headroom, so
+// lower them when allocations are removed.
+const size_t LISTING_SIZE = 1000;
+
+static string metadataJson(const string& path, bool isDir) {
+  stringstream ss;
+  ss << "{\"size\": \"1 KB\", \"bytes\": 1024, \"path\": \"" << path
+    << "\", \"is_dir\": " << (isDir ? "true" : "false")
+    << ", \"is_deleted\": false, \"rev\": \"35e97029684fe\", "
+    << "\"thumb_exists\": false, \"icon\": \"page_white\", "
+    << "\"root\": \"dropbox\", "
+    << "\"modified\": \"Tue, 19 Jul 2011 21:55:38 +0000\", "
+    << "\"client_mtime\": \"Tue, 19 Jul 2011 21:55:38 +0000\", "
+    << "\"mime_type\": \"application/octet-stream\"}";
+  return ss.str();
+}
+
+static string listingJson(size_t n, bool folder) {
+  stringstream ss;
+  if (folder) {
+    string m = metadataJson(TEST_DIR, true);
+    ss << m.substr(0, m.size() - 1) << ", \"contents\": ";
+  }
+
+  ss << "[";
+  for (size_t i = 0; i < n; ++i) {
+    ss << (i ? ", " : "") << metadataJson(TEST_DIR + "/file-" +
+      to_string(i), false);
+  }
+  ss << "]";
+
+  if (folder) {
+    ss << "}";
+  }
+  return ss.str();
+}
+
+TEST(AllocationBudgetTestCase, MetadataListingParseTest) {
+  string json = listingJson(LISTING_SIZE, true);
+
+  AllocationCounter c;
+  DropboxMetadataResponse res;
+  res.readJson(json);
+
+  EXPECT_EQ(LISTING_SIZE, res.getChildren().size());
+  EXPECT_GE(139000UL, c.getAllocations());
+}
+
+TEST(AllocationBudgetTestCase, SearchResultParseTest) {
+  string json = listingJson(LISTING_SIZE, false);
+
+  AllocationCounter c;
+  DropboxSearchResult res = DropboxSearchResult::readFromJson(json);
+
+  EXPECT_EQ(LISTING_SIZE, res.getResults().size());
+  EXPECT_GE(142000UL, c.getAllocations());
+}
+
+TEST(AllocationBudgetTestCase, MetadataRequestTest) {
+  if (!server) {
+    GTEST_SKIP() << "Only measured against the mock server";
+  }
+
+  DropboxMetadataRequest req("/", false);
+  DropboxMetadataResponse res;
+
+  AllocationCounter c;
+  DropboxErrorCode code = d->getFileMetadata(req, res);
+
+  EXPECT_EQ(SUCCESS, code);
+  EXPECT_GE(135UL, c.getAllocations());
+}
+
+// The bytes each component keeps, spelled out from RFC 3986
+static bool isSafe(uint8_t c, UrlComponent component) {
+  static const string unreserved = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz0123456789-._~";
+  static const string pchar = unreserved + "!$&'()*+,;=:@";
+
+  switch (component) {
+    case UrlQueryComponent:
+      return c && unreserved.find(c) != string::npos;
+    case UrlPathSegment:
+      return c && pchar.find(c) != string::npos;
+    case UrlPath:
+      return c && (c == '/' || pchar.find(c) != string::npos);
+  }
+  return false;
+}
+
+TEST(PercentEncodingTestCase, AllBytesTest) {
+  const char* hex = "0123456789ABCDEF";
+  UrlComponent components[] = { UrlQueryComponent, UrlPathSegment, UrlPath };
+
+  // Every byte, both between runs of safe bytes and next to other unsafe
+  // ones, encoded from a range of offsets
+  string data;
+  for (int i = 0; i < 256 * 8; ++i) {
+    data += (char)(i % 8 ? 'a' + i % 26 : i / 8);
+  }
+  for (int i = 0; i < 256; ++i) {
+    data += (char)i;
+  }
+
+  for (auto component : components) {
+    for (size_t offset = 0; offset < 17; ++offset) {
+      string expected;
+      for (size_t i = offset; i < data.size(); ++i) {
+        uint8_t c = data[i];
+        if (isSafe(c, component)) {
+          expected += c;
+        } else {
+          expected += '%';
+          expected += hex[c >> 4];
+          expected += hex[c & 0xf];
+        }
+      }
+
+      EXPECT_EQ(expected, percentEncode(data.substr(offset), component));
+      EXPECT_EQ(expected.size(), percentEncodedSize(data.data() + offset,
+        data.size() - offset, component));
+    }
+  }
+
+  EXPECT_EQ("a%20b%2Bc%26d%3De%2Ff",
+    percentEncode("a b+c&d=e/f", UrlQueryComponent));
+  EXPECT_EQ("a%20b+c&d=e%2Ff", percentEncode("a b+c&d=e/f", UrlPathSegment));
+  EXPECT_EQ("/a%20b/%C3%A9%25", percentEncode("/a b/\xc3\xa9%", UrlPath));
+
+  // Dot segments would be resolved away by curl or the server
+  EXPECT_EQ("/a/%2E%2E/b/%2E/.c/.../d./%2E",
+    percentEncode("/a/../b/./.c/.../d./.", UrlPath));
+  EXPECT_EQ("%2E%2E", percentEncode("..", UrlPathSegment));
+  EXPECT_EQ(".%2F.", percentEncode("./.", UrlPathSegment));
+  EXPECT_EQ("..", percentEncode("..", UrlQueryComponent));
+}
+
+class DropboxTestEnvironment : public ::testing::Environment {
+public:
+  void SetUp() {
+    // Without an app key, run against a local mock server
+    if (!getenv("DROPBOX_API_KEY")) {
+      server = new MockDropboxServer();
+      server->install();
+
+      setenv("DROPBOX_API_KEY", "mock-key", 1);
+      setenv("DROPBOX_API_SECRET", "mock-secret", 1);
+      setenv("DROPBOX_AUTH_TOKEN", "mock-token", 1);
+      setenv("DROPBOX_AUTH_TOKEN_SECRET", "mock-token-secret", 1);
+      setenv("DROPBOX_ACCOUNT_EMAIL", MockDropboxServer::ACCOUNT_EMAIL, 1);
+
+      // The account name is not read from the response yet
+      setenv("DROPBOX_ACCOUNT_NAME", "", 1);
+    }
+
     char* api_key = getenv("DROPBOX_API_KEY");
     char* api_secret = getenv("DROPBOX_API_SECRET");
 
@@ -467,6 +3130,7 @@ public:
 
   void TearDown() {
     delete d;
+    delete server;
   }
 };
 
@@ -0,0 +1,136 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "BandwidthLimiter.h"
+
+#include <algorithm>
+#include <ctime>
+
+using namespace util;
+using namespace std;
+
+static double burstFor(double rate, double burst) {
+  if (burst > 0) {
+    return burst;
+  }
+
+  return max(rate / 4, 64.0 * 1024);
+}
+
+BandwidthLimiter::BandwidthLimiter(double bytesPerSecond, double burst) :
+    rate_(bytesPerSecond),
+    burst_(burst),
+    effective_(0),
+    checked_(Clock::time_point::min()),
+    bytes_(0),
+    bucket_(0, burstFor(0, 0)) {
+}
+
+void BandwidthLimiter::setRate(double bytesPerSecond, double burst) {
+  lock_guard<mutex> g(lock_);
+
+  rate_ = bytesPerSecond;
+  burst_ = burst;
+  checked_ = Clock::time_point::min();
+}
+
+void BandwidthLimiter::addSchedule(chrono::minutes start,
+    chrono::minutes end,
+    double bytesPerSecond) {
+  lock_guard<mutex> g(lock_);
+
+  Window w;
+  w.start_ = (int)(start.count() % (24 * 60));
+  w.end_ = (int)(end.count() % (24 * 60));
+  w.rate_ = bytesPerSecond;
+  schedule_.push_back(w);
+
+  checked_ = Clock::time_point::min();
+}
+
+void BandwidthLimiter::clearSchedule() {
+  lock_guard<mutex> g(lock_);
+
+  schedule_.clear();
+  checked_ = Clock::time_point::min();
+}
+
+void BandwidthLimiter::setWallClock(function<time_t()> clock) {
+  lock_guard<mutex> g(lock_);
+
+  wallClock_ = clock;
+  checked_ = Clock::time_point::min();
+}
+
+void BandwidthLimiter::update(Clock::time_point now) {
+  double rate = rate_;
+
+  if (!schedule_.empty()) {
+    time_t t = wallClock_ ? wallClock_() : time(NULL);
+    struct tm local;
+    localtime_r(&t, &local);
+    int minute = local.tm_hour * 60 + local.tm_min;
+
+    for (auto& w : schedule_) {
+      bool in = w.start_ <= w.end_ ?
+        minute >= w.start_ && minute < w.end_ :
+        minute >= w.start_ || minute < w.end_;
+
+      if (in) {
+        rate = w.rate_;
+        break;
+      }
+    }
+  }
+
+  // Also re-applied when only the burst changed
+  bucket_.setRate(rate, burstFor(rate, burst_));
+  effective_ = rate;
+  checked_ = now + chrono::seconds(1);
+}
+
+chrono::microseconds BandwidthLimiter::reserve(size_t bytes) {
+  {
+    lock_guard<mutex> g(lock_);
+
+    bytes_ += bytes;
+
+    Clock::time_point now = Clock::now();
+    if (now >= checked_) {
+      update(now);
+    }
+
+    if (effective_ <= 0) {
+      return chrono::microseconds(0);
+    }
+  }
+
+  return bucket_.reserve(bytes);
+}
+
+double BandwidthLimiter::getRate() {
+  lock_guard<mutex> g(lock_);
+
+  Clock::time_point now = Clock::now();
+  if (now >= checked_) {
+    update(now);
+  }
+
+  return effective_;
+}
+
+uint64_t BandwidthLimiter::getBytes() {
+  lock_guard<mutex> g(lock_);
+  return bytes_;
+}
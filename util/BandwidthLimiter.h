@@ -0,0 +1,142 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __BANDWIDTH_LIMITER_H__
+#define __BANDWIDTH_LIMITER_H__
+
+/**
+ * A cap on the bytes per second moved by every transfer sharing the
+ * limiter. Transfers charge the bytes they send or receive from inside
+ * their curl callbacks, so one limiter shared by many concurrent transfers
+ * caps their combined rate, which per handle speed limits cannot do.
+ *
+ * The rate can be changed at any time, and can follow a time of day
+ * schedule, e.g. to hold bulk transfers back during office hours. A rate
+ * of 0 means unlimited. Thread safe.
+ */
+
+#include "TokenBucket.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace util {
+
+class BandwidthLimiter {
+public:
+  typedef TokenBucket::Clock            Clock;
+
+  /**
+   * Create a limiter
+   *
+   * @param bytesPerSecond  The rate; 0 for unlimited
+   * @param burst           Most bytes that can go without waiting after an
+   *                        idle spell; 0 for a quarter second's worth, but
+   *                        at least 64KB
+   */
+  BandwidthLimiter(double bytesPerSecond = 0, double burst = 0);
+
+  /**
+   * Change the rate outside of the scheduled windows. Takes effect for the
+   * next bytes charged, including those of transfers in flight.
+   *
+   * @return  void
+   */
+  void setRate(double bytesPerSecond, double burst = 0);
+
+  /**
+   * Use a different rate between two times of the day, in local time. A
+   * window whose end is before its start wraps past midnight. Where windows
+   * overlap, the one added first wins.
+   *
+   * @param start           Start of the window, from midnight
+   * @param end             End of the window, from midnight
+   * @param bytesPerSecond  Rate within the window; 0 for unlimited
+   *
+   * @return  void
+   */
+  void addSchedule(std::chrono::minutes start,
+    std::chrono::minutes end,
+    double bytesPerSecond);
+
+  /**
+   * Remove all scheduled windows
+   *
+   * @return  void
+   */
+  void clearSchedule();
+
+  /**
+   * Set the clock that the schedule is matched against, e.g. to test a
+   * schedule without waiting for its windows. Defaults to time().
+   *
+   * @param clock           Returns the current time; empty for the default
+   *
+   * @return  void
+   */
+  void setWallClock(std::function<time_t()> clock);
+
+  /**
+   * Charge bytes that are about to be sent or were just received
+   *
+   * @param bytes           Number of bytes
+   *
+   * @return  How long the transfer should pause; zero to go ahead
+   */
+  std::chrono::microseconds reserve(size_t bytes);
+
+  /**
+   * The rate in effect now
+   *
+   * @return  Bytes per second; 0 if unlimited
+   */
+  double getRate();
+
+  /**
+   * Total bytes charged
+   *
+   * @return  uint64_t
+   */
+  uint64_t getBytes();
+
+private:
+  BandwidthLimiter(const BandwidthLimiter&);
+  BandwidthLimiter& operator=(const BandwidthLimiter&);
+
+  struct Window {
+    int               start_;
+    int               end_;
+    double            rate_;
+  };
+
+  void                update(Clock::time_point now);
+
+  std::mutex          lock_;
+  double              rate_;
+  double              burst_;
+  std::vector<Window> schedule_;
+  std::function<time_t()> wallClock_;
+
+  // The rate in effect is looked up at most once a second
+  double              effective_;
+  Clock::time_point   checked_;
+  uint64_t            bytes_;
+  TokenBucket         bucket_;
+};
+}
+#endif
@@ -0,0 +1,128 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+/**
+ * A blocking FIFO queue with a fixed capacity. Producers block while the
+ * queue is full, which propagates backpressure from slow consumers.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace util {
+
+template <typename T>
+class BoundedQueue {
+public:
+  /**
+   * @param capacity  Maximum number of queued items; at least 1
+   */
+  explicit BoundedQueue(size_t capacity) :
+    capacity_(capacity ? capacity : 1),
+    closed_(false) {
+  }
+
+  /**
+   * Append an item, blocking while the queue is full.
+   *
+   * @return  false if the queue was closed and the item was dropped
+   */
+  bool push(T item) {
+    std::unique_lock<std::mutex> g(lock_);
+    notFull_.wait(g, [this]() {
+      return closed_ || items_.size() < capacity_;
+    });
+
+    if (closed_) {
+      return false;
+    }
+
+    items_.push_back(std::move(item));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Append an item if there is room, without blocking.
+   *
+   * @return  false if the queue is full or closed
+   */
+  bool tryPush(T item) {
+    std::lock_guard<std::mutex> g(lock_);
+    if (closed_ || items_.size() >= capacity_) {
+      return false;
+    }
+
+    items_.push_back(std::move(item));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Remove the item at the head of the queue, blocking while it is empty.
+   *
+   * @return  false once the queue is closed and drained
+   */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> g(lock_);
+    notEmpty_.wait(g, [this]() {
+      return closed_ || !items_.empty();
+    });
+
+    if (items_.empty()) {
+      return false;
+    }
+
+    item = std::move(items_.front());
+    items_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  /**
+   * Close the queue. Blocked producers return false; consumers drain the
+   * remaining items and then return false.
+   */
+  void close() {
+    std::lock_guard<std::mutex> g(lock_);
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> g(lock_);
+    return items_.size();
+  }
+
+  bool isClosed() {
+    std::lock_guard<std::mutex> g(lock_);
+    return closed_;
+  }
+
+private:
+  const size_t              capacity_;
+  bool                      closed_;
+  std::deque<T>             items_;
+  std::mutex                lock_;
+  std::condition_variable   notFull_;
+  std::condition_variable   notEmpty_;
+};
+}
+#endif
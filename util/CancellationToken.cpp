@@ -0,0 +1,69 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "CancellationToken.h"
+
+using namespace util;
+using namespace std;
+
+CancellationToken::CancellationToken() :
+    cancelled_(false),
+    nextId_(0) {
+}
+
+void CancellationToken::cancel() {
+  lock_guard<mutex> g(lock_);
+
+  if (cancelled_.exchange(true)) {
+    return;
+  }
+
+  // Run under the lock, so that unsubscribe() waits for a callback that
+  // is running
+  for (auto& c : callbacks_) {
+    c.second();
+  }
+  callbacks_.clear();
+
+  cond_.notify_all();
+}
+
+bool CancellationToken::isCancelled() const {
+  return cancelled_.load();
+}
+
+bool CancellationToken::waitFor(chrono::microseconds delay) {
+  unique_lock<mutex> g(lock_);
+
+  cond_.wait_for(g, delay, [this]() { return cancelled_.load(); });
+  return !cancelled_.load();
+}
+
+uint64_t CancellationToken::subscribe(function<void()> f) {
+  lock_guard<mutex> g(lock_);
+
+  if (cancelled_.load()) {
+    f();
+    return 0;
+  }
+
+  uint64_t id = ++nextId_;
+  callbacks_[id] = f;
+  return id;
+}
+
+void CancellationToken::unsubscribe(uint64_t id) {
+  lock_guard<mutex> g(lock_);
+  callbacks_.erase(id);
+}
@@ -0,0 +1,94 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __CANCELLATION_TOKEN_H__
+#define __CANCELLATION_TOKEN_H__
+
+/**
+ * A flag shared between whoever may cancel some work and the code doing
+ * it. The work polls isCancelled(), sleeps with waitFor() so that it wakes
+ * up on cancellation, or subscribes a callback to interrupt a wait of its
+ * own. Cancelling is one way and happens at most once. Thread safe.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace util {
+
+class CancellationToken {
+public:
+  CancellationToken();
+
+  /**
+   * Cancel the work. Subscribed callbacks run on the calling thread before
+   * this returns.
+   *
+   * @return  void
+   */
+  void cancel();
+
+  /**
+   * Whether cancel() has been called. Lock free.
+   *
+   * @return  bool
+   */
+  bool isCancelled() const;
+
+  /**
+   * Sleep until a delay has passed or the token is cancelled
+   *
+   * @param delay         How long to sleep
+   *
+   * @return  false if the token was cancelled
+   */
+  bool waitFor(std::chrono::microseconds delay);
+
+  /**
+   * Call a function on cancellation. If the token is already cancelled it
+   * is called right away. The function must not call back into the token.
+   *
+   * @param f             The function
+   *
+   * @return  An id to pass to unsubscribe()
+   */
+  uint64_t subscribe(std::function<void()> f);
+
+  /**
+   * Remove a callback. Once this returns the callback is not running and
+   * will not be called.
+   *
+   * @param id            Id returned by subscribe()
+   *
+   * @return  void
+   */
+  void unsubscribe(uint64_t id);
+
+private:
+  CancellationToken(const CancellationToken&);
+  CancellationToken& operator=(const CancellationToken&);
+
+  std::atomic<bool>                         cancelled_;
+  std::mutex                                lock_;
+  std::condition_variable                   cond_;
+  uint64_t                                  nextId_;
+  std::map<uint64_t, std::function<void()> > callbacks_;
+};
+}
+#endif
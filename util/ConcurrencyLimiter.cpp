@@ -0,0 +1,336 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "ConcurrencyLimiter.h"
+
+#include <algorithm>
+
+using namespace util;
+using namespace std;
+
+ConcurrencyLimiter::ConcurrencyLimiter(size_t initial,
+    size_t minLimit,
+    size_t maxLimit,
+    double backoff) :
+    minLimit_(minLimit ? minLimit : 1),
+    maxLimit_(max(maxLimit, minLimit ? minLimit : 1)),
+    backoff_(backoff),
+    inFlight_(0),
+    epoch_(0),
+    throttles_(0),
+    resumeAt_(Clock::now()),
+    scheduling_(WEIGHTED_SCHEDULING),
+    reserved_(1),
+    virtualTime_(0),
+    nextWaiter_(0) {
+  limit_ = min(max((double)initial, minLimit_), maxLimit_);
+
+  weights_[PRIORITY_INTERACTIVE] = 16;
+  weights_[PRIORITY_NORMAL] = 4;
+  weights_[PRIORITY_BULK] = 1;
+
+  for (int i = 0; i < NUM_PRIORITIES; ++i) {
+    pass_[i] = 0;
+  }
+}
+
+size_t ConcurrencyLimiter::capacity(int priority) const {
+  size_t limit = (size_t)limit_;
+
+  if (priority == PRIORITY_INTERACTIVE) {
+    return limit;
+  }
+
+  return limit > reserved_ ? limit - reserved_ : 1;
+}
+
+int ConcurrencyLimiter::next() const {
+  int best = -1;
+
+  for (int i = 0; i < NUM_PRIORITIES; ++i) {
+    if (waiting_[i].empty() || inFlight_ >= capacity(i)) {
+      continue;
+    }
+
+    if (scheduling_ == STRICT_SCHEDULING) {
+      return i;
+    }
+
+    if (best < 0 || pass_[i] < pass_[best]) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+uint64_t ConcurrencyLimiter::acquire(Priority priority) {
+  uint64_t ticket = 0;
+  acquire(priority, Clock::time_point::max(), NULL, ticket);
+  return ticket;
+}
+
+bool ConcurrencyLimiter::acquire(Priority priority,
+    Clock::time_point deadline,
+    CancellationToken* token,
+    uint64_t& ticket) {
+  // Subscribed outside the lock: the callback runs right away if the token
+  // is already cancelled
+  uint64_t subscription = 0;
+  if (token) {
+    subscription = token->subscribe([this]() {
+      lock_guard<mutex> g(lock_);
+      cond_.notify_all();
+    });
+  }
+
+  bool admitted = wait(priority, deadline, token, ticket);
+
+  if (token) {
+    token->unsubscribe(subscription);
+  }
+
+  return admitted;
+}
+
+bool ConcurrencyLimiter::wait(Priority priority,
+    Clock::time_point deadline,
+    CancellationToken* token,
+    uint64_t& ticket) {
+  unique_lock<mutex> g(lock_);
+
+  int p = priority < NUM_PRIORITIES ? priority : PRIORITY_BULK;
+  uint64_t id = nextWaiter_++;
+
+  // A class that was idle starts from the current virtual time, so it
+  // cannot claim the turns it did not use while idle
+  if (waiting_[p].empty()) {
+    pass_[p] = max(pass_[p], virtualTime_);
+  }
+  waiting_[p].push_back(id);
+
+  while (true) {
+    Clock::time_point now = Clock::now();
+
+    if (now >= deadline || (token && token->isCancelled())) {
+      waiting_[p].erase(find(waiting_[p].begin(), waiting_[p].end(), id));
+
+      // Whoever was queued behind may be able to go now
+      notify();
+      return false;
+    }
+
+    if (now < resumeAt_) {
+      cond_.wait_until(g, min(resumeAt_, deadline));
+      continue;
+    }
+
+    if (waiting_[p].front() == id && next() == p) {
+      break;
+    }
+
+    if (deadline == Clock::time_point::max()) {
+      cond_.wait(g);
+    } else {
+      cond_.wait_until(g, deadline);
+    }
+  }
+
+  waiting_[p].pop_front();
+  ticket = admit(p);
+  return true;
+}
+
+// Must be called with lock_ held, once the waiter has left waiting_
+uint64_t ConcurrencyLimiter::admit(int priority) {
+  ++inFlight_;
+
+  virtualTime_ = pass_[priority];
+  pass_[priority] += 1.0 / weights_[priority];
+
+  // The slot may not have been the last one free
+  notify();
+  return epoch_;
+}
+
+// Must be called with lock_ held. Blocking waiters check for their turn
+// themselves; of the others only the one whose turn it is is woken.
+void ConcurrencyLimiter::notify() {
+  cond_.notify_all();
+
+  int p = next();
+  if (p < 0) {
+    return;
+  }
+
+  auto i = async_.find(waiting_[p].front());
+  if (i != async_.end()) {
+    i->second.second();
+  }
+}
+
+uint64_t ConcurrencyLimiter::enqueue(Priority priority,
+    function<void()> wake) {
+  lock_guard<mutex> g(lock_);
+
+  int p = priority < NUM_PRIORITIES ? priority : PRIORITY_BULK;
+  uint64_t id = nextWaiter_++;
+
+  if (waiting_[p].empty()) {
+    pass_[p] = max(pass_[p], virtualTime_);
+  }
+  waiting_[p].push_back(id);
+  async_[id] = make_pair(p, wake);
+
+  return id;
+}
+
+bool ConcurrencyLimiter::tryAdmit(uint64_t waiter,
+    uint64_t& ticket,
+    Clock::time_point& retryAt) {
+  lock_guard<mutex> g(lock_);
+
+  retryAt = Clock::time_point();
+  auto i = async_.find(waiter);
+  if (i == async_.end()) {
+    return false;
+  }
+
+  if (Clock::now() < resumeAt_) {
+    retryAt = resumeAt_;
+    return false;
+  }
+
+  int p = i->second.first;
+  if (waiting_[p].front() != waiter || next() != p) {
+    return false;
+  }
+
+  waiting_[p].pop_front();
+  async_.erase(i);
+  ticket = admit(p);
+  return true;
+}
+
+void ConcurrencyLimiter::leave(uint64_t waiter) {
+  lock_guard<mutex> g(lock_);
+
+  auto i = async_.find(waiter);
+  if (i == async_.end()) {
+    return;
+  }
+
+  deque<uint64_t>& q = waiting_[i->second.first];
+  q.erase(find(q.begin(), q.end(), waiter));
+  async_.erase(i);
+
+  // Whoever was queued behind may be able to go now
+  notify();
+}
+
+bool ConcurrencyLimiter::tryAcquire(Priority priority, uint64_t& ticket) {
+  lock_guard<mutex> g(lock_);
+
+  int p = priority < NUM_PRIORITIES ? priority : PRIORITY_BULK;
+  if (Clock::now() < resumeAt_ || inFlight_ >= capacity(p)) {
+    return false;
+  }
+
+  for (int i = 0; i < NUM_PRIORITIES; ++i) {
+    if (!waiting_[i].empty()) {
+      return false;
+    }
+  }
+
+  ++inFlight_;
+  ticket = epoch_;
+  return true;
+}
+
+void ConcurrencyLimiter::release(uint64_t ticket,
+    bool throttled,
+    chrono::milliseconds retryAfter) {
+  lock_guard<mutex> g(lock_);
+
+  --inFlight_;
+
+  if (throttled) {
+    ++throttles_;
+
+    if (ticket == epoch_) {
+      ++epoch_;
+      limit_ = max(limit_ * backoff_, minLimit_);
+    }
+
+    Clock::time_point until = Clock::now() + retryAfter;
+    if (until > resumeAt_) {
+      resumeAt_ = until;
+    }
+  } else {
+    limit_ = min(limit_ + 1.0 / limit_, maxLimit_);
+  }
+
+  notify();
+}
+
+void ConcurrencyLimiter::abandon() {
+  lock_guard<mutex> g(lock_);
+
+  --inFlight_;
+  notify();
+}
+
+void ConcurrencyLimiter::setScheduling(Scheduling scheduling) {
+  lock_guard<mutex> g(lock_);
+
+  scheduling_ = scheduling;
+  notify();
+}
+
+void ConcurrencyLimiter::setWeight(Priority priority, double weight) {
+  lock_guard<mutex> g(lock_);
+
+  if (priority < NUM_PRIORITIES) {
+    weights_[priority] = max(weight, 1.0);
+  }
+  notify();
+}
+
+void ConcurrencyLimiter::setReservedSlots(size_t slots) {
+  lock_guard<mutex> g(lock_);
+
+  reserved_ = slots;
+  notify();
+}
+
+size_t ConcurrencyLimiter::getLimit() {
+  lock_guard<mutex> g(lock_);
+  return (size_t)limit_;
+}
+
+size_t ConcurrencyLimiter::getInFlight() {
+  lock_guard<mutex> g(lock_);
+  return inFlight_;
+}
+
+size_t ConcurrencyLimiter::getWaiting(Priority priority) {
+  lock_guard<mutex> g(lock_);
+  return priority < NUM_PRIORITIES ? waiting_[priority].size() : 0;
+}
+
+uint64_t ConcurrencyLimiter::getThrottleCount() {
+  lock_guard<mutex> g(lock_);
+  return throttles_;
+}
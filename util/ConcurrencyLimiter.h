@@ -0,0 +1,248 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __CONCURRENCY_LIMITER_H__
+#define __CONCURRENCY_LIMITER_H__
+
+/**
+ * An adaptive limit on the number of requests in flight. The limit grows by
+ * about one for every window's worth of successful requests (additive
+ * increase) and is cut by a constant factor when the server throttles
+ * (multiplicative decrease). A throttled response may also ask for all
+ * requests to hold off for a while, as with the Retry-After header.
+ *
+ * Waiting requests are queued by priority class. When a slot frees up it
+ * goes to the next class picked by the scheduling policy, first come first
+ * served within a class, and a few slots can be held back for interactive
+ * requests so that they never wait behind a full set of bulk transfers.
+ */
+
+#include "CancellationToken.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace util {
+
+enum Priority {
+  PRIORITY_INTERACTIVE = 0,
+  PRIORITY_NORMAL,
+  PRIORITY_BULK,
+  NUM_PRIORITIES
+};
+
+enum Scheduling {
+  // A waiting request always goes before every request of a lower class
+  STRICT_SCHEDULING,
+  // Classes share slots in proportion to their weights (stride scheduling)
+  WEIGHTED_SCHEDULING
+};
+
+class ConcurrencyLimiter {
+public:
+  typedef std::chrono::steady_clock     Clock;
+
+  /**
+   * Create a limiter
+   *
+   * @param initial       Starting limit
+   * @param minLimit      The limit is never cut below this; at least 1
+   * @param maxLimit      The limit never grows past this
+   * @param backoff       Factor the limit is multiplied by when throttled
+   */
+  ConcurrencyLimiter(size_t initial = 8,
+    size_t minLimit = 1,
+    size_t maxLimit = 64,
+    double backoff = 0.5);
+
+  /**
+   * Wait for a slot. Blocks while the limit is reached, a Retry-After
+   * delay is pending or requests picked ahead of this one are waiting.
+   *
+   * @param priority      Class of the request
+   *
+   * @return  A ticket to be passed to release()
+   */
+  uint64_t acquire(Priority priority = PRIORITY_NORMAL);
+
+  /**
+   * Wait for a slot, giving up at a deadline or on cancellation
+   *
+   * @param priority      Class of the request
+   * @param deadline      When to give up
+   * @param token         Gives up when cancelled; may be NULL
+   * @param ticket        Set to the ticket to be passed to release()
+   *
+   * @return  false if no slot was taken
+   */
+  bool acquire(Priority priority,
+    Clock::time_point deadline,
+    CancellationToken* token,
+    uint64_t& ticket);
+
+  /**
+   * Take a slot only if one is free now and no request is waiting for one,
+   * e.g. for speculative work that should only use idle capacity
+   *
+   * @param priority      Class of the request
+   * @param ticket        Set to the ticket to be passed to release()
+   *
+   * @return  false if no slot was taken
+   */
+  bool tryAcquire(Priority priority, uint64_t& ticket);
+
+  /**
+   * Queue for a slot without blocking, e.g. from an event loop. The waiter
+   * is scheduled along with the blocking ones. wake is called when it may
+   * be its turn, with the limiter's lock held, so it should only arrange
+   * for tryAdmit to be called soon.
+   *
+   * @param priority      Class of the request
+   * @param wake          Called when tryAdmit may succeed; must not call
+   *                      back into the limiter
+   *
+   * @return  An id to pass to tryAdmit() or leave()
+   */
+  uint64_t enqueue(Priority priority, std::function<void()> wake);
+
+  /**
+   * Take a slot for a waiter added by enqueue(), if it is its turn
+   *
+   * @param waiter        Id returned by enqueue()
+   * @param ticket        Set to the ticket to be passed to release()
+   * @param retryAt       Set to when to try again if a Retry-After delay
+   *                      is pending, as wake is not called when it ends;
+   *                      to Clock::time_point() otherwise
+   *
+   * @return  false if the waiter is still queued
+   */
+  bool tryAdmit(uint64_t waiter,
+    uint64_t& ticket,
+    Clock::time_point& retryAt);
+
+  /**
+   * Leave the queue without taking a slot
+   *
+   * @param waiter        Id returned by enqueue()
+   *
+   * @return  void
+   */
+  void leave(uint64_t waiter);
+
+  /**
+   * Give back a slot
+   *
+   * @param ticket        Ticket returned by acquire()
+   * @param throttled     Whether the server throttled the request
+   * @param retryAfter    How long the server asked everyone to wait; zero
+   *                      for no delay
+   *
+   * @return  void
+   */
+  void release(uint64_t ticket,
+    bool throttled,
+    std::chrono::milliseconds retryAfter = std::chrono::milliseconds(0));
+
+  /**
+   * Give back a slot without adjusting the limit, e.g. after a network error
+   *
+   * @return  void
+   */
+  void abandon();
+
+  /**
+   * Set how waiting requests of different classes are ordered. Defaults to
+   * WEIGHTED_SCHEDULING with weights 16, 4 and 1.
+   *
+   * @param scheduling    The policy
+   *
+   * @return  void
+   */
+  void setScheduling(Scheduling scheduling);
+
+  /**
+   * Set the share of slots a class gets under WEIGHTED_SCHEDULING while
+   * other classes are waiting too
+   *
+   * @param priority      The class
+   * @param weight        Relative share; values below 1 are raised to 1
+   *
+   * @return  void
+   */
+  void setWeight(Priority priority, double weight);
+
+  /**
+   * Hold back slots for PRIORITY_INTERACTIVE. Other classes can only use
+   * the slots above the reservation, but never fewer than one. Defaults
+   * to 1.
+   *
+   * @param slots         Number of slots to reserve
+   *
+   * @return  void
+   */
+  void setReservedSlots(size_t slots);
+
+  size_t getLimit();
+  size_t getInFlight();
+  size_t getWaiting(Priority priority);
+  uint64_t getThrottleCount();
+
+private:
+  ConcurrencyLimiter(const ConcurrencyLimiter&);
+  ConcurrencyLimiter& operator=(const ConcurrencyLimiter&);
+
+  bool                        wait(Priority, Clock::time_point,
+                                CancellationToken*, uint64_t&);
+  size_t                      capacity(int priority) const;
+  int                         next() const;
+  uint64_t                    admit(int priority);
+  void                        notify();
+
+  std::mutex                  lock_;
+  std::condition_variable     cond_;
+  double                      limit_;
+  const double                minLimit_;
+  const double                maxLimit_;
+  const double                backoff_;
+  size_t                      inFlight_;
+
+  // Bumped on every cut. A throttle reported for a request that was
+  // admitted before the last cut does not cut again, so a burst of 429s
+  // from one window only halves the limit once.
+  uint64_t                    epoch_;
+  uint64_t                    throttles_;
+  Clock::time_point           resumeAt_;
+
+  // Waiters of each class in arrival order, and the stride scheduler's
+  // pass of each class. The class with the lowest pass goes next, and
+  // dispatching a request advances its pass by 1 / weight.
+  Scheduling                  scheduling_;
+  size_t                      reserved_;
+  std::deque<uint64_t>        waiting_[NUM_PRIORITIES];
+  double                      weights_[NUM_PRIORITIES];
+  double                      pass_[NUM_PRIORITIES];
+  double                      virtualTime_;
+  uint64_t                    nextWaiter_;
+
+  // Class and wake function of the waiters queued by enqueue()
+  std::map<uint64_t, std::pair<int, std::function<void()> > > async_;
+};
+}
+#endif
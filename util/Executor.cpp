@@ -0,0 +1,75 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "Executor.h"
+
+using namespace util;
+using namespace std;
+
+Executor::Executor(size_t concurrency, size_t maxQueued) :
+    tasks_(maxQueued) {
+  if (!concurrency) {
+    concurrency = 1;
+  }
+
+  for (size_t i = 0; i < concurrency; ++i) {
+    workers_.push_back(thread(&Executor::worker, this));
+  }
+}
+
+void Executor::worker() {
+  function<void()> task;
+
+  while (tasks_.pop(task)) {
+    try {
+      task();
+    } catch (...) {
+    }
+  }
+}
+
+bool Executor::submit(function<void()> task) {
+  return tasks_.push(task);
+}
+
+bool Executor::trySubmit(function<void()> task) {
+  return tasks_.tryPush(task);
+}
+
+void Executor::shutdown() {
+  tasks_.close();
+
+  for (auto& t : workers_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+}
+
+bool Executor::isShutdown() {
+  return tasks_.isClosed();
+}
+
+size_t Executor::getConcurrency() const {
+  return workers_.size();
+}
+
+size_t Executor::getQueuedCount() {
+  return tasks_.size();
+}
+
+Executor::~Executor() {
+  shutdown();
+}
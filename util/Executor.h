@@ -0,0 +1,88 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __EXECUTOR_H__
+#define __EXECUTOR_H__
+
+/**
+ * A fixed size thread pool fed by a bounded task queue. The number of
+ * threads caps how many tasks run at once, and the queue capacity caps how
+ * many wait; submitting to a full queue blocks, which pushes back on
+ * producers instead of letting work pile up without bound.
+ */
+
+#include "BoundedQueue.h"
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+class Executor {
+public:
+  /**
+   * Create an executor
+   *
+   * @param concurrency   Number of worker threads; at least 1
+   * @param maxQueued     Maximum number of tasks waiting for a worker
+   */
+  Executor(size_t concurrency, size_t maxQueued);
+
+  /**
+   * Queue a task, blocking while the queue is full.
+   *
+   * @param task          The task to run. Exceptions thrown by the task are
+   *                      swallowed; callers that care must catch them
+   *
+   * @return  false if the executor has been shut down
+   */
+  bool submit(std::function<void()> task);
+
+  /**
+   * Queue a task if there is room, without blocking.
+   *
+   * @return  false if the queue is full or the executor has been shut down
+   */
+  bool trySubmit(std::function<void()> task);
+
+  /**
+   * Stop accepting tasks, run the tasks already queued and join the worker
+   * threads. Called by the destructor.
+   */
+  void shutdown();
+
+  /**
+   * Whether shutdown() has been called, so that submitting fails for good
+   * rather than because the queue is full
+   */
+  bool isShutdown();
+
+  size_t getConcurrency() const;
+  size_t getQueuedCount();
+
+  ~Executor();
+
+private:
+  Executor(const Executor&);
+  Executor& operator=(const Executor&);
+
+  void                                  worker();
+
+  BoundedQueue<std::function<void()> >  tasks_;
+  std::vector<std::thread>              workers_;
+};
+}
+#endif
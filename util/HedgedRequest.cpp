@@ -0,0 +1,129 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "HedgedRequest.h"
+
+#include <curl/curl.h>
+
+using namespace http;
+using namespace std;
+
+static bool succeeded(HttpRequest* r) {
+  long code = r->getResponseCode();
+  return code >= 200 && code < 300;
+}
+
+int http::executeHedged(shared_ptr<HttpRequest> primary,
+    shared_ptr<HttpRequest> hedge,
+    chrono::milliseconds delay,
+    function<bool()> admit,
+    shared_ptr<HttpRequest>& winner,
+    bool& hedged) {
+  typedef chrono::steady_clock Clock;
+
+  winner = primary;
+  hedged = false;
+
+  int ret = primary->prepare();
+  if (ret) {
+    return ret;
+  }
+
+  unique_ptr<CURLM, CURLMcode(*)(CURLM*)> multi(curl_multi_init(),
+    curl_multi_cleanup);
+  curl_multi_add_handle(multi.get(), primary->getHandle());
+
+  Clock::time_point hedgeAt = Clock::now() + delay;
+  bool tried = false;
+  int inFlight = 1;
+  bool finished = false;
+
+  // The first copy to fail while the other is still in flight
+  shared_ptr<HttpRequest> failed;
+  int failedRet = 0;
+
+  while (!finished) {
+    int running;
+    curl_multi_perform(multi.get(), &running);
+
+    CURLMsg* msg;
+    int left;
+    while (!finished && (msg = curl_multi_info_read(multi.get(), &left))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+
+      shared_ptr<HttpRequest> done =
+        msg->easy_handle == primary->getHandle() ? primary : hedge;
+      ret = msg->data.result;
+      curl_multi_remove_handle(multi.get(), msg->easy_handle);
+      --inFlight;
+
+      int collected = done->finish();
+      if (!ret) {
+        ret = collected;
+      }
+
+      if (!ret && succeeded(done.get())) {
+        winner = done;
+        finished = true;
+      } else if (!hedged || !inFlight) {
+        // No other copy left to wait for. Of two failures, keep the first
+        // that got a response, which may tell the caller to back off.
+        winner = done;
+        if (failed && (!failedRet || ret)) {
+          winner = failed;
+          ret = failedRet;
+        }
+        finished = true;
+      } else {
+        failed = done;
+        failedRet = ret;
+      }
+    }
+
+    if (finished) {
+      break;
+    }
+
+    int timeoutMs = 1000;
+    if (!tried) {
+      Clock::time_point now = Clock::now();
+
+      if (now >= hedgeAt) {
+        tried = true;
+        if ((!admit || admit()) && !hedge->prepare()) {
+          curl_multi_add_handle(multi.get(), hedge->getHandle());
+          ++inFlight;
+          hedged = true;
+        }
+        continue;
+      }
+
+      timeoutMs = (int)chrono::duration_cast<chrono::milliseconds>(
+        hedgeAt - now).count() + 1;
+    }
+
+    curl_multi_poll(multi.get(), NULL, 0, timeoutMs, NULL);
+  }
+
+  // Abort the loser, if any
+  if (inFlight) {
+    shared_ptr<HttpRequest> loser = winner == primary ? hedge : primary;
+    curl_multi_remove_handle(multi.get(), loser->getHandle());
+  }
+
+  return ret;
+}
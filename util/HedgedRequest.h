@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __HEDGED_REQUEST_H__
+#define __HEDGED_REQUEST_H__
+
+#include "HttpRequest.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+namespace http {
+
+/**
+ * Send a request and, if it has not completed after 'delay', send a second
+ * copy of it alongside. The first of the two to complete with a 2xx status
+ * wins and the other is aborted; a copy that fails or gets another status
+ * waits for the other one. Both requests must be fully set up, including
+ * authorization headers. A failure of the first request before the hedge
+ * is sent is returned right away, as is the first of two failures that got
+ * a response from the server.
+ *
+ * @param     primary   The request
+ * @param     hedge     The copy sent after the delay
+ * @param     delay     How long to wait for the primary alone
+ * @param     admit     Called when the copy is due; it is only sent if this
+ *                      returns true, e.g. when the limits in force leave
+ *                      room for it. May be empty.
+ * @param     winner    Output param; the request whose result is returned
+ * @param     hedged    Output param; whether the copy was sent
+ *
+ * @return    int   The error code returned by curl for the winner
+ */
+int executeHedged(std::shared_ptr<HttpRequest> primary,
+  std::shared_ptr<HttpRequest> hedge,
+  std::chrono::milliseconds delay,
+  std::function<bool()> admit,
+  std::shared_ptr<HttpRequest>& winner,
+  bool& hedged);
+}
+#endif
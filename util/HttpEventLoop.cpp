@@ -0,0 +1,289 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "HttpEventLoop.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace http;
+using namespace std;
+
+HttpEventLoop::HttpEventLoop() :
+    multi_(curl_multi_init(), curl_multi_cleanup),
+    stopped_(false),
+    active_(0) {
+  // Make sure curl_global_init has run
+  HttpRequestFactory::createFactory();
+}
+
+void HttpEventLoop::start(shared_ptr<HttpRequest> r, Completion done) {
+  ++active_;
+
+  {
+    lock_guard<mutex> g(lock_);
+    pending_.push_back(Transfer(r, done));
+  }
+
+  curl_multi_wakeup(multi_.get());
+}
+
+void HttpEventLoop::post(function<void()> task) {
+  {
+    lock_guard<mutex> g(lock_);
+    tasks_.push_back(task);
+  }
+
+  curl_multi_wakeup(multi_.get());
+}
+
+void HttpEventLoop::postAfter(chrono::microseconds delay,
+    function<void()> task) {
+  {
+    lock_guard<mutex> g(lock_);
+    timers_.insert(make_pair(chrono::steady_clock::now() + delay, task));
+  }
+
+  curl_multi_wakeup(multi_.get());
+}
+
+void HttpEventLoop::setReceivePaused(HttpRequest* r, bool paused) {
+  CURL* h = r->getHandle();
+
+  if (!transfers_.count(h)) {
+    curl_easy_pause(h, paused ? CURLPAUSE_RECV : CURLPAUSE_CONT);
+    return;
+  }
+
+  if (paused) {
+    userPaused_[h] |= CURLPAUSE_RECV;
+  } else {
+    userPaused_[h] &= ~CURLPAUSE_RECV;
+  }
+
+  applyPause(h);
+}
+
+void HttpEventLoop::applyPause(CURL* h) {
+  int mask = 0;
+
+  auto u = userPaused_.find(h);
+  if (u != userPaused_.end()) {
+    mask |= u->second;
+  }
+
+  auto t = throttled_.find(h);
+  if (t != throttled_.end()) {
+    mask |= t->second;
+  }
+
+  curl_easy_pause(h, mask);
+}
+
+void HttpEventLoop::throttled(HttpRequest* r,
+    int direction,
+    chrono::microseconds delay) {
+  // Called from inside the request's curl callback, which has paused the
+  // transfer; it is resumed from a timer outside of any callback
+  CURL* h = r->getHandle();
+  throttled_[h] |= direction;
+
+  postAfter(delay, [this, r, h, direction]() {
+    auto it = transfers_.find(h);
+    if (it == transfers_.end() || it->second.first.get() != r) {
+      return;
+    }
+
+    throttled_[h] &= ~direction;
+    applyPause(h);
+  });
+}
+
+void HttpEventLoop::addPending() {
+  vector<Transfer> pending;
+
+  {
+    lock_guard<mutex> g(lock_);
+    pending.swap(pending_);
+  }
+
+  for (auto& t : pending) {
+    HttpRequest* r = t.first.get();
+    r->setThrottleHandler([this, r](int direction,
+        chrono::microseconds delay) {
+      throttled(r, direction, delay);
+    });
+
+    int ret = r->prepare();
+
+    if (!ret) {
+      CURL* h = t.first->getHandle();
+      ret = curl_multi_add_handle(multi_.get(), h);
+      if (!ret) {
+        transfers_[h] = t;
+
+        // curl only calls the progress callback when it drives the handle,
+        // which may not be for a while; abort from the loop instead
+        shared_ptr<util::CancellationToken> token =
+          r->getCancellationToken();
+        if (token) {
+          cancellations_[h] = token->subscribe([this, r, h]() {
+            post([this, r, h]() { cancelled(r, h); });
+          });
+        }
+        continue;
+      }
+
+      // Not a CURLcode, but any non zero value reports the failure
+      ret = -ret;
+    }
+
+    --active_;
+    t.second(ret);
+  }
+}
+
+void HttpEventLoop::runTasks() {
+  vector<function<void()> > tasks;
+
+  {
+    lock_guard<mutex> g(lock_);
+    tasks.swap(tasks_);
+
+    // Timers that are due run along with the posted tasks
+    auto now = chrono::steady_clock::now();
+    auto end = timers_.upper_bound(now);
+    for (auto i = timers_.begin(); i != end; ++i) {
+      tasks.push_back(i->second);
+    }
+    timers_.erase(timers_.begin(), end);
+  }
+
+  for (auto& t : tasks) {
+    t();
+  }
+}
+
+void HttpEventLoop::reap() {
+  CURLMsg* msg;
+  int left;
+
+  while ((msg = curl_multi_info_read(multi_.get(), &left))) {
+    if (msg->msg == CURLMSG_DONE) {
+      complete(msg->easy_handle, msg->data.result);
+    }
+  }
+}
+
+void HttpEventLoop::complete(CURL* h, int ret) {
+  auto it = transfers_.find(h);
+  assert(it != transfers_.end());
+
+  Transfer t = it->second;
+  transfers_.erase(it);
+  userPaused_.erase(h);
+  throttled_.erase(h);
+  curl_multi_remove_handle(multi_.get(), h);
+
+  auto c = cancellations_.find(h);
+  if (c != cancellations_.end()) {
+    t.first->getCancellationToken()->unsubscribe(c->second);
+    cancellations_.erase(c);
+  }
+
+  int collected = t.first->finish();
+  if (!ret) {
+    ret = collected;
+  }
+
+  --active_;
+  t.second(ret);
+}
+
+void HttpEventLoop::cancelled(HttpRequest* r, CURL* h) {
+  // The transfer may have completed, and its request been freed or its
+  // handle reused, since; r is only compared
+  auto it = transfers_.find(h);
+  if (it == transfers_.end() || it->second.first.get() != r) {
+    return;
+  }
+
+  complete(h, CURLE_ABORTED_BY_CALLBACK);
+}
+
+int HttpEventLoop::nextTimeout(int timeoutMs) {
+  lock_guard<mutex> g(lock_);
+
+  if (!tasks_.empty()) {
+    return 0;
+  }
+
+  if (!timers_.empty()) {
+    auto wait = chrono::duration_cast<chrono::milliseconds>(
+      timers_.begin()->first - chrono::steady_clock::now()).count() + 1;
+    timeoutMs = (int)max(min((long long)wait, (long long)timeoutMs), 0LL);
+  }
+
+  return timeoutMs;
+}
+
+bool HttpEventLoop::runOnce(int timeoutMs) {
+  if (stopped_.load()) {
+    return false;
+  }
+
+  addPending();
+
+  int running;
+  curl_multi_perform(multi_.get(), &running);
+  reap();
+
+  // Tasks run after the transfers have been driven so that they never run
+  // from inside a curl callback
+  runTasks();
+
+  if (stopped_.load()) {
+    return false;
+  }
+
+  curl_multi_poll(multi_.get(), NULL, 0, nextTimeout(timeoutMs), NULL);
+
+  return !stopped_.load();
+}
+
+void HttpEventLoop::run() {
+  while (runOnce(1000)) {
+  }
+}
+
+void HttpEventLoop::stop() {
+  stopped_.store(true);
+  curl_multi_wakeup(multi_.get());
+}
+
+size_t HttpEventLoop::getActiveCount() const {
+  return active_.load();
+}
+
+HttpEventLoop::~HttpEventLoop() {
+  for (auto& t : transfers_) {
+    auto c = cancellations_.find(t.first);
+    if (c != cancellations_.end()) {
+      t.second.first->getCancellationToken()->unsubscribe(c->second);
+    }
+
+    curl_multi_remove_handle(multi_.get(), t.first);
+  }
+}
@@ -0,0 +1,168 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __HTTP_EVENT_LOOP_H__
+#define __HTTP_EVENT_LOOP_H__
+
+/**
+ * Drives many HttpRequests at once from a single thread with the curl
+ * "multi" interface. Requests are handed to the loop with start() and their
+ * completion callbacks run on the thread calling run(), so a thread waiting
+ * on socket events can serve thousands of transfers instead of one thread
+ * being parked per transfer.
+ *
+ * Requests held up by a bandwidth limiter are paused and resumed from a
+ * timer, so a throttled transfer never stalls the others on the loop.
+ * Requests with a cancellation token are aborted, with
+ * CURLE_ABORTED_BY_CALLBACK, as soon as it is cancelled.
+ */
+
+#include "HttpRequest.h"
+
+#include <curl/curl.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace http {
+
+class HttpEventLoop {
+public:
+  /**
+   * Called on the loop thread when a request completes
+   *
+   * @param     int   The error code returned by curl; 0 on success
+   */
+  typedef std::function<void(int)>     Completion;
+
+  HttpEventLoop();
+
+  /**
+   * Start a request. May be called from any thread. The request must have
+   * been fully set up (params, headers, data) and must not be touched until
+   * its completion has run.
+   *
+   * @param     r       The request
+   * @param     done    Called on the loop thread once the request completes
+   *
+   * @return    void
+   */
+  void start(std::shared_ptr<HttpRequest> r, Completion done);
+
+  /**
+   * Run a task on the loop thread. May be called from any thread.
+   *
+   * @param     task    The task
+   *
+   * @return    void
+   */
+  void post(std::function<void()> task);
+
+  /**
+   * Run a task on the loop thread once a delay has passed. May be called
+   * from any thread.
+   *
+   * @param     delay   How long to wait
+   * @param     task    The task
+   *
+   * @return    void
+   */
+  void postAfter(std::chrono::microseconds delay, std::function<void()> task);
+
+  /**
+   * Pause or resume receiving data for a request in flight. Must be called
+   * on the loop thread, outside of the request's curl callbacks.
+   *
+   * @param     r       The request
+   * @param     paused  true to pause, false to resume
+   *
+   * @return    void
+   */
+  void setReceivePaused(HttpRequest* r, bool paused);
+
+  /**
+   * Process events until stop() is called
+   *
+   * @return    void
+   */
+  void run();
+
+  /**
+   * Wait up to timeoutMs for socket activity and process any events
+   *
+   * @param     timeoutMs   Longest time to wait for activity
+   *
+   * @return    false once stop() has been called
+   */
+  bool runOnce(int timeoutMs);
+
+  /**
+   * Make run() return. May be called from any thread.
+   *
+   * @return    void
+   */
+  void stop();
+
+  /**
+   * Number of requests started and not yet completed
+   *
+   * @return    size_t
+   */
+  size_t getActiveCount() const;
+
+  ~HttpEventLoop();
+
+private:
+  HttpEventLoop(const HttpEventLoop&);
+  HttpEventLoop& operator=(const HttpEventLoop&);
+
+  typedef std::pair<std::shared_ptr<HttpRequest>, Completion>  Transfer;
+
+  void                                addPending();
+  void                                runTasks();
+  int                                 nextTimeout(int timeoutMs);
+  void                                reap();
+  void                                complete(CURL* h, int ret);
+  void                                cancelled(HttpRequest* r, CURL* h);
+  void                                throttled(HttpRequest* r, int direction,
+                                        std::chrono::microseconds delay);
+  void                                applyPause(CURL* h);
+
+  std::unique_ptr<CURLM, CURLMcode(*)(CURLM*)>  multi_;
+  std::atomic<bool>                   stopped_;
+  std::atomic<size_t>                 active_;
+
+  std::mutex                          lock_;
+  std::vector<Transfer>               pending_;
+  std::vector<std::function<void()> > tasks_;
+  std::multimap<std::chrono::steady_clock::time_point,
+    std::function<void()> >           timers_;
+
+  // Only touched on the loop thread. A transfer is paused in a direction
+  // if either its owner or a bandwidth limiter paused it.
+  std::map<CURL*, Transfer>           transfers_;
+  std::map<CURL*, int>                userPaused_;
+  std::map<CURL*, int>                throttled_;
+  // Subscriptions to the cancellation tokens of transfers
+  std::map<CURL*, uint64_t>           cancellations_;
+};
+}
+#endif
@@ -14,8 +14,13 @@
 */
 
 #include "HttpRequest.h"
+#include "PercentEncoding.h"
 
 #include <curl/curl.h>
+#if __has_include(<openssl/ssl.h>)
+#include <openssl/ssl.h>
+#define HAVE_OPENSSL_SESSION_INFO
+#endif
 
 #include <vector>
 #include <map>
@@ -23,41 +28,141 @@
 #include <sstream>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 using namespace http;
 using namespace std;
 
+namespace http {
+
+// Every request has an easy handle of its own, so without a share each one
+// would open a new connection. libcurl doesn't support a connection cache
+// in use by several threads at once, so each thread gets a share, which
+// lets the requests it makes one after another reuse connections, DNS
+// answers and TLS sessions. Requests keep the share they were last
+// prepared with alive. The locks only matter when a request prepared by
+// one thread is moved to another's share.
+struct CurlShare {
+  CurlShare() : share_(curl_share_init()) {
+    if (!share_) {
+      return;
+    }
+
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &CurlShare::lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &CurlShare::unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  ~CurlShare() {
+    if (share_) {
+      curl_share_cleanup(share_);
+    }
+  }
+
+  static void lock(CURL*, curl_lock_data data, curl_lock_access, void* p) {
+    ((CurlShare *)p)->locks_[data].lock();
+  }
+
+  static void unlock(CURL*, curl_lock_data data, void* p) {
+    ((CurlShare *)p)->locks_[data].unlock();
+  }
+
+  CURLSH*     share_;
+  mutex       locks_[CURL_LOCK_DATA_LAST];
+};
+
+}
+
+static shared_ptr<CurlShare> threadShare() {
+  static thread_local shared_ptr<CurlShare> share(new CurlShare());
+  return share;
+}
+
 HttpRequest::HttpRequest(HttpRequestFactory* factory,
     string url,
-    HttpRequestMethod method) : factory_(factory),
+    HttpRequestMethod method,
+    string requested) : factory_(factory),
       url_(url),
+      requestedUrl_(requested.empty() ? url : requested),
       method_(method),
+      idempotentSet_(false),
+      idempotent_(false),
+      hasRange_(false),
+      requestDataSize_(0),
       requestDataOffset_(0),
       requestData_(NULL),
+      bodyOffset_(0),
+      dirty_(true),
+      sendPrepaid_(0),
+      receivePrepaid_(0),
+      deadline_(chrono::steady_clock::time_point::max()),
+      responseSize_(0),
       response_(NULL, free),
-      curl_(curl_easy_init(), curl_easy_cleanup),
-      slist_(NULL, curl_slist_free_all) {
+      responseCode_(0),
+      tlsChecked_(false),
+      tlsResumed_(false),
+      curl_(curl_easy_init(), curl_easy_cleanup) {
   factory_->increaseRequestCount();
 }
 
+const string& HttpRequest::getUrl() const {
+  return url_;
+}
+
+const string& HttpRequest::getRequestedUrl() const {
+  return requestedUrl_;
+}
+
 void HttpRequest::setMethod(HttpRequestMethod method) {
   method_ = method;
+  dirty_ = true;
 }
 
 HttpRequestMethod HttpRequest::getMethod() const {
   return method_;
 }
 
-void HttpRequest::addParam(const string& param, const string& value) {
-  params_[param] = value;
+void HttpRequest::setIdempotent(bool idempotent) {
+  idempotentSet_ = true;
+  idempotent_ = idempotent;
+}
+
+bool HttpRequest::isIdempotent() const {
+  return idempotentSet_ ? idempotent_ : method_ == HttpGetRequest;
 }
 
-void HttpRequest::addIntegerParam(const string& param, const int value) {
-  stringstream ss;
+// Set a field, replacing the value it had. Returns whether that changed
+// anything.
+static bool setField(HttpRequest::Fields& fields,
+    const string& name,
+    const string& value) {
+  for (auto& f : fields) {
+    if (f.first == name) {
+      if (f.second == value) {
+        return false;
+      }
+      f.second = value;
+      return true;
+    }
+  }
 
-  ss << value;
+  fields.push_back(make_pair(name, value));
+  return true;
+}
+
+void HttpRequest::addParam(const string& param, const string& value) {
+  if (setField(params_, param, value)) {
+    dirty_ = true;
+  }
+}
 
-  addParam(param, ss.str());
+void HttpRequest::addIntegerParam(const string& param, int64_t value) {
+  addParam(param, to_string(value));
 }
 
 void HttpRequest::addRange(uint64_t start, uint64_t end) {
@@ -66,13 +171,15 @@ void HttpRequest::addRange(uint64_t start, uint64_t end) {
   rangeEnd_ = end;
 }
 
-const map<string, string>& HttpRequest::getParams() const {
+const HttpRequest::Fields& HttpRequest::getParams() const {
   return params_;
 }
 
 void HttpRequest::addHeader(const string& header, const string& value)
 {
-  headers_[header] = value;
+  if (setField(headers_, header, value)) {
+    dirty_ = true;
+  }
 }
 
 void HttpRequest::addData(const string& data, const string& value)
@@ -80,20 +187,141 @@ void HttpRequest::addData(const string& data, const string& value)
   data_[data] = value;
 }
 
-const map<string, string>& HttpRequest::getHeaders() const {
+const HttpRequest::Fields& HttpRequest::getHeaders() const {
   return headers_;
 }
 
+string HttpRequest::getHeader(const string& header) const {
+  for (auto& h : headers_) {
+    if (h.first == header) {
+      return h.second;
+    }
+  }
+
+  return "";
+}
+
 void HttpRequest::setRequestData(uint8_t* const data, const size_t sz) {
+  // Whether there is a body decides where a POST puts its params
+  dirty_ = dirty_ || (!requestData_ != !data);
+
   requestData_ = data;
   requestDataSize_ = sz;
   requestDataOffset_ = 0;
 }
 
+size_t HttpRequest::getRequestDataSize() const {
+  return requestDataSize_;
+}
+
+void HttpRequest::setResponseSink(function<bool(const uint8_t*, size_t)> sink) {
+  responseSink_ = sink;
+}
+
+void HttpRequest::addSendLimiter(shared_ptr<util::BandwidthLimiter> l) {
+  if (find(sendLimiters_.begin(), sendLimiters_.end(), l) ==
+      sendLimiters_.end()) {
+    sendLimiters_.push_back(l);
+  }
+}
+
+void HttpRequest::addReceiveLimiter(shared_ptr<util::BandwidthLimiter> l) {
+  if (find(receiveLimiters_.begin(), receiveLimiters_.end(), l) ==
+      receiveLimiters_.end()) {
+    receiveLimiters_.push_back(l);
+  }
+}
+
+void HttpRequest::setThrottleHandler(ThrottleHandler handler) {
+  throttleHandler_ = handler;
+}
+
+void HttpRequest::setDeadline(chrono::steady_clock::time_point deadline) {
+  deadline_ = deadline;
+}
+
+void HttpRequest::setCancellationToken(
+    shared_ptr<util::CancellationToken> token) {
+  cancel_ = token;
+}
+
+shared_ptr<util::CancellationToken> HttpRequest::getCancellationToken() const {
+  return cancel_;
+}
+
+void HttpRequest::setProgressHandler(ProgressHandler handler) {
+  progressHandler_ = handler;
+}
+
+int HttpRequest::progressFunction(void* p,
+    curl_off_t dltotal,
+    curl_off_t dlnow,
+    curl_off_t ultotal,
+    curl_off_t ulnow) {
+  HttpRequest* r = (HttpRequest *)p;
+  if (r->cancel_ && r->cancel_->isCancelled()) {
+    return 1;
+  }
+
+  if (r->progressHandler_ &&
+      !r->progressHandler_(dltotal, dlnow, ultotal, ulnow)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+bool HttpRequest::throttle(const Limiters& limiters,
+    size_t bytes,
+    size_t& prepaid,
+    int direction) {
+  // Data offered again after a pause was paid for before pausing
+  size_t charge = bytes > prepaid ? bytes - prepaid : 0;
+  prepaid = 0;
+
+  if (!charge) {
+    return false;
+  }
+
+  chrono::microseconds delay(0);
+  for (auto& l : limiters) {
+    delay = max(delay, l->reserve(charge));
+  }
+
+  if (delay.count() <= 0) {
+    return false;
+  }
+
+  if (throttleHandler_) {
+    prepaid = bytes;
+    throttleHandler_(direction, delay);
+    return true;
+  }
+
+  this_thread::sleep_for(delay);
+  return false;
+}
+
 size_t HttpRequest::writeFunction(char* buf, size_t size, size_t n, void *p) {
   size_t numBytes = size * n;
   HttpRequest* r = (HttpRequest *)p;
 
+  if (!r->receiveLimiters_.empty() &&
+      r->throttle(r->receiveLimiters_, numBytes, r->receivePrepaid_,
+        CURLPAUSE_RECV)) {
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  if (r->responseSink_) {
+    long code = 0;
+    curl_easy_getinfo(r->curl_.get(), CURLINFO_RESPONSE_CODE, &code);
+
+    if (code >= 200 && code < 300) {
+      // Returning anything other than numBytes makes curl abort the transfer
+      return r->responseSink_((uint8_t *)buf, numBytes) ? numBytes : 0;
+    }
+  }
+
   uint64_t offset = r->responseSize_;
 
   if (!r->responseSize_) {
@@ -128,6 +356,12 @@ size_t HttpRequest::headerFunction(char* buf, size_t sz, size_t n, void *p) {
     return numBytes;
   }
 
+  // The connection is only reachable while the transfer is running
+  if (!r->tlsChecked_) {
+    r->tlsChecked_ = true;
+    r->tlsResumed_ = r->isTlsResumed();
+  }
+
   string s(buf, size + 1);
   size_t pos = s.find(":");
 
@@ -156,55 +390,122 @@ size_t HttpRequest::readFunction(void* buf, size_t size, size_t n, void *p) {
     numBytes = remBytes;
    }
 
+  if (!r->sendLimiters_.empty() &&
+      r->throttle(r->sendLimiters_, numBytes, r->sendPrepaid_,
+        CURLPAUSE_SEND)) {
+    return CURL_READFUNC_PAUSE;
+  }
+
   memcpy(buf, r->requestData_ + r->requestDataOffset_, numBytes);
   r->requestDataOffset_ += numBytes;
 
   return numBytes;
 }
 
-int HttpRequest::execute() {
-  int ret = 0;
+// Append params as name=value&name=value, percent-encoded
+static void appendParams(string& out, const HttpRequest::Fields& params) {
+  bool first = true;
 
-  responseSize_ = 0;
+  for (auto& p : params) {
+    if (!first) {
+      out += '&';
+    }
+    first = false;
 
-  // Set the headers
-  vector<string> headerstrings;
-  for (auto i : headers_) {
-    stringstream ss;
-    ss << i.first << ": " << i.second;
+    percentEncode(p.first.data(), p.first.size(), UrlQueryComponent, out);
+    out += '=';
+    percentEncode(p.second.data(), p.second.size(), UrlQueryComponent, out);
+  }
+}
 
-    headerstrings.push_back(ss.str());
+void HttpRequest::build() {
+  // Params go in the query string, except for a POST without a body, where
+  // they are the form body. DELETE requests take none.
+  bool form = (method_ == HttpPostRequest && !requestData_);
+  bool query = !params_.empty() && !form && method_ != HttpDeleteRequest;
+
+  size_t paramsSize = 0;
+  for (auto& p : params_) {
+    paramsSize += 2 +
+      percentEncodedSize(p.first.data(), p.first.size(), UrlQueryComponent) +
+      percentEncodedSize(p.second.data(), p.second.size(), UrlQueryComponent);
   }
 
-  for (auto i : headerstrings) {
-    slist_.reset(curl_slist_append(slist_.get(), i.c_str()));
+  size_t size = url_.size() + 1 + (query ? paramsSize : 0) +
+    (form ? paramsSize : 0) + 1;
+  for (auto& h : headers_) {
+    size += h.first.size() + h.second.size() + 3;
   }
 
-  if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_HTTPHEADER, slist_.get()))) {
-    return ret;
+  wire_.clear();
+  wire_.reserve(size);
+
+  wire_ += url_;
+  if (query) {
+    wire_ += '?';
+    appendParams(wire_, params_);
+  }
+  wire_ += '\0';
+
+  size_t headers = wire_.size();
+  for (auto& h : headers_) {
+    wire_ += h.first;
+    wire_ += ": ";
+    wire_ += h.second;
+    wire_ += '\0';
   }
 
-  // Set the params
-  string paramList;
-  bool empty = true;
-  if (method_ == HttpGetRequest ||
-      method_ == HttpPostRequest ||
-      method_ == HttpPutRequest) {
-    for (auto i : params_) {
-      stringstream ss;
-      ss << i.first << "=" << i.second;
-
-      if (empty) {
-        empty = false;
-        paramList += ss.str();
-      } else {
-        paramList += "&";
-        paramList += ss.str();
-      }
+  bodyOffset_ = wire_.size();
+  if (form) {
+    appendParams(wire_, params_);
+  }
+  wire_ += '\0';
+  assert(wire_.size() <= size);
+
+  // Only now that the buffer is final can the list point into it
+  headerList_.resize(headers_.size());
+  for (size_t i = 0; i < headerList_.size(); ++i) {
+    headerList_[i].data = &wire_[headers];
+    headerList_[i].next = (i + 1 < headerList_.size()) ?
+      &headerList_[i + 1] : NULL;
+    headers += headers_[i].first.size() + headers_[i].second.size() + 3;
+  }
+
+  dirty_ = false;
+}
+
+int HttpRequest::prepare() {
+  int ret = 0;
+
+  responseSize_ = 0;
+  response_.reset();
+  responseCode_ = 0;
+  responseHeaders_.clear();
+  tlsChecked_ = false;
+  tlsResumed_ = false;
+  requestDataOffset_ = 0;
+  sendPrepaid_ = 0;
+  receivePrepaid_ = 0;
+
+  // The url, headers and form body only change when the request does
+  if (dirty_) {
+    build();
+  }
+
+  shared_ptr<CurlShare> share = threadShare();
+  if (share != share_ && share->share_) {
+    if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_SHARE, share->share_))) {
+      return ret;
     }
+    share_ = share;
+  }
+
+  if ((ret = curl_easy_setopt(curl_.get(),
+      CURLOPT_HTTPHEADER,
+      headerList_.empty() ? NULL : &headerList_[0]))) {
+    return ret;
   }
 
-  string url = url_;
   // Set the Http method
   switch (method_) {
     case HttpPutRequest:
@@ -235,8 +536,6 @@ int HttpRequest::execute() {
       }
 
     case HttpGetRequest:
-      url += "?";
-      url += paramList;
       break;
 
     case HttpPostRequest:
@@ -244,9 +543,48 @@ int HttpRequest::execute() {
         return ret;
       }
 
+      if (requestData_) {
+        // The body is the request data; params went in the query string
+        if ((ret = curl_easy_setopt(curl_.get(),
+            CURLOPT_POSTFIELDSIZE_LARGE,
+            (curl_off_t)requestDataSize_))) {
+          return ret;
+        }
+
+        if (sendLimiters_.empty()) {
+          if ((ret = curl_easy_setopt(curl_.get(),
+              CURLOPT_POSTFIELDS,
+              requestData_))) {
+            return ret;
+          }
+          break;
+        }
+
+        // A shaped body is fed through the read callback, where it is
+        // charged to the limiters as it goes out
+        if ((ret = curl_easy_setopt(curl_.get(),
+            CURLOPT_POSTFIELDS,
+            NULL))) {
+          return ret;
+        }
+
+        if ((ret = curl_easy_setopt(curl_.get(),
+            CURLOPT_READFUNCTION,
+            &HttpRequest::readFunction))) {
+          return ret;
+        }
+
+        if ((ret = curl_easy_setopt(curl_.get(),
+            CURLOPT_READDATA,
+            this))) {
+          return ret;
+        }
+        break;
+      }
+
       if ((ret = curl_easy_setopt(curl_.get(),
           CURLOPT_POSTFIELDS,
-          paramList.c_str()))) {
+          wire_.c_str() + bodyOffset_))) {
         return ret;
       }
       break;
@@ -256,7 +594,7 @@ int HttpRequest::execute() {
   }
 
   // Set the URL
-  if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_URL, url.c_str()))
+  if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_URL, wire_.c_str()))
       != CURLE_OK) {
     return ret;
   }
@@ -286,6 +624,64 @@ int HttpRequest::execute() {
     return ret;
   }
 
+  // Timeouts. Without them a dead connection blocks the caller forever.
+  long timeoutMs = 0;
+  if (deadline_ != chrono::steady_clock::time_point::max()) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(
+      deadline_ - chrono::steady_clock::now()).count();
+    if (left <= 0) {
+      return CURLE_OPERATION_TIMEDOUT;
+    }
+    timeoutMs = (long)left;
+  }
+
+  if ((ret = curl_easy_setopt(curl_.get(),
+      CURLOPT_TIMEOUT_MS,
+      timeoutMs))) {
+    return ret;
+  }
+
+  long connectMs = (long)factory_->getConnectTimeout().count();
+  if ((ret = curl_easy_setopt(curl_.get(),
+      CURLOPT_CONNECTTIMEOUT_MS,
+      timeoutMs ? min(timeoutMs, connectMs) : connectMs))) {
+    return ret;
+  }
+
+  if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_LOW_SPEED_LIMIT, 1L))) {
+    return ret;
+  }
+
+  if ((ret = curl_easy_setopt(curl_.get(),
+      CURLOPT_LOW_SPEED_TIME,
+      (long)factory_->getStallTimeout().count()))) {
+    return ret;
+  }
+
+  // Cancellation and progress share curl's progress callback
+  if (cancel_ && cancel_->isCancelled()) {
+    return CURLE_ABORTED_BY_CALLBACK;
+  }
+
+  bool progress = cancel_ || progressHandler_;
+  if (progress) {
+    if ((ret = curl_easy_setopt(curl_.get(),
+        CURLOPT_XFERINFOFUNCTION,
+        &HttpRequest::progressFunction))) {
+      return ret;
+    }
+
+    if ((ret = curl_easy_setopt(curl_.get(), CURLOPT_XFERINFODATA, this))) {
+      return ret;
+    }
+  }
+
+  if ((ret = curl_easy_setopt(curl_.get(),
+      CURLOPT_NOPROGRESS,
+      progress ? 0L : 1L))) {
+    return ret;
+  }
+
   // Range
   if (hasRange_) {
     stringstream ss;
@@ -298,17 +694,95 @@ int HttpRequest::execute() {
     }
   }
 
-  // Go!!
-  if ((ret = curl_easy_perform(curl_.get()))) {
+  return 0;
+}
+
+int HttpRequest::finish() {
+  int ret = curl_easy_getinfo(curl_.get(), CURLINFO_RESPONSE_CODE,
+    &responseCode_);
+
+  factory_->countConnection(url_, getTiming(), responseCode_ != 0);
+
+  return ret;
+}
+
+int HttpRequest::execute() {
+  int ret;
+
+  if ((ret = prepare())) {
     return ret;
   }
 
-  if ((ret = curl_easy_getinfo(curl_.get(),
-      CURLINFO_RESPONSE_CODE, &responseCode_)) != CURLE_OK) {
-    return ret;
+  // Go!!
+  ret = curl_easy_perform(curl_.get());
+
+  int collected = finish();
+  return ret ? ret : collected;
+}
+
+bool HttpRequest::isTlsResumed() const {
+#ifdef HAVE_OPENSSL_SESSION_INFO
+  struct curl_tlssessioninfo* info = NULL;
+
+  if (curl_easy_getinfo(curl_.get(), CURLINFO_TLS_SSL_PTR, &info) ||
+      !info || info->backend != CURLSSLBACKEND_OPENSSL || !info->internals) {
+    return false;
   }
 
-  return 0;
+  return SSL_session_reused((SSL *)info->internals) == 1;
+#else
+  return false;
+#endif
+}
+
+// Microseconds since the start of the transfer at which curl reached a
+// phase; 0 if it was not reached
+static curl_off_t timeOf(CURL* h, CURLINFO info) {
+  curl_off_t t = 0;
+
+  if (curl_easy_getinfo(h, info, &t) != CURLE_OK || t < 0) {
+    return 0;
+  }
+
+  return t;
+}
+
+RequestTiming HttpRequest::getTiming() const {
+  RequestTiming timing;
+  CURL* h = curl_.get();
+
+  curl_off_t lookup = timeOf(h, CURLINFO_NAMELOOKUP_TIME_T);
+  curl_off_t connect = max(timeOf(h, CURLINFO_CONNECT_TIME_T), lookup);
+  curl_off_t tls = max(timeOf(h, CURLINFO_APPCONNECT_TIME_T), connect);
+  curl_off_t pretransfer = max(timeOf(h, CURLINFO_PRETRANSFER_TIME_T), tls);
+  curl_off_t firstByte = max(timeOf(h, CURLINFO_STARTTRANSFER_TIME_T),
+    pretransfer);
+  curl_off_t total = max(timeOf(h, CURLINFO_TOTAL_TIME_T), firstByte);
+
+  timing.nameLookup_ = chrono::microseconds(lookup);
+  timing.connect_ = chrono::microseconds(connect - lookup);
+  timing.tlsHandshake_ = chrono::microseconds(tls - connect);
+  timing.firstByte_ = chrono::microseconds(firstByte - tls);
+  timing.transfer_ = chrono::microseconds(total - firstByte);
+  timing.total_ = chrono::microseconds(total);
+
+  curl_off_t sent = 0;
+  if (curl_easy_getinfo(h, CURLINFO_SIZE_UPLOAD_T, &sent) == CURLE_OK) {
+    timing.bytesSent_ = sent;
+  }
+  timing.bytesReceived_ = getBytesReceived();
+
+  long connects = 0;
+  if (curl_easy_getinfo(h, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+    timing.connectionReused_ = (connects == 0);
+  }
+  timing.tlsResumed_ = tlsResumed_;
+
+  return timing;
+}
+
+CURL* HttpRequest::getHandle() const {
+  return curl_.get();
 }
 
 long HttpRequest::getResponseCode() const {
@@ -323,6 +797,13 @@ size_t HttpRequest::getResponseSize() const {
   return responseSize_;
 }
 
+uint64_t HttpRequest::getBytesReceived() const {
+  curl_off_t bytes = 0;
+
+  curl_easy_getinfo(curl_.get(), CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+  return (uint64_t)bytes;
+}
+
 const map<string, string>& HttpRequest::getResponseHeaders() const {
   return responseHeaders_;
 }
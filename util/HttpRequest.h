@@ -20,6 +20,8 @@
  * A simple wrapper around the curl "easy" functions
  */
 #include "HttpRequestFactory.h"
+#include "BandwidthLimiter.h"
+#include "CancellationToken.h"
 
 #include <sys/types.h>
 
@@ -28,20 +30,105 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <vector>
 
 namespace http {
 
+// The connections, DNS answers and TLS sessions of one thread
+struct CurlShare;
+
+// Where the time of one execution of a request went, from curl. The phases
+// follow each other, so they add up to the total. Phases that did not
+// happen, like the TLS handshake of a plain http request or the lookup and
+// connect of a reused connection, are zero.
+struct RequestTiming {
+  RequestTiming() : nameLookup_(0), connect_(0), tlsHandshake_(0),
+    firstByte_(0), transfer_(0), total_(0), bytesSent_(0), bytesReceived_(0),
+    connectionReused_(false), tlsResumed_(false) {
+  }
+
+  std::chrono::microseconds   nameLookup_;
+  std::chrono::microseconds   connect_;
+  std::chrono::microseconds   tlsHandshake_;
+  // From the connection being ready to the first byte of the response:
+  // the server's time. For a request with a body curl stops this clock
+  // once the body starts going out, so the upload and the server's time
+  // count as transfer instead.
+  std::chrono::microseconds   firstByte_;
+  // Receiving the rest of the response
+  std::chrono::microseconds   transfer_;
+  std::chrono::microseconds   total_;
+  uint64_t                    bytesSent_;
+  uint64_t                    bytesReceived_;
+  bool                        connectionReused_;
+  // Whether the TLS handshake of a new connection resumed a session. Only
+  // known with the OpenSSL backend of curl.
+  bool                        tlsResumed_;
+};
+
 class HttpRequest {
 public:
+  /**
+   * Called from inside a curl callback when a bandwidth limiter holds up
+   * the transfer. The callback has paused the transfer in the given
+   * direction, and the handler must resume it once the delay has passed.
+   *
+   * @param     int     CURLPAUSE_SEND or CURLPAUSE_RECV
+   * @param     delay   How long to pause for
+   */
+  typedef std::function<void(int,
+    std::chrono::microseconds)>   ThrottleHandler;
+
+  // Params and headers, in the order they were first added. A request has
+  // a handful of each, so a flat vector beats a map for both lookups and
+  // serialization.
+  typedef std::vector<std::pair<std::string,
+    std::string> >                Fields;
+
+  /**
+   * Called from curl's progress callback with the bytes transferred so
+   * far. Totals are 0 while not known.
+   *
+   * @param     dltotal   Bytes to download
+   * @param     dlnow     Bytes downloaded
+   * @param     ultotal   Bytes to upload
+   * @param     ulnow     Bytes uploaded
+   *
+   * @return    false to abort the transfer
+   */
+  typedef std::function<bool(uint64_t, uint64_t,
+    uint64_t, uint64_t)>          ProgressHandler;
+
   /**
    * Construct a HttpRequest
    *
    * @param     factory   The HttpRequestFactory that created this request
    * @param     url       The url to hit
    * @param     method    The Http method (GET/PUT etc.) to use
+   * @param     requested The url the caller asked for before any base
+   *                      url mapping, empty if it is the same as url
    */
   HttpRequest(HttpRequestFactory* factory, std::string url,
-    HttpRequestMethod method);
+    HttpRequestMethod method, std::string requested = "");
+
+  /**
+   * Get the url the request is sent to, without params
+   *
+   * @return    string
+   */
+  const std::string&              getUrl() const;
+
+  /**
+   * Get the url the caller asked for, before the factory mapped it to
+   * another base url. Use this to tell which Dropbox host a request is
+   * meant for.
+   *
+   * @return    string
+   */
+  const std::string&              getRequestedUrl() const;
 
   /**
    * Set the request method
@@ -59,11 +146,30 @@ public:
    */
   HttpRequestMethod               getMethod() const;
 
+  /**
+   * Mark whether sending the request more than once has the same effect as
+   * sending it once, which makes it safe to retry. By default only GET
+   * requests are idempotent.
+   *
+   * @param     idempotent  true if the request may be retried
+   *
+   * @return    void
+   */
+  void                            setIdempotent(bool idempotent);
+
+  /**
+   * Whether the request may be retried
+   *
+   * @return    bool
+   */
+  bool                            isIdempotent() const;
+
   /**
    * Adds a parameter to the http request. All params are consolidated
    * like:
    * param1=value1&param2=value2...
-   * before the request is sent.
+   * before the request is sent. Names and values are given unencoded;
+   * they are percent-encoded when the request is built.
    *
    * @param     param   Name of the param
    * @param     value   Value of the param
@@ -83,7 +189,7 @@ public:
    * @return    void
    */
    void                           addIntegerParam(const std::string& param,
-                                    const int val);
+                                    int64_t val);
 
   /**
    * add a Range for Http Get requests
@@ -94,12 +200,11 @@ public:
    void                           addRange(uint64_t start, uint64_t end);
 
   /**
-   * Returns the params in a map of params to values
+   * Returns the params and their values
    *
-   * @return    map<string, string>   map of the params and values
+   * @return    Fields    The params, in the order they were added
    */
-  const std::map<std::string,
-    std::string>&                 getParams() const;
+  const Fields&                   getParams() const;
 
   void                            addData(const std::string& data,
                                       const std::string& value);
@@ -117,18 +222,28 @@ public:
                                     const std::string& value);
 
   /**
-   * Get headers as a map of header names to values
+   * Get the headers and their values
    *
-   * @return    map<string, string>    Map of header names to values
+   * @return    Fields    The headers, in the order they were added
    */
-  const std::map<std::string,
-    std::string>&                 getHeaders() const;
+  const Fields&                   getHeaders() const;
+
+  /**
+   * Get the value of a header
+   *
+   * @param     header    The name of the header, as added
+   *
+   * @return    string    Its value; empty if it was not added
+   */
+  std::string                     getHeader(const std::string& header) const;
 
   /**
    * Adds data to the request. This is typically used when uploading files
-   * using a PUT request. The data is *NOT* copied and it is the responsibility
-   * of the owner to make sure the pointer provided as an argument to this
-   * function is valid until the execution of the request completes.
+   * using a PUT request. For POST requests the data becomes the request body
+   * and the params are sent in the query string instead. The data is *NOT*
+   * copied and it is the responsibility of the owner to make sure the pointer
+   * provided as an argument to this function is valid until the execution of
+   * the request completes.
    *
    * @param     data      The data to be uploaded
    * @param     size      Size of the data being uploaded
@@ -138,6 +253,105 @@ public:
   void                            setRequestData(uint8_t* const data,
                                     const size_t size);
 
+  /**
+   * Size of the data set with setRequestData
+   *
+   * @return    size_t   Number of bytes to upload
+   */
+  size_t                          getRequestDataSize() const;
+
+  /**
+   * Stream the body of a successful (2xx) response to a sink instead of
+   * buffering it. The sink returns false to abort the transfer. Bodies of
+   * error responses are still buffered so they can be inspected through
+   * getResponse().
+   *
+   * @param     sink      Called with every block of response data received
+   *
+   * @return    void
+   */
+  void                            setResponseSink(
+                                    std::function<bool(const uint8_t*,
+                                      size_t)> sink);
+
+  /**
+   * Charge the bytes of the request body against a bandwidth limiter. A
+   * request may be shaped by several limiters, e.g. a per transfer, a per
+   * client and a process wide one; it goes at the pace of the slowest.
+   * Adding the same limiter twice has no effect.
+   *
+   * @param     limiter   The limiter
+   *
+   * @return    void
+   */
+  void                            addSendLimiter(
+                                    std::shared_ptr<util::BandwidthLimiter>
+                                      limiter);
+
+  /**
+   * Charge the bytes of the response body against a bandwidth limiter
+   *
+   * @param     limiter   The limiter
+   *
+   * @return    void
+   */
+  void                            addReceiveLimiter(
+                                    std::shared_ptr<util::BandwidthLimiter>
+                                      limiter);
+
+  /**
+   * Set how the transfer waits when a bandwidth limiter holds it up. By
+   * default the curl callback sleeps, which suits execute(). A request
+   * driven by a curl multi handle that serves other transfers should pause
+   * instead; see HttpEventLoop.
+   *
+   * @param     handler   The handler; empty to sleep
+   *
+   * @return    void
+   */
+  void                            setThrottleHandler(ThrottleHandler handler);
+
+  /**
+   * Follow the progress of the transfer. The handler runs on the thread
+   * driving the transfer, at least once a second and whenever data moves;
+   * returning false aborts the transfer with CURLE_ABORTED_BY_CALLBACK.
+   *
+   * @param     handler   The handler; empty for none
+   *
+   * @return    void
+   */
+  void                            setProgressHandler(ProgressHandler handler);
+
+  /**
+   * Set the time by which the transfer must complete. Each execution is
+   * given what is left of it, and fails with CURLE_OPERATION_TIMEDOUT once
+   * it has passed.
+   *
+   * @param     deadline  The deadline; time_point::max() for none
+   *
+   * @return    void
+   */
+  void                            setDeadline(
+                                    std::chrono::steady_clock::time_point
+                                      deadline);
+
+  /**
+   * Abort the transfer, with CURLE_ABORTED_BY_CALLBACK, when a token is
+   * cancelled. Cancellation is noticed from curl's progress callback, which
+   * runs at least once a second in a blocking execute(). HttpEventLoop
+   * subscribes to the token and aborts the transfer straight away.
+   *
+   * @param     token     The token; NULL for none
+   *
+   * @return    void
+   */
+  void                            setCancellationToken(
+                                    std::shared_ptr<util::CancellationToken>
+                                      token);
+
+  std::shared_ptr<util::CancellationToken>
+                                  getCancellationToken() const;
+
   /**
    * Dispatch the http request
    *
@@ -147,6 +361,31 @@ public:
    */
   int                             execute();
 
+  /**
+   * Set up the curl handle for the request without sending it. Together with
+   * finish() this lets a request be driven by a curl multi handle instead of
+   * execute(); see HttpEventLoop.
+   *
+   * @return    int   The error code returned by curl. 0 on success
+   */
+  int                             prepare();
+
+  /**
+   * Collect the results of a transfer that was set up by prepare() and has
+   * ended, successfully or not, and count its connection setup with the
+   * factory
+   *
+   * @return    int   The error code returned by curl. 0 on success
+   */
+  int                             finish();
+
+  /**
+   * Get the underlying curl easy handle
+   *
+   * @return    CURL*   The handle; owned by the request
+   */
+  CURL*                           getHandle() const;
+
   /**
    * Get the Http response code for the executed http request
    *
@@ -168,6 +407,22 @@ public:
    */
   size_t                          getResponseSize() const;
 
+  /**
+   * Number of body bytes received by the last execution, including bytes
+   * handed to a response sink
+   *
+   * @return    uint64_t
+   */
+  uint64_t                        getBytesReceived() const;
+
+  /**
+   * Timing of the last execution, successful or not. Only valid until the
+   * request is executed again.
+   *
+   * @return    RequestTiming
+   */
+  RequestTiming                   getTiming() const;
+
   /**
    * The http headers set in the response returned as a map of header name
    * to value
@@ -225,15 +480,39 @@ public:
    */
   static size_t                   readFunction(void*, size_t, size_t, void*);
 
+  /**
+   * Progress callback; aborts the transfer once the cancellation token is
+   * cancelled or the progress handler returns false
+   *
+   * @return    int     Non zero to abort
+   */
+  static int                      progressFunction(void*, curl_off_t,
+                                    curl_off_t, curl_off_t, curl_off_t);
+
   ~HttpRequest();
 private:
+  typedef std::vector<std::shared_ptr<util::BandwidthLimiter> > Limiters;
+
+  // Lays out the url and query string, the headers and the form body in
+  // wire_
+  void                            build();
+
+  // Whether the connection of the running transfer resumed a TLS session
+  bool                            isTlsResumed() const;
+
+  bool                            throttle(const Limiters& limiters,
+                                    size_t bytes, size_t& prepaid,
+                                    int direction);
 
   HttpRequestFactory* const                 factory_;
   const std::string                         url_;
+  const std::string                         requestedUrl_;
   HttpRequestMethod                         method_;
+  bool                                      idempotentSet_;
+  bool                                      idempotent_;
 
-  std::map<std::string, std::string>        params_;
-  std::map<std::string, std::string>        headers_;
+  Fields                                    params_;
+  Fields                                    headers_;
   std::map<std::string, std::string>        data_;
 
   bool                                      hasRange_;
@@ -244,15 +523,39 @@ private:
   size_t                                    requestDataOffset_;
   uint8_t*                                  requestData_;
 
+  // The url with its query string, each header and the form body, NUL
+  // terminated one after the other, and the header list curl reads, which
+  // points into it. Rebuilt by prepare() only once the request changed.
+  std::string                               wire_;
+  std::vector<curl_slist>                   headerList_;
+  size_t                                    bodyOffset_;
+  bool                                      dirty_;
+
+  // Bytes already charged for data that a paused callback will see again
+  Limiters                                  sendLimiters_;
+  Limiters                                  receiveLimiters_;
+  ThrottleHandler                           throttleHandler_;
+  size_t                                    sendPrepaid_;
+  size_t                                    receivePrepaid_;
+
+  std::chrono::steady_clock::time_point     deadline_;
+  std::shared_ptr<util::CancellationToken>  cancel_;
+  ProgressHandler                           progressHandler_;
+
+  std::function<bool(const uint8_t*,
+    size_t)>                                responseSink_;
   size_t                                    responseSize_;
   std::unique_ptr<uint8_t, void(*)(void *)> response_;
   long                                      responseCode_;
   std::map<std::string, std::string>        responseHeaders_;
+  bool                                      tlsChecked_;
+  bool                                      tlsResumed_;
 
+  // The share of the thread that last prepared the request. Declared
+  // before curl_ so that the handle is cleaned up first.
+  std::shared_ptr<CurlShare>                share_;
   std::unique_ptr<CURL,
     void(*)(CURL*)>                         curl_;
-  std::unique_ptr<struct curl_slist,
-    void(*)(struct curl_slist*)>            slist_;
 };
 }
 #endif
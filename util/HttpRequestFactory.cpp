@@ -25,8 +25,17 @@
 using namespace http;
 using namespace std;
 
-HttpRequestFactory::HttpRequestFactory() {
+// A connection that cannot be set up within this time is given up on
+static const long CONNECT_TIMEOUT_MS = 30000;
+
+// A transfer that moves less than a byte a second for this long is stuck
+static const long STALL_TIMEOUT_SECONDS = 60;
+
+HttpRequestFactory::HttpRequestFactory() :
+    baseUrls_(new BaseUrls()) {
   numRequests_.store(0);
+  connectTimeoutMs_.store(CONNECT_TIMEOUT_MS);
+  stallTimeoutSeconds_.store(STALL_TIMEOUT_SECONDS);
 
   if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
     throw std::bad_alloc();
@@ -53,7 +62,95 @@ HttpRequestFactory* HttpRequestFactory::createFactory() {
 
 HttpRequest* HttpRequestFactory::createHttpRequest(string url,
     HttpRequestMethod method) {
-  return new HttpRequest(this, url, method);
+  shared_ptr<const BaseUrls> urls = atomic_load(&baseUrls_);
+  string target = url;
+
+  for (auto& b : *urls) {
+    if (!url.compare(0, b.first.size(), b.first) &&
+        (url.size() == b.first.size() || url[b.first.size()] == '/')) {
+      target = b.second + url.substr(b.first.size());
+      break;
+    }
+  }
+
+  return new HttpRequest(this, target, method, url);
+}
+
+void HttpRequestFactory::setBaseUrl(const string& base, const string& target) {
+  static mutex lock;
+  lock_guard<mutex> g(lock);
+
+  shared_ptr<BaseUrls> urls(new BaseUrls(*atomic_load(&baseUrls_)));
+  if (target.empty()) {
+    urls->erase(base);
+  } else {
+    (*urls)[base] = target;
+  }
+
+  atomic_store(&baseUrls_, shared_ptr<const BaseUrls>(urls));
+}
+
+void HttpRequestFactory::setConnectTimeout(chrono::milliseconds timeout) {
+  connectTimeoutMs_.store((long)timeout.count());
+}
+
+chrono::milliseconds HttpRequestFactory::getConnectTimeout() const {
+  return chrono::milliseconds(connectTimeoutMs_.load());
+}
+
+void HttpRequestFactory::setStallTimeout(chrono::seconds timeout) {
+  stallTimeoutSeconds_.store((long)timeout.count());
+}
+
+chrono::seconds HttpRequestFactory::getStallTimeout() const {
+  return chrono::seconds(stallTimeoutSeconds_.load());
+}
+
+void HttpRequestFactory::countConnection(const string& url,
+    const RequestTiming& timing,
+    bool responded) {
+  bool opened = !timing.connectionReused_;
+  if (!opened && !responded) {
+    return;
+  }
+
+  // The host, and port if any, between the scheme and the path
+  size_t start = url.find("://");
+  start = (start == string::npos) ? 0 : start + 3;
+  string host = url.substr(start, url.find('/', start) - start);
+
+  lock_guard<mutex> g(statsLock_);
+  HostConnectionStats& s = connectionStats_[host];
+
+  ++s.requests_;
+  if (opened) {
+    ++s.newConnections_;
+  } else {
+    ++s.reusedConnections_;
+  }
+
+  // A reused connection needs neither. curl reports some name lookup time
+  // even then, so only count the lookups of new connections.
+  if (opened && timing.nameLookup_.count() > 0) {
+    ++s.dnsLookups_;
+  }
+
+  if (opened && timing.tlsHandshake_.count() > 0) {
+    ++s.tlsHandshakes_;
+    if (timing.tlsResumed_) {
+      ++s.tlsResumptions_;
+    }
+  }
+}
+
+map<string, HostConnectionStats> HttpRequestFactory::getConnectionStats() {
+  lock_guard<mutex> g(statsLock_);
+  return connectionStats_;
+}
+
+void HttpRequestFactory::resetConnectionStats() {
+  lock_guard<mutex> g(statsLock_);
+  connectionStats_.clear();
 }
 
 void HttpRequestFactory::increaseRequestCount() {
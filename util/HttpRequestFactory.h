@@ -22,6 +22,11 @@
  */
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 
 namespace http {
@@ -34,6 +39,27 @@ enum HttpRequestMethod {
 };
 
 class HttpRequest;
+struct RequestTiming;
+
+// How the requests sent to one host got their connections. Requests that
+// failed before getting a response count only when they opened a
+// connection.
+struct HostConnectionStats {
+  HostConnectionStats() : requests_(0), newConnections_(0),
+    reusedConnections_(0), dnsLookups_(0), tlsHandshakes_(0),
+    tlsResumptions_(0) {
+  }
+
+  uint64_t                    requests_;
+  uint64_t                    newConnections_;
+  uint64_t                    reusedConnections_;
+  // Name resolutions for new connections, including answers from curl's
+  // DNS cache
+  uint64_t                    dnsLookups_;
+  // TLS handshakes on new connections, full and resumed
+  uint64_t                    tlsHandshakes_;
+  uint64_t                    tlsResumptions_;
+};
 
 class HttpRequestFactory {
 public:
@@ -57,6 +83,77 @@ public:
   HttpRequest* createHttpRequest(std::string url,
     HttpRequestMethod method=HttpGetRequest);
 
+  /**
+   * Send the requests for a base url somewhere else, e.g. to point the
+   * client at a local test server:
+   *
+   *   setBaseUrl("https://api.dropbox.com", "http://127.0.0.1:8080");
+   *
+   * Applies to requests created after the call.
+   *
+   * @param base      Scheme and host, without a trailing slash
+   * @param target    Where to send them instead; empty to remove the mapping
+   *
+   * @return  void
+   */
+  void setBaseUrl(const std::string& base, const std::string& target);
+
+  /**
+   * Set how long a request may take to set up its connection before it
+   * fails with CURLE_OPERATION_TIMEDOUT. A request deadline that is closer
+   * wins. Applies to executions that start after the call.
+   *
+   * @param timeout   The connect timeout; 30s by default
+   *
+   * @return  void
+   */
+  void setConnectTimeout(std::chrono::milliseconds timeout);
+
+  std::chrono::milliseconds getConnectTimeout() const;
+
+  /**
+   * Set how long a transfer may move less than a byte a second before it
+   * is treated as stuck and fails with CURLE_OPERATION_TIMEDOUT. Waiting
+   * for the response counts as not moving. Applies to executions that
+   * start after the call.
+   *
+   * @param timeout   The stall timeout; 60s by default
+   *
+   * @return  void
+   */
+  void setStallTimeout(std::chrono::seconds timeout);
+
+  std::chrono::seconds getStallTimeout() const;
+
+  /**
+   * Count the connection setup of a request execution. Called by
+   * HttpRequest::finish().
+   *
+   * @param url       The url of the request
+   * @param timing    Its timing
+   * @param responded Whether it got a response
+   *
+   * @return  void
+   */
+  void countConnection(const std::string& url,
+    const RequestTiming& timing,
+    bool responded);
+
+  /**
+   * Get the connection stats of every host requests were sent to, keyed by
+   * host[:port]
+   *
+   * @return  The stats
+   */
+  std::map<std::string, HostConnectionStats> getConnectionStats();
+
+  /**
+   * Forget the connection stats counted so far
+   *
+   * @return  void
+   */
+  void resetConnectionStats();
+
   /**
    * Increases the counter of number of allocated http requests from this
    * factory
@@ -84,7 +181,17 @@ public:
 private:
   HttpRequestFactory();
 
-  std::atomic<int>    numRequests_;
+  typedef std::map<std::string, std::string>   BaseUrls;
+
+  std::atomic<int>                numRequests_;
+  std::atomic<long>               connectTimeoutMs_;
+  std::atomic<long>               stallTimeoutSeconds_;
+
+  // Copy on write, so that creating a request never takes a lock
+  std::shared_ptr<const BaseUrls> baseUrls_;
+
+  std::mutex                                    statsLock_;
+  std::map<std::string, HostConnectionStats>    connectionStats_;
 };
 }
 #endif
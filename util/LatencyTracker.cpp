@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "LatencyTracker.h"
+
+#include <algorithm>
+
+using namespace util;
+using namespace std;
+
+LatencyTracker::LatencyTracker(size_t window, size_t minSamples) :
+    window_(window ? window : 1),
+    minSamples_(max(minSamples, (size_t)1)),
+    next_(0) {
+  samples_.reserve(window_);
+}
+
+void LatencyTracker::record(chrono::microseconds latency) {
+  lock_guard<mutex> g(lock_);
+
+  if (samples_.size() < window_) {
+    samples_.push_back(latency);
+  } else {
+    samples_[next_] = latency;
+  }
+
+  next_ = (next_ + 1) % window_;
+}
+
+bool LatencyTracker::quantile(double q, chrono::microseconds& out) {
+  vector<chrono::microseconds> s;
+
+  {
+    lock_guard<mutex> g(lock_);
+    if (samples_.size() < minSamples_) {
+      return false;
+    }
+    s = samples_;
+  }
+
+  q = min(max(q, 0.0), 1.0);
+  size_t k = (size_t)(q * (s.size() - 1));
+
+  nth_element(s.begin(), s.begin() + k, s.end());
+  out = s[k];
+
+  return true;
+}
@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __LATENCY_TRACKER_H__
+#define __LATENCY_TRACKER_H__
+
+/**
+ * Keeps the most recent latency samples of an operation so that quantiles
+ * of its current latency can be estimated. Thread safe.
+ */
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace util {
+
+class LatencyTracker {
+public:
+  /**
+   * Create a tracker
+   *
+   * @param window        Number of recent samples kept
+   * @param minSamples    Samples needed before quantiles are reported
+   */
+  LatencyTracker(size_t window = 256, size_t minSamples = 20);
+
+  void record(std::chrono::microseconds latency);
+
+  /**
+   * Estimate a quantile of the recent latencies
+   *
+   * @param q             The quantile, between 0 and 1
+   * @param out           Output param receiving the estimate
+   *
+   * @return  false if too few samples have been recorded
+   */
+  bool quantile(double q, std::chrono::microseconds& out);
+
+private:
+  std::mutex                              lock_;
+  std::vector<std::chrono::microseconds>  samples_;
+  const size_t                            window_;
+  const size_t                            minSamples_;
+  size_t                                  next_;
+};
+}
+#endif
@@ -0,0 +1,401 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "Metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace util;
+using namespace std;
+
+namespace {
+
+// Metric ids index the shards of the calling thread. Ids are never reused,
+// so a slot can't be mistaken for the shard of another metric.
+atomic<size_t> nextId(0);
+
+// The shards of a thread. When the thread exits each one is handed back to
+// its metric, which merges and frees it. Metrics live as long as the
+// process, so they outlive every thread's shards.
+struct ThreadShards {
+  struct Slot {
+    Slot() : shard_(NULL), metric_(NULL), retire_(NULL) {
+    }
+
+    void*   shard_;
+    void*   metric_;
+    void    (*retire_)(void*, void*);
+  };
+
+  ~ThreadShards() {
+    for (auto& s : slots_) {
+      if (s.shard_) {
+        s.retire_(s.metric_, s.shard_);
+      }
+    }
+  }
+
+  vector<Slot>    slots_;
+};
+
+thread_local ThreadShards threadShards;
+
+template <typename Shard>
+Shard* findShard(size_t id) {
+  vector<ThreadShards::Slot>& slots = threadShards.slots_;
+  if (id < slots.size()) {
+    return (Shard*)slots[id].shard_;
+  }
+
+  return NULL;
+}
+
+void setShard(size_t id, void* shard, void* metric,
+    void (*retire)(void*, void*)) {
+  vector<ThreadShards::Slot>& slots = threadShards.slots_;
+  if (id >= slots.size()) {
+    slots.resize(id + 1);
+  }
+
+  slots[id].shard_ = shard;
+  slots[id].metric_ = metric;
+  slots[id].retire_ = retire;
+}
+
+// Free a shard that has been merged
+template <typename Shard>
+void removeShard(vector<unique_ptr<Shard> >& shards, Shard* shard) {
+  for (auto i = shards.begin(); i != shards.end(); ++i) {
+    if (i->get() == shard) {
+      shards.erase(i);
+      return;
+    }
+  }
+}
+
+// A single writer per shard: no read-modify-write needed
+inline void bump(atomic<uint64_t>& a, uint64_t n) {
+  a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+}
+
+Counter::Counter() :
+    id_(nextId++),
+    retired_(0) {
+}
+
+Counter::Shard* Counter::shard() {
+  Shard* s = findShard<Shard>(id_);
+  if (s) {
+    return s;
+  }
+
+  lock_guard<mutex> g(lock_);
+  shards_.push_back(unique_ptr<Shard>(new Shard()));
+  s = shards_.back().get();
+  setShard(id_, s, this, &Counter::retire);
+
+  return s;
+}
+
+void Counter::retire(void* metric, void* shard) {
+  Counter* c = (Counter *)metric;
+  Shard* s = (Shard *)shard;
+
+  lock_guard<mutex> g(c->lock_);
+  c->retired_ += s->value_.load(memory_order_relaxed);
+  removeShard(c->shards_, s);
+}
+
+void Counter::add(uint64_t n) {
+  bump(shard()->value_, n);
+}
+
+uint64_t Counter::get() {
+  lock_guard<mutex> g(lock_);
+
+  uint64_t sum = retired_;
+  for (auto& s : shards_) {
+    sum += s->value_.load(memory_order_relaxed);
+  }
+
+  return sum;
+}
+
+size_t Counter::getShardCount() {
+  lock_guard<mutex> g(lock_);
+  return shards_.size();
+}
+
+Histogram::Shard::Shard() :
+    count_(0),
+    sum_(0),
+    max_(0) {
+  for (auto& c : counts_) {
+    c.store(0, memory_order_relaxed);
+  }
+}
+
+Histogram::Histogram() :
+    id_(nextId++) {
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+  const uint64_t subBuckets = 1ULL << SUB_BUCKET_BITS;
+
+  if (value < subBuckets) {
+    return value;
+  }
+
+  // The top SUB_BUCKET_BITS + 1 bits of the value pick the bucket
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent >= MAX_VALUE_BITS) {
+    return NUM_BUCKETS - 1;
+  }
+
+  int shift = exponent - SUB_BUCKET_BITS;
+  return ((size_t)(shift + 1) << SUB_BUCKET_BITS) +
+    (size_t)((value >> shift) - subBuckets);
+}
+
+uint64_t Histogram::lowestOf(size_t bucket) {
+  const uint64_t subBuckets = 1ULL << SUB_BUCKET_BITS;
+
+  if (bucket < subBuckets) {
+    return bucket;
+  }
+
+  int shift = (int)(bucket >> SUB_BUCKET_BITS) - 1;
+  return (subBuckets + (bucket & (subBuckets - 1))) << shift;
+}
+
+uint64_t Histogram::highestOf(size_t bucket) {
+  if (bucket + 1 >= NUM_BUCKETS) {
+    return UINT64_MAX;
+  }
+
+  return lowestOf(bucket + 1) - 1;
+}
+
+Histogram::Shard* Histogram::shard() {
+  Shard* s = findShard<Shard>(id_);
+  if (s) {
+    return s;
+  }
+
+  lock_guard<mutex> g(lock_);
+  shards_.push_back(unique_ptr<Shard>(new Shard()));
+  s = shards_.back().get();
+  setShard(id_, s, this, &Histogram::retire);
+
+  return s;
+}
+
+void Histogram::merge(Snapshot& snap, const Shard& s) {
+  snap.count_ += s.count_.load(memory_order_relaxed);
+  snap.sum_ += s.sum_.load(memory_order_relaxed);
+  snap.max_ = max(snap.max_, s.max_.load(memory_order_relaxed));
+
+  for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+    snap.counts_[i] += s.counts_[i].load(memory_order_relaxed);
+  }
+}
+
+void Histogram::retire(void* metric, void* shard) {
+  Histogram* h = (Histogram *)metric;
+  Shard* s = (Shard *)shard;
+
+  lock_guard<mutex> g(h->lock_);
+  merge(h->retired_, *s);
+  removeShard(h->shards_, s);
+}
+
+void Histogram::record(uint64_t value) {
+  Shard* s = shard();
+
+  bump(s->counts_[bucketOf(value)], 1);
+  bump(s->count_, 1);
+  bump(s->sum_, value);
+
+  if (value > s->max_.load(memory_order_relaxed)) {
+    s->max_.store(value, memory_order_relaxed);
+  }
+}
+
+void Histogram::record(chrono::microseconds d) {
+  record((uint64_t)max(d.count(), (chrono::microseconds::rep)0));
+}
+
+Histogram::Snapshot Histogram::snapshot() {
+  lock_guard<mutex> g(lock_);
+
+  Snapshot snap = retired_;
+  for (auto& s : shards_) {
+    merge(snap, *s);
+  }
+
+  return snap;
+}
+
+size_t Histogram::getShardCount() {
+  lock_guard<mutex> g(lock_);
+  return shards_.size();
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+  // Buckets are read one by one while threads record, so their total may
+  // differ slightly from count_
+  uint64_t total = 0;
+  for (auto c : counts_) {
+    total += c;
+  }
+
+  if (!total) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(min(max(q, 0.0), 1.0) * (total - 1)) + 1;
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      // The middle of the bucket, but never past the largest value seen
+      uint64_t lo = lowestOf(i);
+      uint64_t mid = lo + (min(highestOf(i), max_) - lo) / 2;
+      return min(max(mid, lo), max_);
+    }
+  }
+
+  return max_;
+}
+
+Metrics::Metrics() {
+}
+
+Metrics* Metrics::getInstance() {
+  static Metrics metrics;
+  return &metrics;
+}
+
+Counter& Metrics::counter(const string& name,
+    const string& help,
+    const string& labels) {
+  lock_guard<mutex> g(lock_);
+
+  help_[name] = help;
+
+  unique_ptr<Counter>& c = counters_[Key(name, labels)];
+  if (!c) {
+    c.reset(new Counter());
+  }
+
+  return *c;
+}
+
+Histogram& Metrics::histogram(const string& name,
+    const string& help,
+    const string& labels) {
+  lock_guard<mutex> g(lock_);
+
+  help_[name] = help;
+
+  unique_ptr<Histogram>& h = histograms_[Key(name, labels)];
+  if (!h) {
+    h.reset(new Histogram());
+  }
+
+  return *h;
+}
+
+// name{labels} or name{labels,extra}
+static string series(const string& name,
+    const string& labels,
+    const string& extra = "") {
+  string s = name;
+
+  if (!labels.empty() || !extra.empty()) {
+    s += "{";
+    s += labels;
+    if (!labels.empty() && !extra.empty()) {
+      s += ",";
+    }
+    s += extra;
+    s += "}";
+  }
+
+  return s;
+}
+
+string Metrics::renderPrometheus() {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+  // Metrics are never removed, so the pointers stay valid once the lock is
+  // dropped; reading them takes their own locks
+  vector<pair<Key, Counter*> > counters;
+  vector<pair<Key, Histogram*> > histograms;
+  map<string, string> help;
+
+  {
+    lock_guard<mutex> g(lock_);
+
+    for (auto& c : counters_) {
+      counters.push_back(make_pair(c.first, c.second.get()));
+    }
+    for (auto& h : histograms_) {
+      histograms.push_back(make_pair(h.first, h.second.get()));
+    }
+    help = help_;
+  }
+
+  stringstream ss;
+  string last;
+
+  for (auto& c : counters) {
+    const string& name = c.first.first;
+    if (name != last) {
+      ss << "# HELP " << name << " " << help[name] << "\n";
+      ss << "# TYPE " << name << " counter\n";
+      last = name;
+    }
+
+    ss << series(name, c.first.second) << " " << c.second->get() << "\n";
+  }
+
+  last.clear();
+  for (auto& h : histograms) {
+    const string& name = h.first.first;
+    if (name != last) {
+      ss << "# HELP " << name << " " << help[name] << "\n";
+      ss << "# TYPE " << name << " summary\n";
+      last = name;
+    }
+
+    Histogram::Snapshot snap = h.second->snapshot();
+    for (double q : quantiles) {
+      stringstream label;
+      label << "quantile=\"" << q << "\"";
+
+      ss << series(name, h.first.second, label.str()) << " "
+        << snap.quantile(q) << "\n";
+    }
+    ss << series(name + "_sum", h.first.second) << " " << snap.sum_ << "\n";
+    ss << series(name + "_count", h.first.second) << " " << snap.count_
+      << "\n";
+  }
+
+  return ss.str();
+}
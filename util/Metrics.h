@@ -0,0 +1,267 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/**
+ * Process wide counters and latency histograms, cheap enough to leave on in
+ * production, and a dump of them in the Prometheus text exposition format.
+ *
+ * Every thread updates its own shard of a metric with plain relaxed loads
+ * and stores, so recording takes a few nanoseconds and never contends with
+ * other threads; shards are merged when the metric is read. When a thread
+ * exits its shards are folded into their metrics and freed, so short lived
+ * threads leave nothing behind. Histograms are
+ * HDR style: buckets are logarithmic with 32 linear sub-buckets each, so
+ * quantiles are accurate to about 3% over the whole range of values.
+ *
+ * Metrics are created once, through the registry, and live as long as the
+ * process. Look them up ahead of time and keep the reference; the lookup
+ * itself takes a lock.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+class Counter {
+public:
+  /**
+   * Add to the counter
+   *
+   * @param n             Amount to add
+   *
+   * @return  void
+   */
+  void add(uint64_t n = 1);
+
+  /**
+   * Sum of the amounts added by all threads
+   *
+   * @return  uint64_t
+   */
+  uint64_t get();
+
+  /**
+   * Number of live threads that have added to the counter
+   *
+   * @return  size_t
+   */
+  size_t getShardCount();
+
+private:
+  friend class Metrics;
+
+  Counter();
+  Counter(const Counter&);
+  Counter& operator=(const Counter&);
+
+  struct Shard {
+    Shard() : value_(0) {
+    }
+
+    std::atomic<uint64_t>   value_;
+
+    // Keeps the shards of different threads off the same cache line
+    char                    pad_[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  Shard*                    shard();
+
+  // Called when the thread owning a shard exits
+  static void               retire(void* metric, void* shard);
+
+  const size_t                          id_;
+  std::mutex                            lock_;
+  std::vector<std::unique_ptr<Shard> >  shards_;
+  // What the shards of exited threads added up to
+  uint64_t                              retired_;
+};
+
+class Histogram {
+public:
+  // Values up to 2^40 are told apart; larger ones land in the last bucket
+  static const int          SUB_BUCKET_BITS = 5;
+  static const int          MAX_VALUE_BITS = 40;
+  static const size_t       NUM_BUCKETS =
+    (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+  // The merged state of a histogram at some point in time
+  struct Snapshot {
+    Snapshot() : count_(0), sum_(0), max_(0), counts_(NUM_BUCKETS, 0) {
+    }
+
+    /**
+     * Estimate a quantile of the recorded values
+     *
+     * @param q           The quantile, between 0 and 1
+     *
+     * @return  The estimate; 0 if nothing was recorded
+     */
+    uint64_t quantile(double q) const;
+
+    uint64_t                count_;
+    uint64_t                sum_;
+    uint64_t                max_;
+    std::vector<uint64_t>   counts_;
+  };
+
+  /**
+   * Record a value
+   *
+   * @param value         The value
+   *
+   * @return  void
+   */
+  void record(uint64_t value);
+
+  /**
+   * Record a duration, in microseconds
+   *
+   * @return  void
+   */
+  void record(std::chrono::microseconds d);
+
+  /**
+   * Merge the shards of all threads
+   *
+   * @return  Snapshot
+   */
+  Snapshot snapshot();
+
+  /**
+   * Number of live threads that have recorded in the histogram
+   *
+   * @return  size_t
+   */
+  size_t getShardCount();
+
+  static size_t bucketOf(uint64_t value);
+  static uint64_t lowestOf(size_t bucket);
+  static uint64_t highestOf(size_t bucket);
+
+private:
+  friend class Metrics;
+
+  Histogram();
+  Histogram(const Histogram&);
+  Histogram& operator=(const Histogram&);
+
+  struct Shard {
+    Shard();
+
+    std::atomic<uint64_t>   count_;
+    std::atomic<uint64_t>   sum_;
+    std::atomic<uint64_t>   max_;
+    std::atomic<uint64_t>   counts_[NUM_BUCKETS];
+  };
+
+  Shard*                    shard();
+
+  // Called when the thread owning a shard exits
+  static void               retire(void* metric, void* shard);
+
+  static void               merge(Snapshot& snap, const Shard& s);
+
+  const size_t                          id_;
+  std::mutex                            lock_;
+  std::vector<std::unique_ptr<Shard> >  shards_;
+  // What the shards of exited threads added up to
+  Snapshot                              retired_;
+};
+
+/**
+ * Records the time from its construction to its destruction in a histogram
+ */
+class ScopedTimer {
+public:
+  ScopedTimer(Histogram& h) :
+    histogram_(h), start_(std::chrono::steady_clock::now()) {
+  }
+
+  ~ScopedTimer() {
+    histogram_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start_));
+  }
+
+private:
+  Histogram&                              histogram_;
+  std::chrono::steady_clock::time_point   start_;
+};
+
+/**
+ * The registry of metrics. This class is a singleton; the memory is
+ * internally managed.
+ */
+class Metrics {
+public:
+  static Metrics* getInstance();
+
+  /**
+   * Get a counter, creating it on first use
+   *
+   * @param name          Metric name, e.g. "dropbox_requests_total"
+   * @param help          Description, shown in the exposition
+   * @param labels        Label pairs, e.g. "code=\"429\""; may be empty
+   *
+   * @return  The counter
+   */
+  Counter& counter(const std::string& name,
+    const std::string& help,
+    const std::string& labels = "");
+
+  /**
+   * Get a histogram, creating it on first use. Histograms are exposed as
+   * Prometheus summaries with the 0.5, 0.9, 0.99 and 0.999 quantiles.
+   *
+   * @param name          Metric name, e.g. "dropbox_request_microseconds"
+   * @param help          Description, shown in the exposition
+   * @param labels        Label pairs; may be empty
+   *
+   * @return  The histogram
+   */
+  Histogram& histogram(const std::string& name,
+    const std::string& help,
+    const std::string& labels = "");
+
+  /**
+   * Render every metric in the Prometheus text exposition format
+   *
+   * @return  The exposition
+   */
+  std::string renderPrometheus();
+
+private:
+  Metrics();
+  Metrics(const Metrics&);
+  Metrics& operator=(const Metrics&);
+
+  typedef std::pair<std::string, std::string>   Key;
+
+  std::mutex                                    lock_;
+  std::map<std::string, std::string>            help_;
+  std::map<Key, std::unique_ptr<Counter> >      counters_;
+  std::map<Key, std::unique_ptr<Histogram> >    histograms_;
+};
+}
+#endif
@@ -31,6 +31,7 @@ OAuth::OAuth(string key,
     securityMethod_(method),
     oauthVersion_(version),
     requestFactory_(HttpRequestFactory::createFactory()) {
+  publishAccessHeader();
 }
 
 void OAuth::splitParams(string& response, map<string, string>& params) {
@@ -78,7 +79,7 @@ void OAuth::getTokenAndSecret(string& response, string& token, string& secret) {
   secret = i->second;
 }
 
-void OAuth::addOAuthHeader(HttpRequest* r, string token, string secret) const {
+string OAuth::formatOAuthHeader(string token, string secret) const {
   stringstream ss;
 
   ss << "OAuth oauth_version=\"" << oauthVersion_ << "\", ";
@@ -107,8 +108,17 @@ void OAuth::addOAuthHeader(HttpRequest* r, string token, string secret) const {
   ss << "oauth_signature_method=\"" << signatureMethod << "\", ";
   ss << "oauth_signature=\"" << signature << "\"";
 
-  string header = ss.str();
-  r->addHeader("Authorization", header);
+  return ss.str();
+}
+
+void OAuth::addOAuthHeader(HttpRequest* r, string token, string secret) const {
+  r->addHeader("Authorization", formatOAuthHeader(token, secret));
+}
+
+void OAuth::publishAccessHeader() {
+  shared_ptr<const string> header(
+    new string(formatOAuthHeader(accessToken_, accessSecret_)));
+  atomic_store(&accessHeader_, header);
 }
 
 void OAuth::fetchRequestToken(string url) {
@@ -145,6 +155,7 @@ void OAuth::fetchAccessToken(string url) {
 
   string response((char *)r->getResponse(), r->getResponseSize());
   getTokenAndSecret(response, accessToken_, accessSecret_);
+  publishAccessHeader();
 }
 
 string OAuth::getRequestToken() const {
@@ -165,12 +176,15 @@ string OAuth::getAccessTokenSecret() const {
 
 void OAuth::setAccessToken(string token) {
   accessToken_ = token;
+  publishAccessHeader();
 }
 
 void OAuth::setAccessTokenSecret(string secret) {
   accessSecret_ = secret;
+  publishAccessHeader();
 }
 
 void OAuth::addOAuthAccessHeader(HttpRequest* r) const {
-  addOAuthHeader(r, accessToken_, accessSecret_);
+  shared_ptr<const string> header = atomic_load(&accessHeader_);
+  r->addHeader("Authorization", *header);
 }
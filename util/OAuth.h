@@ -116,7 +116,9 @@ public:
 
   /**
    * Adds an OAuth authentication header to the supplied HTTP request. Use thus
-   * method to add authentication to the service provider api calls you make
+   * method to add authentication to the service provider api calls you make.
+   * The header is preformatted whenever the access token or secret changes
+   * and is read with a single atomic load, so this takes no lock.
    *
    * @param   HttpRequest* request  The HttpRequest to add the authentication
    *                                header to
@@ -125,6 +127,8 @@ public:
 
 private:
   void addOAuthHeader(http::HttpRequest*, std::string, std::string) const;
+  std::string formatOAuthHeader(std::string, std::string) const;
+  void publishAccessHeader();
   void getTokenAndSecret(std::string&, std::string&, std::string&);
   void splitParams(std::string&, std::map<std::string, std::string>&);
 
@@ -140,6 +144,9 @@ private:
 
   std::string                       accessToken_;
   std::string                       accessSecret_;
+  // Authorization header for the access token, swapped atomically when the
+  // token or secret changes
+  std::shared_ptr<const std::string> accessHeader_;
 };
 }
 
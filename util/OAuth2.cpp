@@ -17,24 +17,71 @@
 #include "HttpRequest.h"
 #include "OAuthException.h"
 #include "OAuth2.h"
+#include "PercentEncoding.h"
 
 #include <sstream>
+#include <algorithm>
 
 using namespace boost::property_tree;
 using namespace boost::property_tree::json_parser;
 using namespace oauth;
 using namespace std;
 using namespace http;
+
 OAuth2::OAuth2(string key, string secret, string version, OAuthSecurityMethod method) :
     consumerKey_(key),
     consumerSecret_(secret),
     securityMethod_(method),
     oauthVersion_(version),
-    requestFactory_(HttpRequestFactory::createFactory()) {
+    requestFactory_(HttpRequestFactory::createFactory()),
+    tokenUrl_("https://api.dropboxapi.com/oauth2/token"),
+    hasExpiry_(false),
+    tokenLifetime_(0),
+    refreshMargin_(300),
+    stopRefresh_(false) {
+  publishAccessHeader();
+}
 
+OAuth2::~OAuth2() {
+  stopAutoRefresh();
 }
 
-void OAuth2::getToken(string& response, string& token, string& token_type, string& id)
+// Must be called with tokenLock_ held
+void OAuth2::publishAccessHeader() {
+  shared_ptr<const string> header(new string("Bearer " + accessToken_));
+  atomic_store(&accessHeader_, header);
+}
+
+void OAuth2::setToken(const string& token, const string& refresh,
+    long expiresIn) {
+  function<void()> listener;
+
+  {
+    lock_guard<mutex> g(tokenLock_);
+
+    accessToken_ = token;
+    if (!refresh.empty()) {
+      refreshToken_ = refresh;
+    }
+
+    hasExpiry_ = expiresIn > 0;
+    if (hasExpiry_) {
+      tokenLifetime_ = chrono::seconds(expiresIn);
+      expiresAt_ = chrono::steady_clock::now() + tokenLifetime_;
+    }
+
+    publishAccessHeader();
+    refreshCond_.notify_all();
+    listener = tokenListener_;
+  }
+
+  if (listener) {
+    listener();
+  }
+}
+
+void OAuth2::getToken(string& response, string& token, string& token_type,
+    string& id, string& refresh, long& expiresIn)
 {
   stringstream s;
   ptree pt;
@@ -45,6 +92,8 @@ void OAuth2::getToken(string& response, string& token, string& token_type, strin
 
   token = pt.get<string>("access_token");
   token_type = pt.get<string>("token_type");
+  refresh = pt.get<string>("refresh_token", "");
+  expiresIn = pt.get<long>("expires_in", 0);
 
   boost::optional<string> ptOptAccId = pt.get_optional<string>("account_id");
   boost::optional<string> ptOptTeamId = pt.get_optional<string>("team_id");
@@ -78,7 +127,7 @@ void OAuth2::getNewTokenFromV1toV2(string& response, string& token)
 void OAuth2::addOAuthHeader(HttpRequest* r, string token) const {
   stringstream ss;
 
-  ss << "Bearer " ;
+  ss << "Bearer " << token;
 
   string header = ss.str();
   r->addHeader("Authorization", header);
@@ -116,15 +165,18 @@ void OAuth2::fetchTokenV1toV2(string url, string tokenOauth1, string tokenSecret
     throw OAuthException(HttpRequestFailed, ss.str());
   }
   string response((char *)r->getResponse(), r->getResponseSize());
-  getNewTokenFromV1toV2(response , accessToken_ );
+  string token;
+  getNewTokenFromV1toV2(response, token);
+  setToken(token, "", 0);
 }
 void OAuth2::fetchAuthorization(string Response_type)
 {//https://www.dropbox.com/1/oauth2/authorize same as below
   string url = "https://www.dropbox.com/oauth2/authorize";
   stringstream ss;
   ss << url;
-  ss << "?response_type=" << Response_type << "&";
-  ss << "client_id=" << consumerKey_;
+  ss << "?response_type=" << percentEncode(Response_type, UrlQueryComponent)
+    << "&";
+  ss << "client_id=" << percentEncode(consumerKey_, UrlQueryComponent);
 
   url = ss.str();
 
@@ -152,14 +204,187 @@ void OAuth2::fetchRequestTokenOauth2(string url)
   }
 
   string response((char *)r->getResponse(), r->getResponseSize());
-  getToken(response, accessToken_, tokenType_, accountid_);
+  string token;
+  string id;
+  string refresh;
+  long expiresIn;
+  getToken(response, token, tokenType_, id, refresh, expiresIn);
+
+  {
+    lock_guard<mutex> g(tokenLock_);
+    accountid_ = id;
+  }
+  setToken(token, refresh, expiresIn);
 }
+
+bool OAuth2::doRefresh(const string& staleHeader) {
+  string refresh;
+  string url;
+
+  {
+    lock_guard<mutex> g(tokenLock_);
+
+    // Someone else already replaced the token that was rejected
+    if (!staleHeader.empty() && *atomic_load(&accessHeader_) != staleHeader) {
+      return true;
+    }
+
+    refresh = refreshToken_;
+    url = tokenUrl_;
+  }
+
+  if (refresh.empty()) {
+    return false;
+  }
+
+  unique_ptr<HttpRequest> r(requestFactory_->createHttpRequest(url));
+
+  r->setMethod(HttpPostRequest);
+  r->addParam("grant_type", "refresh_token");
+  r->addParam("refresh_token", refresh);
+  r->addParam("client_id", consumerKey_);
+  r->addParam("client_secret", consumerSecret_);
+
+  if (r->execute() || r->getResponseCode() != 200) {
+    return false;
+  }
+
+  try {
+    stringstream s;
+    s.write((char *)r->getResponse(), r->getResponseSize());
+
+    ptree pt;
+    read_json(s, pt);
+
+    // Refresh responses carry no account id, and usually no new refresh
+    // token
+    setToken(pt.get<string>("access_token"),
+      pt.get<string>("refresh_token", ""),
+      pt.get<long>("expires_in", 0));
+  } catch (exception& e) {
+    return false;
+  }
+
+  return true;
+}
+
+bool OAuth2::refreshAccessToken(const string& staleHeader) {
+  // All refreshes share one key, so concurrent callers wait for the one in
+  // flight instead of each spending the refresh token
+  return *refreshes_.run(0, [this, &staleHeader]() {
+    return doRefresh(staleHeader);
+  });
+}
+
+bool OAuth2::canRefresh() const {
+  lock_guard<mutex> g(tokenLock_);
+  return !refreshToken_.empty();
+}
+
+void OAuth2::setRefreshToken(string refreshToken) {
+  lock_guard<mutex> g(tokenLock_);
+  refreshToken_ = refreshToken;
+  refreshCond_.notify_all();
+}
+
+string OAuth2::getRefreshToken() const {
+  lock_guard<mutex> g(tokenLock_);
+  return refreshToken_;
+}
+
+void OAuth2::setTokenExpiry(chrono::seconds expiresIn) {
+  lock_guard<mutex> g(tokenLock_);
+  hasExpiry_ = true;
+  tokenLifetime_ = expiresIn;
+  expiresAt_ = chrono::steady_clock::now() + expiresIn;
+  refreshCond_.notify_all();
+}
+
+string OAuth2::getAccountId() const {
+  lock_guard<mutex> g(tokenLock_);
+  return accountid_;
+}
+
+void OAuth2::setTokenListener(function<void()> listener) {
+  lock_guard<mutex> g(tokenLock_);
+  tokenListener_ = listener;
+}
+
+void OAuth2::setTokenUrl(string url) {
+  lock_guard<mutex> g(tokenLock_);
+  tokenUrl_ = url;
+}
+
+void OAuth2::autoRefresh() {
+  chrono::seconds backoff(5);
+  unique_lock<mutex> g(tokenLock_);
+
+  while (!stopRefresh_) {
+    if (!hasExpiry_ || refreshToken_.empty()) {
+      // Nothing to do until a token with an expiry shows up
+      refreshCond_.wait(g);
+      continue;
+    }
+
+    // A margin as long as the token's lifetime would have the fresh token
+    // due again right away, so never refresh before half of it is used up
+    chrono::steady_clock::duration margin =
+      min<chrono::steady_clock::duration>(refreshMargin_,
+        tokenLifetime_ / 2);
+    chrono::steady_clock::time_point due = expiresAt_ - margin;
+    if (chrono::steady_clock::now() < due) {
+      refreshCond_.wait_until(g, due);
+      continue;
+    }
+
+    g.unlock();
+    bool ok = refreshAccessToken();
+    g.lock();
+
+    if (ok) {
+      backoff = chrono::seconds(5);
+    } else {
+      // Requests keep using the current token in the meantime
+      refreshCond_.wait_for(g, backoff);
+      backoff = min(backoff * 2, chrono::seconds(60));
+    }
+  }
+}
+
+void OAuth2::startAutoRefresh(chrono::seconds margin) {
+  lock_guard<mutex> g(tokenLock_);
+
+  refreshMargin_ = margin;
+  if (!refreshThread_.joinable()) {
+    stopRefresh_ = false;
+    refreshThread_ = thread(&OAuth2::autoRefresh, this);
+  }
+  refreshCond_.notify_all();
+}
+
+void OAuth2::stopAutoRefresh() {
+  {
+    lock_guard<mutex> g(tokenLock_);
+    stopRefresh_ = true;
+    refreshCond_.notify_all();
+  }
+
+  if (refreshThread_.joinable()) {
+    refreshThread_.join();
+  }
+}
+
 string OAuth2::getAccessToken() const {
+  lock_guard<mutex> g(tokenLock_);
   return accessToken_;
 }
 
 void OAuth2::setAccessToken(string token) {
+  lock_guard<mutex> g(tokenLock_);
   accessToken_ = token;
+  hasExpiry_ = false;
+  publishAccessHeader();
+  refreshCond_.notify_all();
 }
 void OAuth2::addOAuthAccessContentType(HttpRequest* r) const {
   addContentTypeHeader(r);
@@ -168,7 +393,8 @@ void OAuth2::addOAuthBasicHeader(HttpRequest* r) const {
   addOAuthBasicHeader(r, consumerKey_, consumerSecret_);
 }
 void OAuth2::addOAuthAccessHeader(HttpRequest* r) const {
-  addOAuthHeader(r, accessToken_);
+  shared_ptr<const string> header = atomic_load(&accessHeader_);
+  r->addHeader("Authorization", *header);
 }
 /*TODO
 Implement errors management for Dropbox API v2
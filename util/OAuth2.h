@@ -13,24 +13,27 @@
 * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
-#ifndef __OAUTH_H__
-#define __OAUTH_H__
+#ifndef __OAUTH2_H__
+#define __OAUTH2_H__
 
 #include "HttpRequestFactory.h"
 #include "HttpRequest.h"
+#include "OAuth.h"
+#include "SingleFlight.h"
 
 #include <memory>
 #include <map>
 #include <string>
 #include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 namespace oauth {
-// Currently only supports plaintext
-enum OAuthSecurityMethod {
-  OAuthSecPlaintext,
-};
 enum AccountType {
   account_id,
   team_id,
@@ -123,9 +126,99 @@ public:
    */
   void            setAccessTokenSecret(std::string tokenSecret);
 
+  /**
+   * Set the refresh token used to get new access tokens. Tokens obtained
+   * with fetchRequestTokenOauth2 set it automatically when the server
+   * issues one.
+   *
+   * @param string    refreshToken  The refresh token
+   */
+  void            setRefreshToken(std::string refreshToken);
+
+  /**
+   * Return the refresh token, if any
+   *
+   * @return string   The refresh token; empty if none
+   */
+  std::string     getRefreshToken() const;
+
+  /**
+   * Set when the current access token expires, e.g. for a token obtained out
+   * of band. Tokens fetched or refreshed by this class track their expiry
+   * automatically.
+   *
+   * @param expiresIn   Lifetime of the token from now
+   */
+  void            setTokenExpiry(std::chrono::seconds expiresIn);
+
+  /**
+   * Get a new access token with the refresh token (grant_type=refresh_token)
+   * and publish it. Concurrent calls are coalesced into a single request.
+   * A call made with a stale token whose replacement has already been
+   * published returns right away without refreshing again.
+   *
+   * @param staleHeader   The Authorization header that was rejected, or
+   *                      empty to refresh unconditionally
+   *
+   * @return  true if a fresh token is available
+   */
+  bool            refreshAccessToken(const std::string& staleHeader = "");
+
+  /**
+   * Whether a refresh token is available
+   *
+   * @return bool
+   */
+  bool            canRefresh() const;
+
+  /**
+   * Refresh the access token in a background thread ahead of its expiry,
+   * so that requests never see an expired token. Failed refreshes are
+   * retried with backoff until the token expires.
+   *
+   * @param margin      How long before expiry to refresh; at most half of
+   *                    the token's lifetime is used
+   */
+  void            startAutoRefresh(
+                    std::chrono::seconds margin = std::chrono::seconds(300));
+
+  /**
+   * Stop the background refresh thread. Called by the destructor.
+   */
+  void            stopAutoRefresh();
+
+  /**
+   * Return the id of the account that authorized the app, as given by the
+   * token endpoint with fetchRequestTokenOauth2
+   *
+   * @return string   The account or team id; empty if unknown
+   */
+  std::string     getAccountId() const;
+
+  /**
+   * Set a function to be called after the token endpoint hands out a new
+   * access token, including refreshes in the background. It is called
+   * without any lock of this class held.
+   *
+   * @param listener  The function; empty to remove it
+   */
+  void            setTokenListener(std::function<void()> listener);
+
+  /**
+   * Set the url of the token endpoint used for refreshes
+   *
+   * @param url     The url
+   */
+  void            setTokenUrl(std::string url);
+
+  ~OAuth2();
+
   /**
    * Adds an OAuth authentication header to the supplied HTTP request. Use thus
-   * method to add authentication to the service provider api calls you make
+   * method to add authentication to the service provider api calls you make.
+   * The header is preformatted whenever the access token changes and is read
+   * with a single atomic load, so this method is safe to call concurrently
+   * with token updates and takes no lock.
    *
    * @param   HttpRequest* request  The HttpRequest to add the authentication
    *                                header to
@@ -137,8 +230,13 @@ public:
 private:
   void addOAuthBasicHeader(http::HttpRequest* , std::string, std::string ) const;
   void addOAuthHeader(http::HttpRequest* , std::string) const;
+  void publishAccessHeader();
   void addContentTypeHeader(http::HttpRequest* ) const;
-  void getToken(std::string& , std::string& , std::string& , std::string& );
+  void getToken(std::string& , std::string& , std::string& , std::string& ,
+    std::string&, long&);
+  void setToken(const std::string&, const std::string&, long);
+  bool doRefresh(const std::string&);
+  void autoRefresh();
   void getNewTokenFromV1toV2(std::string& , std::string& );
 
   const std::string                 consumerKey_;
@@ -149,7 +247,25 @@ private:
   http::HttpRequestFactory* const   requestFactory_;
 
 
+  // Guards the token state below, which a background refresh may change
+  mutable std::mutex                tokenLock_;
   std::string                       accessToken_;
+  std::string                       refreshToken_;
+  std::string                       tokenUrl_;
+  std::chrono::steady_clock::time_point expiresAt_;
+  bool                              hasExpiry_;
+  std::chrono::steady_clock::duration tokenLifetime_;
+  std::function<void()>             tokenListener_;
+
+  // "Bearer <accessToken_>", swapped atomically when the token changes
+  std::shared_ptr<const std::string> accessHeader_;
+
+  util::SingleFlight<int, bool>     refreshes_;
+
+  std::condition_variable           refreshCond_;
+  std::chrono::seconds              refreshMargin_;
+  bool                              stopRefresh_;
+  std::thread                       refreshThread_;
 
   std::string                       accountid_;
   std::string                       tokenType_;
@@ -0,0 +1,140 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "PercentEncoding.h"
+
+#include <cstdint>
+
+using namespace http;
+using namespace std;
+
+// The components each byte may appear in unencoded, one bit per
+// UrlComponent. '.' is only marked safe in query components: in paths it is
+// checked for dot segments first.
+static const uint8_t SAFE[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 6, 0, 0, 6, 0, 6, 6, 6, 6, 6, 6, 6, 7, 1, 4,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6, 6, 0, 6, 0, 0,
+  6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 7,
+  0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 7, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char HEX[] = "0123456789ABCDEF";
+
+// The number of bytes at the start of data that need no encoding
+static size_t safeRun(const char* data, size_t size, uint8_t bit) {
+  size_t i = 0;
+  while (i < size && (SAFE[(uint8_t)data[i]] & bit)) {
+    ++i;
+  }
+
+  return i;
+}
+
+// Whether the '.' at data[i] is part of a "." or ".." segment. Clients and
+// servers remove those from urls, so a name made only of dots is encoded.
+static bool inDotSegment(const char* data,
+    size_t size,
+    size_t i,
+    UrlComponent component) {
+  size_t start = 0;
+  size_t end = size;
+
+  // In a whole path '/' separates segments; in one segment it is data
+  if (component == UrlPath) {
+    while (start < i && data[i - start - 1] != '/') {
+      ++start;
+    }
+    start = i - start;
+
+    end = i;
+    while (end < size && data[end] != '/') {
+      ++end;
+    }
+  }
+
+  size_t length = end - start;
+  return (length == 1 || length == 2) &&
+    data[start] == '.' && data[end - 1] == '.';
+}
+
+// Whether data[i] can be written as is
+static inline bool keep(const char* data,
+    size_t size,
+    size_t i,
+    UrlComponent component) {
+  uint8_t c = data[i];
+  return (SAFE[c] & (1 << component)) ||
+    (c == '.' && !inDotSegment(data, size, i, component));
+}
+
+void http::percentEncode(const char* data,
+    size_t size,
+    UrlComponent component,
+    string& out) {
+  const uint8_t bit = 1 << component;
+
+  // Only grow; reserving less than the capacity may shrink the string
+  if (out.capacity() < out.size() + size) {
+    out.reserve(out.size() + size);
+  }
+
+  // Safe bytes are copied a run at a time, as most of a path or value is
+  size_t i = 0;
+  while (i < size) {
+    size_t run = safeRun(data + i, size - i, bit);
+    out.append(data + i, run);
+    i += run;
+
+    for (; i < size && !(SAFE[(uint8_t)data[i]] & bit); ++i) {
+      uint8_t c = data[i];
+      if (keep(data, size, i, component)) {
+        out += c;
+      } else {
+        char escaped[3] = { '%', HEX[c >> 4], HEX[c & 0xf] };
+        out.append(escaped, 3);
+      }
+    }
+  }
+}
+
+string http::percentEncode(const string& s, UrlComponent component) {
+  string out;
+  percentEncode(s.data(), s.size(), component, out);
+  return out;
+}
+
+size_t http::percentEncodedSize(const char* data,
+    size_t size,
+    UrlComponent component) {
+  size_t encoded = size;
+  for (size_t i = 0; i < size; ++i) {
+    if (!keep(data, size, i, component)) {
+      encoded += 2;
+    }
+  }
+
+  return encoded;
+}
@@ -0,0 +1,79 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __PERCENT_ENCODING_H__
+#define __PERCENT_ENCODING_H__
+
+/**
+ * RFC 3986 percent-encoding of the parts of a url. Bytes outside the set
+ * a component allows are written as %XX, so paths and params may hold
+ * spaces, reserved characters and UTF-8.
+ */
+
+#include <cstddef>
+#include <string>
+
+namespace http {
+
+enum UrlComponent {
+  // A name or value of the query string or a form body: only unreserved
+  // characters are kept, so '&', '=' and '+' never end up unescaped
+  UrlQueryComponent,
+  // One segment of a path: unreserved characters, sub-delims, ':' and '@'
+  // are kept, '/' is encoded. A segment of "." or ".." is encoded as
+  // "%2E" or "%2E%2E", so it names an entry instead of being resolved.
+  UrlPathSegment,
+  // A whole path: as a segment, but '/' separates segments and is kept
+  UrlPath,
+};
+
+/**
+ * Append the encoding of some bytes to a string
+ *
+ * @param data          The bytes
+ * @param size          How many
+ * @param component     What they are used as
+ * @param out           Where the encoding is appended
+ *
+ * @return  void
+ */
+void percentEncode(const char* data,
+  size_t size,
+  UrlComponent component,
+  std::string& out);
+
+/**
+ * Encode a string
+ *
+ * @param s             The string
+ * @param component     What it is used as
+ *
+ * @return  The encoded string
+ */
+std::string percentEncode(const std::string& s, UrlComponent component);
+
+/**
+ * The size of the encoding of some bytes, to presize a buffer with
+ *
+ * @param data          The bytes
+ * @param size          How many
+ * @param component     What they are used as
+ *
+ * @return  The size in bytes
+ */
+size_t percentEncodedSize(const char* data,
+  size_t size,
+  UrlComponent component);
+}
+#endif
@@ -0,0 +1,53 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "RetryPolicy.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace util;
+using namespace std;
+
+RetryPolicy::RetryPolicy(size_t maxAttempts,
+    chrono::milliseconds baseDelay,
+    chrono::milliseconds maxDelay) :
+    maxAttempts_(maxAttempts ? maxAttempts : 1),
+    baseDelay_(baseDelay),
+    maxDelay_(max(maxDelay, baseDelay)) {
+}
+
+size_t RetryPolicy::getMaxAttempts() const {
+  return maxAttempts_;
+}
+
+chrono::milliseconds RetryPolicy::getBaseDelay() const {
+  return baseDelay_;
+}
+
+chrono::milliseconds RetryPolicy::getMaxDelay() const {
+  return maxDelay_;
+}
+
+chrono::milliseconds RetryPolicy::nextDelay(
+    chrono::milliseconds previous) const {
+  static thread_local mt19937_64 rng(random_device{}());
+
+  long long lo = baseDelay_.count();
+  long long hi = max(lo, (long long)previous.count() * 3);
+
+  uniform_int_distribution<long long> d(lo, hi);
+  return min(chrono::milliseconds(d(rng)), maxDelay_);
+}
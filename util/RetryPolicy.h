@@ -0,0 +1,66 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __RETRY_POLICY_H__
+#define __RETRY_POLICY_H__
+
+/**
+ * How often and how patiently to retry a transient failure. Delays follow
+ * the "decorrelated jitter" scheme: each delay is drawn uniformly between
+ * the base delay and three times the previous delay, capped. The jitter
+ * spreads out clients that failed together so they do not retry in lock
+ * step.
+ */
+
+#include <chrono>
+#include <cstddef>
+
+namespace util {
+
+class RetryPolicy {
+public:
+  /**
+   * Create a policy
+   *
+   * @param maxAttempts   Total number of attempts, including the first;
+   *                      1 disables retries
+   * @param baseDelay     Smallest delay between attempts
+   * @param maxDelay      Largest delay between attempts
+   */
+  RetryPolicy(size_t maxAttempts = 3,
+    std::chrono::milliseconds baseDelay = std::chrono::milliseconds(100),
+    std::chrono::milliseconds maxDelay = std::chrono::milliseconds(10000));
+
+  size_t getMaxAttempts() const;
+  std::chrono::milliseconds getBaseDelay() const;
+  std::chrono::milliseconds getMaxDelay() const;
+
+  /**
+   * Draw the delay before the next attempt. Thread safe.
+   *
+   * @param previous      The previous delay; getBaseDelay() before the first
+   *                      retry
+   *
+   * @return  The delay
+   */
+  std::chrono::milliseconds nextDelay(std::chrono::milliseconds previous) const;
+
+private:
+  size_t                      maxAttempts_;
+  std::chrono::milliseconds   baseDelay_;
+  std::chrono::milliseconds   maxDelay_;
+};
+}
+#endif
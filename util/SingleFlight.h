@@ -0,0 +1,113 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __SINGLE_FLIGHT_H__
+#define __SINGLE_FLIGHT_H__
+
+/**
+ * Coalesces identical concurrent calls. While a call for a key is in
+ * flight, further calls for the same key wait for it and share its result
+ * instead of running again. Once the call completes the key is forgotten,
+ * so results are never cached beyond the lifetime of the call.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace util {
+
+template <typename Key, typename Value>
+class SingleFlight {
+public:
+  typedef std::shared_ptr<const Value>    Result;
+
+  SingleFlight() : shared_(0) {
+  }
+
+  /**
+   * Run fn for key, or wait for the call for key already in flight.
+   * Exceptions thrown by fn are rethrown to every caller sharing the call.
+   *
+   * @param key       Identifies the call
+   * @param fn        Produces the result
+   * @param shared    If not NULL, set to whether the result came from a
+   *                  call already in flight
+   *
+   * @return  The result of the call
+   */
+  Result run(const Key& key,
+      std::function<Value()> fn,
+      bool* shared = NULL) {
+    std::shared_ptr<std::promise<Result> > leader;
+    std::shared_future<Result> f;
+
+    if (shared) {
+      *shared = false;
+    }
+
+    {
+      std::lock_guard<std::mutex> g(lock_);
+
+      auto i = calls_.find(key);
+      if (i != calls_.end()) {
+        shared_++;
+        if (shared) {
+          *shared = true;
+        }
+        f = i->second;
+      } else {
+        leader.reset(new std::promise<Result>());
+        f = leader->get_future().share();
+        calls_[key] = f;
+      }
+    }
+
+    if (!leader) {
+      return f.get();
+    }
+
+    try {
+      leader->set_value(Result(new Value(fn())));
+    } catch (...) {
+      leader->set_exception(std::current_exception());
+    }
+
+    {
+      std::lock_guard<std::mutex> g(lock_);
+      calls_.erase(key);
+    }
+
+    return f.get();
+  }
+
+  /**
+   * @return  Number of calls that shared the result of another call
+   */
+  uint64_t sharedCount() const {
+    return shared_.load();
+  }
+
+private:
+  std::mutex                                  lock_;
+  std::map<Key, std::shared_future<Result> >  calls_;
+  std::atomic<uint64_t>                       shared_;
+};
+}
+#endif
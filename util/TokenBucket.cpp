@@ -0,0 +1,86 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "TokenBucket.h"
+
+#include <algorithm>
+
+using namespace util;
+using namespace std;
+
+TokenBucket::TokenBucket(double rate, double capacity) :
+    rate_(rate),
+    capacity_(capacity),
+    tokens_(capacity),
+    updated_(Clock::now()) {
+}
+
+void TokenBucket::refill(Clock::time_point now) {
+  double elapsed = chrono::duration<double>(now - updated_).count();
+
+  tokens_ = min(tokens_ + elapsed * rate_, capacity_);
+  updated_ = now;
+}
+
+void TokenBucket::setRate(double rate, double capacity) {
+  lock_guard<mutex> g(lock_);
+
+  refill(Clock::now());
+  rate_ = rate;
+  capacity_ = capacity;
+  tokens_ = min(tokens_, capacity_);
+}
+
+chrono::microseconds TokenBucket::reserve(double tokens) {
+  lock_guard<mutex> g(lock_);
+
+  refill(Clock::now());
+  tokens_ -= tokens;
+
+  if (tokens_ >= 0 || rate_ <= 0) {
+    return chrono::microseconds(0);
+  }
+
+  return chrono::microseconds((int64_t)(-tokens_ / rate_ * 1e6));
+}
+
+bool TokenBucket::tryTake(double tokens) {
+  lock_guard<mutex> g(lock_);
+
+  refill(Clock::now());
+  if (tokens_ < tokens) {
+    return false;
+  }
+
+  tokens_ -= tokens;
+  return true;
+}
+
+void TokenBucket::refund(double tokens) {
+  lock_guard<mutex> g(lock_);
+
+  refill(Clock::now());
+  tokens_ = min(tokens_ + tokens, capacity_);
+}
+
+double TokenBucket::getRate() {
+  lock_guard<mutex> g(lock_);
+  return rate_;
+}
+
+double TokenBucket::getCapacity() {
+  lock_guard<mutex> g(lock_);
+  return capacity_;
+}
@@ -0,0 +1,93 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef __TOKEN_BUCKET_H__
+#define __TOKEN_BUCKET_H__
+
+/**
+ * A token bucket rate limiter. Tokens accrue at a fixed rate up to the
+ * bucket's capacity. Callers reserve tokens and are told how long to wait
+ * before going ahead, rather than being blocked, so the wait can be spent
+ * sleeping, on a timer of an event loop, or anywhere else. Reservations may
+ * overdraw the bucket; the debt delays whoever reserves next. Thread safe.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace util {
+
+class TokenBucket {
+public:
+  typedef std::chrono::steady_clock     Clock;
+
+  /**
+   * Create a bucket. It starts full.
+   *
+   * @param rate          Tokens added per second
+   * @param capacity      Most tokens the bucket holds, i.e. the largest burst
+   */
+  TokenBucket(double rate, double capacity);
+
+  /**
+   * Change the rate and capacity. Tokens already in the bucket are kept, up
+   * to the new capacity.
+   *
+   * @return  void
+   */
+  void setRate(double rate, double capacity);
+
+  /**
+   * Take tokens from the bucket
+   *
+   * @param tokens        Number of tokens
+   *
+   * @return  How long the caller should wait before going ahead; zero if
+   *          the tokens were available
+   */
+  std::chrono::microseconds reserve(double tokens);
+
+  /**
+   * Take tokens only if they are available now
+   *
+   * @return  false if the bucket holds too few tokens
+   */
+  bool tryTake(double tokens);
+
+  /**
+   * Put back tokens taken for something that did not go ahead. The bucket
+   * still holds no more than its capacity.
+   *
+   * @param tokens        Number of tokens
+   *
+   * @return  void
+   */
+  void refund(double tokens);
+
+  double getRate();
+  double getCapacity();
+
+private:
+  void                refill(Clock::time_point now);
+
+  std::mutex          lock_;
+  double              rate_;
+  double              capacity_;
+  double              tokens_;
+  Clock::time_point   updated_;
+};
+}
+#endif
@@ -0,0 +1,213 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "Tracer.h"
+
+#include <unistd.h>
+
+using namespace util;
+using namespace std;
+
+// Queued spans are written out at least this often
+static const chrono::milliseconds FLUSH_INTERVAL(200);
+static const size_t FLUSH_EVENTS = 4096;
+
+atomic<bool> Tracer::enabled_(false);
+
+static string quote(const string& s) {
+  string out = "\"";
+
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+
+  return out + "\"";
+}
+
+// Small, stable ids are easier to read in trace viewers than native ones
+static uint32_t threadId() {
+  static atomic<uint32_t> next(1);
+  static thread_local uint32_t id = next++;
+  return id;
+}
+
+Tracer::Tracer() :
+    stopping_(false),
+    out_(NULL),
+    first_(true),
+    epoch_(0) {
+}
+
+Tracer::~Tracer() {
+  stop();
+}
+
+Tracer* Tracer::getInstance() {
+  static Tracer tracer;
+  return &tracer;
+}
+
+bool Tracer::start(const string& path) {
+  lock_guard<mutex> control(controlLock_);
+  stopLocked();
+
+  FILE* out = fopen(path.c_str(), "w");
+  if (!out) {
+    return false;
+  }
+
+  lock_guard<mutex> g(lock_);
+
+  out_ = out;
+  first_ = true;
+  stopping_ = false;
+  epoch_.store(Clock::now().time_since_epoch().count());
+  fputs("{\"traceEvents\": [\n", out_);
+
+  writer_ = thread(&Tracer::writer, this);
+  enabled_.store(true);
+
+  return true;
+}
+
+void Tracer::stop() {
+  lock_guard<mutex> control(controlLock_);
+  stopLocked();
+}
+
+void Tracer::stopLocked() {
+  {
+    lock_guard<mutex> g(lock_);
+    if (!out_) {
+      return;
+    }
+
+    enabled_.store(false);
+    stopping_ = true;
+    cond_.notify_all();
+  }
+
+  writer_.join();
+
+  lock_guard<mutex> g(lock_);
+  fputs("\n]}\n", out_);
+  fclose(out_);
+  out_ = NULL;
+}
+
+void Tracer::record(const string& name,
+    Clock::time_point start,
+    Clock::time_point end,
+    const string& args) {
+  // A span begun in an earlier trace doesn't belong to this one
+  Clock::time_point epoch(Clock::duration(epoch_.load()));
+  if (start < epoch) {
+    return;
+  }
+
+  Event e;
+  e.name_ = name;
+  e.start_ = chrono::duration_cast<chrono::microseconds>(
+    start - epoch).count();
+  e.duration_ = chrono::duration_cast<chrono::microseconds>(
+    end - start).count();
+  e.thread_ = threadId();
+  e.args_ = args;
+
+  lock_guard<mutex> g(lock_);
+  if (!out_ || stopping_) {
+    return;
+  }
+
+  pending_.push_back(std::move(e));
+  if (pending_.size() >= FLUSH_EVENTS) {
+    cond_.notify_all();
+  }
+}
+
+void Tracer::writer() {
+  unique_lock<mutex> g(lock_);
+
+  while (true) {
+    cond_.wait_for(g, FLUSH_INTERVAL, [this]() {
+      return stopping_ || pending_.size() >= FLUSH_EVENTS;
+    });
+
+    vector<Event> events;
+    events.swap(pending_);
+    bool stopping = stopping_;
+
+    // Formatting and I/O happen without the lock, so that recording
+    // threads never wait on the disk
+    g.unlock();
+    write(events);
+    g.lock();
+
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+void Tracer::write(const vector<Event>& events) {
+  static const int pid = getpid();
+
+  for (auto& e : events) {
+    fprintf(out_, "%s{\"name\": %s, \"cat\": \"dropbox\", \"ph\": \"X\", "
+      "\"ts\": %lld, \"dur\": %lld, \"pid\": %d, \"tid\": %u, "
+      "\"args\": {%s}}", first_ ? "" : ",\n", quote(e.name_).c_str(),
+      (long long)e.start_, (long long)e.duration_, pid, e.thread_,
+      e.args_.c_str());
+    first_ = false;
+  }
+
+  fflush(out_);
+}
+
+void Span::addArg(const char* key, const string& value) {
+  if (!active_) {
+    return;
+  }
+
+  if (!args_.empty()) {
+    args_ += ", ";
+  }
+  args_ += "\"";
+  args_ += key;
+  args_ += "\": ";
+  args_ += quote(value);
+}
+
+void Span::addArg(const char* key, int64_t value) {
+  if (!active_) {
+    return;
+  }
+
+  if (!args_.empty()) {
+    args_ += ", ";
+  }
+  args_ += "\"";
+  args_ += key;
+  args_ += "\": ";
+  args_ += to_string(value);
+}
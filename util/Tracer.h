@@ -0,0 +1,167 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __TRACER_H__
+#define __TRACER_H__
+
+/**
+ * Optional tracing of API calls into a Chrome trace-event JSON file, which
+ * chrome://tracing and Perfetto can load. Spans are queued by the threads
+ * that record them and written out by a background thread.
+ *
+ * While tracing is off a Span costs one relaxed atomic load.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+/**
+ * The trace writer. This class is a singleton; the memory is internally
+ * managed.
+ */
+class Tracer {
+public:
+  typedef std::chrono::steady_clock   Clock;
+
+  static Tracer* getInstance();
+
+  /**
+   * @return  Whether spans are being recorded
+   */
+  static bool isEnabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Start writing spans to a file. A trace already in progress is stopped
+   * first.
+   *
+   * @param path          The trace file; overwritten
+   *
+   * @return  false if the file could not be opened
+   */
+  bool start(const std::string& path);
+
+  /**
+   * Stop recording, write out the queued spans and close the file
+   *
+   * @return  void
+   */
+  void stop();
+
+  /**
+   * Record a span that has already ended. Dropped if tracing is off, or if
+   * the span began before the current trace started.
+   *
+   * @param name          Span name
+   * @param start         When it began
+   * @param end           When it ended
+   * @param args          JSON members for the "args" object, e.g.
+   *                      "\"offset\": 0"; may be empty
+   *
+   * @return  void
+   */
+  void record(const std::string& name,
+    Clock::time_point start,
+    Clock::time_point end,
+    const std::string& args = "");
+
+  ~Tracer();
+
+private:
+  Tracer();
+  Tracer(const Tracer&);
+  Tracer& operator=(const Tracer&);
+
+  struct Event {
+    std::string       name_;
+    int64_t           start_;
+    int64_t           duration_;
+    uint32_t          thread_;
+    std::string       args_;
+  };
+
+  void                writer();
+  void                write(const std::vector<Event>& events);
+  void                stopLocked();
+
+  static std::atomic<bool>    enabled_;
+
+  // Held across start() and stop(), so that they run one at a time. The
+  // writer thread takes lock_, so stop() can't hold that while joining it.
+  std::mutex                  controlLock_;
+  std::mutex                  lock_;
+  std::condition_variable     cond_;
+  std::vector<Event>          pending_;
+  bool                        stopping_;
+  std::thread                 writer_;
+  FILE*                       out_;
+  bool                        first_;
+  // Start of the trace, in Clock ticks; read by recording threads without
+  // the lock
+  std::atomic<Clock::rep>     epoch_;
+};
+
+/**
+ * Records the time from its construction to its destruction as a span on
+ * the calling thread. Spans on a thread nest by time, so a span opened
+ * inside another shows up as its child.
+ */
+class Span {
+public:
+  Span(const char* name) :
+    active_(Tracer::isEnabled()), name_(name) {
+    if (active_) {
+      start_ = Tracer::Clock::now();
+    }
+  }
+
+  ~Span() {
+    if (active_) {
+      Tracer::getInstance()->record(name_, start_, Tracer::Clock::now(),
+        args_);
+    }
+  }
+
+  /**
+   * Attach a value to the span
+   *
+   * @param key           Argument name; must not need escaping
+   * @param value         The value
+   *
+   * @return  void
+   */
+  void addArg(const char* key, const std::string& value);
+  void addArg(const char* key, int64_t value);
+
+private:
+  Span(const Span&);
+  Span& operator=(const Span&);
+
+  bool                        active_;
+  const char*                 name_;
+  Tracer::Clock::time_point   start_;
+  std::string                 args_;
+};
+}
+#endif
@@ -0,0 +1,96 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#include "TransferProgress.h"
+
+#include <cmath>
+
+using namespace util;
+using namespace std;
+
+// Time constant of the smoothed rate
+static const double SMOOTHING_SECONDS = 5.0;
+
+ProgressMeter::ProgressMeter(ProgressCallback callback,
+    chrono::milliseconds interval) :
+    callback_(callback),
+    interval_(interval),
+    last_(Clock::now()),
+    lastDone_(0),
+    done_(0),
+    total_(0),
+    smoothedRate_(0),
+    reported_(false),
+    pending_(false),
+    aborted_(false) {
+}
+
+bool ProgressMeter::update(uint64_t done, uint64_t total) {
+  if (aborted_) {
+    return false;
+  }
+
+  done_ = done;
+  total_ = total;
+  pending_ = true;
+
+  Clock::time_point now = Clock::now();
+  if (now - last_ < interval_) {
+    return true;
+  }
+
+  return report(now);
+}
+
+void ProgressMeter::finish() {
+  if (pending_ && !aborted_) {
+    report(Clock::now());
+  }
+}
+
+bool ProgressMeter::report(Clock::time_point now) {
+  double seconds = chrono::duration<double>(now - last_).count();
+  uint64_t bytes = done_ > lastDone_ ? done_ - lastDone_ : 0;
+
+  TransferProgress p;
+  p.done_ = done_;
+  p.total_ = total_;
+  p.rate_ = seconds > 0 ? bytes / seconds : 0;
+
+  if (!reported_) {
+    smoothedRate_ = p.rate_;
+  } else {
+    smoothedRate_ += (1 - exp(-seconds / SMOOTHING_SECONDS)) *
+      (p.rate_ - smoothedRate_);
+  }
+  p.smoothedRate_ = smoothedRate_;
+
+  if (total_ && done_ >= total_) {
+    p.eta_ = chrono::milliseconds(0);
+  } else if (total_ && smoothedRate_ > 0) {
+    p.eta_ = chrono::milliseconds(
+      (int64_t)((total_ - done_) * 1000 / smoothedRate_));
+  }
+
+  last_ = now;
+  lastDone_ = done_;
+  reported_ = true;
+  pending_ = false;
+
+  if (!callback_(p)) {
+    aborted_ = true;
+  }
+
+  return !aborted_;
+}
@@ -0,0 +1,108 @@
+/*
+* Copyright (c) 2013 Rahul Iyer
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms are permitted provided that
+* the above copyright notice and this paragraph are duplicated in all such forms
+* and that any documentation, advertising materials, and other materials related
+* to such distribution and use acknowledge that the software was developed by
+* Rahul Iyer.  The name of Rahul Iyer may not be used to endorse or promote
+* products derived from this software without specific prior written permission.
+* THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+* WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+#ifndef __TRANSFER_PROGRESS_H__
+#define __TRANSFER_PROGRESS_H__
+
+/**
+ * Progress reporting for uploads and downloads. A ProgressMeter turns the
+ * byte counts seen during a transfer into throughput and ETA estimates and
+ * hands them to a callback at most once per interval.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace util {
+
+/**
+ * The progress of a transfer at one point in time
+ */
+struct TransferProgress {
+  TransferProgress() : done_(0), total_(0), rate_(0), smoothedRate_(0),
+    eta_(-1) {
+  }
+
+  // Bytes transferred so far
+  uint64_t                    done_;
+  // Bytes to transfer in all; 0 when not known
+  uint64_t                    total_;
+  // Bytes per second since the previous report
+  double                      rate_;
+  // Bytes per second, exponentially weighted over the last few seconds
+  double                      smoothedRate_;
+  // Time left at the smoothed rate; negative when it cannot be estimated
+  std::chrono::milliseconds   eta_;
+};
+
+/**
+ * Called with the progress of a transfer. Returning false aborts it.
+ */
+typedef std::function<bool(const TransferProgress&)> ProgressCallback;
+
+/**
+ * Rate limits and enriches the progress of one transfer. Not thread safe;
+ * a transfer reports from one thread at a time.
+ */
+class ProgressMeter {
+public:
+  typedef std::chrono::steady_clock   Clock;
+
+  /**
+   * Create a meter
+   *
+   * @param callback      Receives the reports
+   * @param interval      Minimum time between two reports
+   */
+  ProgressMeter(ProgressCallback callback,
+    std::chrono::milliseconds interval);
+
+  /**
+   * Note the bytes transferred so far, and report them if the interval has
+   * passed since the previous report. The count may go back when a request
+   * is retried.
+   *
+   * @param done          Bytes transferred
+   * @param total         Bytes to transfer; 0 when not known
+   *
+   * @return  false once the callback has asked for the transfer to be
+   *          aborted
+   */
+  bool update(uint64_t done, uint64_t total);
+
+  /**
+   * Report the last counts noted, regardless of the interval, if they have
+   * not been reported yet. Called once the transfer has completed.
+   *
+   * @return  void
+   */
+  void finish();
+
+private:
+  bool                        report(Clock::time_point now);
+
+  ProgressCallback            callback_;
+  const Clock::duration       interval_;
+  Clock::time_point           last_;
+  uint64_t                    lastDone_;
+  uint64_t                    done_;
+  uint64_t                    total_;
+  double                      smoothedRate_;
+  bool                        reported_;
+  bool                        pending_;
+  bool                        aborted_;
+};
+}
+#endif